@@ -0,0 +1,278 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "allele_locate.h"
+
+#include "cpu_dispatch.h"
+#include "packed_seq.h"
+#include "parse_seq.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const int16_t EMPTY_SLOT = INT16_MIN;
+static const int16_t REPEATED_KMER = INT16_MAX;
+
+
+static inline size_t anchor_slot(uint16_t kmer)
+{
+    return ((uint32_t) kmer * 40503u >> 6) & (ANCHOR_SLOTS - 1);
+}
+
+
+static void add_anchor(allele_anchors *anchors,
+                       uint16_t kmer,
+                       int16_t position)
+{
+    size_t slot = anchor_slot(kmer);
+
+    while (anchors->positions[slot] != EMPTY_SLOT) {
+        // A k-mer seen twice cannot place the allele
+        if (anchors->kmers[slot] == kmer) {
+            anchors->positions[slot] = REPEATED_KMER;
+            return;
+        }
+
+        slot = (slot + 1) & (ANCHOR_SLOTS - 1);
+    }
+
+    anchors->kmers[slot] = kmer;
+    anchors->positions[slot] = position;
+    anchors->num_anchors++;
+
+    if (position < anchors->min_position) {
+        anchors->min_position = position;
+    }
+}
+
+
+static inline int16_t find_anchor(const allele_anchors *anchors,
+                                  uint16_t kmer)
+{
+    size_t slot = anchor_slot(kmer);
+
+    while (anchors->positions[slot] != EMPTY_SLOT) {
+        if (anchors->kmers[slot] == kmer) {
+            return anchors->positions[slot];
+        }
+
+        slot = (slot + 1) & (ANCHOR_SLOTS - 1);
+    }
+
+    return EMPTY_SLOT;
+}
+
+
+void build_allele_anchors(const mate_plan *plan,
+                          allele_anchors *anchors)
+{
+    memset(anchors, 0, sizeof(*anchors));
+
+    for (size_t i = 0; i < ANCHOR_SLOTS; i++) {
+        anchors->positions[i] = EMPTY_SLOT;
+    }
+
+    long allele_offset = plan->allele_offset;
+
+    for (size_t i = 0; i < plan->num_checks; i++) {
+        const segment_check *check = &(plan->checks[i]);
+        const read_segment *segment = check->segment;
+
+        // Keep the table at most half full
+        for (size_t j = 0; j + ANCHOR_K <= segment->length &&
+                           anchors->num_anchors < ANCHOR_SLOTS / 2; j++) {
+            uint64_t kmer;
+
+            if (pack_kmer(segment->seq + j, ANCHOR_K, &kmer)) {
+                add_anchor(anchors, (uint16_t) kmer, (int16_t) (check->offset + j - allele_offset));
+            }
+        }
+
+        if (check->offset + check->length == allele_offset) {
+            anchors->left_flank = &(segment->packed);
+            anchors->left_flank_position = (int16_t) (check->offset - allele_offset);
+        }
+    }
+}
+
+
+/* Edit distance of the whole flank against the read, starting anywhere
+   within 'band' bases of 'read_start' and keeping to that band: two
+   rows of 2 * band + 1 cells, no allocation. Returns the displacement
+   of the best end of the flank (the smallest on ties), or INT_MIN. */
+static KERNEL_INLINE int band_align_body(const packed_seq *flank,
+                                         const packed_seq *read,
+                                         long read_start,
+                                         int band)
+{
+    enum { INF = INT_MAX / 2 };
+
+    int rows[2][2 * MAX_ALLELE_SHIFT + 1];
+    int *previous = rows[0];
+    int *current = rows[1];
+
+    if (band > MAX_ALLELE_SHIFT) {
+        band = MAX_ALLELE_SHIFT;
+    }
+
+    for (int d = -band; d <= band; d++) {
+        previous[d + band] = (read_start + d >= 0) ? 0 : INF;
+    }
+
+    for (long i = 1; i <= (long) flank->length; i++) {
+        unsigned flank_base = packed_base_at(flank, i - 1);
+
+        for (int d = -band; d <= band; d++) {
+            long j = read_start + i + d;
+            int cost = INF;
+
+            if (j >= 1) {
+                unsigned read_base = (j - 1 < (long) read->length) ? packed_base_at(read, j - 1) : 4;
+                int mismatch = (flank_base != read_base) || flank_base == 4;
+
+                cost = previous[d + band] + mismatch;
+            }
+            if (d < band && previous[d + band + 1] + 1 < cost) {
+                cost = previous[d + band + 1] + 1;
+            }
+            if (d > -band && current[d + band - 1] + 1 < cost) {
+                cost = current[d + band - 1] + 1;
+            }
+
+            current[d + band] = (cost < INF) ? cost : INF;
+        }
+
+        int *swap = previous;
+        previous = current;
+        current = swap;
+    }
+
+    int best = INT_MIN;
+    int best_cost = INF;
+
+    for (int distance = 0; distance <= band; distance++) {
+        for (int sign = -1; sign <= 1; sign += 2) {
+            int d = sign * distance;
+
+            if (previous[d + band] < best_cost) {
+                best_cost = previous[d + band];
+                best = d;
+            }
+        }
+    }
+
+    return best;
+}
+
+
+int band_align_flank_scalar(const packed_seq *flank,
+                            const packed_seq *read,
+                            long read_start,
+                            int band)
+{
+    return band_align_body(flank, read, read_start, band);
+}
+
+
+#ifdef HAVE_X86_KERNELS
+TARGET_SSE42
+int band_align_flank_sse42(const packed_seq *flank,
+                           const packed_seq *read,
+                           long read_start,
+                           int band)
+{
+    return band_align_body(flank, read, read_start, band);
+}
+
+
+TARGET_AVX2
+int band_align_flank_avx2(const packed_seq *flank,
+                          const packed_seq *read,
+                          long read_start,
+                          int band)
+{
+    return band_align_body(flank, read, read_start, band);
+}
+
+
+TARGET_AVX512BW
+int band_align_flank_avx512bw(const packed_seq *flank,
+                              const packed_seq *read,
+                              long read_start,
+                              int band)
+{
+    return band_align_body(flank, read, read_start, band);
+}
+#endif
+
+
+long locate_allele(const allele_anchors *anchors,
+                   const packed_seq *read,
+                   long expected,
+                   int max_shift,
+                   const kernel_set *kernels)
+{
+    if (max_shift > MAX_ALLELE_SHIFT) {
+        max_shift = MAX_ALLELE_SHIFT;
+    }
+
+    long best = -1;
+    long best_gap = LONG_MAX;
+    long best_shift = LONG_MAX;
+
+    if (anchors->num_anchors > 0) {
+        long first = expected + anchors->min_position - max_shift;
+        long last = (long) read->length - ANCHOR_K;
+
+        for (long p = (first > 0) ? first : 0; p <= last; p++) {
+            uint64_t kmer;
+
+            if (! packed_kmer_at(read, p, ANCHOR_K, &kmer)) {
+                continue;
+            }
+
+            int16_t position = find_anchor(anchors, (uint16_t) kmer);
+
+            if (position == EMPTY_SLOT || position == REPEATED_KMER) {
+                continue;
+            }
+
+            long shift = p - position - expected;
+
+            if (labs(shift) > max_shift) {
+                continue;
+            }
+
+            // Bases between the k-mer and the allele, where an indel
+            // could still move one relative to the other
+            long gap = (position < 0) ? -position - ANCHOR_K : position - 1;
+
+            if (gap < best_gap || (gap == best_gap && labs(shift) < labs(best_shift))) {
+                best = p - position;
+                best_gap = gap;
+                best_shift = shift;
+            }
+        }
+    }
+
+    if (best >= 0 || anchors->left_flank == NULL) {
+        return best;
+    }
+
+    long read_start = expected + anchors->left_flank_position;
+    int end_shift = kernels->band_align_flank(anchors->left_flank, read, read_start, max_shift);
+
+    if (end_shift == INT_MIN) {
+        return -1;
+    }
+
+    long position = read_start + (long) anchors->left_flank->length + end_shift;
+
+    return (position >= 0) ? position : -1;
+}
@@ -0,0 +1,50 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef ALLELE_LOCATE_H
+#define ALLELE_LOCATE_H
+
+#include "cpu_dispatch.h"
+#include "packed_seq.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    ANCHOR_K = 8,
+    ANCHOR_SLOTS = 1024,
+    MAX_ALLELE_SHIFT = 32
+};
+
+struct mate_plan;
+
+/* k-mers of the sequences around the allele, each with its position
+   relative to the allele, used to find where the allele really is in
+   reads where indels have moved it. */
+typedef struct allele_anchors {
+    size_t num_anchors;
+    int16_t min_position;
+    uint16_t kmers[ANCHOR_SLOTS];
+    int16_t positions[ANCHOR_SLOTS];
+    const packed_seq *left_flank;
+    int16_t left_flank_position;
+} allele_anchors;
+
+/* Indexes the flanking segments of a prototype that contains the allele */
+extern void build_allele_anchors(const struct mate_plan *plan,
+                                 allele_anchors *anchors);
+
+/* Position of the allele in 'read', which is expected at 'expected'
+   and displaced by at most 'max_shift' bases, or -1 if it cannot be
+   placed. The nearest flank k-mer found in the read decides; without
+   one, the left flank is aligned in a band of +/- 'max_shift' by
+   'kernels'. */
+extern long locate_allele(const allele_anchors *anchors,
+                          const packed_seq *read,
+                          long expected,
+                          int max_shift,
+                          const kernel_set *kernels);
+
+#endif
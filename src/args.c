@@ -4,6 +4,7 @@
 */
 
 #include "args.h"
+#include "allele_locate.h"
 #include "argparse.h"
 
 #include <errno.h>
@@ -11,13 +12,63 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+/* Checks that an input can be read without consuming it: stdin ("-")
+   and FIFOs are only checked for permissions, since opening and
+   closing a pipe here would signal end-of-input to its writer. */
+static bool input_is_readable(const char *path)
+{
+    if (strcmp(path, "-") == 0) {
+        return true;
+    }
+
+    struct stat file_info;
+
+    if (stat(path, &file_info) != 0) {
+        fprintf(stderr, "Error: unable to read file '%s': %s\n",
+                path, strerror(errno));
+        return false;
+    }
+
+    if (S_ISFIFO(file_info.st_mode)) {
+        if (access(path, R_OK) != 0) {
+            fprintf(stderr, "Error: unable to read FIFO '%s': %s\n",
+                    path, strerror(errno));
+            return false;
+        }
+
+        return true;
+    }
+
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        fprintf(stderr, "Error: unable to read file '%s': %s\n",
+                path, strerror(errno));
+        return false;
+    }
+
+    fclose(fp);
+
+    return true;
+}
 
 
 args parse_args(int argc, const char **argv)
 {
     static const char *usage[] = {
         "fsdm [options] <sequences.fa> <reads_1.fq> <reads_2.fq>",
-        "(FASTQ files can be gzipped or uncompressed, and multiple pairs can be provided at once.)",
+        "fsdm [options] --interleaved <sequences.fa> <reads.fq>",
+        "fsdm [options] --follow <seconds> --watch <directory> <sequences.fa> [<reads_1.fq> <reads_2.fq>]",
+        "fsdm log-counts [options] <reads.log>",
+        "fsdm index [options] <sequences.fa> <library.idx>",
+        "fsdm serve [options] <socket>",
+        "(sequences.fa can be an index built by 'fsdm index' with the same -a and barcode options.",
+        " FASTQ files can be gzipped or uncompressed, and multiple pairs can be provided at once.",
+        " Use '-' to read from stdin; named pipes are also accepted.)",
         NULL
     };
 
@@ -27,10 +78,29 @@ args parse_args(int argc, const char **argv)
     args parsed_args = {
         .num_fastq_pairs = 0,
         .outfile = NULL,
-        .output_all = false,
+        .kernel = NULL,
+        .log_file = NULL,
+        .server = NULL,
+        .watch_dir = NULL,
+        .metrics_file = NULL,
+        .output_all = 0,
+        .interleaved = 0,
+        .io_stats = 0,
+        .bc_scan = 0,
+        .bc_indels = 0,
+        .template_align = 0,
+        .any_orientation = 0,
+        .umi_collapse = 0,
+        .perf_counters = 0,
         .bc_mismatches = 0,
         .ad_fl_mismatches = 1,
-        .ed_threshold = 4
+        .ed_threshold = 4,
+        .max_shift = 8,
+        .umi_memory = 0,
+        .top = 0,
+        .follow = 0,
+        .snapshot = 0,
+        .metrics_interval = 10
     };
 
     struct argparse_option arguments[] = {
@@ -43,15 +113,85 @@ args parse_args(int argc, const char **argv)
         OPT_BOOLEAN('a', NULL, &parsed_args.output_all,
                     "Output all possible barcode combinations",
                     NULL, 0, 0),
+        OPT_BOOLEAN('i', "interleaved", &parsed_args.interleaved,
+                    "FASTQ input is a single stream with alternating R1/R2 records",
+                    NULL, 0, 0),
+        OPT_BOOLEAN(0, "io-stats", &parsed_args.io_stats,
+                    "Report input backend, throughput and I/O queue depth to stderr",
+                    NULL, 0, 0),
         OPT_INTEGER(0, "bm", &parsed_args.bc_mismatches,
                     "Number of mismatches allowed in a barcode sequence (default 0)",
                     NULL, 0, 0),
+        OPT_BOOLEAN(0, "bc-scan", &parsed_args.bc_scan,
+                    "Compare barcodes against all candidates instead of a mismatch table "
+                    "(always used with --bm 2 or more)",
+                    NULL, 0, 0),
+        OPT_BOOLEAN(0, "bc-indels", &parsed_args.bc_indels,
+                    "Allow insertions and deletions within the --bm barcode edits",
+                    NULL, 0, 0),
         OPT_INTEGER(0, "mm", &parsed_args.ad_fl_mismatches,
                     "Number of mismatches allowed in each adapter or flanking sequence (default 1)",
                     NULL, 0, 0),
         OPT_INTEGER(0, "ed", &parsed_args.ed_threshold,
                     "Maximum edit distance allowed across all adapter and flanking sequences (default 4)",
                     NULL, 0, 0),
+        OPT_BOOLEAN(0, "any-orientation", &parsed_args.any_orientation,
+                    "Also accept pairs with swapped mates (prototype 2 in R1, prototype 1 in R2) "
+                    "and report the share of each orientation to stderr",
+                    NULL, 0, 0),
+        OPT_BOOLEAN(0, "template-align", &parsed_args.template_align,
+                    "Align each read against its whole prototype in one pass, so that indels "
+                    "may shift the segments that follow them (up to --ed bases)",
+                    NULL, 0, 0),
+        OPT_INTEGER(0, "max-shift", &parsed_args.max_shift,
+                    "Maximum number of bases an indel can move the allele by (default 8)",
+                    NULL, 0, 0),
+        OPT_BOOLEAN(0, "umi-collapse", &parsed_args.umi_collapse,
+                    "Count a UMI within one mismatch of a UMI with at least twice as many reads (less one) "
+                    "(for the same barcodes and allele) as an error of that UMI",
+                    NULL, 0, 0),
+        OPT_INTEGER(0, "umi-memory", &parsed_args.umi_memory,
+                    "MiB of memory for distinct UMIs, beyond which they are estimated "
+                    "(default 0, no limit)",
+                    NULL, 0, 0),
+        OPT_INTEGER(0, "top", &parsed_args.top,
+                    "Report the N most common unmatched barcodes, barcode pairs and failing "
+                    "adapter and flanking windows to stderr (default 0, none)",
+                    NULL, 0, 0),
+        OPT_STRING(0, "log", &parsed_args.log_file,
+                   "Write a compressed record of every read pair's barcodes, allele, edit distances "
+                   "and reject reason to this file (read back with 'fsdm log-counts')",
+                   NULL, 0, 0),
+        OPT_INTEGER(0, "follow", &parsed_args.follow,
+                    "Read FASTQ files that are still being written as they grow, until one has not "
+                    "grown for this many seconds (a BGZF file ends at its end-of-file block)",
+                    NULL, 0, 0),
+        OPT_STRING(0, "watch", &parsed_args.watch_dir,
+                   "With --follow, also read the FASTQ files of this directory (pairs named _R1/_R2) "
+                   "as they appear, until none has appeared for --follow seconds",
+                   NULL, 0, 0),
+        OPT_INTEGER(0, "snapshot", &parsed_args.snapshot,
+                    "Rewrite the -o output file with the counts so far every this many seconds "
+                    "(the file is replaced whole)",
+                    NULL, 0, 0),
+        OPT_STRING(0, "metrics-file", &parsed_args.metrics_file,
+                   "Write the progress of the run (read pairs by outcome, bytes read, time per stage, "
+                   "input queues and time remaining) to this file in the Prometheus text format",
+                   NULL, 0, 0),
+        OPT_INTEGER(0, "metrics-interval", &parsed_args.metrics_interval,
+                    "Rewrite the --metrics-file every this many seconds (default 10)",
+                    NULL, 0, 0),
+        OPT_BOOLEAN(0, "perf-counters", &parsed_args.perf_counters,
+                    "Report the cycles, instructions, IPC and cache and branch misses per read pair "
+                    "of each stage of the run to stderr, from hardware performance counters",
+                    NULL, 0, 0),
+        OPT_STRING(0, "server", &parsed_args.server,
+                   "Send the run to the 'fsdm serve' server listening on this socket, which keeps "
+                   "the classifiers of recent libraries built",
+                   NULL, 0, 0),
+        OPT_STRING(0, "kernel", &parsed_args.kernel,
+                   "SIMD kernels to use: auto, scalar, sse4.2, avx2 or avx512bw (default auto)",
+                   NULL, 0, 0),
 
         OPT_END()
     };
@@ -67,7 +207,10 @@ args parse_args(int argc, const char **argv)
 
     argc = argparse_parse(&parser, argc, argv);
 
-    if (argc < 3 || ((argc - 1) & 1) != 0) {
+    // FASTQ files are optional with --watch
+    int min_files = parsed_args.watch_dir ? 1 : (parsed_args.interleaved ? 2 : 3);
+
+    if (argc < min_files || (! parsed_args.interleaved && ((argc - 1) & 1) != 0)) {
         fprintf(stderr, "Error: invalid number of FASTA/FASTQ files\n\n\n");
         argparse_usage(&parser, false);
         exit(EXIT_FAILURE);
@@ -85,18 +228,74 @@ args parse_args(int argc, const char **argv)
         argument_error = true;
     }
 
-    for (int i = 0; i < argc; i++) {
-        const char *seq_file = argv[i];
+    if (parsed_args.max_shift < 0 || parsed_args.max_shift > MAX_ALLELE_SHIFT) {
+        fprintf(stderr, "Error: allele shift must be between 0 and %d\n", MAX_ALLELE_SHIFT);
+        argument_error = true;
+    }
 
-        FILE *fp = fopen(seq_file, "r");
+    if (parsed_args.umi_memory < 0) {
+        fprintf(stderr, "Error: UMI memory limit cannot be negative\n");
+        argument_error = true;
+    }
 
-        if (fp == NULL) {
-            fprintf(stderr, "Error: unable to read file '%s': %s\n",
-                    seq_file, strerror(errno));
+    if (parsed_args.top < 0 || parsed_args.top > MAX_TOP_UNMATCHED) {
+        fprintf(stderr, "Error: --top must be between 0 and %d\n", MAX_TOP_UNMATCHED);
+        argument_error = true;
+    }
+
+    if (strcmp(argv[0], "-") == 0) {
+        fprintf(stderr, "Error: the FASTA file cannot be read from stdin\n");
+        argument_error = true;
+    }
+
+    int num_stdin_inputs = 0;
+
+    for (int i = 0; i < argc; i++) {
+        num_stdin_inputs += (i > 0 && strcmp(argv[i], "-") == 0);
+
+        if (! input_is_readable(argv[i])) {
             argument_error = true;
         }
+    }
+
+    if (parsed_args.server && (num_stdin_inputs > 0 || parsed_args.io_stats || parsed_args.kernel ||
+                               parsed_args.follow || parsed_args.watch_dir || parsed_args.snapshot ||
+                               parsed_args.metrics_file || parsed_args.perf_counters)) {
+        fprintf(stderr, "Error: stdin, --io-stats, --kernel, --follow, --watch, --snapshot, "
+                "--metrics-file and --perf-counters cannot be used with --server\n");
+        argument_error = true;
+    }
+
+    if (parsed_args.follow < 0 || parsed_args.snapshot < 0) {
+        fprintf(stderr, "Error: --follow and --snapshot cannot be negative\n");
+        argument_error = true;
+    }
+
+    if (parsed_args.metrics_interval <= 0) {
+        fprintf(stderr, "Error: --metrics-interval must be positive\n");
+        argument_error = true;
+    }
 
-        fclose(fp);
+    if (parsed_args.watch_dir && parsed_args.follow == 0) {
+        fprintf(stderr, "Error: --watch requires --follow\n");
+        argument_error = true;
+    }
+
+    struct stat dir_info;
+
+    if (parsed_args.watch_dir && (stat(parsed_args.watch_dir, &dir_info) != 0 || ! S_ISDIR(dir_info.st_mode))) {
+        fprintf(stderr, "Error: '%s' is not a directory\n", parsed_args.watch_dir);
+        argument_error = true;
+    }
+
+    if (parsed_args.snapshot > 0 && parsed_args.outfile == NULL) {
+        fprintf(stderr, "Error: --snapshot requires an output file (-o)\n");
+        argument_error = true;
+    }
+
+    if (num_stdin_inputs > 1) {
+        fprintf(stderr, "Error: stdin ('-') can only be used for one FASTQ input\n");
+        argument_error = true;
     }
 
     if (parsed_args.outfile) {
@@ -107,8 +306,15 @@ args parse_args(int argc, const char **argv)
                     parsed_args.outfile, strerror(errno));
             argument_error = true;
         }
+        else {
+            fclose(fp);
+        }
+    }
 
-        fclose(fp);
+    if (parsed_args.log_file && parsed_args.outfile &&
+        strcmp(parsed_args.log_file, parsed_args.outfile) == 0) {
+        fprintf(stderr, "Error: the read log and the output file must differ\n");
+        argument_error = true;
     }
 
     if (argument_error) {
@@ -117,7 +323,7 @@ args parse_args(int argc, const char **argv)
 
     parsed_args.fasta_file = argv[0];
     parsed_args.fastq_files = argv + 1;
-    parsed_args.num_fastq_pairs = (argc - 1) / 2;
+    parsed_args.num_fastq_pairs = parsed_args.interleaved ? argc - 1 : (argc - 1) / 2;
 
     return parsed_args;
 }
@@ -9,15 +9,37 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+enum { MAX_TOP_UNMATCHED = 1000 };
+
+/* Flags are ints, as OPT_BOOLEAN counts their occurrences into an int */
 typedef struct args {
     const char *fasta_file;
     const char **fastq_files;
     char *outfile;
-    bool output_all;
+    char *kernel;
+    char *log_file;
+    char *server;
+    char *watch_dir;
+    char *metrics_file;
+    int output_all;
+    int interleaved;
+    int io_stats;
+    int bc_scan;
+    int bc_indels;
+    int template_align;
+    int any_orientation;
+    int umi_collapse;
+    int perf_counters;
     int num_fastq_pairs;
     int bc_mismatches;
     int ad_fl_mismatches;
     int ed_threshold;
+    int max_shift;
+    int umi_memory;
+    int top;
+    int follow;
+    int snapshot;
+    int metrics_interval;
 } args;
 
 extern args parse_args(int argc, const char **argv);
@@ -0,0 +1,609 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "async_read.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined __linux__ && defined __has_include
+    #if __has_include(<linux/io_uring.h>)
+        #define HAVE_IO_URING 1
+    #endif
+#endif
+
+#ifdef HAVE_IO_URING
+    #include <linux/io_uring.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+#endif
+
+enum {
+    ASYNC_QUEUE_DEPTH = 8,
+    ASYNC_BLOCK_SIZE = 1 << 20,
+    FOLLOW_POLL_MS = 250
+};
+
+struct read_slot {
+    unsigned char *data;
+    struct iovec iov;
+    uint64_t offset;
+    long result;
+    bool in_flight;
+};
+
+#ifdef HAVE_IO_URING
+struct uring {
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+#endif
+
+/* Slots are consumed strictly in file order. The slot handed out by the
+   previous call is resubmitted for the next unread block on the
+   following call, keeping up to ASYNC_QUEUE_DEPTH reads in flight.
+   async_reader_interrupt() writes to the 'wake_fds' pipe, which is
+   watched while waiting on a pipe input ('pollable') or for a followed
+   file to grow. */
+struct async_reader {
+    int fd;
+    int wake_fds[2];
+    bool interrupted;
+    bool pollable;
+    bool use_uring;
+#ifdef HAVE_IO_URING
+    struct uring ring;
+#endif
+    struct read_slot slots[ASYNC_QUEUE_DEPTH];
+    size_t num_slots;
+    size_t head;
+    bool head_in_use;
+    uint64_t next_offset;
+    bool eof_reached;
+    bool finished;
+    int follow_seconds;
+    struct timespec last_growth;
+    unsigned num_in_flight;
+    uint64_t depth_sum;
+    uint64_t depth_samples;
+    uint64_t bytes_read;
+    struct timespec start_time;
+    struct timespec end_time;
+};
+
+
+static double seconds_between(const struct timespec *start,
+                              const struct timespec *end)
+{
+    return (double) (end->tv_sec - start->tv_sec) +
+           (double) (end->tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+
+#ifdef HAVE_IO_URING
+static int uring_setup(struct uring *ring,
+                       unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+
+    if (single_mmap && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    if (single_mmap) {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if (ring->sqes == MAP_FAILED) {
+        if (! single_mmap) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    uint8_t *sq_ptr = ring->sq_ring;
+    uint8_t *cq_ptr = ring->cq_ring;
+
+    ring->sq_tail = (unsigned *) (sq_ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq_ptr + params.sq_off.array);
+    ring->cq_head = (unsigned *) (cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq_ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq_ptr + params.cq_off.cqes);
+
+    return 0;
+}
+
+
+static void uring_destroy(struct uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+
+static int uring_enter(struct uring *ring,
+                       unsigned to_submit,
+                       unsigned min_complete)
+{
+    unsigned flags = (min_complete > 0) ? IORING_ENTER_GETEVENTS : 0;
+    int status;
+
+    do {
+        status = (int) syscall(__NR_io_uring_enter, ring->fd, to_submit,
+                               min_complete, flags, NULL, 0);
+    } while (status < 0 && errno == EINTR);
+
+    return status;
+}
+
+
+/* Collects the reads that have completed, without waiting */
+static void reap_completions(async_reader *reader)
+{
+    struct uring *ring = &(reader->ring);
+    unsigned head = *(ring->cq_head);
+
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &(ring->cqes[head & *(ring->cq_mask)]);
+        struct read_slot *slot = &(reader->slots[cqe->user_data]);
+
+        slot->result = cqe->res;
+        slot->in_flight = false;
+        reader->num_in_flight--;
+        head++;
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+/* Samples how many reads are queued, for the mean queue depth */
+static void sample_queue_depth(async_reader *reader)
+{
+    reader->depth_sum += reader->num_in_flight;
+    reader->depth_samples++;
+}
+
+
+static int submit_read(async_reader *reader,
+                       size_t slot_index)
+{
+    struct uring *ring = &(reader->ring);
+    struct read_slot *slot = &(reader->slots[slot_index]);
+
+    slot->offset = reader->next_offset;
+    slot->iov.iov_base = slot->data;
+    slot->iov.iov_len = ASYNC_BLOCK_SIZE;
+    slot->in_flight = true;
+    reader->next_offset += ASYNC_BLOCK_SIZE;
+    reader->num_in_flight++;
+
+    unsigned tail = *(ring->sq_tail);
+    unsigned index = tail & *(ring->sq_mask);
+    struct io_uring_sqe *sqe = &(ring->sqes[index]);
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = reader->fd;
+    sqe->addr = (uintptr_t) &(slot->iov);
+    sqe->len = 1;
+    sqe->off = slot->offset;
+    sqe->user_data = slot_index;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (uring_enter(ring, 1, 0) < 0) {
+        slot->in_flight = false;
+        reader->num_in_flight--;
+        return -1;
+    }
+
+    reap_completions(reader);
+    sample_queue_depth(reader);
+
+    return 0;
+}
+
+
+static long next_uring_block(async_reader *reader,
+                             struct read_slot *slot)
+{
+    // Reads that completed while the previous block was being consumed
+    // no longer count towards the depth
+    reap_completions(reader);
+    sample_queue_depth(reader);
+
+    while (slot->in_flight) {
+        if (uring_enter(&(reader->ring), 0, 1) < 0) {
+            return -1;
+        }
+
+        reap_completions(reader);
+    }
+
+    if (slot->result < 0) {
+        errno = (int) -slot->result;
+        return -1;
+    }
+
+    // A short read is either the end of the file or an interrupted
+    // transfer (e.g. on network filesystems); complete it synchronously
+    // so that the blocks already in flight stay contiguous
+    size_t total = (size_t) slot->result;
+
+    while (total > 0 && total < ASYNC_BLOCK_SIZE) {
+        ssize_t num_bytes = pread(reader->fd, slot->data + total,
+                                  ASYNC_BLOCK_SIZE - total, slot->offset + total);
+
+        if (num_bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (num_bytes < 0) {
+            return -1;
+        }
+        if (num_bytes == 0) {
+            break;
+        }
+
+        total += (size_t) num_bytes;
+    }
+
+    if (total < ASYNC_BLOCK_SIZE) {
+        reader->eof_reached = true;
+    }
+
+    return (long) total;
+}
+#endif
+
+
+static bool is_interrupted(async_reader *reader)
+{
+    return __atomic_load_n(&(reader->interrupted), __ATOMIC_ACQUIRE);
+}
+
+
+/* Waits up to 'timeout_ms' (-1 for no limit) for 'fd' (-1 for none) to
+   become readable. Returns false if the reader was interrupted. */
+static bool wait_for_input(async_reader *reader,
+                           int fd,
+                           int timeout_ms)
+{
+    struct pollfd fds[2] = {
+        {.fd = reader->wake_fds[0], .events = POLLIN},
+        {.fd = fd, .events = POLLIN}
+    };
+
+    while (poll(fds, 2, timeout_ms) < 0 && errno == EINTR) {
+    }
+
+    return ! is_interrupted(reader);
+}
+
+
+/* Waits at the end of a followed input for it to grow. Returns false
+   once it has been idle for its time limit, or on an interrupt. */
+static bool wait_for_growth(async_reader *reader)
+{
+    struct timespec now;
+
+    if (reader->follow_seconds <= 0) {
+        return false;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (seconds_between(&(reader->last_growth), &now) >= reader->follow_seconds) {
+        return false;
+    }
+
+    return wait_for_input(reader, -1, FOLLOW_POLL_MS);
+}
+
+
+static long next_read_block(async_reader *reader,
+                            struct read_slot *slot)
+{
+    ssize_t num_bytes = 0;
+
+    // Only one read is ever queued
+    reader->depth_sum += 1;
+    reader->depth_samples++;
+
+    do {
+        // A pipe may not be written to again, so its reads must be
+        // interruptible
+        if (reader->pollable && ! wait_for_input(reader, reader->fd, -1)) {
+            break;
+        }
+
+        num_bytes = read(reader->fd, slot->data, ASYNC_BLOCK_SIZE);
+    } while ((num_bytes < 0 && errno == EINTR) || (num_bytes == 0 && wait_for_growth(reader)));
+
+    if (is_interrupted(reader)) {
+        errno = ECANCELED;
+        return -1;
+    }
+
+    if (num_bytes == 0) {
+        reader->eof_reached = true;
+    }
+    else if (num_bytes > 0 && reader->follow_seconds > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &(reader->last_growth));
+    }
+
+    return (long) num_bytes;
+}
+
+
+async_reader *async_reader_open(int fd,
+                                int follow_seconds)
+{
+    async_reader *reader = calloc(1, sizeof(*reader));
+
+    if (reader == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    reader->fd = fd;
+    reader->num_slots = 1;
+    clock_gettime(CLOCK_MONOTONIC, &(reader->start_time));
+    reader->last_growth = reader->start_time;
+
+    if (pipe(reader->wake_fds) < 0) {
+        free(reader);
+        close(fd);
+        return NULL;
+    }
+
+    fcntl(reader->wake_fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(reader->wake_fds[1], F_SETFD, FD_CLOEXEC);
+
+    struct stat file_info;
+    bool regular_file = fstat(fd, &file_info) == 0 && S_ISREG(file_info.st_mode);
+    reader->pollable = ! regular_file;
+
+    // The end of a pipe is final
+    if (regular_file) {
+        reader->follow_seconds = follow_seconds;
+    }
+
+#ifdef HAVE_IO_URING
+    // Reads at explicit offsets only make sense for seekable files, and
+    // are all queued up to a fixed end
+    if (regular_file && reader->follow_seconds <= 0 &&
+        uring_setup(&(reader->ring), ASYNC_QUEUE_DEPTH) == 0) {
+        reader->use_uring = true;
+        reader->num_slots = ASYNC_QUEUE_DEPTH;
+        reader->next_offset = (uint64_t) lseek(fd, 0, SEEK_CUR);
+    }
+#endif
+
+    for (size_t i = 0; i < reader->num_slots; i++) {
+        reader->slots[i].data = malloc(ASYNC_BLOCK_SIZE);
+
+        if (reader->slots[i].data == NULL) {
+            async_reader_close(reader);
+            return NULL;
+        }
+    }
+
+#ifdef HAVE_IO_URING
+    if (reader->use_uring) {
+        for (size_t i = 0; i < reader->num_slots; i++) {
+            if (submit_read(reader, i) < 0) {
+                async_reader_close(reader);
+                return NULL;
+            }
+        }
+    }
+#endif
+
+    return reader;
+}
+
+
+long async_reader_next(async_reader *reader,
+                       const unsigned char **data)
+{
+    if (reader->head_in_use) {
+        reader->head_in_use = false;
+
+#ifdef HAVE_IO_URING
+        if (reader->use_uring) {
+            if (! reader->eof_reached && submit_read(reader, reader->head) < 0) {
+                return -1;
+            }
+
+            reader->head = (reader->head + 1) % reader->num_slots;
+        }
+#endif
+    }
+
+    if (reader->finished) {
+        return 0;
+    }
+
+    // Reads of a regular file end by themselves, so an interrupt is only
+    // checked for between blocks
+    if (is_interrupted(reader)) {
+        reader->finished = true;
+        clock_gettime(CLOCK_MONOTONIC, &(reader->end_time));
+        errno = ECANCELED;
+        return -1;
+    }
+
+    struct read_slot *slot = &(reader->slots[reader->head]);
+    long num_bytes;
+
+#ifdef HAVE_IO_URING
+    if (reader->use_uring) {
+        num_bytes = next_uring_block(reader, slot);
+    }
+    else {
+        num_bytes = next_read_block(reader, slot);
+    }
+#else
+    num_bytes = next_read_block(reader, slot);
+#endif
+
+    if (num_bytes <= 0) {
+        reader->finished = true;
+        clock_gettime(CLOCK_MONOTONIC, &(reader->end_time));
+        return num_bytes;
+    }
+
+    // Blocks queued after a short read lie past the end of the file
+    if (reader->eof_reached) {
+        reader->finished = true;
+        clock_gettime(CLOCK_MONOTONIC, &(reader->end_time));
+    }
+
+    reader->bytes_read += (uint64_t) num_bytes;
+    reader->head_in_use = true;
+    *data = slot->data;
+
+    return num_bytes;
+}
+
+
+void async_reader_stop_following(async_reader *reader)
+{
+    reader->follow_seconds = 0;
+}
+
+
+void async_reader_interrupt(async_reader *reader)
+{
+    __atomic_store_n(&(reader->interrupted), true, __ATOMIC_RELEASE);
+
+    while (write(reader->wake_fds[1], "", 1) < 0 && errno == EINTR) {
+    }
+}
+
+
+void async_reader_stats(const async_reader *reader,
+                        async_read_stats *stats)
+{
+    struct timespec now;
+
+    if (reader->finished) {
+        now = reader->end_time;
+    }
+    else {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+
+    stats->backend = reader->use_uring ? "io_uring" : "read";
+    stats->bytes_read = reader->bytes_read;
+    stats->seconds = seconds_between(&(reader->start_time), &now);
+    stats->mean_queue_depth = 0.0;
+    stats->queue_depth_sum = reader->depth_sum;
+    stats->queue_depth_samples = reader->depth_samples;
+
+    if (reader->depth_samples > 0) {
+        stats->mean_queue_depth = (double) reader->depth_sum / (double) reader->depth_samples;
+    }
+}
+
+
+void async_reader_close(async_reader *reader)
+{
+    if (reader == NULL) {
+        return;
+    }
+
+#ifdef HAVE_IO_URING
+    if (reader->use_uring) {
+        // The kernel may still be writing into the slot buffers
+        while (reader->num_in_flight > 0) {
+            if (uring_enter(&(reader->ring), 0, 1) < 0) {
+                break;
+            }
+            reap_completions(reader);
+        }
+
+        uring_destroy(&(reader->ring));
+    }
+#endif
+
+    for (size_t i = 0; i < reader->num_slots; i++) {
+        free(reader->slots[i].data);
+    }
+
+    close(reader->wake_fds[0]);
+    close(reader->wake_fds[1]);
+    close(reader->fd);
+    free(reader);
+}
@@ -0,0 +1,52 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef ASYNC_READ_H
+#define ASYNC_READ_H
+
+#include <stdint.h>
+
+typedef struct async_reader async_reader;
+
+typedef struct async_read_stats {
+    const char *backend;
+    uint64_t bytes_read;
+    double seconds;
+    double mean_queue_depth;
+    uint64_t queue_depth_sum;
+    uint64_t queue_depth_samples;
+} async_read_stats;
+
+/* Takes ownership of 'fd'. Regular files are read through io_uring with
+   several large reads kept in flight; pipes, and systems where io_uring
+   is unavailable, fall back to plain read(). A regular file is followed
+   if 'follow_seconds' is positive: it is taken to be still being written,
+   so a read at its end waits for it to grow, and it only ends once it has
+   not grown for 'follow_seconds' (it is then read with plain read()). */
+extern async_reader *async_reader_open(int fd,
+                                       int follow_seconds);
+
+/* Ends a followed input at its current end, once it is known to be
+   complete */
+extern void async_reader_stop_following(async_reader *reader);
+
+/* Makes a call to async_reader_next() in another thread (or the next
+   call) return -1 with errno set to ECANCELED as soon as possible; a
+   blocked read of a pipe or wait for a followed file to grow is cut
+   short. The reader can then only be closed. */
+extern void async_reader_interrupt(async_reader *reader);
+
+/* Points 'data' at the next chunk of raw input in file order and returns
+   its length, 0 at the end of the input or -1 on error. The chunk stays
+   valid until the next call. */
+extern long async_reader_next(async_reader *reader,
+                              const unsigned char **data);
+
+extern void async_reader_stats(const async_reader *reader,
+                               async_read_stats *stats);
+
+extern void async_reader_close(async_reader *reader);
+
+#endif
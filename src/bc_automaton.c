@@ -0,0 +1,540 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "bc_automaton.h"
+
+#include "packed_seq.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    ALPHABET_SIZE = 5,   // A, C, G, T and anything else
+    DEAD_STATE = 0,
+    MAX_AUTOMATON_STATES = 1 << 22
+};
+
+static const uint8_t NO_PATH = UINT8_MAX;
+
+/* 'value' is the barcode that has been fully consumed within the edit
+   limit at this state: 0 if none, -1 if several, and an exact match
+   overrides any others. */
+struct automaton_state {
+    int32_t next[ALPHABET_SIZE];
+    int16_t value;
+    uint8_t distance;
+};
+
+/* 'mapped' automata use the states of an image in place */
+struct bc_automaton {
+    size_t bc_length;
+    int max_edits;
+    int32_t start;
+    size_t num_states;
+    struct automaton_state *states;
+    bool mapped;
+};
+
+/* An image is this header followed by the states */
+struct automaton_image {
+    uint64_t bc_length;
+    int32_t max_edits;
+    int32_t start;
+    uint64_t num_states;
+};
+
+/* While building, each DFA state is the set of NFA states (barcode,
+   bases of the barcode consumed), stored as the fewest edits needed to
+   reach each one, or NO_PATH. */
+struct automaton_builder {
+    const char **barcodes;
+    size_t num_barcodes;
+    size_t bc_length;
+    int max_edits;
+    size_t width;
+    uint8_t *vectors;
+    size_t num_states;
+    size_t capacity;
+    int32_t *slots;
+    size_t num_slots;
+    struct automaton_state *states;
+};
+
+
+static inline uint8_t symbol_code(char base)
+{
+    switch (base) {
+        case 'A':
+            return 0;
+        case 'C':
+            return 1;
+        case 'G':
+            return 2;
+        case 'T':
+            return 3;
+        default:
+            return 4;
+    }
+}
+
+
+static uint32_t hash_vector(const uint8_t *vector,
+                            size_t width)
+{
+    uint32_t hash = 2166136261UL;
+
+    for (size_t i = 0; i < width; i++) {
+        hash ^= vector[i];
+        hash *= 16777619UL;
+    }
+
+    return hash;
+}
+
+
+/* Returns NULL (leaving 'array' allocated) if memory runs out */
+static void *grow_array(void *array,
+                        size_t num_items,
+                        size_t item_size)
+{
+    void *resized = realloc(array, num_items * item_size);
+
+    if (resized == NULL) {
+        perror("Error: memory allocation failed for barcode automaton");
+    }
+
+    return resized;
+}
+
+
+/* Deletions from the read consume a barcode base without a read base */
+static void epsilon_closure(const struct automaton_builder *builder,
+                            uint8_t *vector)
+{
+    size_t row = builder->bc_length + 1;
+
+    for (size_t b = 0; b < builder->num_barcodes; b++) {
+        uint8_t *edits = vector + b * row;
+
+        for (size_t i = 0; i < builder->bc_length; i++) {
+            if (edits[i] != NO_PATH && edits[i] + 1 <= builder->max_edits &&
+                edits[i] + 1 < edits[i + 1]) {
+                edits[i + 1] = edits[i] + 1;
+            }
+        }
+    }
+}
+
+
+static void set_accept_value(const struct automaton_builder *builder,
+                             const uint8_t *vector,
+                             struct automaton_state *state)
+{
+    size_t row = builder->bc_length + 1;
+
+    state->value = 0;
+    state->distance = NO_PATH;
+
+    for (size_t b = 0; b < builder->num_barcodes; b++) {
+        uint8_t edits = vector[b * row + builder->bc_length];
+
+        if (edits == NO_PATH) {
+            continue;
+        }
+
+        if (edits == 0) {
+            state->value = (int16_t) (b + 1);
+            state->distance = 0;
+            return;
+        }
+
+        state->value = (state->value == 0) ? (int16_t) (b + 1) : -1;
+
+        if (edits < state->distance) {
+            state->distance = edits;
+        }
+    }
+}
+
+
+/* Returns -1 if the automaton is too large or memory runs out */
+static int32_t find_or_add_state(struct automaton_builder *builder,
+                                 const uint8_t *vector)
+{
+    size_t mask = builder->num_slots - 1;
+    size_t index = hash_vector(vector, builder->width) & mask;
+
+    while (builder->slots[index] >= 0) {
+        int32_t existing = builder->slots[index];
+
+        if (memcmp(builder->vectors + (size_t) existing * builder->width,
+                   vector, builder->width) == 0) {
+            return existing;
+        }
+
+        index = (index + 1) & mask;
+    }
+
+    if (builder->num_states >= MAX_AUTOMATON_STATES) {
+        fprintf(stderr, "Error: barcode automaton is too large; "
+                "reduce the number of barcode mismatches\n");
+        return -1;
+    }
+
+    if (builder->num_states == builder->capacity) {
+        uint8_t *vectors = grow_array(builder->vectors, 2 * builder->capacity, builder->width);
+
+        if (vectors == NULL) {
+            return -1;
+        }
+
+        builder->vectors = vectors;
+
+        struct automaton_state *states = grow_array(builder->states, 2 * builder->capacity,
+                                                    sizeof(*(builder->states)));
+
+        if (states == NULL) {
+            return -1;
+        }
+
+        builder->states = states;
+        builder->capacity *= 2;
+    }
+
+    int32_t state_index = (int32_t) builder->num_states;
+
+    memcpy(builder->vectors + (size_t) state_index * builder->width, vector, builder->width);
+    set_accept_value(builder, vector, &(builder->states[state_index]));
+    builder->slots[index] = state_index;
+    builder->num_states++;
+
+    // Keep the probe table at most half full
+    if (builder->num_states * 2 > builder->num_slots) {
+        size_t num_slots = builder->num_slots * 2;
+        int32_t *slots = malloc(num_slots * sizeof(*slots));
+
+        if (slots == NULL) {
+            perror("Error: memory allocation failed for barcode automaton");
+            return -1;
+        }
+
+        memset(slots, -1, num_slots * sizeof(*slots));
+
+        for (size_t s = 0; s < builder->num_states; s++) {
+            size_t slot = hash_vector(builder->vectors + s * builder->width,
+                                      builder->width) & (num_slots - 1);
+
+            while (slots[slot] >= 0) {
+                slot = (slot + 1) & (num_slots - 1);
+            }
+
+            slots[slot] = (int32_t) s;
+        }
+
+        free(builder->slots);
+        builder->slots = slots;
+        builder->num_slots = num_slots;
+    }
+
+    return state_index;
+}
+
+
+static void next_vector(const struct automaton_builder *builder,
+                        const uint8_t *current,
+                        uint8_t symbol,
+                        uint8_t *next)
+{
+    size_t row = builder->bc_length + 1;
+
+    memset(next, NO_PATH, builder->width);
+
+    for (size_t b = 0; b < builder->num_barcodes; b++) {
+        const char *barcode = builder->barcodes[b];
+        const uint8_t *edits = current + b * row;
+        uint8_t *next_edits = next + b * row;
+
+        for (size_t i = 0; i <= builder->bc_length; i++) {
+            if (edits[i] == NO_PATH) {
+                continue;
+            }
+
+            // Match or substitution
+            if (i < builder->bc_length) {
+                int cost = edits[i] + (symbol_code(barcode[i]) != symbol);
+
+                if (cost <= builder->max_edits && cost < next_edits[i + 1]) {
+                    next_edits[i + 1] = (uint8_t) cost;
+                }
+            }
+
+            // Insertion in the read
+            int cost = edits[i] + 1;
+
+            if (cost <= builder->max_edits && cost < next_edits[i]) {
+                next_edits[i] = (uint8_t) cost;
+            }
+        }
+    }
+
+    epsilon_closure(builder, next);
+}
+
+
+bc_automaton *build_bc_automaton(const char **barcodes,
+                                 size_t num_barcodes,
+                                 size_t bc_length,
+                                 int max_edits)
+{
+    struct automaton_builder builder = {
+        .barcodes = barcodes,
+        .num_barcodes = num_barcodes,
+        .bc_length = bc_length,
+        .max_edits = max_edits,
+        .width = num_barcodes * (bc_length + 1),
+        .capacity = 1024,
+        .num_slots = 4096
+    };
+
+    builder.vectors = grow_array(NULL, builder.capacity, builder.width);
+    builder.states = grow_array(NULL, builder.capacity, sizeof(*(builder.states)));
+    builder.slots = grow_array(NULL, builder.num_slots, sizeof(*(builder.slots)));
+
+    uint8_t *vector = grow_array(NULL, 1, builder.width);
+    bc_automaton *automaton = NULL;
+    int32_t start = -1;
+
+    if (builder.vectors == NULL || builder.states == NULL || builder.slots == NULL || vector == NULL) {
+        goto CLEANUP;
+    }
+
+    memset(builder.slots, -1, builder.num_slots * sizeof(*(builder.slots)));
+
+    // Dead state first, so that index 0 means no barcode can match
+    memset(vector, NO_PATH, builder.width);
+
+    if (find_or_add_state(&builder, vector) < 0) {
+        goto CLEANUP;
+    }
+
+    for (size_t b = 0; b < num_barcodes; b++) {
+        vector[b * (bc_length + 1)] = 0;
+    }
+
+    epsilon_closure(&builder, vector);
+    start = find_or_add_state(&builder, vector);
+
+    // States are appended in discovery order, so walking the array is a
+    // breadth-first construction
+    for (size_t s = 0; s < builder.num_states && start >= 0; s++) {
+        for (uint8_t symbol = 0; symbol < ALPHABET_SIZE; symbol++) {
+            int32_t next_state = DEAD_STATE;
+
+            if (s != DEAD_STATE) {
+                const uint8_t *current = builder.vectors + s * builder.width;
+                next_vector(&builder, current, symbol, vector);
+                next_state = find_or_add_state(&builder, vector);
+
+                if (next_state < 0) {
+                    start = -1;
+                    break;
+                }
+            }
+
+            builder.states[s].next[symbol] = next_state;
+        }
+    }
+
+    if (start < 0) {
+        goto CLEANUP;
+    }
+
+    automaton = malloc(sizeof(*automaton));
+
+    if (automaton == NULL) {
+        perror("Error: memory allocation failed for barcode automaton");
+        goto CLEANUP;
+    }
+
+    automaton->bc_length = bc_length;
+    automaton->max_edits = max_edits;
+    automaton->start = start;
+    automaton->num_states = builder.num_states;
+    automaton->mapped = false;
+
+    // Shrinking cannot fail in practice; keep the larger array if it does
+    automaton->states = realloc(builder.states, builder.num_states * sizeof(*(builder.states)));
+
+    if (automaton->states == NULL) {
+        automaton->states = builder.states;
+    }
+
+    builder.states = NULL;
+
+  CLEANUP:
+    free(vector);
+    free(builder.vectors);
+    free(builder.slots);
+    free(builder.states);
+
+    return automaton;
+}
+
+
+/* A barcode can end after any of (length - edits) to (length + edits)
+   read bases. A read is assigned to an exact match, otherwise to the
+   only barcode within the edit limit at any end position, using the
+   end with the fewest edits (and the smallest shift on ties). */
+int bc_automaton_lookup(const bc_automaton *self,
+                        const packed_seq *read,
+                        size_t offset,
+                        int *shift)
+{
+    const int bc_length = (int) self->bc_length;
+    int max_steps = bc_length + self->max_edits;
+
+    if (offset >= read->length) {
+        return 0;
+    }
+    if ((size_t) max_steps > read->length - offset) {
+        max_steps = (int) (read->length - offset);
+    }
+
+    int32_t state = self->start;
+    int candidate = 0;
+    int best_distance = INT_MAX;
+    int best_shift = 0;
+    bool ambiguous = false;
+
+    for (int j = 0; j < max_steps; j++) {
+        // Packed codes use the same symbol numbering as symbol_code()
+        state = self->states[state].next[packed_base_at(read, offset + j)];
+
+        if (state == DEAD_STATE) {
+            break;
+        }
+
+        const struct automaton_state *current = &(self->states[state]);
+
+        if (current->value == 0) {
+            continue;
+        }
+
+        int step_shift = j + 1 - bc_length;
+
+        if (current->distance == 0) {
+            *shift = 0;
+            return current->value;
+        }
+
+        if (current->value < 0 || (candidate && candidate != current->value)) {
+            ambiguous = true;
+            continue;
+        }
+
+        candidate = current->value;
+
+        if (current->distance < best_distance ||
+            (current->distance == best_distance && abs(step_shift) < abs(best_shift))) {
+            best_distance = current->distance;
+            best_shift = step_shift;
+        }
+    }
+
+    if (ambiguous || candidate == 0) {
+        return 0;
+    }
+
+    *shift = best_shift;
+
+    return candidate;
+}
+
+
+size_t bc_automaton_num_states(const bc_automaton *self)
+{
+    return self->num_states;
+}
+
+
+size_t bc_automaton_image(const bc_automaton *self,
+                          void *image)
+{
+    size_t states_size = self->num_states * sizeof(*(self->states));
+
+    if (image != NULL) {
+        struct automaton_image header = {
+            .bc_length = self->bc_length,
+            .max_edits = self->max_edits,
+            .start = self->start,
+            .num_states = self->num_states
+        };
+
+        memcpy(image, &header, sizeof(header));
+        memcpy((char *) image + sizeof(header), self->states, states_size);
+    }
+
+    return sizeof(struct automaton_image) + states_size;
+}
+
+
+bc_automaton *map_bc_automaton(const void *image,
+                               size_t size)
+{
+    const struct automaton_image *header = image;
+
+    if (size < sizeof(*header) || ((uintptr_t) image & 7) != 0 ||
+        header->num_states == 0 || header->num_states > MAX_AUTOMATON_STATES ||
+        size != sizeof(*header) + header->num_states * sizeof(struct automaton_state) ||
+        header->start < 0 || (uint64_t) header->start >= header->num_states) {
+        return NULL;
+    }
+
+    struct automaton_state *states = (struct automaton_state *) (header + 1);
+
+    // Every transition must stay within the states
+    for (size_t s = 0; s < header->num_states; s++) {
+        for (size_t symbol = 0; symbol < ALPHABET_SIZE; symbol++) {
+            if (states[s].next[symbol] < 0 || (uint64_t) states[s].next[symbol] >= header->num_states) {
+                return NULL;
+            }
+        }
+    }
+
+    bc_automaton *automaton = malloc(sizeof(*automaton));
+
+    if (automaton == NULL) {
+        perror("Error: memory allocation failed for barcode automaton");
+        return NULL;
+    }
+
+    automaton->bc_length = header->bc_length;
+    automaton->max_edits = header->max_edits;
+    automaton->start = header->start;
+    automaton->num_states = header->num_states;
+    automaton->states = states;
+    automaton->mapped = true;
+
+    return automaton;
+}
+
+
+void destroy_bc_automaton(bc_automaton **automaton_double_ptr)
+{
+    bc_automaton *automaton = *automaton_double_ptr;
+
+    if (! automaton->mapped) {
+        free(automaton->states);
+    }
+
+    free(automaton);
+
+    *automaton_double_ptr = NULL;
+}
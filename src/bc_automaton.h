@@ -0,0 +1,50 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef BC_AUTOMATON_H
+#define BC_AUTOMATON_H
+
+#include "packed_seq.h"
+
+#include <stddef.h>
+
+/* Deterministic Levenshtein automaton over a set of barcodes, allowing
+   substitutions, insertions and deletions. Built once at startup; each
+   lookup walks at most (barcode length + max edits) read bases. */
+typedef struct bc_automaton bc_automaton;
+
+/* Returns NULL (after reporting the error) if the automaton would be
+   too large or memory runs out */
+bc_automaton *build_bc_automaton(const char **barcodes,
+                                 size_t num_barcodes,
+                                 size_t bc_length,
+                                 int max_edits);
+
+/* Returns the value (index + 1) of the barcode at 'offset' in 'read'
+   under the same rule as the mismatch table (an exact match, else the
+   only barcode within the edit limit), or 0. 'shift' is set to the
+   number of bases the rest of the read is displaced by indels in the
+   barcode (positive for insertions in the read). */
+int bc_automaton_lookup(const bc_automaton *self,
+                        const packed_seq *read,
+                        size_t offset,
+                        int *shift);
+
+size_t bc_automaton_num_states(const bc_automaton *self);
+
+/* Copies the automaton to 'image' (if not NULL) as it is written to an
+   index, and returns the size of the image */
+size_t bc_automaton_image(const bc_automaton *self,
+                          void *image);
+
+/* An automaton over the states of an image, used in place (read-only,
+   and only as long as the image); NULL if it is not a valid image or
+   memory runs out */
+bc_automaton *map_bc_automaton(const void *image,
+                               size_t size);
+
+void destroy_bc_automaton(bc_automaton **automaton_double_ptr);
+
+#endif
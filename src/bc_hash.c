@@ -14,50 +14,31 @@
 #include <stdlib.h>
 #include <string.h>
 
-#if defined __clang__ || defined __GNUC__ || defined __INTEL_COMPILER
-    #define LIKELY(x) __builtin_expect(!!(x), 1)
-#else
-    #define LIKELY(x) (x)
-#endif
-
-
-/* The value is one of:
+/* Keys are barcodes packed 2 bits per base (see packed_seq.h).
+   The value is one of:
     0 -> empty slot
    -1 -> ambiguous/duplicated entry
     1 to num_barcodes -> unique entry */
 struct hash_kv {
-    char key[6];
+    uint32_t key;
     int8_t value[2];
 };
 
 struct bc_hash_table {
     void *malloc_ptr;
     size_t num_slots;
-    size_t key_length;
     size_t num_items;
     hash_kv items[];
 };
 
 
-/* 32-bit FNV-1a hash function */
-inline uint32_t fnv_1a(const void *buffer,
-                       size_t length)
+/* Multiplicative (Fibonacci) hash of a packed key, folded so that the
+   low bits used for the slot index depend on every base */
+static inline uint32_t hash_key(uint32_t key)
 {
-    const uint32_t FNV_PRIME = 16777619UL;
-    const uint32_t FNV_OFFSET_32 = 2166136261UL;
-
-    const uint8_t *restrict octets = buffer;
-
-    uint32_t hash = FNV_OFFSET_32;
-
-    LIKELY(length == 6);
-    #pragma unroll 6
-    for (size_t i = 0; i < length; i++) {
-        hash ^= octets[i];
-        hash *= FNV_PRIME;
-    }
+    uint32_t hash = key * 2654435769UL;
 
-    return hash;
+    return hash ^ (hash >> 16);
 }
 
 
@@ -85,7 +66,7 @@ bc_hash_table *init_hash_table(size_t num_items)
 
     if (malloc_ptr == NULL) {
         perror("Error: memory allocation failed for hash table");
-        exit(EXIT_FAILURE);
+        return NULL;
     }
 
     // Align key-value struct array member to typical cache line
@@ -98,7 +79,6 @@ bc_hash_table *init_hash_table(size_t num_items)
 
     hash_table->malloc_ptr = malloc_ptr;
     hash_table->num_slots = num_slots;
-    hash_table->key_length = sizeof((*(hash_table->items)).key);
     hash_table->num_items = 0;
 
     memset(hash_table->items, 0, num_slots * sizeof(*(hash_table->items)));
@@ -109,14 +89,16 @@ bc_hash_table *init_hash_table(size_t num_items)
 
 /* Inserts an entry into a hash table if
    the key is not already present, otherwise,
-   flag the existing entry as a duplicate. */
+   flag the existing entry as a duplicate.
+   Both barcode positions share a slot per key,
+   so a slot is only free when neither has a value. */
 void hash_table_insert(bc_hash_table *ht,
-                       const char *key,
+                       uint32_t key,
                        int8_t value,
                        size_t bc_index,
                        bool overwrite)
 {
-    uint32_t hash = fnv_1a(key, ht->key_length);
+    uint32_t hash = hash_key(key);
     size_t index = hash & (ht->num_slots - 1);
 
     while (true) {
@@ -125,70 +107,67 @@ void hash_table_insert(bc_hash_table *ht,
         }
 
         hash_kv *kv_slot = &(ht->items[index]);
+        bool slot_empty = (kv_slot->value[0] == 0) && (kv_slot->value[1] == 0);
 
-        // Slot is empty
-        if (kv_slot->value[bc_index] == 0) {
-            // Copy new key/value pair into hash table
-            strncpy(kv_slot->key, key, ht->key_length);
+        // Collision; probe next slot
+        if (! slot_empty && key != kv_slot->key) {
+            index++;
+            continue;
+        }
 
+        // No entry for this barcode position yet
+        if (kv_slot->value[bc_index] == 0) {
+            kv_slot->key = key;
             kv_slot->value[bc_index] = value;
             ht->num_items += 1;
-
-            return;
         }
         // Key to be inserted matches that of an existing entry,
         // i.e., current key is a repeat and not a collision
-        else if (strncmp(key, kv_slot->key, ht->key_length) == 0) {
-            if (overwrite) {
-                kv_slot->value[bc_index] = value;
-                return;
-            }
-            else {
-                kv_slot->value[bc_index] = -1;
-                return;
-            }
+        else if (overwrite) {
+            kv_slot->value[bc_index] = value;
         }
-        // Collision; probe next slot
         else {
-            index++;
+            kv_slot->value[bc_index] = -1;
         }
+
+        return;
     }
 }
 
 
 inline int hash_table_lookup(const bc_hash_table *ht,
-                             const char *key,
+                             uint32_t key,
                              size_t bc_index)
 {
-    uint32_t hash = fnv_1a(key, ht->key_length);
+    uint32_t hash = hash_key(key);
     size_t index = hash & (ht->num_slots - 1);
 
-    int8_t value;
-
-    do {
+    while (true) {
         if (index >= ht->num_slots) {
             index = 0;
         }
 
-        value = ht->items[index].value[bc_index];
+        const hash_kv *kv_slot = &(ht->items[index]);
 
-        if (value != 0 && strncmp(key, ht->items[index].key, ht->key_length) == 0) {
-            break;
+        if (kv_slot->value[0] == 0 && kv_slot->value[1] == 0) {
+            return 0;
         }
 
-        index++;
-    } while (value != 0);
+        if (key == kv_slot->key) {
+            return kv_slot->value[bc_index];
+        }
 
-    return value;
+        index++;
+    }
 }
 
 
 /* Remove entries from the hash table that
    refer to ambiguous barcode mismatches. */
-void prune_hash_table(bc_hash_table **ht_double_ptr)
+bool prune_hash_table(bc_hash_table **ht_double_ptr)
 {
     if (*ht_double_ptr == NULL) {
-        return;
+        return true;
     }
 
     bc_hash_table *original_table = *ht_double_ptr;
@@ -207,15 +186,14 @@ void prune_hash_table(bc_hash_table **ht_double_ptr)
     }
 
     if (num_slots_with_duplicates == 0) {
-        return;
+        return true;
     }
 
     size_t pruned_num_slots = nearest_pow2(num_unique_keys * 3 / 2);
     bc_hash_table *pruned_table = init_hash_table(pruned_num_slots);
 
     if (pruned_table == NULL) {
-        perror("Error: memory allocation failed for pruned hash table");
-        exit(EXIT_FAILURE);
+        return false;
     }
 
     for (size_t i = 0; i < original_table->num_slots; i++) {
@@ -230,6 +208,44 @@ void prune_hash_table(bc_hash_table **ht_double_ptr)
     destroy_hash_table(ht_double_ptr);
 
     *ht_double_ptr = pruned_table;
+
+    return true;
+}
+
+
+/* The image is the table itself without its allocation, so that a
+   mapped image is used in place */
+size_t hash_table_image(const bc_hash_table *self,
+                        void *image)
+{
+    size_t size = offsetof(bc_hash_table, items) + self->num_slots * sizeof(*(self->items));
+
+    if (image != NULL) {
+        memcpy(image, self, size);
+        ((bc_hash_table *) image)->malloc_ptr = NULL;
+    }
+
+    return size;
+}
+
+
+bc_hash_table *map_hash_table(const void *image,
+                              size_t size)
+{
+    bc_hash_table *hash_table = (bc_hash_table *) image;
+
+    if (size < offsetof(bc_hash_table, items) || ((uintptr_t) image & 7) != 0) {
+        return NULL;
+    }
+
+    size_t num_slots = hash_table->num_slots;
+
+    if (hash_table->malloc_ptr != NULL || num_slots == 0 || (num_slots & (num_slots - 1)) != 0 ||
+        size != offsetof(bc_hash_table, items) + num_slots * sizeof(*(hash_table->items))) {
+        return NULL;
+    }
+
+    return hash_table;
 }
 
 
@@ -13,19 +13,32 @@
 typedef struct hash_kv hash_kv;
 typedef struct bc_hash_table bc_hash_table;
 
+/* Returns NULL (after reporting the error) if memory runs out */
 bc_hash_table *init_hash_table(size_t num_items);
 
 void hash_table_insert(bc_hash_table *self,
-                       const char *key,
+                       uint32_t key,
                        int8_t value,
                        size_t bc_index,
                        bool overwrite);
 
 int hash_table_lookup(const bc_hash_table *self,
-                      const char *key,
+                      uint32_t key,
                       size_t bc_index);
 
-void prune_hash_table(bc_hash_table **ht_double_ptr);
+/* Returns false, leaving the table unpruned, if memory runs out */
+bool prune_hash_table(bc_hash_table **ht_double_ptr);
+
+/* Copies the table to 'image' (if not NULL) as it is written to an
+   index, and returns the size of the image */
+size_t hash_table_image(const bc_hash_table *self,
+                        void *image);
+
+/* The table of an image, used in place (read-only, and only as long as
+   the image); NULL if it is not a valid image. Destroying the table
+   leaves the image alone. */
+bc_hash_table *map_hash_table(const void *image,
+                              size_t size);
 
 void destroy_hash_table(bc_hash_table **ht_double_ptr);
 
@@ -0,0 +1,322 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "bc_scan.h"
+
+#include "cpu_dispatch.h"
+#include "packed_seq.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined __clang__ || defined __GNUC__ || defined __INTEL_COMPILER
+    #define POPCOUNT32(x) __builtin_popcount(x)
+#else
+    static inline int POPCOUNT32(uint32_t x)
+    {
+        int count = 0;
+        for (; x; x &= x - 1) {
+            count++;
+        }
+        return count;
+    }
+#endif
+
+typedef int (*scan_kernel)(const uint32_t *candidates,
+                           const int16_t *values,
+                           size_t num_candidates,
+                           uint32_t key,
+                           int max_mismatches);
+
+struct bc_candidates {
+    uint32_t *packed;
+    int16_t *values;
+    size_t count;
+    size_t capacity;
+};
+
+struct bc_scanner {
+    size_t bc_length;
+    int max_mismatches;
+    scan_kernel kernel;
+    struct bc_candidates candidates[2];
+};
+
+
+/* A read maps to a barcode if it matches it exactly, or if it is the
+   only barcode within the mismatch limit, i.e. the best distance is
+   within the limit and the second-best is not. */
+struct scan_tally {
+    int exact_value;
+    int nearest_value;
+    size_t num_within;
+};
+
+
+static KERNEL_INLINE void tally_candidates(struct scan_tally *tally,
+                                    const uint32_t *candidates,
+                                    const int16_t *values,
+                                    size_t num_candidates,
+                                    uint32_t key,
+                                    int max_mismatches)
+{
+    for (size_t i = 0; i < num_candidates; i++) {
+        uint32_t diff = candidates[i] ^ key;
+        int mismatches = POPCOUNT32((diff | (diff >> 1)) & 0x55555555u);
+
+        if (mismatches == 0) {
+            tally->exact_value = values[i];
+        }
+        else if (mismatches <= max_mismatches) {
+            tally->nearest_value = values[i];
+            tally->num_within++;
+        }
+    }
+}
+
+
+static inline int tally_result(const struct scan_tally *tally)
+{
+    if (tally->exact_value) {
+        return tally->exact_value;
+    }
+
+    return (tally->num_within == 1) ? tally->nearest_value : 0;
+}
+
+
+int scan_barcodes_scalar(const uint32_t *candidates,
+                         const int16_t *values,
+                         size_t num_candidates,
+                         uint32_t key,
+                         int max_mismatches)
+{
+    struct scan_tally tally = {0};
+
+    tally_candidates(&tally, candidates, values, num_candidates, key, max_mismatches);
+
+    return tally_result(&tally);
+}
+
+
+#ifdef HAVE_X86_KERNELS
+/* One candidate at a time, with the hardware population count */
+TARGET_SSE42
+int scan_barcodes_sse42(const uint32_t *candidates,
+                        const int16_t *values,
+                        size_t num_candidates,
+                        uint32_t key,
+                        int max_mismatches)
+{
+    struct scan_tally tally = {0};
+
+    tally_candidates(&tally, candidates, values, num_candidates, key, max_mismatches);
+
+    return tally_result(&tally);
+}
+
+
+/* Byte popcounts through a nibble lookup table, widened to 32 bits */
+#define POPCOUNT_NIBBLES 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+
+
+TARGET_AVX2
+int scan_barcodes_avx2(const uint32_t *candidates,
+                       const int16_t *values,
+                       size_t num_candidates,
+                       uint32_t key,
+                       int max_mismatches)
+{
+    const __m256i key_vec = _mm256_set1_epi32((int) key);
+    const __m256i base_bits = _mm256_set1_epi32(0x55555555);
+    const __m256i nibble_mask = _mm256_set1_epi8(0x0f);
+    const __m256i ones_8 = _mm256_set1_epi8(1);
+    const __m256i ones_16 = _mm256_set1_epi16(1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i limit = _mm256_set1_epi32(max_mismatches + 1);
+    const __m256i popcount_lut = _mm256_setr_epi8(POPCOUNT_NIBBLES, POPCOUNT_NIBBLES);
+
+    struct scan_tally tally = {0};
+    size_t i = 0;
+
+    for (; i + 8 <= num_candidates; i += 8) {
+        __m256i packed = _mm256_loadu_si256((const __m256i *) (candidates + i));
+        __m256i diff = _mm256_xor_si256(packed, key_vec);
+        __m256i mismatch_bits = _mm256_and_si256(_mm256_or_si256(diff, _mm256_srli_epi32(diff, 1)),
+                                                 base_bits);
+
+        __m256i low = _mm256_shuffle_epi8(popcount_lut, _mm256_and_si256(mismatch_bits, nibble_mask));
+        __m256i high = _mm256_shuffle_epi8(popcount_lut,
+                                           _mm256_and_si256(_mm256_srli_epi16(mismatch_bits, 4),
+                                                            nibble_mask));
+        __m256i byte_counts = _mm256_add_epi8(low, high);
+        __m256i mismatches = _mm256_madd_epi16(_mm256_maddubs_epi16(byte_counts, ones_8), ones_16);
+
+        int exact_mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(mismatches, zero)));
+        int within_mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(limit, mismatches)));
+        within_mask &= ~exact_mask;
+
+        if (exact_mask) {
+            tally.exact_value = values[i + 31 - __builtin_clz((unsigned) exact_mask)];
+        }
+        if (within_mask) {
+            tally.nearest_value = values[i + __builtin_ctz((unsigned) within_mask)];
+            tally.num_within += POPCOUNT32((unsigned) within_mask);
+        }
+    }
+
+    tally_candidates(&tally, candidates + i, values + i, num_candidates - i,
+                     key, max_mismatches);
+
+    return tally_result(&tally);
+}
+
+
+/* Sixteen candidates per step, with comparisons straight into masks */
+TARGET_AVX512BW
+int scan_barcodes_avx512bw(const uint32_t *candidates,
+                           const int16_t *values,
+                           size_t num_candidates,
+                           uint32_t key,
+                           int max_mismatches)
+{
+    const __m512i key_vec = _mm512_set1_epi32((int) key);
+    const __m512i base_bits = _mm512_set1_epi32(0x55555555);
+    const __m512i nibble_mask = _mm512_set1_epi8(0x0f);
+    const __m512i ones_8 = _mm512_set1_epi8(1);
+    const __m512i ones_16 = _mm512_set1_epi16(1);
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i limit = _mm512_set1_epi32(max_mismatches);
+    const __m512i popcount_lut = _mm512_broadcast_i32x4(_mm_setr_epi8(POPCOUNT_NIBBLES));
+
+    struct scan_tally tally = {0};
+    size_t i = 0;
+
+    for (; i + 16 <= num_candidates; i += 16) {
+        __m512i packed = _mm512_loadu_si512((const void *) (candidates + i));
+        __m512i diff = _mm512_xor_si512(packed, key_vec);
+        __m512i mismatch_bits = _mm512_and_si512(_mm512_or_si512(diff, _mm512_srli_epi32(diff, 1)),
+                                                 base_bits);
+
+        __m512i low = _mm512_shuffle_epi8(popcount_lut, _mm512_and_si512(mismatch_bits, nibble_mask));
+        __m512i high = _mm512_shuffle_epi8(popcount_lut,
+                                           _mm512_and_si512(_mm512_srli_epi16(mismatch_bits, 4),
+                                                            nibble_mask));
+        __m512i byte_counts = _mm512_add_epi8(low, high);
+        __m512i mismatches = _mm512_madd_epi16(_mm512_maddubs_epi16(byte_counts, ones_8), ones_16);
+
+        unsigned exact_mask = _mm512_cmpeq_epi32_mask(mismatches, zero);
+        unsigned within_mask = _mm512_cmple_epi32_mask(mismatches, limit) & ~exact_mask;
+
+        if (exact_mask) {
+            tally.exact_value = values[i + 31 - __builtin_clz(exact_mask)];
+        }
+        if (within_mask) {
+            tally.nearest_value = values[i + __builtin_ctz(within_mask)];
+            tally.num_within += POPCOUNT32(within_mask);
+        }
+    }
+
+    tally_candidates(&tally, candidates + i, values + i, num_candidates - i,
+                     key, max_mismatches);
+
+    return tally_result(&tally);
+}
+#endif
+
+
+bc_scanner *init_bc_scanner(size_t bc_length,
+                            int max_mismatches,
+                            const kernel_set *kernels)
+{
+    if (bc_length > MAX_SCAN_BC_LEN) {
+        fprintf(stderr, "Error: barcodes longer than %d bases cannot be scanned\n",
+                MAX_SCAN_BC_LEN);
+        return NULL;
+    }
+
+    bc_scanner *scanner = calloc(1, sizeof(*scanner));
+
+    if (scanner == NULL) {
+        perror("Error: memory allocation failed for barcode scanner");
+        return NULL;
+    }
+
+    scanner->bc_length = bc_length;
+    scanner->max_mismatches = max_mismatches;
+    scanner->kernel = kernels->scan_barcodes;
+
+    return scanner;
+}
+
+
+bool bc_scanner_add(bc_scanner *self,
+                    const char *barcode,
+                    int value,
+                    size_t bc_index)
+{
+    struct bc_candidates *candidates = &(self->candidates[bc_index]);
+    uint64_t packed;
+
+    // N and other symbols never match, as in the hash table
+    if (! pack_kmer(barcode, self->bc_length, &packed)) {
+        return true;
+    }
+
+    if (candidates->count == candidates->capacity) {
+        size_t capacity = candidates->capacity ? candidates->capacity * 2 : 64;
+        uint32_t *packed_tmp = realloc(candidates->packed, capacity * sizeof(*packed_tmp));
+        int16_t *values_tmp = realloc(candidates->values, capacity * sizeof(*values_tmp));
+
+        // A block that was moved is kept, so that it is freed with the scanner
+        if (packed_tmp != NULL) {
+            candidates->packed = packed_tmp;
+        }
+        if (values_tmp != NULL) {
+            candidates->values = values_tmp;
+        }
+
+        if (packed_tmp == NULL || values_tmp == NULL) {
+            perror("Error: memory allocation failed for barcode scanner");
+            return false;
+        }
+
+        candidates->capacity = capacity;
+    }
+
+    candidates->packed[candidates->count] = (uint32_t) packed;
+    candidates->values[candidates->count] = (int16_t) value;
+    candidates->count++;
+
+    return true;
+}
+
+
+int bc_scanner_lookup(const bc_scanner *self,
+                      uint32_t key,
+                      size_t bc_index)
+{
+    const struct bc_candidates *candidates = &(self->candidates[bc_index]);
+
+    return self->kernel(candidates->packed, candidates->values, candidates->count,
+                        key, self->max_mismatches);
+}
+
+
+void destroy_bc_scanner(bc_scanner **scanner_double_ptr)
+{
+    bc_scanner *scanner = *scanner_double_ptr;
+
+    for (size_t i = 0; i < 2; i++) {
+        free(scanner->candidates[i].packed);
+        free(scanner->candidates[i].values);
+    }
+
+    free(scanner);
+    *scanner_double_ptr = NULL;
+}
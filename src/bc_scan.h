@@ -0,0 +1,46 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef BC_SCAN_H
+#define BC_SCAN_H
+
+#include "cpu_dispatch.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Barcode lookup by comparing a read against every barcode at once,
+   as an alternative to the mismatch neighbourhood hash table when the
+   table would grow too large. Barcodes are packed 2 bits per base and
+   compared with XOR/popcount, up to sixteen candidates per instruction
+   (see cpu_dispatch.h). */
+typedef struct bc_scanner bc_scanner;
+
+enum { MAX_SCAN_BC_LEN = 16 };
+
+/* Both return NULL or false (after reporting the error) if the
+   barcodes are too long or memory runs out. The scanner compares with
+   the barcode kernel of 'kernels'. */
+bc_scanner *init_bc_scanner(size_t bc_length,
+                            int max_mismatches,
+                            const kernel_set *kernels);
+
+bool bc_scanner_add(bc_scanner *self,
+                    const char *barcode,
+                    int value,
+                    size_t bc_index);
+
+/* Same result as hash_table_lookup() on a table built with the same
+   barcodes and mismatch limit: the value of an exact match, else of the
+   only barcode within the mismatch limit, else 0. 'key' is the packed
+   read barcode (see packed_seq.h). */
+int bc_scanner_lookup(const bc_scanner *self,
+                      uint32_t key,
+                      size_t bc_index);
+
+void destroy_bc_scanner(bc_scanner **scanner_double_ptr);
+
+#endif
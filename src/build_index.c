@@ -0,0 +1,86 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "build_index.h"
+
+#include "argparse.h"
+#include "fsdm.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+int build_index_main(int argc,
+                     const char **argv)
+{
+    static const char *usage[] = {
+        "fsdm index [options] <sequences.fa> <library.idx>",
+        NULL
+    };
+
+    static const char *description = "Builds an index of a library for fsdm runs with the same "
+                                     "barcode options, given in place of sequences.fa";
+
+    fsdm_options options;
+    int output_all = 0;
+    int bc_scan = 0;
+    int bc_indels = 0;
+
+    fsdm_default_options(&options);
+
+    struct argparse_option arguments[] = {
+        OPT_HELP(false),
+
+        OPT_GROUP("Options"),
+        OPT_BOOLEAN('a', NULL, &output_all,
+                    "Index all possible barcode combinations",
+                    NULL, 0, 0),
+        OPT_INTEGER(0, "bm", &options.bc_mismatches,
+                    "Number of mismatches allowed in a barcode sequence (default 0)",
+                    NULL, 0, 0),
+        OPT_BOOLEAN(0, "bc-scan", &bc_scan,
+                    "Compare barcodes against all candidates instead of a mismatch table",
+                    NULL, 0, 0),
+        OPT_BOOLEAN(0, "bc-indels", &bc_indels,
+                    "Allow insertions and deletions within the --bm barcode edits",
+                    NULL, 0, 0),
+
+        OPT_END()
+    };
+
+    struct argparse parser;
+    argparse_init(&parser, arguments, usage, 0);
+    argparse_describe(&parser, description, NULL);
+
+    argc = argparse_parse(&parser, argc, argv);
+
+    if (argc != 2) {
+        fprintf(stderr, "Error: expected a FASTA file and an index file\n\n\n");
+        argparse_usage(&parser, false);
+        return EXIT_FAILURE;
+    }
+
+    if (options.bc_mismatches < 0 || options.bc_mismatches >= 6) {
+        fprintf(stderr, "Error: number of barcode mismatches must be between 0 and 5\n");
+        return EXIT_FAILURE;
+    }
+
+    options.output_all = output_all;
+    options.bc_scan = bc_scan;
+    options.bc_indels = bc_indels;
+
+    fsdm_classifier *classifier = fsdm_classifier_new(argv[0], &options);
+
+    if (classifier == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    bool saved = fsdm_classifier_save(classifier, argv[1]);
+
+    fsdm_classifier_free(&classifier);
+
+    return saved ? 0 : EXIT_FAILURE;
+}
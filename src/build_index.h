@@ -0,0 +1,15 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef BUILD_INDEX_H
+#define BUILD_INDEX_H
+
+/* 'fsdm index': builds the barcode tables of a library once and writes
+   them with it to an index file, which runs then map instead of the
+   FASTA file ('argv[0]' is the subcommand name) */
+extern int build_index_main(int argc,
+                            const char **argv);
+
+#endif
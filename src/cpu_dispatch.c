@@ -0,0 +1,94 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "cpu_dispatch.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#define KERNEL_SET(label, suffix) { \
+    .name = label, \
+    .pack_sequence = pack_sequence_##suffix, \
+    .packed_mismatches = packed_mismatches_##suffix, \
+    .scan_barcodes = scan_barcodes_##suffix, \
+    .find_newline = find_newline_##suffix, \
+    .band_align_flank = band_align_flank_##suffix, \
+    .align_template = align_template_##suffix \
+}
+
+/* Ordered from the narrowest to the widest instruction set */
+static const kernel_set KERNEL_SETS[] = {
+    KERNEL_SET("scalar", scalar),
+#ifdef HAVE_X86_KERNELS
+    KERNEL_SET("sse4.2", sse42),
+    KERNEL_SET("avx2", avx2),
+    KERNEL_SET("avx512bw", avx512bw)
+#endif
+};
+
+static const size_t NUM_KERNEL_SETS = sizeof(KERNEL_SETS) / sizeof(KERNEL_SETS[0]);
+
+
+static bool cpu_supports_kernel_set(size_t index)
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+
+    switch (index) {
+        case 1:
+            return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+        case 2:
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+        case 3:
+            return __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("bmi2") &&
+                   __builtin_cpu_supports("popcnt");
+        default:
+            break;
+    }
+#endif
+
+    return index == 0;
+}
+
+
+const kernel_set *find_kernels(const char *name)
+{
+    if (name == NULL || strcmp(name, "auto") == 0) {
+        size_t best = 0;
+
+        for (size_t i = 0; i < NUM_KERNEL_SETS; i++) {
+            if (cpu_supports_kernel_set(i)) {
+                best = i;
+            }
+        }
+
+        return &KERNEL_SETS[best];
+    }
+
+    for (size_t i = 0; i < NUM_KERNEL_SETS; i++) {
+        if (strcmp(name, KERNEL_SETS[i].name) != 0) {
+            continue;
+        }
+
+        if (! cpu_supports_kernel_set(i)) {
+            fprintf(stderr, "Error: '%s' kernels are not supported by this CPU\n", name);
+            return NULL;
+        }
+
+        return &KERNEL_SETS[i];
+    }
+
+    fprintf(stderr, "Error: unknown kernel set '%s' (expected auto", name);
+
+    for (size_t i = 0; i < NUM_KERNEL_SETS; i++) {
+        fprintf(stderr, ", %s", KERNEL_SETS[i].name);
+    }
+
+    fprintf(stderr, ")\n");
+
+    return NULL;
+}
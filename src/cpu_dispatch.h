@@ -0,0 +1,104 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef CPU_DISPATCH_H
+#define CPU_DISPATCH_H
+
+#include "packed_seq.h"
+#include "template_align.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined __x86_64__ && (defined __GNUC__ || defined __clang__)
+    #define HAVE_X86_KERNELS 1
+    #include <immintrin.h>
+
+    #define TARGET_SSE42 __attribute__((target("sse4.2,popcnt")))
+    #define TARGET_AVX2 __attribute__((target("avx2,popcnt")))
+    #define TARGET_AVX512BW __attribute__((target("avx512bw,bmi2,popcnt")))
+#endif
+
+/* Portable kernel bodies are forced inline into each variant, so that
+   they are compiled for that variant's instruction set */
+#if defined __GNUC__ || defined __clang__
+    #define KERNEL_INLINE inline __attribute__((always_inline))
+#else
+    #define KERNEL_INLINE inline
+#endif
+
+/* The hot kernels, compiled once per instruction set level through
+   target attributes and chosen per classifier from what the CPU
+   supports, so a single portable binary still runs full-width SIMD
+   where it can. */
+typedef struct kernel_set {
+    const char *name;
+    // Packs at most the first PACKED_MAX_BASES bases of 'seq'
+    void (*pack_sequence)(const char *seq,
+                          size_t length,
+                          packed_seq *packed);
+    // Mismatching bases between 'length' bases of 'seq' starting at
+    // 'offset' and the start of 'reference', compared a word at a time.
+    // Returns -1 if the window runs past either sequence or either side
+    // contains an N.
+    int (*packed_mismatches)(const packed_seq *seq,
+                             size_t offset,
+                             const packed_seq *reference,
+                             size_t length);
+    int (*scan_barcodes)(const uint32_t *candidates,
+                         const int16_t *values,
+                         size_t num_candidates,
+                         uint32_t key,
+                         int max_mismatches);
+    // Index of the first '\n' in 'data', or 'length' if there is none
+    size_t (*find_newline)(const char *data,
+                           size_t length);
+    int (*band_align_flank)(const packed_seq *flank,
+                            const packed_seq *read,
+                            long read_start,
+                            int band);
+    // Aligns the whole template against 'read' from 'read_start' in a
+    // single pass, allowing up to 'max_edits' substitutions, insertions
+    // and deletions (and so indels that displace the following segments
+    // by up to that many bases). The template end is free in the read.
+    // Returns false if every alignment needs more edits; otherwise fills
+    // in the edits per plan check and the read position of each allele
+    // site (-1 if it was deleted).
+    bool (*align_template)(const read_template *tmpl,
+                           const packed_seq *read,
+                           long read_start,
+                           int max_edits,
+                           template_alignment *alignment);
+} kernel_set;
+
+/* The kernel set called 'name' ("scalar", "sse4.2", "avx2" or
+   "avx512bw"), or the widest one the CPU supports if 'name' is NULL or
+   "auto". Returns NULL (after reporting the error) if the set is unknown
+   or unsupported. */
+extern const kernel_set *find_kernels(const char *name);
+
+/* Every variant is defined next to the portable version of the kernel */
+#define DECLARE_KERNEL_SET(suffix) \
+    void pack_sequence_##suffix(const char *seq, size_t length, packed_seq *packed); \
+    int packed_mismatches_##suffix(const packed_seq *seq, size_t offset, \
+                                   const packed_seq *reference, size_t length); \
+    int scan_barcodes_##suffix(const uint32_t *candidates, const int16_t *values, \
+                               size_t num_candidates, uint32_t key, int max_mismatches); \
+    size_t find_newline_##suffix(const char *data, size_t length); \
+    int band_align_flank_##suffix(const packed_seq *flank, const packed_seq *read, \
+                                  long read_start, int band); \
+    bool align_template_##suffix(const read_template *tmpl, const packed_seq *read, \
+                                 long read_start, int max_edits, template_alignment *alignment);
+
+DECLARE_KERNEL_SET(scalar)
+
+#ifdef HAVE_X86_KERNELS
+DECLARE_KERNEL_SET(sse42)
+DECLARE_KERNEL_SET(avx2)
+DECLARE_KERNEL_SET(avx512bw)
+#endif
+
+#endif
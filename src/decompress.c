@@ -0,0 +1,263 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "decompress.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+    #include <zstd.h>
+#endif
+
+#ifdef HAVE_ISAL
+    #include <isa-l/igzip_lib.h>
+#endif
+
+static const unsigned char GZIP_MAGIC[] = {0x1f, 0x8b};
+static const unsigned char ZSTD_MAGIC[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+
+/* Uncompressed input */
+static void *plain_create(void)
+{
+    static char state;
+    return &state;
+}
+
+
+static int plain_decompress(void *state,
+                            decompress_buffers *buffers)
+{
+    (void) state;
+
+    size_t num_bytes = buffers->input_length;
+
+    if (num_bytes > buffers->output_length) {
+        num_bytes = buffers->output_length;
+    }
+
+    memcpy(buffers->output, buffers->input, num_bytes);
+    buffers->input += num_bytes;
+    buffers->input_length -= num_bytes;
+    buffers->output += num_bytes;
+    buffers->output_length -= num_bytes;
+
+    return 0;
+}
+
+
+static void plain_destroy(void *state)
+{
+    (void) state;
+}
+
+
+#ifndef HAVE_ZSTD
+/* Recognised formats whose library was not available at build time */
+static void *unsupported_create(void)
+{
+    return NULL;
+}
+#endif
+
+
+/* zlib */
+static void *zlib_create(void)
+{
+    z_stream *stream = calloc(1, sizeof(*stream));
+
+    if (stream != NULL && inflateInit2(stream, 15 + 16) != Z_OK) {
+        free(stream);
+        stream = NULL;
+    }
+
+    return stream;
+}
+
+
+static int zlib_decompress(void *state,
+                           decompress_buffers *buffers)
+{
+    z_stream *stream = state;
+
+    // z_stream lengths are 32-bit
+    unsigned int input_length = (buffers->input_length > UINT_MAX) ? UINT_MAX
+                                : (unsigned int) buffers->input_length;
+    unsigned int output_length = (buffers->output_length > UINT_MAX) ? UINT_MAX
+                                 : (unsigned int) buffers->output_length;
+
+    stream->next_in = (unsigned char *) buffers->input;
+    stream->avail_in = input_length;
+    stream->next_out = buffers->output;
+    stream->avail_out = output_length;
+
+    int status = inflate(stream, Z_NO_FLUSH);
+
+    buffers->input += input_length - stream->avail_in;
+    buffers->input_length -= input_length - stream->avail_in;
+    buffers->output += output_length - stream->avail_out;
+    buffers->output_length -= output_length - stream->avail_out;
+
+    if (status == Z_STREAM_END) {
+        inflateReset(stream);
+        return 1;
+    }
+
+    return (status == Z_OK || status == Z_BUF_ERROR) ? 0 : -1;
+}
+
+
+static void zlib_destroy(void *state)
+{
+    inflateEnd(state);
+    free(state);
+}
+
+
+#ifdef HAVE_ZSTD
+static void *zstd_create(void)
+{
+    return ZSTD_createDStream();
+}
+
+
+static int zstd_decompress(void *state,
+                           decompress_buffers *buffers)
+{
+    ZSTD_inBuffer input = {buffers->input, buffers->input_length, 0};
+    ZSTD_outBuffer output = {buffers->output, buffers->output_length, 0};
+
+    size_t status = ZSTD_decompressStream(state, &output, &input);
+
+    buffers->input += input.pos;
+    buffers->input_length -= input.pos;
+    buffers->output += output.pos;
+    buffers->output_length -= output.pos;
+
+    if (ZSTD_isError(status)) {
+        return -1;
+    }
+
+    // 0 means the frame is fully decoded and flushed
+    return (status == 0) ? 1 : 0;
+}
+
+
+static void zstd_destroy(void *state)
+{
+    ZSTD_freeDStream(state);
+}
+#endif
+
+
+#ifdef HAVE_ISAL
+/* ISA-L igzip: a faster drop-in for gzip members */
+static void *isal_create(void)
+{
+    struct inflate_state *stream = malloc(sizeof(*stream));
+
+    if (stream != NULL) {
+        isal_inflate_init(stream);
+        stream->crc_flag = ISAL_GZIP;
+    }
+
+    return stream;
+}
+
+
+static int isal_decompress(void *state,
+                           decompress_buffers *buffers)
+{
+    struct inflate_state *stream = state;
+
+    unsigned int input_length = (buffers->input_length > UINT_MAX) ? UINT_MAX
+                                : (unsigned int) buffers->input_length;
+    unsigned int output_length = (buffers->output_length > UINT_MAX) ? UINT_MAX
+                                 : (unsigned int) buffers->output_length;
+
+    stream->next_in = (uint8_t *) buffers->input;
+    stream->avail_in = input_length;
+    stream->next_out = buffers->output;
+    stream->avail_out = output_length;
+
+    int status = isal_inflate(stream);
+
+    buffers->input += input_length - stream->avail_in;
+    buffers->input_length -= input_length - stream->avail_in;
+    buffers->output += output_length - stream->avail_out;
+    buffers->output_length -= output_length - stream->avail_out;
+
+    if (status < 0) {
+        return -1;
+    }
+
+    if (stream->block_state == ISAL_BLOCK_FINISH) {
+        isal_inflate_reset(stream);
+        stream->crc_flag = ISAL_GZIP;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static void isal_destroy(void *state)
+{
+    free(state);
+}
+#endif
+
+
+/* Earlier entries take precedence for the same magic number */
+static const decompress_backend BACKENDS[] = {
+#ifdef HAVE_ISAL
+    {"gzip (isa-l)", GZIP_MAGIC, sizeof(GZIP_MAGIC),
+     isal_create, isal_decompress, isal_destroy},
+#endif
+    {"gzip", GZIP_MAGIC, sizeof(GZIP_MAGIC),
+     zlib_create, zlib_decompress, zlib_destroy},
+#ifdef HAVE_ZSTD
+    {"zstd", ZSTD_MAGIC, sizeof(ZSTD_MAGIC),
+     zstd_create, zstd_decompress, zstd_destroy},
+#else
+    {"zstd", ZSTD_MAGIC, sizeof(ZSTD_MAGIC),
+     unsupported_create, NULL, NULL},
+#endif
+    {"plain", NULL, 0,
+     plain_create, plain_decompress, plain_destroy}
+};
+
+
+bool decompress_magic_matches(const decompress_backend *backend,
+                              const unsigned char *data,
+                              size_t length)
+{
+    // Only the bytes available so far can be compared
+    if (length > backend->magic_length) {
+        length = backend->magic_length;
+    }
+
+    return memcmp(data, backend->magic, length) == 0;
+}
+
+
+const decompress_backend *select_decompress_backend(const unsigned char *data,
+                                                    size_t length)
+{
+    size_t num_backends = sizeof(BACKENDS) / sizeof(BACKENDS[0]);
+
+    for (size_t i = 0; i < num_backends - 1; i++) {
+        if (length > 0 && decompress_magic_matches(&BACKENDS[i], data, length)) {
+            return &BACKENDS[i];
+        }
+    }
+
+    return &BACKENDS[num_backends - 1];
+}
@@ -0,0 +1,44 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct decompress_buffers {
+    const unsigned char *input;
+    size_t input_length;
+    unsigned char *output;
+    size_t output_length;
+} decompress_buffers;
+
+/* A streaming decompressor. 'decompress' consumes input and fills output,
+   advancing the pointers in 'buffers', and returns 1 once a complete
+   frame (gzip member, zstd frame) has been decoded, 0 when it needs more
+   input or output space and -1 on corrupt input. The state is ready for
+   a following frame after returning 1. 'create' returns NULL when the
+   backend cannot be initialised, or was not compiled in. */
+typedef struct decompress_backend {
+    const char *name;
+    const unsigned char *magic;
+    size_t magic_length;
+    void *(*create)(void);
+    int (*decompress)(void *state, decompress_buffers *buffers);
+    void (*destroy)(void *state);
+} decompress_backend;
+
+/* Chooses a backend from the leading bytes of an input; inputs without a
+   recognised magic number are passed through uncompressed. */
+extern const decompress_backend *select_decompress_backend(const unsigned char *data,
+                                                           size_t length);
+
+/* Whether 'data' could be the start of another frame for 'backend'. */
+extern bool decompress_magic_matches(const decompress_backend *backend,
+                                     const unsigned char *data,
+                                     size_t length);
+
+#endif
@@ -5,19 +5,37 @@
 
 #include "demultiplex.h"
 
+#include "allele_locate.h"
+#include "bc_automaton.h"
 #include "bc_hash.h"
+#include "bc_scan.h"
+#include "cpu_dispatch.h"
 #include "edit_distance.h"
+#include "fastq_reader.h"
+#include "haplotype_counts.h"
+#include "packed_seq.h"
 #include "parse_seq.h"
+#include "perf_counters.h"
+#include "read_log.h"
+#include "run_metrics.h"
+#include "spacer_phase.h"
+#include "template_align.h"
+
+// Records are split into lines with the newline scan of the reader's kernels
+#define KS_FIND_NEWLINE(data, length) fastq_reader_find_newline(ks->f, data, length)
 #include "kseq.h"
 
 #include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <zlib.h>
+#include <string.h>
+#include <time.h>
 
-KSEQ_INIT(gzFile, gzread)
+KSEQ_INIT(fastq_reader *, fastq_reader_read)
 
 
 static inline bool read_fastq_pair(kseq_t *fq_1,
@@ -31,89 +49,1420 @@ static inline bool read_fastq_pair(kseq_t *fq_1,
 }
 
 
-void demultiplex_fastq_pair(const char **fastq_pair,
-                            library_seqs *fs2_seqs,
-                            bc_hash_table *hash_table,
-                            bc_counter *bc_combo_counts,
-                            int ad_fl_mismatches,
-                            int ed_threshold,
-                            const bool *valid_alleles)
+/* Both mates come from the same stream, so the parser state that
+   kseq keeps between records (the stream and the last header character
+   already consumed) is handed from one record to the next. */
+static inline bool read_interleaved_pair(kseq_t *fq_1,
+                                         kseq_t *fq_2,
+                                         int status[2])
 {
-    gzFile fastq_fp[2] = {NULL};
+    status[0] = kseq_read(fq_1);
 
-    for (size_t i = 0; i < 2; i++) {
-        fastq_fp[i] = gzopen(fastq_pair[i], "r");
+    fq_2->last_char = fq_1->last_char;
+    status[1] = (status[0] >= 0) ? kseq_read(fq_2) : status[0];
+    fq_1->last_char = fq_2->last_char;
 
-        if (fastq_fp[i] == NULL) {
-            fprintf(stderr, "Error: unable to read file '%s': %s\n",
-                    fastq_pair[i], strerror(errno));
-            exit(EXIT_FAILURE);
-        }
+    return (status[0] >= 0) && (status[1] >= 0);
+}
+
+
+/* Returns the value (0 if unmatched) of the barcode at 'offset' and
+   sets 'shift' to the displacement of the rest of the read caused by
+   indels in the barcode, which only the automaton can decode. */
+static inline int lookup_barcode(const bc_decoder *decoder,
+                                 const packed_seq *read,
+                                 size_t bc_index,
+                                 size_t offset,
+                                 int *shift)
+{
+    *shift = 0;
+
+    if (decoder->automata[bc_index]) {
+        return bc_automaton_lookup(decoder->automata[bc_index], read, offset, shift);
     }
 
-    kseq_t *fq[2] = {kseq_init(fastq_fp[0]), kseq_init(fastq_fp[1])};
-    int read_status[2] = {0};
+    uint64_t key;
 
-    while (read_fastq_pair(fq[0], fq[1], read_status)) {
-        int bc1 = hash_table_lookup(hash_table, fq[0]->seq.s, 0) - 1;
-        int bc2 = hash_table_lookup(hash_table, fq[1]->seq.s, 1) - 1;
+    // Barcodes with an N are never in the table or the candidate list
+    if (! packed_kmer_at(read, offset, 6, &key)) {
+        return 0;
+    }
+
+    if (decoder->scanner) {
+        return bc_scanner_lookup(decoder->scanner, (uint32_t) key, bc_index);
+    }
 
-        if ((bc1 | bc2) < 0) {
+    return hash_table_lookup(decoder->hash_table, (uint32_t) key, bc_index);
+}
+
+
+/* With phased primers, the barcode is looked up after the spacer
+   length found from the junction k-mers. If it is not found there, an
+   indel near the junction may have displaced the k-mers, so the
+   runner-up length and the lengths one base either side are tried.
+   The spacer shifts the rest of the mate like an indel. */
+static inline int lookup_phased_barcode(const bc_decoder *decoder,
+                                        const phase_index *phases,
+                                        const packed_seq *read,
+                                        size_t bc_index,
+                                        int *shift)
+{
+    int runner_up;
+    int phase = find_phase(phases, read, &runner_up);
+
+    *shift = 0;
+
+    if (phase < 0) {
+        return 0;
+    }
+
+    int candidates[4] = {phase, runner_up, phase - 1, phase + 1};
+    size_t num_candidates = (phases->min_phase == phases->max_phase) ? 1 : 4;
+
+    for (size_t i = 0; i < num_candidates; i++) {
+        int candidate = candidates[i];
+
+        if (candidate < phases->min_phase || candidate > phases->max_phase ||
+            (i > 1 && candidate == runner_up)) {
             continue;
         }
 
-        int edit_distance = 0;
+        int value = lookup_barcode(decoder, read, bc_index, (size_t) candidate, shift);
+
+        if (value != 0) {
+            *shift += candidate;
+            return value;
+        }
+    }
+
+    return 0;
+}
+
+
+/* The distance of two windows with exactly two mismatching bases: one
+   transposition if the mismatches are adjacent and swapped, and two
+   edits otherwise, as no single edit keeps the length */
+static inline int two_mismatch_distance(const char *segment,
+                                        const char *window)
+{
+    size_t i = 0;
+
+    while (segment[i] == window[i]) {
+        i++;
+    }
+
+    return (segment[i] == window[i + 1] && segment[i + 1] == window[i]) ? 1 : 2;
+}
+
+
+/* A cascade of ever costlier tiers, counted in 'tier_hits': most windows
+   match their segment exactly or with a mismatch or two, which a
+   word-at-a-time comparison of the packed sequences settles (no edits
+   with an indel can explain them in fewer). Windows with an N, or more
+   mismatches, fall back to the byte-wise kernel, which only needs to
+   tell distances above 'limit' (INT_MAX for none) apart from the rest. */
+static KERNEL_INLINE int check_distance(const kernel_set *kernels,
+                                        const segment_check *check,
+                                        const packed_seq *read,
+                                        const char *seq,
+                                        int shift,
+                                        int limit,
+                                        unsigned *cost,
+                                        uint64_t *tier_hits)
+{
+    size_t offset = check->offset + shift;
+    int mismatches;
+
+    if (check->inline_bases) {
+        uint64_t bases;
+
+        if (packed_kmer_at(read, offset, check->length, &bases)) {
+            uint64_t diff = bases ^ check->bases;
+
+            mismatches = (diff == 0) ? 0 : kmer_mismatches(bases, check->bases);
+        }
+        else {
+            mismatches = -1;
+        }
+    }
+    else {
+        mismatches = kernels->packed_mismatches(read, offset, &(check->segment->packed),
+                                                check->length);
+    }
+
+    // Relative work: one packed comparison, plus the quadratic kernel
+    *cost = 1;
+
+    if (mismatches == 0) {
+        tier_hits[MATCH_EXACT]++;
+        return 0;
+    }
+
+    if (mismatches == 1 || mismatches == 2) {
+        tier_hits[MATCH_MISMATCHES]++;
+        return (mismatches == 1) ? 1 : two_mismatch_distance(check->segment->seq, seq + offset);
+    }
+
+    tier_hits[MATCH_DAMERAU_LEVENSHTEIN]++;
+    *cost += (unsigned) check->length * check->length / 16;
 
-        for (size_t i = 0; i < 2; i++) {
-            size_t segment_index = 0;
-            read_segment **segments = fs2_seqs->prototypes[i].segments;
+    if (limit < (int) check->length) {
+        return damerau_levenshtein_within(check->segment->seq, seq + offset, check->length, limit);
+    }
 
-            while (segments[segment_index] && edit_distance <= ed_threshold) {
-                read_segment *segment = segments[segment_index];
+    return damerau_levenshtein(check->segment->seq, seq + offset, check->length);
+}
 
-                int segment_ed = damerau_levenshtein(segment->seq,
-                                                     fq[i]->seq.s + segment->offset,
-                                                     segment->length);
 
-                if (segment_ed <= ad_fl_mismatches) {
-                    edit_distance += segment_ed;
+/* The segment checks of both mates in evaluation order. A read pair is
+   accepted only if every check passes (each within the segment mismatch
+   limit and their sum within the threshold) and rejected at the first
+   one that fails, so the order changes how much work rejects take but
+   never the result. Every ORDER_UPDATE_INTERVAL pairs, checks are
+   re-sorted by ascending observed cost per rejection, which minimises
+   the expected work per pair, and the statistics are halved so that the
+   order follows changes in the input. 'distance' is that of the check
+   in the last pair it was evaluated on. */
+enum { ORDER_UPDATE_INTERVAL = 1 << 16 };
+
+struct ordered_check {
+    const segment_check *check;
+    size_t mate;
+    size_t index;
+    uint64_t evaluated;
+    uint64_t rejected;
+    uint64_t cost;
+    int distance;
+};
+
+/* 'rejection' is why the last pair was rejected (a LOG_ reason) and the
+   check that rejected it (NULL if no check did), kept for the unmatched
+   read report and the read log, as are the edit distances of the checks
+   of each mate in 'segment_edits'. Both are those of the checks in the
+   order of 'plans' (see blame_rejection()) when 'blame_rejections' is
+   set, that is when something reads them; 'log_edits' is set if the
+   read log needs the exact edits. 'tier_hits' counts the checks each
+   tier of check_distance() settled. */
+struct rejection {
+    int bc[2];
+    uint8_t reason;
+    const segment_check *check;
+    size_t mate;
+    int shift;
+};
+
+struct check_order {
+    const mate_plan *plans[2];
+    size_t num_checks;
+    bool common_layout;
+    bool blame_rejections;
+    bool log_edits;
+    size_t pairs_until_update;
+    struct rejection rejection;
+    uint8_t segment_edits[2][MAX_PLAN_CHECKS];
+    uint64_t tier_hits[NUM_MATCH_TIERS];
+    struct ordered_check checks[2 * MAX_PLAN_CHECKS];
+};
+
+
+static void init_check_order(struct check_order *order,
+                             const library_seqs *fs2_seqs)
+{
+    memset(order, 0, sizeof(*order));
+
+    for (size_t mate = 0; mate < 2; mate++) {
+        const mate_plan *plan = &(fs2_seqs->plans[mate]);
+
+        order->plans[mate] = plan;
+
+        for (size_t i = 0; i < plan->num_checks; i++) {
+            struct ordered_check *entry = &(order->checks[order->num_checks++]);
+
+            entry->check = &(plan->checks[i]);
+            entry->mate = mate;
+            entry->index = i;
+        }
+    }
+
+    order->common_layout = (fs2_seqs->plans[0].layout == LAYOUT_ADAPTER_FLANKED_ALLELE &&
+                            fs2_seqs->plans[1].layout == LAYOUT_ADAPTER);
+    order->pairs_until_update = ORDER_UPDATE_INTERVAL;
+}
+
+
+/* Expected work spent per rejection, with one imaginary rejection so
+   that checks that never reject still compare by cost */
+static inline double work_per_rejection(const struct ordered_check *entry)
+{
+    double mean_cost = (entry->evaluated > 0) ? (double) entry->cost / entry->evaluated : 1.0;
+
+    return mean_cost * (entry->evaluated + 2) / (entry->rejected + 1);
+}
+
+
+static void update_check_order(struct check_order *order)
+{
+    // Insertion sort; there are only a handful of checks
+    for (size_t i = 1; i < order->num_checks; i++) {
+        struct ordered_check entry = order->checks[i];
+        double key = work_per_rejection(&entry);
+        size_t j = i;
+
+        while (j > 0 && work_per_rejection(&(order->checks[j - 1])) > key) {
+            order->checks[j] = order->checks[j - 1];
+            j--;
+        }
+
+        order->checks[j] = entry;
+    }
+
+    for (size_t i = 0; i < order->num_checks; i++) {
+        order->checks[i].evaluated /= 2;
+        order->checks[i].rejected /= 2;
+        order->checks[i].cost /= 2;
+    }
+
+    order->pairs_until_update = ORDER_UPDATE_INTERVAL;
+}
+
+
+static inline uint8_t logged_edits(int segment_ed)
+{
+    return (segment_ed < READ_LOG_MAX_EDITS) ? (uint8_t) segment_ed : READ_LOG_MAX_EDITS;
+}
+
+
+/* check_distance() for work that is not classification, kept out of the
+   tier counts */
+static int uncounted_distance(const kernel_set *kernels,
+                              const segment_check *check,
+                              const packed_seq *read,
+                              const char *seq,
+                              int shift,
+                              int limit)
+{
+    uint64_t tier_hits[NUM_MATCH_TIERS] = {0};
+    unsigned cost;
+
+    return check_distance(kernels, check, read, seq, shift, limit, &cost, tier_hits);
+}
+
+
+/* Finds the check that rejects a pair when the checks are run in plan
+   order (those of mate 1, then of mate 2), reusing the distances of the
+   first 'num_evaluated' checks in the current order. Which check fails
+   first, and so the window reported and the checks logged, would
+   otherwise depend on the order, which varies with the pairs seen
+   before. Only rejected pairs that are reported or logged pay for
+   this. */
+static void blame_rejection(struct check_order *order,
+                            size_t num_evaluated,
+                            const packed_seq *reads,
+                            const seq_view *mates,
+                            const int *shift,
+                            const demux_options *options)
+{
+    int distances[2][MAX_PLAN_CHECKS];
+
+    memset(distances, -1, sizeof(distances));
+
+    if (order->log_edits) {
+        memset(order->segment_edits, READ_LOG_UNCHECKED, sizeof(order->segment_edits));
+    }
+
+    for (size_t i = 0; i < num_evaluated; i++) {
+        const struct ordered_check *entry = &(order->checks[i]);
+
+        distances[entry->mate][entry->index] = entry->distance;
+    }
+
+    int edit_distance = 0;
+
+    for (size_t mate = 0; mate < 2; mate++) {
+        const mate_plan *plan = order->plans[mate];
+
+        for (size_t i = 0; i < plan->num_checks; i++) {
+            int segment_ed = distances[mate][i];
+
+            if (segment_ed < 0) {
+                // Without a read log, only whether the check fails matters
+                int limit = options->ed_threshold - edit_distance;
+
+                if (order->log_edits) {
+                    limit = INT_MAX;
                 }
-                else {
-                    edit_distance = ed_threshold + 1;
+                else if (limit > options->ad_fl_mismatches) {
+                    limit = options->ad_fl_mismatches;
                 }
 
-                segment_index++;
+                segment_ed = uncounted_distance(options->kernels, &(plan->checks[i]), &reads[mate],
+                                                mates[mate].seq, shift[mate], limit);
+            }
+
+            edit_distance += segment_ed;
+            order->segment_edits[mate][i] = logged_edits(segment_ed);
+
+            if (segment_ed > options->ad_fl_mismatches || edit_distance > options->ed_threshold) {
+                order->rejection.check = &(plan->checks[i]);
+                order->rejection.mate = mate;
+                order->rejection.shift = shift[mate];
+                return;
+            }
+        }
+    }
+}
+
+
+/* 'num_checks' is a constant for the common layout, so the loop is
+   unrolled there */
+static KERNEL_INLINE bool run_checks(struct check_order *order,
+                                     size_t num_checks,
+                                     const packed_seq *reads,
+                                     const seq_view *mates,
+                                     const int *shift,
+                                     const demux_options *options)
+{
+    int edit_distance = 0;
+
+    for (size_t i = 0; i < num_checks; i++) {
+        struct ordered_check *entry = &(order->checks[i]);
+        size_t mate = entry->mate;
+        unsigned cost;
+
+        int segment_ed = check_distance(options->kernels, entry->check, &reads[mate],
+                                        mates[mate].seq, shift[mate], INT_MAX, &cost,
+                                        order->tier_hits);
+
+        edit_distance += segment_ed;
+        entry->evaluated++;
+        entry->cost += cost;
+        entry->distance = segment_ed;
+        order->segment_edits[mate][entry->index] = logged_edits(segment_ed);
+
+        if (segment_ed > options->ad_fl_mismatches || edit_distance > options->ed_threshold) {
+            entry->rejected++;
+
+            if (order->blame_rejections) {
+                blame_rejection(order, i + 1, reads, mates, shift, options);
             }
+            return false;
         }
+    }
+
+    return true;
+}
+
+
+static inline bool classify_pair(struct check_order *order,
+                                 const packed_seq *reads,
+                                 const seq_view *mates,
+                                 const int *shift,
+                                 const demux_options *options)
+{
+    if (--(order->pairs_until_update) == 0) {
+        update_check_order(order);
+    }
+
+    if (order->common_layout) {
+        return run_checks(order, 4, reads, mates, shift, options);
+    }
+
+    return run_checks(order, order->num_checks, reads, mates, shift, options);
+}
+
 
-        if (edit_distance > ed_threshold) {
+/* The --template-align alternative to classify_pair(): each mate's
+   template is aligned in one banded pass, under the same limits per
+   segment and in total, and indels move the allele sites with them.
+   Sets the read positions of the sites in the first mate's template. */
+static inline bool align_pair(const read_template *const *templates,
+                              const packed_seq *reads,
+                              const int *shift,
+                              const demux_options *options,
+                              long *site_positions,
+                              uint8_t (*segment_edits)[MAX_PLAN_CHECKS])
+{
+    int edit_distance = 0;
+
+    for (size_t mate = 0; mate < 2; mate++) {
+        const read_template *tmpl = templates[mate];
+        template_alignment alignment;
+
+        if (tmpl->length == 0) {
             continue;
         }
 
-        char allele = fq[0]->seq.s[fs2_seqs->prototypes[0].allele_offset];
-        size_t allele_i = allele_char_to_enum(allele);
+        if (! options->kernels->align_template(tmpl, &reads[mate], (long) tmpl->start + shift[mate],
+                                               options->ed_threshold - edit_distance,
+                                               &alignment)) {
+            return false;
+        }
+
+        for (size_t i = 0; i < tmpl->num_segments; i++) {
+            segment_edits[mate][i] = logged_edits(alignment.segment_edits[i]);
+        }
+
+        for (size_t i = 0; i < tmpl->num_segments; i++) {
+            if (alignment.segment_edits[i] > options->ad_fl_mismatches) {
+                return false;
+            }
+        }
+
+        edit_distance += alignment.total_edits;
+
+        if (mate == 0) {
+            for (size_t k = 0; k < tmpl->num_sites; k++) {
+                site_positions[k] = alignment.site_positions[k];
+            }
+        }
+    }
+
+    return true;
+}
+
+
+/* The checks of a panel locus (with the segments of prototype 1 before
+   it) and of prototype 2, under the same limits as classify_pair() */
+static inline bool check_locus_pair(const mate_plan *locus_plan,
+                                    const mate_plan *plan_2,
+                                    const packed_seq *reads,
+                                    const seq_view *mates,
+                                    const int *shift,
+                                    const demux_options *options,
+                                    struct check_order *order)
+{
+    const mate_plan *plans[2] = {locus_plan, plan_2};
+    int edit_distance = 0;
+
+    for (size_t mate = 0; mate < 2; mate++) {
+        for (size_t i = 0; i < plans[mate]->num_checks; i++) {
+            unsigned cost;
+            int segment_ed = check_distance(options->kernels, &(plans[mate]->checks[i]),
+                                            &reads[mate], mates[mate].seq, shift[mate], INT_MAX,
+                                            &cost, order->tier_hits);
+
+            edit_distance += segment_ed;
+            order->segment_edits[mate][i] = logged_edits(segment_ed);
+
+            if (segment_ed > options->ad_fl_mismatches || edit_distance > options->ed_threshold) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+/* Routes the first mate of a panel read pair to its locus by the flank
+   k-mers, verifies the pair against that locus, and reads its allele
+   sites. Pairs with a base at a site that the locus does not declare
+   are rejected. */
+static inline bool classify_locus(const library_seqs *fs2_seqs,
+                                  struct check_order *order,
+                                  const packed_seq *reads,
+                                  const seq_view *mates,
+                                  const int *shift,
+                                  const demux_options *options,
+                                  size_t *locus_i,
+                                  uint32_t *haplotype)
+{
+    int routed = route_locus(fs2_seqs->locus_index, &reads[0], shift[0], options->max_shift);
+
+    if (routed < 0) {
+        order->rejection.reason = LOG_NO_LOCUS;
+        return false;
+    }
+
+    const panel_locus *locus = &(fs2_seqs->loci[routed]);
+    long site_positions[MAX_ALLELE_SITES];
+
+    for (size_t k = 0; k < locus->num_sites; k++) {
+        site_positions[k] = (long) locus->site_offsets[k] + shift[0];
+    }
+
+    if (options->template_align) {
+        const read_template *templates[2] = {&(locus->tmpl), &(fs2_seqs->templates[1])};
+
+        if (! align_pair(templates, reads, shift, options, site_positions, order->segment_edits)) {
+            order->rejection.reason = LOG_SEGMENTS;
+            return false;
+        }
+    }
+    else if (! check_locus_pair(&(locus->plan), &(fs2_seqs->plans[1]), reads, mates, shift, options,
+                                order)) {
+        order->rejection.reason = LOG_SEGMENTS;
+        return false;
+    }
+
+    *haplotype = 0;
+
+    for (size_t k = 0; k < locus->num_sites; k++) {
+        if (site_positions[k] < 0 || site_positions[k] >= (long) mates[0].length) {
+            order->rejection.reason = LOG_ALLELE_SITE;
+            return false;
+        }
+
+        char base = mates[0].seq[site_positions[k]];
+
+        if (strchr(locus->site_alleles[k], base) == NULL) {
+            order->rejection.reason = LOG_ALLELE_SITE;
+            return false;
+        }
+
+        *haplotype |= haplotype_site_code(base) << (HAPLOTYPE_SITE_BITS * k);
+    }
+
+    *locus_i = (size_t) routed;
+
+    return true;
+}
+
+
+/* The UMI of the pair: that of the first mate, followed by that of the
+   second if both prototypes have one. Returns false if it has an N. */
+static inline bool read_umi(const mate_plan *plans,
+                            const packed_seq *reads,
+                            const int *shift,
+                            uint32_t *umi)
+{
+    *umi = 0;
+
+    for (size_t mate = 0, umi_bases = 0; mate < 2; mate++) {
+        const mate_plan *plan = &plans[mate];
+        uint64_t bases;
+
+        if (plan->umi_length == 0) {
+            continue;
+        }
+
+        if (! packed_kmer_at(&reads[mate], (size_t) (plan->umi_offset + shift[mate]),
+                             plan->umi_length, &bases)) {
+            return false;
+        }
+
+        *umi |= (uint32_t) bases << (2 * umi_bases);
+        umi_bases += plan->umi_length;
+    }
+
+    return true;
+}
+
+
+/* Window keys: the packed bases, their number, the check and the mate */
+enum {
+    WINDOW_MAX_BASES = 27,
+    WINDOW_LENGTH_SHIFT = 2 * WINDOW_MAX_BASES,
+    WINDOW_CHECK_SHIFT = WINDOW_LENGTH_SHIFT + 5,
+    WINDOW_MATE_SHIFT = WINDOW_CHECK_SHIFT + 4
+};
+
+
+/* Records why a pair was not counted: the barcodes that were not found
+   (as read where the shortest spacer puts them), or else the window of
+   the adapter or flanking sequence that rejected it. Rejections by a
+   template alignment, a panel locus, the allele or the UMI are not
+   recorded. */
+static void record_unmatched(const library_seqs *fs2_seqs,
+                             const packed_seq *reads,
+                             const struct rejection *rejection,
+                             unmatched_reads *unmatched)
+{
+    if ((rejection->bc[0] | rejection->bc[1]) < 0) {
+        uint64_t barcodes[2];
+        bool readable[2];
+
+        for (size_t mate = 0; mate < 2; mate++) {
+            readable[mate] = packed_kmer_at(&reads[mate], fs2_seqs->plans[mate].min_phase, 6,
+                                            &barcodes[mate]);
+
+            if (rejection->bc[mate] < 0 && readable[mate]) {
+                heavy_hitters_add(unmatched->barcodes[mate], barcodes[mate]);
+            }
+        }
+
+        if (readable[0] && readable[1]) {
+            heavy_hitters_add(unmatched->barcode_pairs, barcodes[0] | (barcodes[1] << 12));
+        }
+
+        return;
+    }
+
+    const segment_check *check = rejection->check;
+
+    if (check == NULL) {
+        return;
+    }
+
+    uint64_t check_i = (uint64_t) (check - fs2_seqs->plans[rejection->mate].checks);
+    uint64_t length = (check->length < WINDOW_MAX_BASES) ? check->length : WINDOW_MAX_BASES;
+    uint64_t bases;
+
+    if (packed_kmer_at(&reads[rejection->mate], check->offset + rejection->shift, length, &bases)) {
+        heavy_hitters_add(unmatched->windows, bases | (length << WINDOW_LENGTH_SHIFT) |
+                                              (check_i << WINDOW_CHECK_SHIFT) |
+                                              ((uint64_t) rejection->mate << WINDOW_MATE_SHIFT));
+    }
+}
+
+
+/* Classifies a read pair in one orientation, where 'reads' and 'mates'
+   hold the mates to match against prototypes 1 and 2. Returns false if
+   the pair is rejected, otherwise sets the barcode indices and either
+   the allele or, for prototypes with several allele sites, the
+   haplotype; for a panel, the locus and the haplotype of its sites.
+   The UMI is read too if the prototypes have one. 'perf' has the
+   performance counters of the pair if it is profiled (NULL if not). */
+static inline bool classify_mates(const library_seqs *fs2_seqs,
+                                  const bc_decoder *decoder,
+                                  struct check_order *order,
+                                  const packed_seq *reads,
+                                  const seq_view *mates,
+                                  const bool *valid_alleles,
+                                  const demux_options *options,
+                                  int *bc,
+                                  size_t *allele_i,
+                                  size_t *locus_i,
+                                  uint32_t *haplotype,
+                                  uint32_t *umi,
+                                  perf_counters *perf)
+{
+    int shift[2];
+
+    perf_stage(perf, PERF_BARCODE);
+
+    bc[0] = lookup_phased_barcode(decoder, &(fs2_seqs->phases[0]), &reads[0], 0, &shift[0]) - 1;
+    bc[1] = lookup_phased_barcode(decoder, &(fs2_seqs->phases[1]), &reads[1], 1, &shift[1]) - 1;
+
+    if ((bc[0] | bc[1]) < 0) {
+        order->rejection.reason = LOG_NO_BARCODE;
+        return false;
+    }
+
+    if (! read_umi(fs2_seqs->plans, reads, shift, umi)) {
+        order->rejection.reason = LOG_UMI_N;
+        return false;
+    }
+
+    perf_stage(perf, PERF_SEGMENTS);
+
+    if (fs2_seqs->num_loci > 0) {
+        return classify_locus(fs2_seqs, order, reads, mates, shift, options, locus_i, haplotype);
+    }
+
+    const mate_plan *plan = &(fs2_seqs->plans[0]);
+    long allele_position = (long) plan->allele_offset + shift[0];
+    long site_positions[MAX_ALLELE_SITES];
+
+    for (size_t k = 0; k < plan->num_sites; k++) {
+        site_positions[k] = (long) plan->site_offsets[k] + shift[0];
+    }
+
+    if (options->template_align) {
+        const read_template *templates[2] = {&(fs2_seqs->templates[0]), &(fs2_seqs->templates[1])};
+
+        if (! align_pair(templates, reads, shift, options, site_positions, order->segment_edits)) {
+            order->rejection.reason = LOG_SEGMENTS;
+            return false;
+        }
+
+        if (plan->num_sites > 0) {
+            allele_position = site_positions[0];
+        }
+
+        // The allele was deleted, or lies past the end of the read
+        if (allele_position < 0 || allele_position >= (long) mates[0].length) {
+            order->rejection.reason = LOG_ALLELE_SITE;
+            return false;
+        }
+    }
+    else if (! classify_pair(order, reads, mates, shift, options)) {
+        order->rejection.reason = LOG_SEGMENTS;
+        return false;
+    }
+
+    if (plan->num_sites > 1) {
+        *haplotype = 0;
+
+        for (size_t k = 0; k < plan->num_sites; k++) {
+            if (site_positions[k] < 0 || site_positions[k] >= (long) mates[0].length) {
+                order->rejection.reason = LOG_ALLELE_SITE;
+                return false;
+            }
+
+            *haplotype |= haplotype_site_code(mates[0].seq[site_positions[k]]) << (HAPLOTYPE_SITE_BITS * k);
+        }
+
+        return true;
+    }
+
+    char allele = mates[0].seq[allele_position];
+    *allele_i = allele_char_to_enum(allele);
+
+    if (! valid_alleles[*allele_i] && ! options->template_align) {
+        perf_stage(perf, PERF_ALLELE);
+
+        long position = locate_allele(&(fs2_seqs->anchors), &reads[0],
+                                      (long) fs2_seqs->plans[0].allele_offset + shift[0],
+                                      options->max_shift, options->kernels);
+
+        if (position >= 0 && position < (long) mates[0].length) {
+            *allele_i = allele_char_to_enum(mates[0].seq[position]);
+        }
+    }
+
+    return true;
+}
+
+
+/* Logs the pair in the orientation it was counted in, or why it was not
+   counted in the orientation given (as record_unmatched() does) */
+static void log_pair(read_log *log,
+                     const struct check_order *order,
+                     const struct rejection *rejection,
+                     bool matched,
+                     bool swapped,
+                     const int *bc,
+                     size_t locus_i,
+                     uint32_t allele,
+                     uint32_t umi)
+{
+    read_log_record record = {
+        .reason = matched ? LOG_COUNTED : rejection->reason,
+        .swapped = swapped,
+        .bc = {matched ? bc[0] : rejection->bc[0], matched ? bc[1] : rejection->bc[1]},
+        .locus = matched ? (uint32_t) locus_i : 0,
+        .allele = matched ? allele : 0,
+        .umi = matched ? umi : 0
+    };
+
+    memcpy(record.segment_edits, order->segment_edits, sizeof(record.segment_edits));
+    read_log_write(log, &record);
+}
+
+
+struct demux_state {
+    const library_seqs *fs2_seqs;
+    const bc_decoder *decoder;
+    const bool *valid_alleles;
+    const demux_options *options;
+    size_t inspected[2];
+    char *padded[2];
+    uint64_t num_forward;
+    uint64_t num_swapped;
+    perf_counters *perf;
+    struct check_order check_order;
+};
+
+
+demux_state *init_demux_state(const library_seqs *fs2_seqs,
+                              const bc_decoder *decoder,
+                              const bool *valid_alleles,
+                              const demux_options *options)
+{
+    demux_state *state = calloc(1, sizeof(*state));
+
+    if (state == NULL) {
+        perror("Error: memory allocation failed for classifier state");
+        return NULL;
+    }
+
+    state->fs2_seqs = fs2_seqs;
+    state->decoder = decoder;
+    state->valid_alleles = valid_alleles;
+    state->options = options;
+
+    init_check_order(&(state->check_order), fs2_seqs);
+
+    // Bases past the prototype that barcode indels, allele relocation or
+    // indels within the template alignment can reach
+    size_t margin = options->max_shift;
+
+    if (options->template_align && options->ed_threshold > options->max_shift) {
+        margin = (options->ed_threshold < MAX_TEMPLATE_BAND) ? options->ed_threshold : MAX_TEMPLATE_BAND;
+    }
+
+    margin += decoder->max_shift;
+
+    for (size_t i = 0; i < 2; i++) {
+        state->inspected[i] = fs2_seqs->plans[i].length + fs2_seqs->plans[i].max_phase + margin;
+    }
+
+    // Either mate may be checked against either prototype
+    if (options->any_orientation) {
+        state->inspected[0] = state->inspected[1] = (state->inspected[0] > state->inspected[1]) ?
+                                                    state->inspected[0] : state->inspected[1];
+    }
+
+    for (size_t i = 0; i < 2; i++) {
+        state->padded[i] = malloc(state->inspected[i] + 1);
+
+        if (state->padded[i] == NULL) {
+            perror("Error: memory allocation failed for classifier state");
+            destroy_demux_state(&state);
+            return NULL;
+        }
+    }
+
+    return state;
+}
+
+
+/* Classifies a read pair and counts it, or records why it was not
+   counted. Only the prefix that the prototypes cover is looked at, and
+   a mate shorter than that is compared from a copy padded with NULs, so
+   no check reads past the end of the mate. Returns false if memory for
+   the counts runs out. */
+static inline bool classify_read_pair(demux_state *state,
+                                      const seq_view *read_mates,
+                                      bc_counter *bc_combo_counts)
+{
+    const library_seqs *fs2_seqs = state->fs2_seqs;
+    const demux_options *options = state->options;
+    struct check_order *check_order = &(state->check_order);
+    read_log *log = options->log;
+    seq_view mates[2] = {read_mates[0], read_mates[1]};
+    packed_seq packed_reads[2];
+
+    for (size_t i = 0; i < 2; i++) {
+        size_t inspected = state->inspected[i];
+
+        if (mates[i].length < inspected) {
+            memcpy(state->padded[i], mates[i].seq, mates[i].length);
+            memset(state->padded[i] + mates[i].length, 0, inspected + 1 - mates[i].length);
+            mates[i].seq = state->padded[i];
+        }
+
+        // Only the prefix that the prototypes cover is packed, once per read
+        options->kernels->pack_sequence(mates[i].seq,
+                                        (mates[i].length < inspected) ? mates[i].length : inspected,
+                                        &packed_reads[i]);
+    }
+
+    int bc[2];
+    size_t allele_i = 0;
+    size_t locus_i = 0;
+    uint32_t haplotype = 0;
+    uint32_t umi = 0;
+
+    check_order->rejection.check = NULL;
+    check_order->blame_rejections = (log != NULL || bc_combo_counts->unmatched != NULL);
+    check_order->log_edits = (log != NULL);
+
+    if (log) {
+        memset(check_order->segment_edits, READ_LOG_UNCHECKED, sizeof(check_order->segment_edits));
+    }
+
+    bool matched = classify_mates(fs2_seqs, state->decoder, check_order, packed_reads, mates,
+                                  state->valid_alleles, options, bc, &allele_i, &locus_i,
+                                  &haplotype, &umi, state->perf);
+
+    // Unmatched pairs are diagnosed in the orientation given
+    struct rejection rejection = check_order->rejection;
+
+    rejection.bc[0] = bc[0];
+    rejection.bc[1] = bc[1];
+
+    bool swapped = false;
+
+    if (matched) {
+        state->num_forward++;
+    }
+    else if (options->any_orientation) {
+        // Swapped mates carry prototype 2 in R1 and prototype 1 in R2
+        packed_seq swapped_reads[2] = {packed_reads[1], packed_reads[0]};
+        seq_view swapped_mates[2] = {mates[1], mates[0]};
+        uint8_t forward_edits[2][MAX_PLAN_CHECKS];
+
+        if (log) {
+            memcpy(forward_edits, check_order->segment_edits, sizeof(forward_edits));
+            memset(check_order->segment_edits, READ_LOG_UNCHECKED, sizeof(check_order->segment_edits));
+        }
+
+        matched = classify_mates(fs2_seqs, state->decoder, check_order, swapped_reads, swapped_mates,
+                                 state->valid_alleles, options, bc, &allele_i, &locus_i,
+                                 &haplotype, &umi, state->perf);
+        state->num_swapped += matched;
+        swapped = matched;
+
+        if (log && ! matched) {
+            memcpy(check_order->segment_edits, forward_edits, sizeof(forward_edits));
+        }
+    }
+
+    uint32_t group = bc_combo_counts->haplotypes ? haplotype : (uint32_t) allele_i;
+
+    perf_stage(state->perf, PERF_COUNTING);
+
+    if (log) {
+        log_pair(log, check_order, &rejection, matched, swapped, bc, locus_i, group, umi);
+    }
+
+    if (options->metrics) {
+        metrics_add(&(options->metrics->read_pairs[matched ? LOG_COUNTED : rejection.reason]), 1);
+    }
+
+    if (! matched) {
+        if (bc_combo_counts->unmatched) {
+            record_unmatched(fs2_seqs, packed_reads, &rejection, bc_combo_counts->unmatched);
+        }
+
+        return true;
+    }
+
+    return count_pair(bc_combo_counts, bc, locus_i, group, umi);
+}
+
+
+bool demultiplex_read_pair(demux_state *state,
+                           const seq_view *mates,
+                           bc_counter *bc_combo_counts)
+{
+    return classify_read_pair(state, mates, bc_combo_counts);
+}
+
+
+void destroy_demux_state(demux_state **state_double_ptr)
+{
+    demux_state *state = *state_double_ptr;
+
+    free(state->padded[0]);
+    free(state->padded[1]);
+    free(state);
+
+    *state_double_ptr = NULL;
+}
+
+
+/* Adds the segment checks of the current input settled by each tier
+   since the last call ('reported') to the metrics */
+static void report_tier_hits(const struct check_order *order,
+                             uint64_t *reported,
+                             run_metrics *metrics)
+{
+    for (size_t i = 0; i < NUM_MATCH_TIERS; i++) {
+        metrics_add(&(metrics->segment_checks[i]), order->tier_hits[i] - reported[i]);
+        reported[i] = order->tier_hits[i];
+    }
+}
+
+
+bool demultiplex_fastq_pair(const char **fastq_pair,
+                            demux_state *state,
+                            bc_counter *bc_combo_counts)
+{
+    const demux_options *options = state->options;
+    const bool interleaved = options->interleaved;
+
+    size_t num_inputs = interleaved ? 1 : 2;
+    fastq_reader *fastq_fp[2] = {NULL};
+
+    for (size_t i = 0; i < num_inputs; i++) {
+        input_metrics *metrics = options->metrics ? &(options->metrics->inputs[i]) : NULL;
+
+        fastq_fp[i] = fastq_reader_open(fastq_pair[i], options->follow_seconds, metrics,
+                                        options->perf, options->kernels);
+
+        if (fastq_fp[i] == NULL) {
+            if (i > 0) {
+                fastq_reader_close(fastq_fp[0]);
+            }
+
+            return false;
+        }
+    }
+
+    kseq_t *fq[2] = {kseq_init(fastq_fp[0]), NULL};
+
+    if (interleaved) {
+        // Second record of each pair is parsed from the first mate's stream
+        fq[1] = kseq_init(NULL);
+        ks_destroy(fq[1]->f);
+        fq[1]->f = fq[0]->f;
+    }
+    else {
+        fq[1] = kseq_init(fastq_fp[1]);
+    }
+
+    int read_status[2] = {0};
+    bool counted = true;
+    uint64_t num_pairs = 0;
+
+    // Each input starts from the declared check order, so that its log
+    // does not depend on the inputs before it
+    init_check_order(&(state->check_order), state->fs2_seqs);
+
+    uint64_t first_forward = state->num_forward;
+    uint64_t first_swapped = state->num_swapped;
+
+    if (options->log) {
+        read_log_start_input(options->log);
+    }
+
+    struct timespec loop_time;
+    uint64_t reported_checks[NUM_MATCH_TIERS] = {0};
+
+    if (options->metrics) {
+        clock_gettime(CLOCK_MONOTONIC, &loop_time);
+    }
+
+    // Parsing a sampled pair is profiled from the end of the pair before
+    perf_counters *perf = options->perf ? open_perf_counters(options->perf) : NULL;
+
+    if (perf) {
+        perf_counters_sample_pair(perf);
+        state->perf = perf;
+    }
+
+    while (interleaved ? read_interleaved_pair(fq[0], fq[1], read_status)
+                       : read_fastq_pair(fq[0], fq[1], read_status)) {
+        seq_view mates[2] = {
+            {fq[0]->seq.s, fq[0]->seq.l},
+            {fq[1]->seq.s, fq[1]->seq.l}
+        };
+
+        if (! classify_read_pair(state, mates, bc_combo_counts)) {
+            counted = false;
+            break;
+        }
+
+        if (++num_pairs % CHECKPOINT_PAIRS == 0) {
+            if (options->metrics) {
+                metrics_add_elapsed(&(options->metrics->loop_ns), &loop_time);
+                report_tier_hits(&(state->check_order), reported_checks, options->metrics);
+            }
 
-        if (! valid_alleles[allele_i]) {
-            read_segment *left_flanking = &(fs2_seqs->flanking[0]);
+            if (options->checkpoint) {
+                options->checkpoint(options->checkpoint_data);
+            }
+        }
 
-            int allele_offset = nw_offset(left_flanking->seq,
-                                          fq[0]->seq.s + left_flanking->offset,
-                                          left_flanking->length);
-            allele_offset += (int) fs2_seqs->prototypes[0].allele_offset;
+        if (perf) {
+            bool sampled = num_pairs % PERF_SAMPLE_PAIRS == 0;
 
-            if (0 < allele_offset < fq[0]->seq.l) {
-                allele_i = allele_char_to_enum(fq[0]->seq.s[allele_offset]);
+            if (sampled) {
+                perf_counters_sample_pair(perf);
             }
+            else if (state->perf) {
+                perf_counters_enter(perf, PERF_UNPROFILED);
+            }
+
+            state->perf = sampled ? perf : NULL;
         }
+    }
+
+    if (options->metrics) {
+        metrics_add_elapsed(&(options->metrics->loop_ns), &loop_time);
+        report_tier_hits(&(state->check_order), reported_checks, options->metrics);
+    }
+
+    if (perf) {
+        state->perf = NULL;
+        close_perf_counters(&perf, num_pairs);
+    }
+
+    if (options->perf) {
+        perf_profile_add_checks(options->perf, state->check_order.tier_hits);
+    }
 
-        bc_combo_counts->counts[bc_combo_counts->num_bc2 * bc1 + bc2][allele_i] += 1;
+    if (interleaved) {
+        fq[1]->f = NULL;
     }
 
     kseq_destroy(fq[0]);
     kseq_destroy(fq[1]);
 
-    if ((read_status[0] & read_status[1]) != -1) {
+    bool read_error = false;
+
+    for (size_t i = 0; i < num_inputs; i++) {
+        if (fastq_reader_error(fastq_fp[i])) {
+            fprintf(stderr, "Error: failed to read FASTQ input '%s'\n", fastq_pair[i]);
+            read_error = true;
+        }
+        else if (options->io_stats) {
+            fastq_reader_print_stats(fastq_fp[i], fastq_pair[i]);
+        }
+
+        fastq_reader_close(fastq_fp[i]);
+    }
+
+    if (options->metrics) {
+        metrics_add(&(options->metrics->inputs_done), 1);
+    }
+
+    if (! counted || read_error) {
+        return false;
+    }
+
+    if (options->any_orientation) {
+        uint64_t num_forward = state->num_forward - first_forward;
+        uint64_t num_swapped = state->num_swapped - first_swapped;
+        uint64_t num_matched = num_forward + num_swapped;
+        double swapped_percent = (num_matched > 0) ? 100.0 * num_swapped / num_matched : 0.0;
+
+        fprintf(stderr, "Orientation '%s': %" PRIu64 " pairs forward, %" PRIu64 " swapped "
+                "(%.2f%% swapped)\n", fastq_pair[0], num_forward, num_swapped, swapped_percent);
+    }
+
+    if (interleaved && read_status[0] >= 0) {
+        fprintf(stderr, "Warning: Interleaved FASTQ input has an unpaired "
+                "final read: '%s'\n", fastq_pair[0]);
+    }
+    else if (! interleaved && (read_status[0] & read_status[1]) != -1) {
         fprintf(stderr, "Warning: Files in FASTQ pair have different number "
                 "of reads: '%s', '%s'\n", fastq_pair[0], fastq_pair[1]);
     }
+
+    return true;
+}
+
+
+bool tally_umis(bc_counter *bc_combo_counts,
+                bool collapse)
+{
+    size_t num_samples = (size_t) bc_combo_counts->num_bc1 * bc_combo_counts->num_bc2 *
+                         bc_combo_counts->num_loci;
+
+    for (size_t sample = 0; sample < num_samples; sample++) {
+        size_t num_groups;
+        const umi_group_count *groups = umi_table_distinct(bc_combo_counts->umis, sample,
+                                                           collapse, &num_groups);
+
+        if (groups == NULL) {
+            return false;
+        }
+
+        for (size_t i = 0; i < num_groups; i++) {
+            if (! bc_combo_counts->haplotypes) {
+                bc_combo_counts->counts[sample][groups[i].group] = groups[i].count;
+            }
+            else if (! haplotype_table_add(bc_combo_counts->haplotypes, sample, groups[i].group,
+                                           groups[i].count)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+bool print_counts(bc_counter *bc_combo_counts,
+                  const count_layout *layout,
+                  FILE *fp)
+{
+    size_t num_loci = layout->num_loci;
+    haplotype_table *haplotypes = bc_combo_counts->haplotypes;
+
+    if (num_loci > 0) {
+        fprintf(fp, "bc1\tbc2\tlocus\tallele\tcount\n");
+    }
+    else if (haplotypes) {
+        fprintf(fp, "bc1\tbc2\thaplotype\tcount\n");
+    }
+    else {
+        fprintf(fp, "bc1\tbc2");
+
+        for (size_t i = 0; i < 4; i++) {
+            if (layout->allele_names[i][0] != '\0') {
+                fprintf(fp, "\t%s", layout->allele_names[i]);
+            }
+        }
+        fprintf(fp, "\n");
+    }
+
+    for (size_t i = 0; i < layout->num_bc[0]; i++) {
+        for (size_t j = 0; j < layout->num_bc[1]; j++) {
+            int bc1_label = layout->bc_labels[0][i];
+            int bc2_label = layout->bc_labels[1][j];
+            size_t sample = layout->num_bc[1] * i + j;
+
+            // One line per allele (haplotype of the locus sites) seen at
+            // each locus, in the order of the loci in the FASTA file
+            if (num_loci > 0) {
+                for (size_t l = 0; l < num_loci; l++) {
+                    size_t num_haplotypes;
+                    const haplotype_count *counts = haplotype_table_sorted(haplotypes,
+                                                                           sample * num_loci + l,
+                                                                           &num_haplotypes);
+                    char allele_str[MAX_ALLELE_SITES + 1];
+
+                    if (counts == NULL) {
+                        return false;
+                    }
+
+                    for (size_t h = 0; h < num_haplotypes; h++) {
+                        haplotype_to_string(counts[h].haplotype, layout->locus_sites[l], allele_str);
+                        fprintf(fp, "%d\t%d\t%s\t%s\t%u\n", bc1_label, bc2_label,
+                                layout->locus_names[l], allele_str, counts[h].count);
+                    }
+                }
+
+                continue;
+            }
+
+            // One line per haplotype seen, in haplotype key order
+            if (haplotypes) {
+                size_t num_haplotypes;
+                const haplotype_count *counts = haplotype_table_sorted(haplotypes, sample,
+                                                                       &num_haplotypes);
+                char haplotype_str[MAX_ALLELE_SITES + 1];
+
+                if (counts == NULL) {
+                    return false;
+                }
+
+                for (size_t h = 0; h < num_haplotypes; h++) {
+                    haplotype_to_string(counts[h].haplotype, layout->num_sites, haplotype_str);
+                    fprintf(fp, "%d\t%d\t%s\t%u\n", bc1_label, bc2_label,
+                            haplotype_str, counts[h].count);
+                }
+
+                continue;
+            }
+
+            fprintf(fp, "%d\t%d", bc1_label, bc2_label);
+
+            for (size_t a = 0; a < 4; a++) {
+                if (layout->allele_names[a][0] != '\0') {
+                    fprintf(fp, "\t%d", bc_combo_counts->counts[sample][a]);
+                }
+            }
+            fprintf(fp, "\n");
+        }
+    }
+
+    return true;
+}
+
+
+unmatched_reads *init_unmatched_reads(size_t top)
+{
+    unmatched_reads *unmatched = calloc(1, sizeof(*unmatched));
+
+    if (unmatched == NULL) {
+        perror("Error: memory allocation failed for unmatched reads");
+        return NULL;
+    }
+
+    // Spare counters, so keys near the cut are ranked by their sketch
+    // estimates rather than by when they were first seen
+    size_t capacity = (4 * top > 64) ? 4 * top : 64;
+
+    unmatched->barcodes[0] = init_heavy_hitters(capacity);
+    unmatched->barcodes[1] = init_heavy_hitters(capacity);
+    unmatched->barcode_pairs = init_heavy_hitters(capacity);
+    unmatched->windows = init_heavy_hitters(capacity);
+
+    if (unmatched->barcodes[0] == NULL || unmatched->barcodes[1] == NULL ||
+        unmatched->barcode_pairs == NULL || unmatched->windows == NULL) {
+        destroy_unmatched_reads(&unmatched);
+        return NULL;
+    }
+
+    return unmatched;
+}
+
+
+static void unpack_bases(uint64_t bases,
+                         size_t length,
+                         char *seq)
+{
+    for (size_t i = 0; i < length; i++) {
+        seq[i] = "ACGT"[(bases >> (2 * i)) & 3];
+    }
+
+    seq[length] = '\0';
+}
+
+
+enum {
+    BARCODE_KEYS,
+    BARCODE_PAIR_KEYS,
+    WINDOW_KEYS
+};
+
+
+static void print_top(heavy_hitters *hitters,
+                      int key_type,
+                      const library_seqs *fs2_seqs,
+                      const char *title,
+                      size_t top,
+                      FILE *fp)
+{
+    size_t num_hitters;
+    const heavy_hitter *hitters_top = heavy_hitters_top(hitters, &num_hitters);
+
+    if (hitters_top == NULL) {
+        return;
+    }
+
+    fprintf(fp, "%s (of %" PRIu64 " read pairs; estimated counts):\n", title,
+            heavy_hitters_total(hitters));
+
+    for (size_t i = 0; i < num_hitters && i < top; i++) {
+        uint64_t key = hitters_top[i].key;
+        char seq[2][WINDOW_MAX_BASES + 1];
+
+        if (key_type == BARCODE_KEYS) {
+            unpack_bases(key, 6, seq[0]);
+            fprintf(fp, "    %s", seq[0]);
+        }
+        else if (key_type == BARCODE_PAIR_KEYS) {
+            unpack_bases(key, 6, seq[0]);
+            unpack_bases(key >> 12, 6, seq[1]);
+            fprintf(fp, "    %s %s", seq[0], seq[1]);
+        }
+        else {
+            size_t length = (key >> WINDOW_LENGTH_SHIFT) & 31;
+            size_t check_i = (key >> WINDOW_CHECK_SHIFT) & 15;
+            size_t mate = key >> WINDOW_MATE_SHIFT;
+            const segment_check *check = &(fs2_seqs->plans[mate].checks[check_i]);
+
+            unpack_bases(key, length, seq[0]);
+            memcpy(seq[1], check->segment->seq, length);
+            seq[1][length] = '\0';
+            fprintf(fp, "    prototype%zu at %u: %s (expected %s)", mate + 1, check->offset,
+                    seq[0], seq[1]);
+        }
+
+        fprintf(fp, "\t%" PRIu64 "\n", hitters_top[i].count);
+    }
+}
+
+
+void print_unmatched_reads(unmatched_reads *unmatched,
+                           const library_seqs *fs2_seqs,
+                           size_t top,
+                           FILE *fp)
+{
+    print_top(unmatched->barcodes[0], BARCODE_KEYS, fs2_seqs,
+              "Top unmatched bc1 barcodes", top, fp);
+    print_top(unmatched->barcodes[1], BARCODE_KEYS, fs2_seqs,
+              "Top unmatched bc2 barcodes", top, fp);
+    print_top(unmatched->barcode_pairs, BARCODE_PAIR_KEYS, fs2_seqs,
+              "Top barcode pairs (bc1 bc2) with an unmatched barcode", top, fp);
+    print_top(unmatched->windows, WINDOW_KEYS, fs2_seqs,
+              "Top failing adapter and flanking windows", top, fp);
+}
+
+
+void destroy_unmatched_reads(unmatched_reads **unmatched_double_ptr)
+{
+    unmatched_reads *unmatched = *unmatched_double_ptr;
+
+    heavy_hitters **hitters[4] = {
+        &(unmatched->barcodes[0]), &(unmatched->barcodes[1]),
+        &(unmatched->barcode_pairs), &(unmatched->windows)
+    };
+
+    for (size_t i = 0; i < 4; i++) {
+        if (*hitters[i]) {
+            destroy_heavy_hitters(hitters[i]);
+        }
+    }
+
+    free(unmatched);
+
+    *unmatched_double_ptr = NULL;
 }
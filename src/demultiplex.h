@@ -6,23 +6,164 @@
 #ifndef DEMULTIPLEX_H
 #define DEMULTIPLEX_H
 
+#include "bc_automaton.h"
 #include "bc_hash.h"
+#include "bc_scan.h"
+#include "cpu_dispatch.h"
+#include "haplotype_counts.h"
+#include "heavy_hitters.h"
 #include "parse_seq.h"
+#include "perf_counters.h"
+#include "read_log.h"
+#include "run_metrics.h"
+#include "umi_counts.h"
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
+/* Exactly one barcode lookup method is set: the mismatch hash table,
+   the all-candidates scanner, or one indel-tolerant automaton per
+   barcode position. 'max_shift' is the most bases a barcode lookup can
+   displace the rest of the read by. */
+typedef struct bc_decoder {
+    bc_hash_table *hash_table;
+    bc_scanner *scanner;
+    bc_automaton *automata[2];
+    int max_shift;
+} bc_decoder;
+
+/* 'log' is NULL unless every read pair is logged. FASTQ inputs are
+   followed while being written for 'follow_seconds' if it is positive
+   (see fastq_reader_open()), and 'checkpoint', if set, is called with
+   'checkpoint_data' every CHECKPOINT_PAIRS read pairs of them. The
+   progress of the run is added to 'metrics' if it is not NULL, and the
+   performance counters of its stages to 'perf'. 'kernels' are those of
+   the classifier. */
+typedef struct demux_options {
+    const kernel_set *kernels;
+    int ad_fl_mismatches;
+    int ed_threshold;
+    int max_shift;
+    bool template_align;
+    bool any_orientation;
+    bool interleaved;
+    bool io_stats;
+    int follow_seconds;
+    read_log *log;
+    void (*checkpoint)(void *checkpoint_data);
+    void *checkpoint_data;
+    run_metrics *metrics;
+    perf_profile *perf;
+} demux_options;
+
+enum { CHECKPOINT_PAIRS = 1 << 14 };
+
+/* The most frequent reasons read pairs were not counted: the barcodes
+   that matched no library barcode (per position, and as pairs), and
+   the read windows of the first adapter or flanking sequence that
+   failed */
+typedef struct unmatched_reads {
+    heavy_hitters *barcodes[2];
+    heavy_hitters *barcode_pairs;
+    heavy_hitters *windows;
+} unmatched_reads;
+
+/* Counts per allele, or per haplotype in 'haplotypes' (NULL unless
+   prototype 1 has several allele sites or the library is a panel, with
+   'num_loci' counters per barcode combination; 1 otherwise). With UMIs,
+   reads are collected in 'umis' and only counted by tally_umis().
+   'unmatched' is NULL unless unmatched reads are reported. */
 typedef struct bc_counter {
     unsigned int num_bc1;
     unsigned int num_bc2;
+    size_t num_loci;
+    haplotype_table *haplotypes;
+    umi_table *umis;
+    unmatched_reads *unmatched;
     unsigned int counts[][4];
 } bc_counter;
 
-void demultiplex_fastq_pair(const char **fastq_pair,
-                            library_seqs *fs2_seqs,
-                            bc_hash_table *hash_table,
-                            bc_counter *bc_combo_counts,
-                            int ad_fl_mismatches,
-                            int ed_threshold,
-                            const bool *valid_alleles);
+/* Counts a read pair of barcode indices 'bc' at 'locus_i', where
+   'group' is its allele index, or its haplotype when counting by
+   haplotype. Returns false if memory for the counts runs out. */
+static inline bool count_pair(bc_counter *bc_combo_counts,
+                              const int *bc,
+                              size_t locus_i,
+                              uint32_t group,
+                              uint32_t umi)
+{
+    // A panel keeps one counter per locus of each barcode combination
+    size_t sample = (bc_combo_counts->num_bc2 * bc[0] + bc[1]) * bc_combo_counts->num_loci + locus_i;
+
+    if (bc_combo_counts->umis) {
+        return umi_table_add(bc_combo_counts->umis, sample, group, umi);
+    }
+    else if (bc_combo_counts->haplotypes) {
+        return haplotype_table_add(bc_combo_counts->haplotypes, sample, group, 1);
+    }
+
+    bc_combo_counts->counts[sample][group] += 1;
+
+    return true;
+}
+
+/* The bases of one mate, which need not be NUL-terminated */
+typedef struct seq_view {
+    const char *seq;
+    size_t length;
+} seq_view;
+
+/* What classifying read pairs against a library changes as it goes:
+   the adaptive check order, the padded copies of short mates and the
+   orientation totals. The library, decoder, valid alleles and options
+   are only read, so one set of them can serve any number of states,
+   each used by one thread at a time. Returns NULL (after reporting the
+   error) if memory runs out. */
+typedef struct demux_state demux_state;
+
+demux_state *init_demux_state(const library_seqs *fs2_seqs,
+                              const bc_decoder *decoder,
+                              const bool *valid_alleles,
+                              const demux_options *options);
+
+/* Classifies the pair of 'mates' (R1 and R2) and counts it; returns
+   false (after reporting the error) if memory for the counts runs out */
+bool demultiplex_read_pair(demux_state *state,
+                           const seq_view *mates,
+                           bc_counter *bc_combo_counts);
+
+void destroy_demux_state(demux_state **state_double_ptr);
+
+/* Returns false (after reporting the error) if an input cannot be read
+   or memory for the counts runs out */
+bool demultiplex_fastq_pair(const char **fastq_pair,
+                            demux_state *state,
+                            bc_counter *bc_combo_counts);
+
+/* Sets the counts to the distinct UMIs of each allele or haplotype,
+   after collapsing UMIs one mismatch apart if 'collapse' is set.
+   Returns false if memory runs out. */
+bool tally_umis(bc_counter *bc_combo_counts,
+                bool collapse);
+
+/* Writes the count table: one line per barcode pair with a column per
+   allele, or one line per haplotype (or locus allele) seen. Returns
+   false if memory runs out. */
+bool print_counts(bc_counter *bc_combo_counts,
+                  const count_layout *layout,
+                  FILE *fp);
+
+/* Keeps enough counters to report the top 'top' of each kind of
+   unmatched read accurately; NULL if memory runs out */
+unmatched_reads *init_unmatched_reads(size_t top);
+
+void print_unmatched_reads(unmatched_reads *unmatched,
+                           const library_seqs *fs2_seqs,
+                           size_t top,
+                           FILE *fp);
+
+void destroy_unmatched_reads(unmatched_reads **unmatched_double_ptr);
 
 #endif
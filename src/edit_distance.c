@@ -106,46 +106,6 @@ unsigned long calc_num_combos(unsigned int bc_len,
 }
 
 
-void generate_all_bc_combos(size_t len,
-                            char (*output)[len + 1])
-{
-    const char bases[4] = {'A', 'T', 'G', 'C'};
-
-    for (size_t i = 0; i < len; i++) {
-        unsigned long prev_num_combos = uint_pow(4, i);
-
-        for (size_t j = 1; j < 4; j++) {
-            for (size_t k = 0; k < prev_num_combos; k++) {
-                strncpy(output[j * prev_num_combos + k] + len - i, output[k] + len - i, i);
-            }
-        }
-
-        for (size_t j = 0; j < 4; j++) {
-            for (size_t k = 0; k < prev_num_combos; k++) {
-                output[j * prev_num_combos + k][len - i - 1] = bases[j];
-            }
-        }
-    }
-}
-
-
-unsigned int hamming_distance(const char *restrict seq_1,
-                              const char *restrict seq_2,
-                              size_t length)
-{
-    unsigned int num_mismatches = 0;
-
-    #pragma unroll 6
-    #pragma clang loop vectorize(enable)
-    #pragma GCC ivdep
-    for (size_t i = 0; i < length; i++) {
-        num_mismatches += (seq_1[i] != seq_2[i]);
-    }
-
-    return num_mismatches;
-}
-
-
 int damerau_levenshtein(const char *restrict seq_1,
                         const char *restrict seq_2,
                         const int len)
@@ -201,95 +161,60 @@ int damerau_levenshtein(const char *restrict seq_1,
 }
 
 
-int nw_offset(const char *restrict seq_1,
-              const char *restrict seq_2,
-              size_t len)
+/* As damerau_levenshtein(), but only the cells within 'limit' of the
+   diagonal are filled in: an alignment of cost at most 'limit' never
+   leaves them, and cells outside keep a cost above any within */
+int damerau_levenshtein_within(const char *restrict seq_1,
+                               const char *restrict seq_2,
+                               const int len,
+                               const int limit)
 {
-    enum {
-        MATCH = 1,
-        MISMATCH = -1,
-        INDEL = -1
-    };
-
-    enum {
-        DIAG = 0,
-        UP = 1,
-        LEFT = 2
-    };
+    int da[256] = {0};
+    int max_dist = len + len;
 
-    int scores[len + 1][len + 1];
-    int traceback[len + 1][len + 1];
+    int dpm[len + 2][len + 2];
 
-    for (size_t i = 0; i < len + 1; i++) {
-        for (size_t j = 0; j < len + 1; j++) {
-            scores[i][j] = 0;
-            traceback[i][j] = 0;
+    for (int i = 0; i < len + 2; i++) {
+        for (int j = 0; j < len + 2; j++) {
+            dpm[i][j] = max_dist;
         }
     }
-
-    for (size_t i = 1; i < len + 1; i++) {
-        scores[i][0] = INDEL * i;
-        traceback[i][0] = UP;
-    }
-    for (size_t j = 1; j < len + 1; j++) {
-        scores[0][j] = INDEL * j;
-        traceback[0][j] = LEFT;
+    for (int i = 0; i < len + 1; i++) {
+        dpm[i + 1][1] = i;
+        dpm[1][i + 1] = i;
     }
 
-    for (size_t i = 1; i < len + 1; i++) {
-        for (size_t j = 1; j < len + 1; j++) {
-            int s_m = (seq_1[i - 1] == seq_2[j - 1]) ? MATCH : MISMATCH;
-            int overlap_score = scores[i - 1][j - 1] + s_m;
+    for (int i = 1; i < len + 1; i++) {
+        int db = 0;
+        int first = (i - limit > 1) ? i - limit : 1;
+        int last = (i + limit < len) ? i + limit : len;
 
-            int s1_gap = scores[i - 1][j] + INDEL;
-            int s2_gap = scores[i][j - 1] + INDEL;
-            int gap_score, gap_move;
+        uint8_t da_i;
+        int k, l, cost;
 
-            if (s1_gap > s2_gap) {
-                gap_score = s1_gap;
-                gap_move = UP;
-            }
-            else {
-                gap_score = s2_gap;
-                gap_move = LEFT;
-            }
+        for (int j = first; j <= last; j++) {
+            da_i = (uint8_t) seq_2[j - 1];
+            k = da[da_i];
+            l = db;
 
-            if (overlap_score > gap_score) {
-                scores[i][j] = overlap_score;
-                traceback[i][j] = DIAG;
+            if (seq_1[i - 1] == seq_2[j - 1]) {
+                cost = 0;
+                db = j;
             }
             else {
-                scores[i][j] = gap_score;
-                traceback[i][j] = gap_move;
+                cost = 1;
             }
-        }
-    }
-
-    size_t aln_index = len * 2 - 1;
-    size_t i_1 = len, i_2 = len;
-
-    int offset = 0;
-    int offset_index[2] = {aln_index};
-    bool offset_reached = false;
-
-    while ((! offset_reached) && (i_1 > 0 || i_2 > 0)) {
-        int traceback_direction = traceback[i_1][i_2];
 
-        if (traceback_direction == DIAG) {
-            offset_reached = true;
-            offset = offset_index[1] - offset_index[0];
-        }
-        else if (traceback_direction == LEFT) {
-            offset_index[1] = aln_index - 1;
-            i_2 -= 1;
-        }
-        else if (traceback_direction == UP) {
-            offset_index[0] = aln_index - 1;
-            i_1 -= 1;
+            dpm[i + 1][j + 1] = min(4,
+                                    dpm[i][j] + cost,                    // substitution
+                                    dpm[i + 1][j] + 1,                   // insertion
+                                    dpm[i][j + 1] + 1,                   // deletion
+                                    dpm[k][l] + (i-k-1) + 1 + (j-l-1));  // transposition
         }
 
-        aln_index--;
+        da_i = (uint8_t) seq_1[i - 1];
+        da[da_i] = i;
     }
 
-    return offset;
+    return dpm[len + 1][len + 1];
 }
@@ -15,19 +15,24 @@ extern unsigned long calc_num_combos(unsigned int bc_len,
                                      unsigned int num_barcodes,
                                      unsigned int max_mismatches);
 
-extern void generate_all_bc_combos(size_t len,
-                                   char (*output)[len + 1]);
-
-extern unsigned int hamming_distance(const char *restrict seq_1,
-                                     const char *restrict seq_2,
-                                     size_t length);
+/* How the distance of a read window to a segment was settled: by an
+   exact match of the packed bases, by their mismatches alone, or by
+   damerau_levenshtein() */
+enum {
+    MATCH_EXACT,
+    MATCH_MISMATCHES,
+    MATCH_DAMERAU_LEVENSHTEIN,
+    NUM_MATCH_TIERS
+};
 
 extern int damerau_levenshtein(const char *restrict seq_1,
                                const char *restrict seq_2,
                                const int len_1);
 
-extern int nw_offset(const char *restrict seq_1,
-                     const char *restrict seq_2,
-                     size_t len);
+/* The distance if it is at most 'limit', otherwise a value above it */
+extern int damerau_levenshtein_within(const char *restrict seq_1,
+                                      const char *restrict seq_2,
+                                      const int len,
+                                      const int limit);
 
 #endif
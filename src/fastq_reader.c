@@ -0,0 +1,431 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "fastq_reader.h"
+
+#include "async_read.h"
+#include "cpu_dispatch.h"
+#include "perf_counters.h"
+#include "stream_reader.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum {
+    READER_NUM_BUFFERS = 4,
+    READER_BUFFER_SIZE = 1 << 20
+};
+
+struct reader_buffer {
+    unsigned char *data;
+    size_t length;
+};
+
+/* Single-producer/single-consumer ring of buffers. The producer only
+   writes to slots that are not yet filled and the consumer only reads
+   from the head slot, so buffer contents are copied outside the lock.
+   'metrics', if set, receives the progress of the input, and
+   'compressed_bytes' is how much of it has been added there, and
+   'depth_sum' and 'depth_samples' the queue depth samples. The
+   thread's 'perf_counters' (opened if 'perf' is set) are closed by
+   fastq_reader_close() once it has joined the thread. Setting 'stop'
+   ends the thread at its next wait or read. */
+struct fastq_reader {
+    stream_reader *input;
+    input_metrics *metrics;
+    uint64_t compressed_bytes;
+    uint64_t depth_sum;
+    uint64_t depth_samples;
+    perf_profile *perf;
+    perf_counters *perf_counters;
+    size_t (*find_newline)(const char *data,
+                           size_t length);
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t drained;
+    struct reader_buffer buffers[READER_NUM_BUFFERS];
+    size_t head;
+    size_t num_filled;
+    size_t consumed;
+    bool eof;
+    bool error;
+    bool stop;
+    bool thread_started;
+};
+
+
+/* Adds the input read since the last call to the metrics, and sets the
+   queue depth to its mean over that input */
+static void add_input_metrics(fastq_reader *reader,
+                              int bytes_read,
+                              struct timespec *since)
+{
+    input_metrics *metrics = reader->metrics;
+    async_read_stats stats;
+
+    stream_reader_stats(reader->input, &stats);
+    metrics_add_elapsed(&(metrics->input_ns), since);
+    metrics_add(&(metrics->compressed_bytes), stats.bytes_read - reader->compressed_bytes);
+    metrics_add(&(metrics->uncompressed_bytes), (bytes_read > 0) ? (uint64_t) bytes_read : 0);
+    reader->compressed_bytes = stats.bytes_read;
+
+    uint64_t num_samples = stats.queue_depth_samples - reader->depth_samples;
+
+    if (num_samples > 0) {
+        uint64_t depth_sum = stats.queue_depth_sum - reader->depth_sum;
+
+        metrics_set(&(metrics->io_depth_milli), depth_sum * 1000 / num_samples);
+        reader->depth_sum = stats.queue_depth_sum;
+        reader->depth_samples = stats.queue_depth_samples;
+    }
+}
+
+
+static void *reader_thread(void *arg)
+{
+    fastq_reader *reader = arg;
+
+    if (reader->perf) {
+        reader->perf_counters = open_perf_counters(reader->perf);
+    }
+
+    while (true) {
+        pthread_mutex_lock(&reader->lock);
+
+        while (reader->num_filled == READER_NUM_BUFFERS && ! reader->stop) {
+            pthread_cond_wait(&reader->drained, &reader->lock);
+        }
+
+        if (reader->stop) {
+            pthread_mutex_unlock(&reader->lock);
+            break;
+        }
+
+        size_t slot = (reader->head + reader->num_filled) % READER_NUM_BUFFERS;
+        pthread_mutex_unlock(&reader->lock);
+
+        struct timespec start;
+
+        if (reader->metrics) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+
+        perf_stage(reader->perf_counters, PERF_INFLATE);
+        int bytes_read = stream_reader_read(reader->input, reader->buffers[slot].data,
+                                            READER_BUFFER_SIZE);
+        perf_stage(reader->perf_counters, PERF_UNPROFILED);
+
+        if (reader->metrics) {
+            add_input_metrics(reader, bytes_read, &start);
+        }
+
+        pthread_mutex_lock(&reader->lock);
+
+        if (reader->stop) {
+            pthread_mutex_unlock(&reader->lock);
+            break;
+        }
+
+        if (bytes_read > 0) {
+            reader->buffers[slot].length = (size_t) bytes_read;
+            reader->num_filled++;
+
+            if (reader->metrics) {
+                metrics_set(&(reader->metrics->buffers_filled), reader->num_filled);
+            }
+        }
+        if (bytes_read < READER_BUFFER_SIZE) {
+            reader->error = stream_reader_error(reader->input);
+            reader->eof = true;
+        }
+
+        pthread_cond_signal(&reader->filled);
+        bool done = reader->eof;
+        pthread_mutex_unlock(&reader->lock);
+
+        if (done) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+fastq_reader *fastq_reader_open(const char *path,
+                                int follow_seconds,
+                                input_metrics *metrics,
+                                perf_profile *perf,
+                                const kernel_set *kernels)
+{
+    fastq_reader *reader = calloc(1, sizeof(*reader));
+
+    if (reader == NULL) {
+        perror("Error: memory allocation failed for FASTQ reader");
+        return NULL;
+    }
+
+    reader->metrics = metrics;
+    reader->perf = perf;
+    reader->find_newline = kernels->find_newline;
+    reader->input = stream_reader_open(path, follow_seconds);
+
+    if (reader->input == NULL) {
+        fprintf(stderr, "Error: unable to read file '%s': %s\n",
+                path, strerror(errno));
+        free(reader);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < READER_NUM_BUFFERS; i++) {
+        reader->buffers[i].data = malloc(READER_BUFFER_SIZE);
+
+        if (reader->buffers[i].data == NULL) {
+            perror("Error: memory allocation failed for FASTQ reader");
+
+            for (size_t j = 0; j < i; j++) {
+                free(reader->buffers[j].data);
+            }
+            stream_reader_close(reader->input);
+            free(reader);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->filled, NULL);
+    pthread_cond_init(&reader->drained, NULL);
+
+    int status = pthread_create(&reader->thread, NULL, reader_thread, reader);
+
+    if (status == 0) {
+        reader->thread_started = true;
+    }
+    else {
+        fprintf(stderr, "Error: unable to start reader thread for '%s': %s\n",
+                path, strerror(status));
+        reader->eof = true;
+        reader->error = true;
+    }
+
+    return reader;
+}
+
+
+int fastq_reader_read(fastq_reader *reader,
+                      void *buffer,
+                      unsigned int length)
+{
+    unsigned char *output = buffer;
+    size_t copied = 0;
+
+    while (copied < length) {
+        pthread_mutex_lock(&reader->lock);
+
+        // Only the waits are timed, which are rare unless input is the
+        // bottleneck
+        if (reader->num_filled == 0 && ! reader->eof && reader->metrics) {
+            struct timespec start;
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            while (reader->num_filled == 0 && ! reader->eof) {
+                pthread_cond_wait(&reader->filled, &reader->lock);
+            }
+
+            metrics_add_elapsed(&(reader->metrics->wait_ns), &start);
+        }
+
+        while (reader->num_filled == 0 && ! reader->eof) {
+            pthread_cond_wait(&reader->filled, &reader->lock);
+        }
+
+        if (reader->num_filled == 0) {
+            pthread_mutex_unlock(&reader->lock);
+            break;
+        }
+
+        struct reader_buffer *current = &(reader->buffers[reader->head]);
+        pthread_mutex_unlock(&reader->lock);
+
+        size_t available = current->length - reader->consumed;
+        size_t num_bytes = length - copied;
+
+        if (num_bytes > available) {
+            num_bytes = available;
+        }
+
+        memcpy(output + copied, current->data + reader->consumed, num_bytes);
+        copied += num_bytes;
+        reader->consumed += num_bytes;
+
+        if (reader->consumed == current->length) {
+            pthread_mutex_lock(&reader->lock);
+            reader->head = (reader->head + 1) % READER_NUM_BUFFERS;
+            reader->num_filled--;
+            reader->consumed = 0;
+
+            if (reader->metrics) {
+                metrics_set(&(reader->metrics->buffers_filled), reader->num_filled);
+            }
+
+            pthread_cond_signal(&reader->drained);
+            pthread_mutex_unlock(&reader->lock);
+        }
+    }
+
+    return (int) copied;
+}
+
+
+bool fastq_reader_error(const fastq_reader *reader)
+{
+    return reader->error;
+}
+
+
+void fastq_reader_print_stats(const fastq_reader *reader,
+                              const char *path)
+{
+    async_read_stats stats;
+    stream_reader_stats(reader->input, &stats);
+    const char *format = stream_reader_format(reader->input);
+
+    double mebibytes = (double) stats.bytes_read / (1024.0 * 1024.0);
+    double throughput = (stats.seconds > 0.0) ? mebibytes / stats.seconds : 0.0;
+
+    fprintf(stderr, "I/O '%s': %s, %s, %.1f MiB in %.2f s (%.1f MiB/s), "
+            "mean queue depth %.2f\n", path, (format != NULL) ? format : "empty",
+            stats.backend, mebibytes, stats.seconds, throughput, stats.mean_queue_depth);
+}
+
+
+void fastq_reader_close(fastq_reader *reader)
+{
+    if (reader == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&reader->lock);
+    bool thread_finished = reader->eof;
+    reader->stop = true;
+    pthread_cond_broadcast(&reader->drained);
+    pthread_mutex_unlock(&reader->lock);
+
+    if (reader->thread_started) {
+        // Input abandoned early (e.g. mates of unequal length); don't
+        // wait on a producer that may never write again
+        if (! thread_finished) {
+            stream_reader_interrupt(reader->input);
+        }
+        pthread_join(reader->thread, NULL);
+    }
+
+    if (reader->perf_counters) {
+        close_perf_counters(&(reader->perf_counters), 0);
+    }
+
+    for (size_t i = 0; i < READER_NUM_BUFFERS; i++) {
+        free(reader->buffers[i].data);
+    }
+
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->filled);
+    pthread_cond_destroy(&reader->drained);
+    stream_reader_close(reader->input);
+    free(reader);
+}
+
+
+size_t find_newline_scalar(const char *data,
+                           size_t length)
+{
+    size_t i = 0;
+
+    while (i < length && data[i] != '\n') {
+        i++;
+    }
+
+    return i;
+}
+
+
+#ifdef HAVE_X86_KERNELS
+TARGET_SSE42
+size_t find_newline_sse42(const char *data,
+                          size_t length)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i chars = _mm_loadu_si128((const __m128i *) (data + i));
+        unsigned matches = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(chars, newline));
+
+        if (matches) {
+            return i + __builtin_ctz(matches);
+        }
+    }
+
+    return i + find_newline_scalar(data + i, length - i);
+}
+
+
+TARGET_AVX2
+size_t find_newline_avx2(const char *data,
+                         size_t length)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i chars = _mm256_loadu_si256((const __m256i *) (data + i));
+        unsigned matches = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chars, newline));
+
+        if (matches) {
+            return i + __builtin_ctz(matches);
+        }
+    }
+
+    return i + find_newline_scalar(data + i, length - i);
+}
+
+
+/* Masked loads cover the tail without reading past the buffer */
+TARGET_AVX512BW
+size_t find_newline_avx512bw(const char *data,
+                             size_t length)
+{
+    const __m512i newline = _mm512_set1_epi8('\n');
+
+    for (size_t i = 0; i < length; i += 64) {
+        size_t remaining = length - i;
+        __mmask64 in_range = (remaining >= 64) ? ~0ULL : (1ULL << remaining) - 1;
+        __m512i chars = _mm512_maskz_loadu_epi8(in_range, data + i);
+        uint64_t matches = _mm512_mask_cmpeq_epi8_mask(in_range, chars, newline);
+
+        if (matches) {
+            return i + __builtin_ctzll(matches);
+        }
+    }
+
+    return length;
+}
+#endif
+
+
+size_t fastq_reader_find_newline(const fastq_reader *reader,
+                                 const char *data,
+                                 size_t length)
+{
+    return reader->find_newline(data, length);
+}
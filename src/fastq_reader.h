@@ -0,0 +1,55 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef FASTQ_READER_H
+#define FASTQ_READER_H
+
+#include "cpu_dispatch.h"
+#include "perf_counters.h"
+#include "run_metrics.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct fastq_reader fastq_reader;
+
+/* Opens a FASTQ input ("-" for stdin, a FIFO, or a regular file) and
+   starts a background thread that decompresses it into a ring of large
+   buffers, so that an upstream producer is drained independently of
+   how fast the reads are classified. Decompression goes through
+   stream_reader, so any supported compression format is accepted. A
+   file still being written is followed for 'follow_seconds' (see
+   stream_reader_open()). The bytes read, the time spent reading and
+   waiting for them and the buffers filled are added to 'metrics' if it
+   is not NULL, and the performance counters of decompressing it to
+   'perf'. Lines are split with the newline scan of 'kernels'. */
+extern fastq_reader *fastq_reader_open(const char *path,
+                                       int follow_seconds,
+                                       input_metrics *metrics,
+                                       perf_profile *perf,
+                                       const kernel_set *kernels);
+
+/* gzread()-compatible read callback for kseq. Only returns fewer than
+   'length' bytes at the end of the input. */
+extern int fastq_reader_read(fastq_reader *reader,
+                             void *buffer,
+                             unsigned int length);
+
+extern bool fastq_reader_error(const fastq_reader *reader);
+
+/* Prints the compression format, input backend, throughput of the raw
+   (compressed) input and the mean number of reads that were in flight. */
+extern void fastq_reader_print_stats(const fastq_reader *reader,
+                                     const char *path);
+
+extern void fastq_reader_close(fastq_reader *reader);
+
+/* Index of the first '\n' in 'data', or 'length' if there is none.
+   Used by kseq to split records into lines. */
+extern size_t fastq_reader_find_newline(const fastq_reader *reader,
+                                        const char *data,
+                                        size_t length);
+
+#endif
@@ -0,0 +1,1031 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "fsdm.h"
+
+#include "bc_automaton.h"
+#include "bc_hash.h"
+#include "bc_scan.h"
+#include "cpu_dispatch.h"
+#include "demultiplex.h"
+#include "edit_distance.h"
+#include "fs2_barcodes.h"
+#include "haplotype_counts.h"
+#include "library_index.h"
+#include "packed_seq.h"
+#include "parse_seq.h"
+#include "perf_counters.h"
+#include "read_log.h"
+#include "run_metrics.h"
+#include "umi_counts.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* The library FASTA file is kept as read, in 'fasta_file' or in the
+   index it was loaded from, whose tables the decoder then uses */
+struct fsdm_classifier {
+    fsdm_options options;
+    const kernel_set *kernels;
+    void *fasta_file;
+    library_index *index;
+    index_section fasta;
+    library_seqs *fs2_seqs;
+    bc_decoder decoder;
+    bool valid_alleles[4];
+    unsigned int num_bc[2];
+    count_layout layout;
+};
+
+/* 'options' are the classifier's, with the log of these counts; the
+   state refers to them. The counts are saved to 'snapshot_path', if set,
+   every 'snapshot_seconds' while FASTQ inputs are classified, and their
+   progress is written by 'metrics_writer' if it is set. 'perf' is set
+   while they are profiled. */
+struct fsdm_counts {
+    const fsdm_classifier *classifier;
+    demux_options options;
+    demux_state *state;
+    bool log_input_started;
+    size_t top;
+    bc_counter *counter;
+    char *snapshot_path;
+    int snapshot_seconds;
+    bool snapshot_umi_collapse;
+    struct timespec last_snapshot;
+    run_metrics *metrics;
+    metrics_writer *metrics_writer;
+    perf_profile *perf;
+};
+
+
+void fsdm_default_options(fsdm_options *options)
+{
+    *options = (fsdm_options) {
+        .bc_mismatches = 0,
+        .ad_fl_mismatches = 1,
+        .ed_threshold = 4,
+        .max_shift = 8,
+        .bc_scan = false,
+        .bc_indels = false,
+        .template_align = false,
+        .any_orientation = false,
+        .output_all = false,
+        .umi_memory = 0,
+        .kernel = NULL
+    };
+}
+
+
+bool fsdm_kernels_supported(const char *name)
+{
+    return find_kernels(name) != NULL;
+}
+
+
+/* The count table of the library, with the standard barcode labels for
+   '-a'. For a panel, the checks of prototype 1 are those of its locus
+   with the most. */
+static bool library_count_layout(const library_seqs *fs2_seqs,
+                                 bool output_all,
+                                 const unsigned int *num_bc,
+                                 count_layout *layout)
+{
+    memset(layout, 0, sizeof(*layout));
+
+    for (size_t i = 0; i < 2; i++) {
+        layout->num_bc[i] = num_bc[i];
+        layout->bc_labels[i] = calloc(num_bc[i] + 1, sizeof(*layout->bc_labels[i]));
+
+        if (layout->bc_labels[i] == NULL) {
+            return false;
+        }
+
+        for (size_t j = 0; j < num_bc[i]; j++) {
+            layout->bc_labels[i][j] = output_all ? (int) j + 1 : fs2_seqs->barcodes[i][j].label;
+        }
+
+        layout->num_checks[i] = fs2_seqs->plans[i].num_checks;
+        layout->umi_length += fs2_seqs->plans[i].umi_length;
+    }
+
+    for (size_t i = 0; i < 4; i++) {
+        strcpy(layout->allele_names[i], fs2_seqs->alleles[i].seq);
+    }
+
+    layout->num_sites = fs2_seqs->prototypes[0].num_sites;
+    layout->num_loci = fs2_seqs->num_loci;
+
+    if (layout->num_loci > 0) {
+        layout->locus_names = calloc(layout->num_loci, sizeof(*layout->locus_names));
+        layout->locus_sites = calloc(layout->num_loci, sizeof(*layout->locus_sites));
+        layout->num_checks[0] = 0;
+
+        if (layout->locus_names == NULL || layout->locus_sites == NULL) {
+            return false;
+        }
+
+        for (size_t l = 0; l < layout->num_loci; l++) {
+            const panel_locus *locus = &(fs2_seqs->loci[l]);
+
+            strcpy(layout->locus_names[l], locus->name);
+            layout->locus_sites[l] = locus->num_sites;
+
+            if (locus->plan.num_checks > layout->num_checks[0]) {
+                layout->num_checks[0] = locus->plan.num_checks;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+/* Every packed 6-mer within the mismatch limit of exactly one barcode
+   of a position is entered for it, then the barcodes themselves */
+static bc_hash_table *build_hash_table(const library_seqs *fs2_seqs,
+                                       const unsigned int *num_bc,
+                                       unsigned int total_num_unique_barcodes,
+                                       bool output_all,
+                                       int bc_mismatches)
+{
+    size_t num_slots = calc_num_combos(6, total_num_unique_barcodes, bc_mismatches);
+    bc_hash_table *hash_table = init_hash_table(num_slots);
+
+    if (hash_table == NULL) {
+        return NULL;
+    }
+
+    // Barcodes packed 2 bits per base, the same way reads are (they
+    // only contain A, C, G and T once loaded)
+    uint64_t packed_bc[2][num_bc[0] > num_bc[1] ? num_bc[0] : num_bc[1]];
+
+    for (size_t i = 0; i < 2; i++) {
+        for (size_t j = 0; j < num_bc[i]; j++) {
+            pack_kmer(output_all ? FS2_BARCODES[j] : fs2_seqs->barcodes[i][j].seq,
+                      6, &packed_bc[i][j]);
+        }
+    }
+
+    if (bc_mismatches > 0) {
+        // Every packed 6-mer is a candidate read barcode
+        uint32_t num_possible_perms = (uint32_t) uint_pow(4, 6);
+
+        for (uint32_t perm = 0; perm < num_possible_perms; perm++) {
+            for (size_t j = 0; j < 2; j++) {
+                if (output_all && j > 0) {
+                    break;
+                }
+
+                bool found = false;
+                size_t mm_bc_index = 0;
+
+                for (size_t k = 0; k < num_bc[j]; k++) {
+                    int mismatches = kmer_mismatches(packed_bc[j][k], perm);
+
+                    if (mismatches <= bc_mismatches) {
+                        if (found) {
+                            found = false;
+                            break;
+                        }
+                        else {
+                            found = true;
+                            mm_bc_index = k;
+                        }
+                    }
+                }
+
+                if (found) {
+                    if (output_all) {
+                        hash_table_insert(hash_table, perm, mm_bc_index + 1, 0, false);
+                        hash_table_insert(hash_table, perm, mm_bc_index + 1, 1, false);
+                    }
+                    else {
+                        hash_table_insert(hash_table, perm, mm_bc_index + 1, j, false);
+                    }
+                }
+            }
+        }
+    }
+
+    if (output_all) {
+        for (size_t i = 0; i < num_bc[0]; i++) {
+            hash_table_insert(hash_table, packed_bc[0][i], i + 1, 0, true);
+            hash_table_insert(hash_table, packed_bc[0][i], i + 1, 1, true);
+        }
+    }
+    else {
+        for (size_t i = 0; i < 2; i++) {
+            for (size_t j = 0; j < num_bc[i]; j++) {
+                hash_table_insert(hash_table, packed_bc[i][j], j + 1, i, true);
+            }
+        }
+    }
+
+    if (! prune_hash_table(&hash_table)) {
+        destroy_hash_table(&hash_table);
+        return NULL;
+    }
+
+    return hash_table;
+}
+
+
+static bool build_decoder(fsdm_classifier *classifier)
+{
+    const library_seqs *fs2_seqs = classifier->fs2_seqs;
+    const fsdm_options *options = &(classifier->options);
+    const unsigned int *num_bc = classifier->num_bc;
+    bc_decoder *decoder = &(classifier->decoder);
+
+    if (options->bc_indels) {
+        for (size_t i = 0; i < 2; i++) {
+            const char *barcodes[num_bc[i]];
+
+            for (size_t j = 0; j < num_bc[i]; j++) {
+                barcodes[j] = options->output_all ? FS2_BARCODES[j] : fs2_seqs->barcodes[i][j].seq;
+            }
+
+            decoder->automata[i] = build_bc_automaton(barcodes, num_bc[i], 6, options->bc_mismatches);
+
+            if (decoder->automata[i] == NULL) {
+                return false;
+            }
+        }
+
+        decoder->max_shift = options->bc_mismatches;
+
+        return true;
+    }
+
+    // The mismatch neighbourhood of every barcode grows combinatorially
+    // with the number of mismatches, so compare reads against all
+    // barcodes directly instead
+    if (options->bc_scan || options->bc_mismatches >= 2) {
+        decoder->scanner = init_bc_scanner(6, options->bc_mismatches, classifier->kernels);
+
+        if (decoder->scanner == NULL) {
+            return false;
+        }
+
+        for (size_t i = 0; i < 2; i++) {
+            for (size_t j = 0; j < num_bc[i]; j++) {
+                const char *barcode = options->output_all ? FS2_BARCODES[j] : fs2_seqs->barcodes[i][j].seq;
+
+                if (! bc_scanner_add(decoder->scanner, barcode, j + 1, i)) {
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    unsigned int num_standard_barcodes = sizeof(FS2_BARCODES) / sizeof(FS2_BARCODES[0]);
+    unsigned int total_num_unique_barcodes = num_bc[0] + num_bc[1];
+
+    if (options->output_all || all_standard_barcodes(fs2_seqs)) {
+        total_num_unique_barcodes = num_standard_barcodes;
+    }
+
+    decoder->hash_table = build_hash_table(fs2_seqs, num_bc, total_num_unique_barcodes,
+                                           options->output_all, options->bc_mismatches);
+
+    return decoder->hash_table != NULL;
+}
+
+
+/* The barcode lookup of the options, as built into an index */
+static void decoder_index_options(const fsdm_options *options,
+                                  index_options *built)
+{
+    *built = (index_options) {
+        .bc_mismatches = options->bc_mismatches,
+        .bc_scan = options->bc_scan,
+        .bc_indels = options->bc_indels,
+        .output_all = options->output_all
+    };
+}
+
+
+/* Uses the lookup tables of the index in place. The scanner is not
+   indexed, since it only packs the barcodes. */
+static bool map_decoder(fsdm_classifier *classifier)
+{
+    const fsdm_options *options = &(classifier->options);
+    index_options requested;
+
+    decoder_index_options(options, &requested);
+
+    if (memcmp(&requested, library_index_options(classifier->index), sizeof(requested)) != 0) {
+        const index_options *built = library_index_options(classifier->index);
+
+        fprintf(stderr, "Error: the index was built with --bm %d%s%s%s, unlike the options given\n",
+                built->bc_mismatches, built->bc_scan ? " --bc-scan" : "",
+                built->bc_indels ? " --bc-indels" : "", built->output_all ? " -a" : "");
+        return false;
+    }
+
+    bc_decoder *decoder = &(classifier->decoder);
+
+    if (options->bc_indels) {
+        for (size_t i = 0; i < 2; i++) {
+            index_section image = library_index_section(classifier->index, INDEX_AUTOMATON_1 + i);
+
+            decoder->automata[i] = map_bc_automaton(image.data, image.length);
+
+            if (decoder->automata[i] == NULL) {
+                fprintf(stderr, "Error: invalid barcode automaton in the index\n");
+                return false;
+            }
+        }
+
+        decoder->max_shift = options->bc_mismatches;
+
+        return true;
+    }
+
+    if (options->bc_scan || options->bc_mismatches >= 2) {
+        return build_decoder(classifier);
+    }
+
+    index_section image = library_index_section(classifier->index, INDEX_HASH_TABLE);
+
+    decoder->hash_table = map_hash_table(image.data, image.length);
+
+    if (decoder->hash_table == NULL) {
+        fprintf(stderr, "Error: invalid barcode table in the index\n");
+        return false;
+    }
+
+    return true;
+}
+
+
+static void *read_file(const char *path,
+                       size_t *length)
+{
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL) {
+        fprintf(stderr, "Error: unable to read file '%s': %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    size_t capacity = 1 << 16;
+    char *data = malloc(capacity);
+
+    *length = 0;
+
+    while (data != NULL) {
+        *length += fread(data + *length, 1, capacity - *length, fp);
+
+        if (*length < capacity) {
+            break;
+        }
+
+        char *grown = realloc(data, 2 * capacity);
+
+        if (grown == NULL) {
+            free(data);
+        }
+
+        data = grown;
+        capacity *= 2;
+    }
+
+    if (data == NULL) {
+        perror("Error: memory allocation failed while reading FASTA");
+    }
+    else if (ferror(fp)) {
+        fprintf(stderr, "Error: unable to read file '%s': %s\n", path, strerror(errno));
+        free(data);
+        data = NULL;
+    }
+
+    fclose(fp);
+
+    return data;
+}
+
+
+fsdm_classifier *fsdm_classifier_new(const char *fasta_path,
+                                     const fsdm_options *options)
+{
+    const kernel_set *kernels = find_kernels(options->kernel);
+
+    if (kernels == NULL) {
+        return NULL;
+    }
+
+    fsdm_classifier *classifier = calloc(1, sizeof(*classifier));
+
+    if (classifier == NULL) {
+        perror("Error: memory allocation failed for classifier");
+        return NULL;
+    }
+
+    classifier->options = *options;
+    classifier->options.kernel = kernels->name;
+    classifier->kernels = kernels;
+
+    if (is_library_index(fasta_path)) {
+        classifier->index = map_library_index(fasta_path);
+
+        if (classifier->index == NULL) {
+            fsdm_classifier_free(&classifier);
+            return NULL;
+        }
+
+        classifier->fasta = library_index_section(classifier->index, INDEX_FASTA);
+    }
+    else {
+        classifier->fasta_file = read_file(fasta_path, &(classifier->fasta.length));
+        classifier->fasta.data = classifier->fasta_file;
+
+        if (classifier->fasta_file == NULL) {
+            fsdm_classifier_free(&classifier);
+            return NULL;
+        }
+    }
+
+    classifier->fs2_seqs = load_fasta_sequences(fasta_path, classifier->fasta.data,
+                                                classifier->fasta.length);
+
+    if (classifier->fs2_seqs == NULL || ! parse_prototypes(classifier->fs2_seqs, kernels)) {
+        fsdm_classifier_free(&classifier);
+        return NULL;
+    }
+
+    library_seqs *fs2_seqs = classifier->fs2_seqs;
+
+    if (classifier->options.output_all && ! all_standard_barcodes(fs2_seqs)) {
+        classifier->options.output_all = false;
+    }
+
+    for (size_t i = 0; i < 2; i++) {
+        classifier->num_bc[i] = classifier->options.output_all ?
+                                sizeof(FS2_BARCODES) / sizeof(FS2_BARCODES[0]) :
+                                fs2_seqs->num_barcodes[i];
+    }
+
+    for (size_t i = 0; i < 4; i++) {
+        classifier->valid_alleles[i] = (fs2_seqs->alleles[i].seq[0] != '\0');
+    }
+
+    if (! library_count_layout(fs2_seqs, classifier->options.output_all, classifier->num_bc,
+                               &(classifier->layout))) {
+        perror("Error: memory allocation failed for classifier");
+        fsdm_classifier_free(&classifier);
+        return NULL;
+    }
+
+    if (! (classifier->index ? map_decoder(classifier) : build_decoder(classifier))) {
+        fsdm_classifier_free(&classifier);
+        return NULL;
+    }
+
+    return classifier;
+}
+
+
+bool fsdm_classifier_save(const fsdm_classifier *classifier,
+                          const char *index_path)
+{
+    const bc_decoder *decoder = &(classifier->decoder);
+    index_section sections[NUM_INDEX_SECTIONS] = {{NULL, 0}};
+    void *images[NUM_INDEX_SECTIONS] = {NULL};
+    bool ok = true;
+
+    sections[INDEX_FASTA] = classifier->fasta;
+
+    if (decoder->hash_table) {
+        sections[INDEX_HASH_TABLE].length = hash_table_image(decoder->hash_table, NULL);
+        images[INDEX_HASH_TABLE] = malloc(sections[INDEX_HASH_TABLE].length);
+        ok = images[INDEX_HASH_TABLE] != NULL;
+
+        if (ok) {
+            hash_table_image(decoder->hash_table, images[INDEX_HASH_TABLE]);
+        }
+    }
+
+    for (size_t i = 0; i < 2 && ok; i++) {
+        if (decoder->automata[i]) {
+            sections[INDEX_AUTOMATON_1 + i].length = bc_automaton_image(decoder->automata[i], NULL);
+            images[INDEX_AUTOMATON_1 + i] = malloc(sections[INDEX_AUTOMATON_1 + i].length);
+            ok = images[INDEX_AUTOMATON_1 + i] != NULL;
+
+            if (ok) {
+                bc_automaton_image(decoder->automata[i], images[INDEX_AUTOMATON_1 + i]);
+            }
+        }
+    }
+
+    if (! ok) {
+        perror("Error: memory allocation failed for index");
+    }
+    else {
+        index_options built;
+
+        for (size_t i = INDEX_HASH_TABLE; i < NUM_INDEX_SECTIONS; i++) {
+            sections[i].data = images[i];
+        }
+
+        decoder_index_options(&(classifier->options), &built);
+        ok = write_library_index(index_path, &built, sections);
+    }
+
+    for (size_t i = 0; i < NUM_INDEX_SECTIONS; i++) {
+        free(images[i]);
+    }
+
+    return ok;
+}
+
+
+const fsdm_options *fsdm_classifier_options(const fsdm_classifier *classifier)
+{
+    return &(classifier->options);
+}
+
+
+void fsdm_classifier_free(fsdm_classifier **classifier_double_ptr)
+{
+    fsdm_classifier *classifier = *classifier_double_ptr;
+    bc_decoder *decoder = &(classifier->decoder);
+
+    for (size_t i = 0; i < 2; i++) {
+        if (decoder->automata[i]) {
+            destroy_bc_automaton(&(decoder->automata[i]));
+        }
+    }
+
+    if (decoder->scanner) {
+        destroy_bc_scanner(&(decoder->scanner));
+    }
+
+    if (decoder->hash_table) {
+        destroy_hash_table(&(decoder->hash_table));
+    }
+
+    if (classifier->fs2_seqs) {
+        destroy_library_seqs(&(classifier->fs2_seqs));
+    }
+
+    if (classifier->index) {
+        unmap_library_index(&(classifier->index));
+    }
+
+    free_count_layout(&(classifier->layout));
+    free(classifier->fasta_file);
+    free(classifier);
+
+    *classifier_double_ptr = NULL;
+}
+
+
+static void free_counter(bc_counter **counter_double_ptr)
+{
+    bc_counter *counter = *counter_double_ptr;
+
+    if (counter->haplotypes) {
+        destroy_haplotype_table(&(counter->haplotypes));
+    }
+
+    if (counter->umis) {
+        destroy_umi_table(&(counter->umis));
+    }
+
+    if (counter->unmatched) {
+        destroy_unmatched_reads(&(counter->unmatched));
+    }
+
+    free(counter);
+
+    *counter_double_ptr = NULL;
+}
+
+
+/* Prototypes with several allele sites, and the loci of a panel, are
+   counted by haplotype, and with UMIs the counts are of distinct UMIs
+   instead of reads ('with_umis' unset for a table to tally them into) */
+static bc_counter *new_counter(const fsdm_classifier *classifier,
+                               bool with_umis)
+{
+    const library_seqs *fs2_seqs = classifier->fs2_seqs;
+    const unsigned int *num_bc = classifier->num_bc;
+    bc_counter *counter = calloc(1, sizeof(*counter) + (size_t) num_bc[0] *
+                                    num_bc[1] * sizeof(*counter->counts));
+
+    if (counter == NULL) {
+        perror("Error: memory allocation failed for counts");
+        return NULL;
+    }
+
+    counter->num_bc1 = num_bc[0];
+    counter->num_bc2 = num_bc[1];
+    counter->num_loci = (fs2_seqs->num_loci > 0) ? fs2_seqs->num_loci : 1;
+
+    size_t num_samples = (size_t) num_bc[0] * num_bc[1] * counter->num_loci;
+
+    if (fs2_seqs->num_loci > 0 || fs2_seqs->prototypes[0].num_sites > 1) {
+        counter->haplotypes = init_haplotype_table(num_samples);
+
+        if (counter->haplotypes == NULL) {
+            free_counter(&counter);
+            return NULL;
+        }
+    }
+
+    if (with_umis && classifier->layout.umi_length > 0) {
+        counter->umis = init_umi_table(num_samples, classifier->layout.umi_length,
+                                       classifier->options.umi_memory);
+
+        if (counter->umis == NULL) {
+            free_counter(&counter);
+            return NULL;
+        }
+    }
+
+    return counter;
+}
+
+
+fsdm_counts *fsdm_counts_new(const fsdm_classifier *classifier)
+{
+    fsdm_counts *counts = calloc(1, sizeof(*counts));
+
+    if (counts == NULL) {
+        perror("Error: memory allocation failed for counts");
+        return NULL;
+    }
+
+    const fsdm_options *options = &(classifier->options);
+
+    counts->classifier = classifier;
+    counts->options = (demux_options) {
+        .kernels = classifier->kernels,
+        .ad_fl_mismatches = options->ad_fl_mismatches,
+        .ed_threshold = options->ed_threshold,
+        .max_shift = options->max_shift,
+        .template_align = options->template_align,
+        .any_orientation = options->any_orientation
+    };
+    counts->counter = new_counter(classifier, true);
+    counts->state = init_demux_state(classifier->fs2_seqs, &(classifier->decoder),
+                                     classifier->valid_alleles, &(counts->options));
+
+    if (counts->counter == NULL || counts->state == NULL) {
+        fsdm_counts_free(&counts);
+        return NULL;
+    }
+
+    return counts;
+}
+
+
+bool fsdm_classify(fsdm_counts *counts,
+                   const fsdm_read_pair *pairs,
+                   size_t num_pairs)
+{
+    // Pairs classified in memory belong to the last FASTQ input logged
+    if (counts->options.log && ! counts->log_input_started) {
+        read_log_start_input(counts->options.log);
+        counts->log_input_started = true;
+    }
+
+    for (size_t i = 0; i < num_pairs; i++) {
+        seq_view mates[2] = {
+            {pairs[i].seq[0], pairs[i].length[0]},
+            {pairs[i].seq[1], pairs[i].length[1]}
+        };
+
+        if (! demultiplex_read_pair(counts->state, mates, counts->counter)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool fsdm_classify_fastq(fsdm_counts *counts,
+                         const char **fastq_pair,
+                         bool interleaved,
+                         bool io_stats)
+{
+    counts->options.interleaved = interleaved;
+    counts->options.io_stats = io_stats;
+    counts->log_input_started = true;
+
+    if (! demultiplex_fastq_pair(fastq_pair, counts->state, counts->counter)) {
+        return false;
+    }
+
+    // A failed snapshot is reported, and left to the next one
+    if (counts->snapshot_path) {
+        fsdm_counts_save(counts, counts->snapshot_umi_collapse, counts->snapshot_path);
+        clock_gettime(CLOCK_MONOTONIC, &(counts->last_snapshot));
+    }
+
+    return true;
+}
+
+
+void fsdm_counts_follow(fsdm_counts *counts,
+                        int idle_seconds)
+{
+    counts->options.follow_seconds = idle_seconds;
+}
+
+
+static void save_snapshot(void *data)
+{
+    fsdm_counts *counts = data;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (now.tv_sec - counts->last_snapshot.tv_sec >= counts->snapshot_seconds) {
+        fsdm_counts_save(counts, counts->snapshot_umi_collapse, counts->snapshot_path);
+        counts->last_snapshot = now;
+    }
+}
+
+
+bool fsdm_counts_snapshot(fsdm_counts *counts,
+                          const char *path,
+                          int interval_seconds,
+                          bool umi_collapse)
+{
+    free(counts->snapshot_path);
+    counts->snapshot_path = strdup(path);
+
+    if (counts->snapshot_path == NULL) {
+        perror("Error: memory allocation failed for snapshots");
+        return false;
+    }
+
+    counts->snapshot_seconds = interval_seconds;
+    counts->snapshot_umi_collapse = umi_collapse;
+    clock_gettime(CLOCK_MONOTONIC, &(counts->last_snapshot));
+
+    counts->options.checkpoint = save_snapshot;
+    counts->options.checkpoint_data = counts;
+
+    return true;
+}
+
+
+bool fsdm_counts_start_metrics(fsdm_counts *counts,
+                               const char *path,
+                               int interval_seconds,
+                               uint64_t expected_bytes)
+{
+    if (counts->metrics_writer) {
+        fprintf(stderr, "Error: the counts already have a metrics file\n");
+        return false;
+    }
+
+    if (counts->metrics == NULL) {
+        counts->metrics = calloc(1, sizeof(*(counts->metrics)));
+
+        if (counts->metrics == NULL) {
+            perror("Error: memory allocation failed for metrics");
+            return false;
+        }
+    }
+    else {
+        memset(counts->metrics, 0, sizeof(*(counts->metrics)));
+    }
+
+    counts->metrics->expected_bytes = expected_bytes;
+    counts->metrics_writer = start_metrics_writer(counts->metrics, path, interval_seconds);
+
+    if (counts->metrics_writer == NULL) {
+        return false;
+    }
+
+    counts->options.metrics = counts->metrics;
+
+    return true;
+}
+
+
+bool fsdm_counts_stop_metrics(fsdm_counts *counts)
+{
+    if (counts->metrics_writer == NULL) {
+        return true;
+    }
+
+    counts->options.metrics = NULL;
+
+    return stop_metrics_writer(&(counts->metrics_writer));
+}
+
+
+bool fsdm_counts_profile(fsdm_counts *counts)
+{
+    if (counts->perf == NULL) {
+        counts->perf = init_perf_profile();
+        counts->options.perf = counts->perf;
+    }
+
+    return counts->perf != NULL;
+}
+
+
+void fsdm_counts_print_profile(const fsdm_counts *counts,
+                               FILE *fp)
+{
+    if (counts->perf) {
+        print_perf_profile(counts->perf, fp);
+    }
+}
+
+
+bool fsdm_counts_merge(fsdm_counts *counts,
+                       const fsdm_counts *other)
+{
+    bc_counter *counter = counts->counter;
+    const bc_counter *other_counter = other->counter;
+    size_t num_bc_pairs = (size_t) counter->num_bc1 * counter->num_bc2;
+
+    if (counts->classifier != other->classifier) {
+        fprintf(stderr, "Error: only counts of the same classifier can be merged\n");
+        return false;
+    }
+
+    for (size_t sample = 0; sample < num_bc_pairs; sample++) {
+        for (size_t a = 0; a < 4; a++) {
+            counter->counts[sample][a] += other_counter->counts[sample][a];
+        }
+    }
+
+    if (counter->haplotypes && ! haplotype_table_merge(counter->haplotypes, other_counter->haplotypes)) {
+        return false;
+    }
+
+    if (counter->umis && ! umi_table_merge(counter->umis, other_counter->umis)) {
+        return false;
+    }
+
+    return true;
+}
+
+
+bool fsdm_counts_estimated(const fsdm_counts *counts)
+{
+    return counts->counter->umis && umi_table_estimated(counts->counter->umis);
+}
+
+
+bool fsdm_counts_write(fsdm_counts *counts,
+                       bool umi_collapse,
+                       FILE *fp)
+{
+    const fsdm_classifier *classifier = counts->classifier;
+
+    if (counts->counter->umis == NULL) {
+        return print_counts(counts->counter, &(classifier->layout), fp);
+    }
+
+    // The UMIs are tallied into a table of their own, so more pairs can
+    // still be counted
+    bc_counter *tallied = new_counter(classifier, false);
+
+    if (tallied == NULL) {
+        return false;
+    }
+
+    tallied->umis = counts->counter->umis;
+
+    bool written = tally_umis(tallied, umi_collapse) &&
+                   print_counts(tallied, &(classifier->layout), fp);
+
+    tallied->umis = NULL;
+    free_counter(&tallied);
+
+    return written;
+}
+
+
+bool fsdm_counts_save(fsdm_counts *counts,
+                      bool umi_collapse,
+                      const char *path)
+{
+    size_t path_length = strlen(path);
+    char *temp_path = malloc(path_length + 5);
+
+    if (temp_path == NULL) {
+        perror("Error: memory allocation failed for output");
+        return false;
+    }
+
+    memcpy(temp_path, path, path_length);
+    memcpy(temp_path + path_length, ".tmp", 5);
+
+    FILE *fp = fopen(temp_path, "w");
+
+    if (fp == NULL) {
+        fprintf(stderr, "Error: unable to open output file '%s': %s\n", temp_path, strerror(errno));
+        free(temp_path);
+        return false;
+    }
+
+    bool saved = fsdm_counts_write(counts, umi_collapse, fp);
+
+    if (fclose(fp) != 0 || ! saved || rename(temp_path, path) != 0) {
+        fprintf(stderr, "Error: failed writing output file '%s': %s\n", path, strerror(errno));
+        remove(temp_path);
+        saved = false;
+    }
+
+    free(temp_path);
+
+    return saved;
+}
+
+
+bool fsdm_counts_track_unmatched(fsdm_counts *counts,
+                                 size_t top)
+{
+    if (counts->counter->unmatched) {
+        destroy_unmatched_reads(&(counts->counter->unmatched));
+    }
+
+    counts->top = top;
+    counts->counter->unmatched = init_unmatched_reads(top);
+
+    return counts->counter->unmatched != NULL;
+}
+
+
+void fsdm_counts_print_unmatched(fsdm_counts *counts,
+                                 FILE *fp)
+{
+    if (counts->counter->unmatched) {
+        print_unmatched_reads(counts->counter->unmatched, counts->classifier->fs2_seqs,
+                              counts->top, fp);
+    }
+}
+
+
+bool fsdm_counts_open_log(fsdm_counts *counts,
+                          const char *log_file)
+{
+    if (counts->options.log) {
+        fprintf(stderr, "Error: the counts already have a read log\n");
+        return false;
+    }
+
+    counts->options.log = open_read_log(log_file, &(counts->classifier->layout));
+    counts->log_input_started = false;
+
+    return counts->options.log != NULL;
+}
+
+
+bool fsdm_counts_close_log(fsdm_counts *counts)
+{
+    if (counts->options.log == NULL) {
+        return true;
+    }
+
+    return close_read_log(&(counts->options.log));
+}
+
+
+void fsdm_counts_free(fsdm_counts **counts_double_ptr)
+{
+    fsdm_counts *counts = *counts_double_ptr;
+
+    fsdm_counts_close_log(counts);
+    fsdm_counts_stop_metrics(counts);
+
+    if (counts->state) {
+        destroy_demux_state(&(counts->state));
+    }
+
+    if (counts->counter) {
+        free_counter(&(counts->counter));
+    }
+
+    free(counts->snapshot_path);
+    free(counts->metrics);
+
+    if (counts->perf) {
+        destroy_perf_profile(&(counts->perf));
+    }
+
+    free(counts);
+
+    *counts_double_ptr = NULL;
+}
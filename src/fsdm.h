@@ -0,0 +1,177 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef FSDM_H
+#define FSDM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* libfsdm: the fsdm classifier for read pairs already in memory. A
+   classifier is built once from a library FASTA and is only read
+   afterwards, so any number of threads can share it, each classifying
+   into counts of its own; counts of the same classifier can then be
+   merged. No function exits the process: errors are reported to stderr
+   and returned as NULL or false. */
+
+/* The fsdm options of the same names (see 'fsdm --help') */
+typedef struct fsdm_options {
+    int bc_mismatches;          // --bm
+    int ad_fl_mismatches;       // --mm
+    int ed_threshold;           // --ed
+    int max_shift;              // --max-shift
+    bool bc_scan;               // --bc-scan
+    bool bc_indels;             // --bc-indels
+    bool template_align;        // --template-align
+    bool any_orientation;       // --any-orientation
+    bool output_all;            // -a
+    size_t umi_memory;          // --umi-memory, in bytes (0 for no limit)
+    const char *kernel;         // --kernel (NULL for the widest the CPU supports)
+} fsdm_options;
+
+/* The defaults of the fsdm command */
+void fsdm_default_options(fsdm_options *options);
+
+/* True if the SIMD kernels called 'name' (as 'kernel' in the options)
+   exist and run on this CPU; the error is reported otherwise */
+bool fsdm_kernels_supported(const char *name);
+
+typedef struct fsdm_classifier fsdm_classifier;
+
+/* 'fasta_path' is a library FASTA file, or an index of one written by
+   fsdm_classifier_save(), whose barcode tables are then used in place
+   instead of being built (the options must be those it was saved with).
+   Returns NULL (after reporting the error) if the library or index is
+   invalid or memory runs out. */
+fsdm_classifier *fsdm_classifier_new(const char *fasta_path,
+                                     const fsdm_options *options);
+
+/* Writes the library and its barcode tables to an index file, which is
+   specific to the options and the machine architecture */
+bool fsdm_classifier_save(const fsdm_classifier *classifier,
+                          const char *index_path);
+
+/* The options in effect: 'output_all' is cleared if the library
+   barcodes are not all standard ones, and 'kernel' names the kernels
+   chosen */
+const fsdm_options *fsdm_classifier_options(const fsdm_classifier *classifier);
+
+/* Frees the classifier, after every counts built from it */
+void fsdm_classifier_free(fsdm_classifier **classifier_double_ptr);
+
+/* One read pair. The sequences need not be NUL-terminated and are only
+   read during the call that classifies them. */
+typedef struct fsdm_read_pair {
+    const char *seq[2];
+    size_t length[2];
+} fsdm_read_pair;
+
+/* The count table of the read pairs classified into it, and the state
+   of classifying them. Counts are used by one thread at a time. */
+typedef struct fsdm_counts fsdm_counts;
+
+fsdm_counts *fsdm_counts_new(const fsdm_classifier *classifier);
+
+/* Both return false (after reporting the error) if an input cannot be
+   read or memory runs out, in which case the counts are incomplete */
+bool fsdm_classify(fsdm_counts *counts,
+                   const fsdm_read_pair *pairs,
+                   size_t num_pairs);
+
+bool fsdm_classify_fastq(fsdm_counts *counts,
+                         const char **fastq_pair,
+                         bool interleaved,
+                         bool io_stats);
+
+/* Adds the counts of 'other', of the same classifier, to 'counts' */
+bool fsdm_counts_merge(fsdm_counts *counts,
+                       const fsdm_counts *other);
+
+/* True if the counts of distinct UMIs exceeded 'umi_memory' and are
+   estimates, which cannot be collapsed */
+bool fsdm_counts_estimated(const fsdm_counts *counts);
+
+/* Writes the count table as fsdm does, with UMIs collapsed if
+   'umi_collapse' is set; the counts can still be added to afterwards.
+   Returns false if memory runs out. */
+bool fsdm_counts_write(fsdm_counts *counts,
+                       bool umi_collapse,
+                       FILE *fp);
+
+/* Writes the count table to 'path' as fsdm_counts_write() does, through
+   a temporary file that replaces it once complete, so that readers of
+   the file never see part of a table */
+bool fsdm_counts_save(fsdm_counts *counts,
+                      bool umi_collapse,
+                      const char *path);
+
+/* For FASTQ files still being written (fsdm --follow and --snapshot):
+   the inputs classified from then on are followed, reading on as they
+   grow until one has not grown for 'idle_seconds' (a BGZF file ends at
+   its end-of-file block), and the counts are saved to 'path' every
+   'interval_seconds' during them and after each one */
+void fsdm_counts_follow(fsdm_counts *counts,
+                        int idle_seconds);
+
+bool fsdm_counts_snapshot(fsdm_counts *counts,
+                          const char *path,
+                          int interval_seconds,
+                          bool umi_collapse);
+
+/* The progress of the FASTQ inputs classified from then on (fsdm
+   --metrics-file): the read pairs of each outcome, the bytes read, the
+   time spent in each stage and the input queues are written to 'path'
+   in the Prometheus text format every 'interval_seconds', and a last
+   time by fsdm_counts_stop_metrics(). 'expected_bytes' is the total
+   size of the inputs, from which the time remaining is estimated (0 if
+   it is unknown). */
+bool fsdm_counts_start_metrics(fsdm_counts *counts,
+                               const char *path,
+                               int interval_seconds,
+                               uint64_t expected_bytes);
+
+bool fsdm_counts_stop_metrics(fsdm_counts *counts);
+
+/* Profiles the FASTQ inputs classified from then on (fsdm
+   --perf-counters): hardware performance counters are attributed to the
+   stages of classifying, on a sample of the read pairs, and
+   fsdm_counts_print_profile() prints the cycles, instructions, IPC and
+   cache and branch misses per read pair of each stage. Where the system
+   does not allow the counters, a warning is printed and only the time
+   of each stage, or nothing, is profiled. Returns false if memory runs
+   out. */
+bool fsdm_counts_profile(fsdm_counts *counts);
+
+void fsdm_counts_print_profile(const fsdm_counts *counts,
+                               FILE *fp);
+
+/* The diagnostics of the fsdm options of the same names: keeping the
+   'top' most common unmatched barcodes and windows, and logging every
+   read pair classified from then on to 'log_file' (--log), which is
+   finished by fsdm_counts_close_log() */
+bool fsdm_counts_track_unmatched(fsdm_counts *counts,
+                                 size_t top);
+
+void fsdm_counts_print_unmatched(fsdm_counts *counts,
+                                 FILE *fp);
+
+bool fsdm_counts_open_log(fsdm_counts *counts,
+                          const char *log_file);
+
+bool fsdm_counts_close_log(fsdm_counts *counts);
+
+void fsdm_counts_free(fsdm_counts **counts_double_ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
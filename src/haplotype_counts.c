@@ -0,0 +1,225 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "haplotype_counts.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum { INITIAL_SLOTS = 8 };
+
+/* Open addressing with linear probing; a count of 0 marks an empty
+   slot, since every stored haplotype has been seen at least once */
+struct sample_counts {
+    uint32_t num_slots;
+    uint32_t num_items;
+    haplotype_count *items;
+};
+
+struct haplotype_table {
+    size_t num_samples;
+    haplotype_count *sorted;
+    struct sample_counts samples[];
+};
+
+
+static inline uint32_t hash_haplotype(uint32_t haplotype)
+{
+    uint32_t hash = haplotype * 2654435769UL;
+
+    return hash ^ (hash >> 16);
+}
+
+
+static void *checked_calloc(size_t count,
+                            size_t size)
+{
+    void *ptr = calloc(count, size);
+
+    if (ptr == NULL) {
+        perror("Error: memory allocation failed for haplotype counts");
+    }
+
+    return ptr;
+}
+
+
+haplotype_table *init_haplotype_table(size_t num_samples)
+{
+    haplotype_table *table = checked_calloc(1, sizeof(*table) + num_samples * sizeof(*table->samples));
+
+    if (table == NULL) {
+        return NULL;
+    }
+
+    table->num_samples = num_samples;
+
+    return table;
+}
+
+
+static void insert_count(struct sample_counts *counts,
+                         uint32_t haplotype,
+                         uint32_t count)
+{
+    uint32_t mask = counts->num_slots - 1;
+    uint32_t slot = hash_haplotype(haplotype) & mask;
+
+    while (counts->items[slot].count != 0 && counts->items[slot].haplotype != haplotype) {
+        slot = (slot + 1) & mask;
+    }
+
+    if (counts->items[slot].count == 0) {
+        counts->items[slot].haplotype = haplotype;
+        counts->num_items++;
+    }
+
+    counts->items[slot].count += count;
+}
+
+
+// Doubles the table once it is over two-thirds full
+static bool grow_counts(struct sample_counts *counts)
+{
+    struct sample_counts grown = {
+        .num_slots = (counts->num_slots > 0) ? 2 * counts->num_slots : INITIAL_SLOTS,
+        .num_items = 0
+    };
+
+    grown.items = checked_calloc(grown.num_slots, sizeof(*grown.items));
+
+    if (grown.items == NULL) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < counts->num_slots; i++) {
+        if (counts->items[i].count != 0) {
+            insert_count(&grown, counts->items[i].haplotype, counts->items[i].count);
+        }
+    }
+
+    free(counts->items);
+    *counts = grown;
+
+    return true;
+}
+
+
+bool haplotype_table_add(haplotype_table *self,
+                         size_t sample,
+                         uint32_t haplotype,
+                         uint32_t count)
+{
+    struct sample_counts *counts = &(self->samples[sample]);
+
+    if (3 * (counts->num_items + 1) > 2 * counts->num_slots && ! grow_counts(counts)) {
+        return false;
+    }
+
+    insert_count(counts, haplotype, count);
+
+    return true;
+}
+
+
+bool haplotype_table_merge(haplotype_table *self,
+                           const haplotype_table *other)
+{
+    for (size_t sample = 0; sample < self->num_samples; sample++) {
+        const struct sample_counts *counts = &(other->samples[sample]);
+
+        for (uint32_t i = 0; i < counts->num_slots; i++) {
+            if (counts->items[i].count != 0 &&
+                ! haplotype_table_add(self, sample, counts->items[i].haplotype, counts->items[i].count)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+/* Orders haplotypes as their strings: by the first site that differs,
+   which is the lowest differing group of bits */
+static int compare_haplotypes(const void *a,
+                              const void *b)
+{
+    uint32_t haplotype_a = ((const haplotype_count *) a)->haplotype;
+    uint32_t haplotype_b = ((const haplotype_count *) b)->haplotype;
+    uint32_t diff = haplotype_a ^ haplotype_b;
+
+    if (diff == 0) {
+        return 0;
+    }
+
+    unsigned shift = HAPLOTYPE_SITE_BITS * ((unsigned) __builtin_ctz(diff) / HAPLOTYPE_SITE_BITS);
+    uint32_t site_mask = (1u << HAPLOTYPE_SITE_BITS) - 1;
+
+    return (int) ((haplotype_a >> shift) & site_mask) - (int) ((haplotype_b >> shift) & site_mask);
+}
+
+
+const haplotype_count *haplotype_table_sorted(haplotype_table *self,
+                                              size_t sample,
+                                              size_t *num_haplotypes)
+{
+    const struct sample_counts *counts = &(self->samples[sample]);
+    size_t n = 0;
+
+    free(self->sorted);
+    self->sorted = checked_calloc(counts->num_items + 1, sizeof(*self->sorted));
+    *num_haplotypes = 0;
+
+    if (self->sorted == NULL) {
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < counts->num_slots; i++) {
+        if (counts->items[i].count != 0) {
+            self->sorted[n++] = counts->items[i];
+        }
+    }
+
+    qsort(self->sorted, n, sizeof(*self->sorted), compare_haplotypes);
+    *num_haplotypes = n;
+
+    return self->sorted;
+}
+
+
+void haplotype_to_string(uint32_t haplotype,
+                         size_t num_sites,
+                         char *str)
+{
+    static const char BASES[] = "ACGTN";
+
+    for (size_t i = 0; i < num_sites; i++) {
+        unsigned code = (haplotype >> (HAPLOTYPE_SITE_BITS * i)) & ((1u << HAPLOTYPE_SITE_BITS) - 1);
+
+        str[i] = BASES[(code < 4) ? code : 4];
+    }
+
+    str[num_sites] = '\0';
+}
+
+
+void destroy_haplotype_table(haplotype_table **table_double_ptr)
+{
+    haplotype_table *table = *table_double_ptr;
+
+    for (size_t i = 0; i < table->num_samples; i++) {
+        free(table->samples[i].items);
+    }
+
+    free(table->sorted);
+    free(table);
+
+    *table_double_ptr = NULL;
+}
@@ -0,0 +1,68 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef HAPLOTYPE_COUNTS_H
+#define HAPLOTYPE_COUNTS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Haplotypes are keyed 3 bits per allele site, the first site in the
+   lowest bits: A=0, C=1, G=2, T=3, and 4 for N or any other base */
+enum { HAPLOTYPE_SITE_BITS = 3 };
+
+static inline uint32_t haplotype_site_code(char base)
+{
+    switch (base) {
+        case 'A':
+            return 0;
+        case 'C':
+            return 1;
+        case 'G':
+            return 2;
+        case 'T':
+            return 3;
+    }
+
+    return 4;
+}
+
+typedef struct haplotype_count {
+    uint32_t haplotype;
+    uint32_t count;
+} haplotype_count;
+
+typedef struct haplotype_table haplotype_table;
+
+/* One sparse counter per sample (barcode combination), allocated on
+   the first haplotype seen for it and grown as haplotypes are added.
+   Functions that allocate return NULL or false (after reporting the
+   error) if memory runs out. */
+haplotype_table *init_haplotype_table(size_t num_samples);
+
+bool haplotype_table_add(haplotype_table *self,
+                         size_t sample,
+                         uint32_t haplotype,
+                         uint32_t count);
+
+/* Adds the counts of 'other', a table of as many samples */
+bool haplotype_table_merge(haplotype_table *self,
+                           const haplotype_table *other);
+
+/* Haplotypes seen for 'sample', in the order of their strings; the
+   array is owned by the table and valid until the next call */
+const haplotype_count *haplotype_table_sorted(haplotype_table *self,
+                                              size_t sample,
+                                              size_t *num_haplotypes);
+
+/* Writes the alleles of 'haplotype' at 'num_sites' sites to 'str' */
+void haplotype_to_string(uint32_t haplotype,
+                         size_t num_sites,
+                         char *str);
+
+void destroy_haplotype_table(haplotype_table **table_double_ptr);
+
+#endif
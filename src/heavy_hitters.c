@@ -0,0 +1,312 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "heavy_hitters.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const uint32_t EMPTY_SLOT = UINT32_MAX;
+
+/* The kept keys form a min-heap on their counts, so the one to replace
+   is always at the root, and an open-addressed index maps each key to
+   its counter. Counters and index slots refer to each other so either
+   can move. */
+struct counter {
+    heavy_hitter hitter;
+    uint32_t slot;
+};
+
+struct heavy_hitters {
+    size_t capacity;
+    size_t num_counters;
+    size_t num_slots;
+    uint64_t total;
+    heavy_hitter *sorted;
+    struct counter *heap;
+    uint32_t *slots;
+    uint32_t sketch[HITTER_SKETCH_DEPTH][HITTER_SKETCH_WIDTH];
+};
+
+
+static void *checked_calloc(size_t count,
+                            size_t size)
+{
+    void *ptr = calloc(count, size);
+
+    if (ptr == NULL) {
+        perror("Error: memory allocation failed for heavy hitters");
+    }
+
+    return ptr;
+}
+
+
+heavy_hitters *init_heavy_hitters(size_t capacity)
+{
+    heavy_hitters *hitters = checked_calloc(1, sizeof(*hitters));
+
+    if (hitters == NULL) {
+        return NULL;
+    }
+
+    hitters->capacity = capacity;
+    hitters->num_slots = 4;
+
+    while (hitters->num_slots < 2 * capacity) {
+        hitters->num_slots *= 2;
+    }
+
+    hitters->heap = checked_calloc(capacity, sizeof(*hitters->heap));
+    hitters->slots = checked_calloc(hitters->num_slots, sizeof(*hitters->slots));
+
+    if (hitters->heap == NULL || hitters->slots == NULL) {
+        destroy_heavy_hitters(&hitters);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < hitters->num_slots; i++) {
+        hitters->slots[i] = EMPTY_SLOT;
+    }
+
+    return hitters;
+}
+
+
+static inline uint64_t mix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+
+    return x ^ (x >> 31);
+}
+
+
+static inline size_t home_slot(const heavy_hitters *self,
+                               uint64_t key)
+{
+    return mix64(key) & (self->num_slots - 1);
+}
+
+
+static size_t find_slot(const heavy_hitters *self,
+                        uint64_t key)
+{
+    size_t slot = home_slot(self, key);
+
+    while (self->slots[slot] != EMPTY_SLOT && self->heap[self->slots[slot]].hitter.key != key) {
+        slot = (slot + 1) & (self->num_slots - 1);
+    }
+
+    return slot;
+}
+
+
+/* Backward-shift deletion, so that probe sequences stay unbroken
+   without tombstones */
+static void remove_slot(heavy_hitters *self,
+                        size_t slot)
+{
+    size_t mask = self->num_slots - 1;
+    size_t hole = slot;
+
+    for (size_t next = (hole + 1) & mask; self->slots[next] != EMPTY_SLOT; next = (next + 1) & mask) {
+        size_t home = home_slot(self, self->heap[self->slots[next]].hitter.key);
+
+        // The entry may fill the hole if the hole lies on its probe path
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            self->slots[hole] = self->slots[next];
+            self->heap[self->slots[hole]].slot = (uint32_t) hole;
+            hole = next;
+        }
+    }
+
+    self->slots[hole] = EMPTY_SLOT;
+}
+
+
+static inline void swap_counters(heavy_hitters *self,
+                                 size_t a,
+                                 size_t b)
+{
+    struct counter tmp = self->heap[a];
+
+    self->heap[a] = self->heap[b];
+    self->heap[b] = tmp;
+    self->slots[self->heap[a].slot] = (uint32_t) a;
+    self->slots[self->heap[b].slot] = (uint32_t) b;
+}
+
+
+static void sift_down(heavy_hitters *self,
+                      size_t i)
+{
+    for (;;) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+
+        if (left < self->num_counters &&
+            self->heap[left].hitter.count < self->heap[smallest].hitter.count) {
+            smallest = left;
+        }
+        if (right < self->num_counters &&
+            self->heap[right].hitter.count < self->heap[smallest].hitter.count) {
+            smallest = right;
+        }
+
+        if (smallest == i) {
+            return;
+        }
+
+        swap_counters(self, i, smallest);
+        i = smallest;
+    }
+}
+
+
+static void sift_up(heavy_hitters *self,
+                    size_t i)
+{
+    while (i > 0 && self->heap[(i - 1) / 2].hitter.count > self->heap[i].hitter.count) {
+        swap_counters(self, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+
+/* Increments only the sketch cells that hold the key's current
+   estimate, which cannot lower any estimate but adds less to keys that
+   share the others */
+static uint64_t sketch_add(heavy_hitters *self,
+                           uint64_t key)
+{
+    uint64_t hash = mix64(key);
+    uint32_t *cells[HITTER_SKETCH_DEPTH];
+    uint32_t estimate = UINT32_MAX;
+
+    for (size_t d = 0; d < HITTER_SKETCH_DEPTH; d++) {
+        cells[d] = &(self->sketch[d][(hash >> (16 * d)) & (HITTER_SKETCH_WIDTH - 1)]);
+
+        if (*cells[d] < estimate) {
+            estimate = *cells[d];
+        }
+    }
+
+    if (estimate == UINT32_MAX) {
+        return estimate;
+    }
+
+    for (size_t d = 0; d < HITTER_SKETCH_DEPTH; d++) {
+        if (*cells[d] == estimate) {
+            (*cells[d])++;
+        }
+    }
+
+    return (uint64_t) estimate + 1;
+}
+
+
+void heavy_hitters_add(heavy_hitters *self,
+                       uint64_t key)
+{
+    uint64_t estimate = sketch_add(self, key);
+
+    self->total++;
+
+    // A kept key's estimate has only grown past its counter, so a key
+    // estimated no higher than the smallest counter is not kept
+    if (self->num_counters == self->capacity && estimate <= self->heap[0].hitter.count) {
+        return;
+    }
+
+    size_t slot = find_slot(self, key);
+
+    if (self->slots[slot] != EMPTY_SLOT) {
+        size_t i = self->slots[slot];
+
+        self->heap[i].hitter.count = estimate;
+        sift_down(self, i);
+        return;
+    }
+
+    if (self->num_counters < self->capacity) {
+        size_t i = self->num_counters++;
+
+        self->heap[i].hitter = (heavy_hitter) {.key = key, .count = estimate};
+        self->heap[i].slot = (uint32_t) slot;
+        self->slots[slot] = (uint32_t) i;
+        sift_up(self, i);
+        return;
+    }
+
+    // The smallest counter is taken over by the new key
+    remove_slot(self, self->heap[0].slot);
+    slot = find_slot(self, key);
+
+    self->heap[0].hitter = (heavy_hitter) {.key = key, .count = estimate};
+    self->heap[0].slot = (uint32_t) slot;
+    self->slots[slot] = 0;
+    sift_down(self, 0);
+}
+
+
+uint64_t heavy_hitters_total(const heavy_hitters *self)
+{
+    return self->total;
+}
+
+
+static int compare_hitters(const void *a,
+                           const void *b)
+{
+    const heavy_hitter *hitter_a = a;
+    const heavy_hitter *hitter_b = b;
+
+    if (hitter_a->count != hitter_b->count) {
+        return (hitter_a->count < hitter_b->count) ? 1 : -1;
+    }
+
+    return (hitter_a->key > hitter_b->key) - (hitter_a->key < hitter_b->key);
+}
+
+
+const heavy_hitter *heavy_hitters_top(heavy_hitters *self,
+                                      size_t *num_hitters)
+{
+    free(self->sorted);
+    self->sorted = checked_calloc(self->num_counters + 1, sizeof(*self->sorted));
+    *num_hitters = 0;
+
+    if (self->sorted == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < self->num_counters; i++) {
+        self->sorted[i] = self->heap[i].hitter;
+    }
+
+    qsort(self->sorted, self->num_counters, sizeof(*self->sorted), compare_hitters);
+    *num_hitters = self->num_counters;
+
+    return self->sorted;
+}
+
+
+void destroy_heavy_hitters(heavy_hitters **hitters_double_ptr)
+{
+    heavy_hitters *hitters = *hitters_double_ptr;
+
+    free(hitters->sorted);
+    free(hitters->heap);
+    free(hitters->slots);
+    free(hitters);
+
+    *hitters_double_ptr = NULL;
+}
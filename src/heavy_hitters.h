@@ -0,0 +1,46 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef HEAVY_HITTERS_H
+#define HEAVY_HITTERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    HITTER_SKETCH_DEPTH = 4,
+    HITTER_SKETCH_WIDTH = 4096
+};
+
+typedef struct heavy_hitter {
+    uint64_t key;
+    uint64_t count;
+} heavy_hitter;
+
+/* The most frequent keys of a stream in fixed memory: every key is
+   counted in a count-min sketch (with conservative updates), and the
+   'capacity' keys with the highest estimates so far are kept in a
+   min-heap. Most keys of a long tail never reach the heap, so adding
+   one costs a few cache-resident increments. Counts never
+   underestimate, and overestimate by at most about
+   e * total / HITTER_SKETCH_WIDTH. */
+typedef struct heavy_hitters heavy_hitters;
+
+/* Returns NULL (after reporting the error) if memory runs out */
+heavy_hitters *init_heavy_hitters(size_t capacity);
+
+void heavy_hitters_add(heavy_hitters *self,
+                       uint64_t key);
+
+uint64_t heavy_hitters_total(const heavy_hitters *self);
+
+/* The counters from the largest count down (NULL if memory runs out);
+   the array is owned by the sketch and valid until the next call */
+const heavy_hitter *heavy_hitters_top(heavy_hitters *self,
+                                      size_t *num_hitters);
+
+void destroy_heavy_hitters(heavy_hitters **hitters_double_ptr);
+
+#endif
@@ -0,0 +1,307 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "job.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { WATCH_POLL_SECONDS = 1 };
+
+const char OUTPUT_ALL_NOTICE[] = "Outputting all barcode combinations ('-a' option). "
+                                 "Refer to the standard barcode number labels from 1-48.";
+
+
+void job_options(const args *job,
+                 fsdm_options *options)
+{
+    fsdm_default_options(options);
+    options->bc_mismatches = job->bc_mismatches;
+    options->ad_fl_mismatches = job->ad_fl_mismatches;
+    options->ed_threshold = job->ed_threshold;
+    options->max_shift = job->max_shift;
+    options->bc_scan = job->bc_scan;
+    options->bc_indels = job->bc_indels;
+    options->template_align = job->template_align;
+    options->any_orientation = job->any_orientation;
+    options->output_all = job->output_all;
+    options->umi_memory = (size_t) job->umi_memory << 20;
+    options->kernel = job->kernel;
+}
+
+
+/* Files whose names start with '.' are taken to be partial copies */
+static bool is_fastq_name(const char *name)
+{
+    return name[0] != '.' && (strstr(name, ".fastq") != NULL || strstr(name, ".fq") != NULL);
+}
+
+
+/* The name of the R2 file of an R1 file, in which the last "_R1" before
+   a '_' or '.' is "_R2"; NULL if 'name' is not of an R1 file */
+static char *mate_name(const char *name)
+{
+    const char *r1 = NULL;
+
+    for (const char *found = strstr(name, "_R1"); found != NULL; found = strstr(found + 1, "_R1")) {
+        if (found[3] == '_' || found[3] == '.') {
+            r1 = found;
+        }
+    }
+
+    if (r1 == NULL) {
+        return NULL;
+    }
+
+    char *mate = strdup(name);
+
+    if (mate != NULL) {
+        mate[r1 - name + 2] = '2';
+    }
+
+    return mate;
+}
+
+
+static int compare_names(const void *a,
+                         const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+
+/* Sets 'input' to the first input of the directory (by name) that is not
+   in 'done': a FASTQ file if interleaved, or else an R1 file and its R2
+   file once both exist. Returns false (after reporting the error) if the
+   directory cannot be read or memory runs out. */
+static bool next_watched_input(const char *dir_path,
+                               bool interleaved,
+                               char **done,
+                               size_t num_done,
+                               char **input)
+{
+    DIR *dir = opendir(dir_path);
+
+    if (dir == NULL) {
+        fprintf(stderr, "Error: unable to read directory '%s': %s\n", dir_path, strerror(errno));
+        return false;
+    }
+
+    char **names = NULL;
+    size_t num_names = 0;
+    bool ok = true;
+    struct dirent *entry;
+
+    while (ok && (entry = readdir(dir)) != NULL) {
+        if (! is_fastq_name(entry->d_name)) {
+            continue;
+        }
+
+        char **grown = realloc(names, (num_names + 1) * sizeof(*names));
+
+        ok = grown != NULL && (grown[num_names] = strdup(entry->d_name)) != NULL;
+        names = grown ? grown : names;
+        num_names += ok;
+    }
+
+    closedir(dir);
+    qsort(names, num_names, sizeof(*names), compare_names);
+
+    for (size_t i = 0; i < num_names && ok && input[0] == NULL; i++) {
+        bool is_done = false;
+
+        for (size_t j = 0; j < num_done && ! is_done; j++) {
+            is_done = strcmp(done[j], names[i]) == 0;
+        }
+
+        char *mate = interleaved ? NULL : mate_name(names[i]);
+
+        if (is_done || (! interleaved && (mate == NULL ||
+                                          ! bsearch(&mate, names, num_names, sizeof(*names), compare_names)))) {
+            free(mate);
+            continue;
+        }
+
+        input[0] = names[i];
+        input[1] = mate;
+        names[i] = NULL;
+    }
+
+    for (size_t i = 0; i < num_names; i++) {
+        free(names[i]);
+    }
+
+    free(names);
+
+    if (! ok) {
+        perror("Error: memory allocation failed for directory listing");
+    }
+
+    return ok;
+}
+
+
+static char *watched_path(const char *dir_path,
+                          const char *name)
+{
+    char *path = malloc(strlen(dir_path) + strlen(name) + 2);
+
+    if (path != NULL) {
+        sprintf(path, "%s/%s", dir_path, name);
+    }
+
+    return path;
+}
+
+
+/* Classifies the inputs of the watched directory as they appear, until
+   none has appeared for --follow seconds since the last one ended */
+static bool watch_directory(fsdm_counts *counts,
+                            const args *job)
+{
+    char **done = NULL;
+    size_t num_done = 0;
+    time_t last_input = time(NULL);
+    bool ok = true;
+
+    while (ok) {
+        char *input[2] = {NULL, NULL};
+
+        ok = next_watched_input(job->watch_dir, job->interleaved, done, num_done, input);
+
+        if (! ok) {
+            break;
+        }
+
+        if (input[0] == NULL) {
+            if (time(NULL) - last_input >= job->follow) {
+                break;
+            }
+
+            sleep(WATCH_POLL_SECONDS);
+            continue;
+        }
+
+        char *paths[2] = {
+            watched_path(job->watch_dir, input[0]),
+            input[1] ? watched_path(job->watch_dir, input[1]) : NULL
+        };
+        char **grown = realloc(done, (num_done + 1) * sizeof(*done));
+
+        done = grown ? grown : done;
+        ok = grown != NULL && paths[0] != NULL && (input[1] == NULL || paths[1] != NULL);
+
+        if (! ok) {
+            perror("Error: memory allocation failed for directory listing");
+        }
+        else {
+            done[num_done++] = input[0];
+            input[0] = NULL;
+            ok = fsdm_classify_fastq(counts, (const char **) paths, job->interleaved, job->io_stats);
+            last_input = time(NULL);
+        }
+
+        free(paths[0]);
+        free(paths[1]);
+        free(input[0]);
+        free(input[1]);
+    }
+
+    for (size_t i = 0; i < num_done; i++) {
+        free(done[i]);
+    }
+
+    free(done);
+
+    return ok;
+}
+
+
+/* The total size of the FASTQ inputs, from which the metrics estimate
+   the time remaining; 0 if it is not known in advance, as for inputs
+   that are followed, watched for or not regular files */
+static uint64_t expected_input_bytes(const args *job)
+{
+    int num_inputs = job->num_fastq_pairs * (job->interleaved ? 1 : 2);
+    uint64_t total = 0;
+
+    if (job->follow > 0 || job->watch_dir) {
+        return 0;
+    }
+
+    for (int i = 0; i < num_inputs; i++) {
+        struct stat file_info;
+
+        if (strcmp(job->fastq_files[i], "-") == 0 ||
+            stat(job->fastq_files[i], &file_info) != 0 || ! S_ISREG(file_info.st_mode)) {
+            return 0;
+        }
+
+        total += (uint64_t) file_info.st_size;
+    }
+
+    return total;
+}
+
+
+fsdm_counts *run_job(const fsdm_classifier *classifier,
+                     const args *job,
+                     FILE *report_fp)
+{
+    fsdm_counts *counts = fsdm_counts_new(classifier);
+
+    if (counts == NULL) {
+        return NULL;
+    }
+
+    bool ok = (job->top == 0 || fsdm_counts_track_unmatched(counts, (size_t) job->top)) &&
+              (job->log_file == NULL || fsdm_counts_open_log(counts, job->log_file)) &&
+              (job->snapshot == 0 ||
+               fsdm_counts_snapshot(counts, job->outfile, job->snapshot, job->umi_collapse)) &&
+              (! job->perf_counters || fsdm_counts_profile(counts)) &&
+              (job->metrics_file == NULL ||
+               fsdm_counts_start_metrics(counts, job->metrics_file, job->metrics_interval,
+                                         expected_input_bytes(job)));
+
+    fsdm_counts_follow(counts, job->follow);
+
+    int inputs_per_pair = job->interleaved ? 1 : 2;
+
+    for (int i = 0; i < job->num_fastq_pairs && ok; i++) {
+        ok = fsdm_classify_fastq(counts, job->fastq_files + inputs_per_pair * i,
+                                 job->interleaved, job->io_stats);
+    }
+
+    if (ok && job->watch_dir) {
+        ok = watch_directory(counts, job);
+    }
+
+    // The last metrics are written even for a failed run
+    ok = fsdm_counts_stop_metrics(counts) && ok;
+
+    if (! fsdm_counts_close_log(counts) || ! ok) {
+        fsdm_counts_free(&counts);
+        return NULL;
+    }
+
+    fsdm_counts_print_unmatched(counts, report_fp);
+    fsdm_counts_print_profile(counts, report_fp);
+
+    if (fsdm_counts_estimated(counts)) {
+        fprintf(report_fp, "Warning: distinct UMIs exceeded --umi-memory and are "
+                "HyperLogLog estimates, without UMI collapsing\n");
+    }
+
+    return counts;
+}
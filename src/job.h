@@ -0,0 +1,28 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef JOB_H
+#define JOB_H
+
+#include "args.h"
+#include "fsdm.h"
+
+#include <stdio.h>
+
+/* Printed to stdout before the counts of a run with '-a' */
+extern const char OUTPUT_ALL_NOTICE[];
+
+/* The classifier options of a run of the command line */
+extern void job_options(const args *job,
+                        fsdm_options *options);
+
+/* Classifies the FASTQ inputs of a run, as the command line does, and
+   writes its --top report and warnings to 'report_fp'. Returns the counts,
+   for the caller to write, or NULL (after reporting the error). */
+extern fsdm_counts *run_job(const fsdm_classifier *classifier,
+                            const args *job,
+                            FILE *report_fp);
+
+#endif
@@ -98,6 +98,20 @@ typedef struct __kstring_t {
 #define kroundup32(x) (--(x), (x)|=(x)>>1, (x)|=(x)>>2, (x)|=(x)>>4, (x)|=(x)>>8, (x)|=(x)>>16, ++(x))
 #endif
 
+/* Index of the first '\n' in a buffer, or its length if there is none;
+   may be defined before including this file to use a faster scan (as a
+   macro, which can refer to the stream as 'ks') */
+#ifndef KS_FIND_NEWLINE
+static inline size_t ks_find_newline(const char *buf, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; ++i)
+		if (buf[i] == '\n') break;
+	return i;
+}
+#define KS_FIND_NEWLINE ks_find_newline
+#endif
+
 #define __KS_GETUNTIL(SCOPE, __read) \
 	SCOPE int ks_getuntil2(kstream_t *ks, int delimiter, kstring_t *str, int *dret, int append) \
 	{ \
@@ -115,8 +129,7 @@ typedef struct __kstring_t {
 				} else break; \
 			} \
 			if (delimiter == KS_SEP_LINE) { \
-				for (i = ks->begin; i < ks->end; ++i) \
-					if (ks->buf[i] == '\n') break; \
+				i = ks->begin + (int)KS_FIND_NEWLINE((const char*)ks->buf + ks->begin, ks->end - ks->begin); \
 			} else if (delimiter > KS_SEP_MAX) { \
 				for (i = ks->begin; i < ks->end; ++i) \
 					if (ks->buf[i] == delimiter) break; \
@@ -0,0 +1,321 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "library_index.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* An index is this header, then each section at the next multiple of
+   INDEX_ALIGNMENT. The tables are written as they lie in memory, so the
+   header records the byte order and word size they were written with.
+   'crc' is the CRC-32 of the whole file with 'crc' itself as 0. */
+static const char INDEX_MAGIC[8] = "FSDMIDX";
+
+enum {
+    INDEX_ALIGNMENT = 64,
+    INDEX_BYTE_ORDER = 0x01020304
+};
+
+struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t word_size;
+    uint32_t num_sections;
+    index_options options;
+    uint64_t file_size;
+    uint32_t crc;
+    uint32_t reserved;
+    struct {
+        uint64_t offset;
+        uint64_t length;
+    } sections[NUM_INDEX_SECTIONS];
+};
+
+struct library_index {
+    const char *path;
+    const uint8_t *data;
+    size_t size;
+    const struct index_header *header;
+};
+
+
+static inline uint64_t aligned_offset(uint64_t offset)
+{
+    return (offset + INDEX_ALIGNMENT - 1) & ~(uint64_t) (INDEX_ALIGNMENT - 1);
+}
+
+
+static uLong update_crc(uLong crc,
+                        const void *data,
+                        size_t length)
+{
+    const Bytef *bytes = data;
+
+    // crc32() takes at most a uInt of data at a time
+    while (length > 0) {
+        uInt block = (length > (1u << 30)) ? (1u << 30) : (uInt) length;
+
+        crc = crc32(crc, bytes, block);
+        bytes += block;
+        length -= block;
+    }
+
+    return crc;
+}
+
+
+static bool write_bytes(FILE *fp,
+                        const void *data,
+                        size_t length,
+                        uLong *crc)
+{
+    *crc = update_crc(*crc, data, length);
+
+    return length == 0 || fwrite(data, 1, length, fp) == length;
+}
+
+
+bool write_library_index(const char *path,
+                         const index_options *options,
+                         const index_section *sections)
+{
+    struct index_header header;
+    uint64_t offset = aligned_offset(sizeof(header));
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = LIBRARY_INDEX_VERSION;
+    header.byte_order = INDEX_BYTE_ORDER;
+    header.word_size = sizeof(size_t);
+    header.num_sections = NUM_INDEX_SECTIONS;
+    header.options = *options;
+
+    for (size_t i = 0; i < NUM_INDEX_SECTIONS; i++) {
+        header.sections[i].offset = offset;
+        header.sections[i].length = sections[i].length;
+        offset = aligned_offset(offset + sections[i].length);
+    }
+
+    header.file_size = offset;
+
+    size_t path_length = strlen(path);
+    char *temp_path = malloc(path_length + 5);
+
+    if (temp_path == NULL) {
+        perror("Error: memory allocation failed for index");
+        return false;
+    }
+
+    memcpy(temp_path, path, path_length);
+    memcpy(temp_path + path_length, ".tmp", 5);
+
+    FILE *fp = fopen(temp_path, "wb");
+
+    if (fp == NULL) {
+        fprintf(stderr, "Error: unable to create index '%s': %s\n", temp_path, strerror(errno));
+        free(temp_path);
+        return false;
+    }
+
+    static const uint8_t padding[INDEX_ALIGNMENT] = {0};
+    uLong crc = crc32(0L, Z_NULL, 0);
+    uint64_t position = sizeof(header);
+    bool ok = write_bytes(fp, &header, sizeof(header), &crc);
+
+    for (size_t i = 0; i < NUM_INDEX_SECTIONS && ok; i++) {
+        uint64_t end = header.sections[i].offset + header.sections[i].length;
+
+        ok = write_bytes(fp, padding, header.sections[i].offset - position, &crc) &&
+             write_bytes(fp, sections[i].data, sections[i].length, &crc);
+        position = end;
+    }
+
+    ok = ok && write_bytes(fp, padding, header.file_size - position, &crc);
+
+    // The CRC covers the header with a 'crc' of 0, as written above
+    header.crc = (uint32_t) crc;
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fp) == 1;
+
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+
+    if (ok && rename(temp_path, path) != 0) {
+        ok = false;
+    }
+
+    if (! ok) {
+        fprintf(stderr, "Error: failed writing index '%s': %s\n", path, strerror(errno));
+        remove(temp_path);
+    }
+
+    free(temp_path);
+
+    return ok;
+}
+
+
+bool is_library_index(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    char magic[sizeof(INDEX_MAGIC)];
+
+    if (fp == NULL) {
+        return false;
+    }
+
+    bool is_index = fread(magic, sizeof(magic), 1, fp) == 1 &&
+                    memcmp(magic, INDEX_MAGIC, sizeof(magic)) == 0;
+
+    fclose(fp);
+
+    return is_index;
+}
+
+
+static bool valid_index(const library_index *index)
+{
+    const struct index_header *header = index->header;
+
+    if (header->version != LIBRARY_INDEX_VERSION) {
+        fprintf(stderr, "Error: index '%s' is of version %u, not %d; rebuild it with 'fsdm index'\n",
+                index->path, header->version, LIBRARY_INDEX_VERSION);
+        return false;
+    }
+
+    if (header->byte_order != INDEX_BYTE_ORDER || header->word_size != sizeof(size_t)) {
+        fprintf(stderr, "Error: index '%s' was built on another machine architecture; "
+                "rebuild it with 'fsdm index'\n", index->path);
+        return false;
+    }
+
+    bool intact = header->num_sections == NUM_INDEX_SECTIONS && header->file_size == index->size;
+
+    for (size_t i = 0; i < NUM_INDEX_SECTIONS && intact; i++) {
+        uint64_t offset = header->sections[i].offset;
+        uint64_t length = header->sections[i].length;
+
+        intact = offset % INDEX_ALIGNMENT == 0 && offset >= sizeof(*header) &&
+                 offset <= index->size && length <= index->size - offset;
+    }
+
+    if (intact) {
+        struct index_header unchecked = *header;
+
+        unchecked.crc = 0;
+
+        uLong crc = update_crc(crc32(0L, Z_NULL, 0), &unchecked, sizeof(unchecked));
+
+        crc = update_crc(crc, index->data + sizeof(unchecked), index->size - sizeof(unchecked));
+        intact = (uint32_t) crc == header->crc;
+    }
+
+    if (! intact) {
+        fprintf(stderr, "Error: index '%s' is truncated or corrupt\n", index->path);
+        return false;
+    }
+
+    return true;
+}
+
+
+library_index *map_library_index(const char *path)
+{
+    library_index *index = calloc(1, sizeof(*index));
+
+    if (index == NULL) {
+        perror("Error: memory allocation failed for index");
+        return NULL;
+    }
+
+    index->path = path;
+
+    int fd = open(path, O_RDONLY);
+    struct stat file_info;
+
+    if (fd < 0 || fstat(fd, &file_info) != 0) {
+        fprintf(stderr, "Error: unable to read index '%s': %s\n", path, strerror(errno));
+
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        free(index);
+        return NULL;
+    }
+
+    if ((size_t) file_info.st_size < sizeof(struct index_header)) {
+        fprintf(stderr, "Error: index '%s' is truncated or corrupt\n", path);
+        close(fd);
+        free(index);
+        return NULL;
+    }
+
+    index->size = (size_t) file_info.st_size;
+    index->data = mmap(NULL, index->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (index->data == MAP_FAILED) {
+        fprintf(stderr, "Error: unable to map index '%s': %s\n", path, strerror(errno));
+        free(index);
+        return NULL;
+    }
+
+    index->header = (const struct index_header *) index->data;
+
+    if (memcmp(index->header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0) {
+        fprintf(stderr, "Error: '%s' is not an fsdm index\n", path);
+        unmap_library_index(&index);
+        return NULL;
+    }
+
+    if (! valid_index(index)) {
+        unmap_library_index(&index);
+        return NULL;
+    }
+
+    return index;
+}
+
+
+const index_options *library_index_options(const library_index *self)
+{
+    return &(self->header->options);
+}
+
+
+index_section library_index_section(const library_index *self,
+                                    size_t section)
+{
+    index_section view = {
+        .data = self->data + self->header->sections[section].offset,
+        .length = self->header->sections[section].length
+    };
+
+    return view;
+}
+
+
+void unmap_library_index(library_index **index_double_ptr)
+{
+    library_index *index = *index_double_ptr;
+
+    munmap((void *) index->data, index->size);
+    free(index);
+
+    *index_double_ptr = NULL;
+}
@@ -0,0 +1,65 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef LIBRARY_INDEX_H
+#define LIBRARY_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum { LIBRARY_INDEX_VERSION = 1 };
+
+/* What an index holds: the library FASTA file as given (its prototypes,
+   alleles and barcodes), and the images of the barcode lookup tables
+   built from it, which runs use in place */
+enum {
+    INDEX_FASTA,
+    INDEX_HASH_TABLE,
+    INDEX_AUTOMATON_1,
+    INDEX_AUTOMATON_2,
+    NUM_INDEX_SECTIONS
+};
+
+/* The options that the lookup tables were built for */
+typedef struct index_options {
+    int32_t bc_mismatches;
+    int32_t bc_scan;
+    int32_t bc_indels;
+    int32_t output_all;
+} index_options;
+
+/* Absent sections have a length of 0 */
+typedef struct index_section {
+    const void *data;
+    size_t length;
+} index_section;
+
+/* Writes the sections to 'path', through a temporary file that replaces
+   it only once complete. Returns false (after reporting the error) if
+   it cannot be written. */
+bool write_library_index(const char *path,
+                         const index_options *options,
+                         const index_section *sections);
+
+/* True if 'path' starts like an index (of any version) */
+bool is_library_index(const char *path);
+
+/* A read-only memory map of an index. Every section starts on a 64-byte
+   boundary, so the tables can be used where they lie. */
+typedef struct library_index library_index;
+
+/* Returns NULL (after reporting the error) if the index cannot be read,
+   is of another version or machine architecture, or fails its CRC-32 */
+library_index *map_library_index(const char *path);
+
+const index_options *library_index_options(const library_index *self);
+
+index_section library_index_section(const library_index *self,
+                                    size_t section);
+
+void unmap_library_index(library_index **index_double_ptr);
+
+#endif
@@ -0,0 +1,212 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "locus_index.h"
+
+#include "packed_seq.h"
+#include "parse_seq.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const int32_t EMPTY_SLOT = -1;
+static const int32_t SHARED_KMER = -2;
+
+struct locus_entry {
+    uint32_t kmer;
+    int32_t locus;
+    long position;
+};
+
+struct locus_index {
+    size_t num_loci;
+    size_t num_slots;
+    long first_position;
+    long last_position;
+    struct locus_entry entries[];
+};
+
+
+static inline size_t locus_slot(uint32_t kmer,
+                                size_t num_slots)
+{
+    uint32_t hash = kmer * 2654435769UL;
+
+    return (hash ^ (hash >> 16)) & (num_slots - 1);
+}
+
+
+static inline const struct locus_entry *find_entry(const locus_index *self,
+                                                   uint32_t kmer)
+{
+    size_t slot = locus_slot(kmer, self->num_slots);
+
+    while (self->entries[slot].locus != EMPTY_SLOT && self->entries[slot].kmer != kmer) {
+        slot = (slot + 1) & (self->num_slots - 1);
+    }
+
+    return &(self->entries[slot]);
+}
+
+
+static void add_entry(locus_index *self,
+                      uint32_t kmer,
+                      int32_t locus,
+                      long position)
+{
+    struct locus_entry *entry = (struct locus_entry *) find_entry(self, kmer);
+
+    // A k-mer that occurs twice cannot tell the locus or its position
+    if (entry->locus != EMPTY_SLOT) {
+        entry->locus = SHARED_KMER;
+        return;
+    }
+
+    entry->kmer = kmer;
+    entry->locus = locus;
+    entry->position = position;
+
+    if (position < self->first_position) {
+        self->first_position = position;
+    }
+    if (position > self->last_position) {
+        self->last_position = position;
+    }
+}
+
+
+locus_index *build_locus_index(const panel_locus *loci,
+                               size_t num_loci)
+{
+    size_t num_kmers = 0;
+
+    for (size_t i = 0; i < num_loci; i++) {
+        for (size_t j = 0; j < loci[i].num_flanks; j++) {
+            num_kmers += loci[i].flanks[j].length;
+        }
+    }
+
+    size_t num_slots = 16;
+
+    while (num_slots < 2 * num_kmers) {
+        num_slots *= 2;
+    }
+
+    locus_index *index = malloc(sizeof(*index) + num_slots * sizeof(*index->entries));
+
+    if (index == NULL) {
+        perror("Error: memory allocation failed for locus index");
+        return NULL;
+    }
+
+    index->num_loci = num_loci;
+    index->num_slots = num_slots;
+    index->first_position = LONG_MAX;
+    index->last_position = 0;
+
+    for (size_t slot = 0; slot < num_slots; slot++) {
+        index->entries[slot].locus = EMPTY_SLOT;
+    }
+
+    for (size_t i = 0; i < num_loci; i++) {
+        for (size_t j = 0; j < loci[i].num_flanks; j++) {
+            const read_segment *flank = &(loci[i].flanks[j]);
+
+            for (size_t p = 0; p + LOCUS_K <= flank->length; p++) {
+                uint64_t kmer;
+
+                if (pack_kmer(flank->seq + p, LOCUS_K, &kmer)) {
+                    add_entry(index, (uint32_t) kmer, (int32_t) i, (long) (flank->offset + p));
+                }
+            }
+        }
+    }
+
+    bool recognisable[num_loci];
+    memset(recognisable, 0, sizeof(recognisable));
+
+    for (size_t slot = 0; slot < num_slots; slot++) {
+        if (index->entries[slot].locus >= 0) {
+            recognisable[index->entries[slot].locus] = true;
+        }
+    }
+
+    for (size_t i = 0; i < num_loci; i++) {
+        if (! recognisable[i]) {
+            fprintf(stderr, "Error: locus '%s' has no flanking %d-mer that is not shared "
+                    "with another locus\n", loci[i].name, LOCUS_K);
+            free(index);
+            return NULL;
+        }
+    }
+
+    return index;
+}
+
+
+int route_locus(const locus_index *self,
+                const packed_seq *read,
+                int shift,
+                int max_shift)
+{
+    unsigned votes[self->num_loci];
+    memset(votes, 0, sizeof(votes));
+
+    long first = self->first_position + shift - max_shift;
+    long last = self->last_position + shift + max_shift;
+
+    if (first < 0) {
+        first = 0;
+    }
+
+    for (long p = first; p <= last; p++) {
+        uint64_t kmer;
+
+        if (! packed_kmer_at(read, (size_t) p, LOCUS_K, &kmer)) {
+            continue;
+        }
+
+        const struct locus_entry *entry = find_entry(self, (uint32_t) kmer);
+
+        if (entry->locus < 0) {
+            continue;
+        }
+
+        long displacement = p - (entry->position + shift);
+
+        if (displacement >= -max_shift && displacement <= max_shift) {
+            votes[entry->locus]++;
+        }
+    }
+
+    int best = -1;
+    unsigned best_votes = 0;
+    bool tied = false;
+
+    for (size_t i = 0; i < self->num_loci; i++) {
+        if (votes[i] > best_votes) {
+            best = (int) i;
+            best_votes = votes[i];
+            tied = false;
+        }
+        else if (votes[i] == best_votes && best_votes > 0) {
+            tied = true;
+        }
+    }
+
+    return tied ? -1 : best;
+}
+
+
+void destroy_locus_index(locus_index **index_double_ptr)
+{
+    free(*index_double_ptr);
+    *index_double_ptr = NULL;
+}
@@ -0,0 +1,38 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef LOCUS_INDEX_H
+#define LOCUS_INDEX_H
+
+#include "packed_seq.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum { LOCUS_K = 12 };
+
+struct panel_locus;
+
+/* k-mers of the flanking sequences of every locus of a panel, each with
+   its locus and its position in the prototype, so a read is routed to
+   its locus before any of the locus's segments are compared */
+typedef struct locus_index locus_index;
+
+/* Returns NULL (after reporting which locus) if a locus has no flanking
+   k-mer of its own to be recognised by, or if memory runs out */
+locus_index *build_locus_index(const struct panel_locus *loci,
+                               size_t num_loci);
+
+/* Locus whose flank k-mers, found within 'max_shift' bases of where the
+   prototype puts them after 'shift', outnumber those of any other
+   locus, or -1 if there is none or a tie */
+int route_locus(const locus_index *self,
+                const packed_seq *read,
+                int shift,
+                int max_shift);
+
+void destroy_locus_index(locus_index **index_double_ptr);
+
+#endif
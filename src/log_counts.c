@@ -0,0 +1,250 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "log_counts.h"
+
+#include "argparse.h"
+#include "demultiplex.h"
+#include "haplotype_counts.h"
+#include "read_log.h"
+#include "umi_counts.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static void print_reasons(const uint64_t *num_pairs,
+                          FILE *fp)
+{
+    uint64_t total = 0;
+
+    for (size_t r = 0; r < NUM_LOG_REASONS; r++) {
+        total += num_pairs[r];
+    }
+
+    fprintf(fp, "Read pairs: %" PRIu64 "\n", total);
+
+    for (size_t r = 0; r < NUM_LOG_REASONS; r++) {
+        double percent = (total > 0) ? 100.0 * num_pairs[r] / total : 0.0;
+
+        fprintf(fp, "  %-18s%" PRIu64 " (%.2f%%)\n", LOG_REASON_NAMES[r], num_pairs[r], percent);
+    }
+}
+
+
+/* One tab-separated line per read pair, with the labels of its barcodes
+   (0 if not found), its allele or haplotype as in the count table, and
+   the edit distance of each check ('-' if not compared) */
+static void print_record(const count_layout *layout,
+                         const read_log_record *record,
+                         FILE *fp)
+{
+    int bc_labels[2];
+
+    for (size_t i = 0; i < 2; i++) {
+        bc_labels[i] = (record->bc[i] >= 0) ? layout->bc_labels[i][record->bc[i]] : 0;
+    }
+
+    fprintf(fp, "%" PRIu32 "\t%" PRIu64 "\t%s\t%s\t%d\t%d", record->input + 1, record->ordinal + 1,
+            LOG_REASON_NAMES[record->reason], record->swapped ? "swapped" : "forward",
+            bc_labels[0], bc_labels[1]);
+
+    if (record->reason != LOG_COUNTED) {
+        fprintf(fp, "\t-\t-");
+    }
+    else if (layout->num_loci > 0 || layout->num_sites > 1) {
+        size_t num_sites = (layout->num_loci > 0) ? layout->locus_sites[record->locus] : layout->num_sites;
+        char allele_str[MAX_ALLELE_SITES + 1];
+
+        haplotype_to_string(record->allele, num_sites, allele_str);
+        fprintf(fp, "\t%s\t%s", (layout->num_loci > 0) ? layout->locus_names[record->locus] : "-",
+                allele_str);
+    }
+    else {
+        fprintf(fp, "\t-\t%c", "ACGT"[record->allele]);
+    }
+
+    for (size_t mate = 0; mate < 2; mate++) {
+        fputc('\t', fp);
+
+        for (size_t i = 0; i < layout->num_checks[mate]; i++) {
+            uint8_t edits = record->segment_edits[mate][i];
+
+            if (i > 0) {
+                fputc(',', fp);
+            }
+
+            if (edits == READ_LOG_UNCHECKED) {
+                fputc('-', fp);
+            }
+            else {
+                fprintf(fp, "%u", edits);
+            }
+        }
+    }
+
+    fputc('\n', fp);
+}
+
+
+int log_counts_main(int argc,
+                    const char **argv)
+{
+    static const char *usage[] = {
+        "fsdm log-counts [options] <reads.log>",
+        NULL
+    };
+
+    static const char *description = "Recomputes the count table of an fsdm run from the "
+                                     "read log written with --log";
+
+    char *outfile = NULL;
+    int umi_collapse = 0;
+    int reasons = 0;
+    int records = 0;
+
+    struct argparse_option arguments[] = {
+        OPT_HELP(false),
+
+        OPT_GROUP("Options"),
+        OPT_STRING('o', NULL, &outfile,
+                   "Output file (results are printed to stdout if unspecified)",
+                   NULL, 0, 0),
+        OPT_BOOLEAN(0, "umi-collapse", &umi_collapse,
+                    "Collapse UMIs as 'fsdm --umi-collapse' does",
+                    NULL, 0, 0),
+        OPT_BOOLEAN(0, "reasons", &reasons,
+                    "Report the number of read pairs counted and rejected for each reason to stderr",
+                    NULL, 0, 0),
+        OPT_BOOLEAN(0, "records", &records,
+                    "Output every logged read pair (input, pair number, reason, orientation, barcodes, "
+                    "locus, allele and the edit distances of each mate's checks) instead of the counts",
+                    NULL, 0, 0),
+
+        OPT_END()
+    };
+
+    struct argparse parser;
+    argparse_init(&parser, arguments, usage, 0);
+    argparse_describe(&parser, description, NULL);
+
+    argc = argparse_parse(&parser, argc, argv);
+
+    if (argc != 1) {
+        fprintf(stderr, "Error: expected one read log\n\n\n");
+        argparse_usage(&parser, false);
+        return EXIT_FAILURE;
+    }
+
+    read_log_reader *reader = open_read_log_reader(argv[0]);
+
+    if (reader == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    const count_layout *layout = read_log_layout(reader);
+    size_t num_loci = (layout->num_loci > 0) ? layout->num_loci : 1;
+    size_t num_samples = (size_t) layout->num_bc[0] * layout->num_bc[1] * num_loci;
+
+    bc_counter *counter = calloc(1, sizeof(*counter) + layout->num_bc[0] *
+                                    layout->num_bc[1] * sizeof(*counter->counts));
+
+    if (counter == NULL) {
+        perror("Error: memory allocation failed for counts");
+        return EXIT_FAILURE;
+    }
+
+    counter->num_bc1 = layout->num_bc[0];
+    counter->num_bc2 = layout->num_bc[1];
+    counter->num_loci = num_loci;
+
+    if (layout->num_loci > 0 || layout->num_sites > 1) {
+        counter->haplotypes = init_haplotype_table(num_samples);
+
+        if (counter->haplotypes == NULL) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Every UMI is kept exactly, so they can always be collapsed
+    if (layout->umi_length > 0) {
+        counter->umis = init_umi_table(num_samples, layout->umi_length, 0);
+
+        if (counter->umis == NULL) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    FILE *output_fp = stdout;
+
+    if (outfile) {
+        output_fp = fopen(outfile, "w");
+
+        if (output_fp == NULL) {
+            fprintf(stderr, "Error: unable to open output file '%s': %s\n",
+                    outfile, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (records) {
+        fprintf(output_fp, "input\tpair\treason\torientation\tbc1\tbc2\tlocus\tallele\t"
+                "edits1\tedits2\n");
+    }
+
+    uint64_t num_pairs[NUM_LOG_REASONS] = {0};
+    read_log_record record;
+    int status;
+
+    while ((status = read_log_next(reader, &record)) > 0) {
+        num_pairs[record.reason]++;
+
+        if (records) {
+            print_record(layout, &record, output_fp);
+        }
+        else if (record.reason == LOG_COUNTED &&
+                 ! count_pair(counter, record.bc, record.locus, record.allele, record.umi)) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (status < 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (counter->umis) {
+        if (! tally_umis(counter, umi_collapse)) {
+            return EXIT_FAILURE;
+        }
+
+        destroy_umi_table(&(counter->umis));
+    }
+
+    if (reasons) {
+        print_reasons(num_pairs, stderr);
+    }
+
+    if (! records && ! print_counts(counter, layout, output_fp)) {
+        return EXIT_FAILURE;
+    }
+
+    if (outfile) {
+        fclose(output_fp);
+    }
+
+    if (counter->haplotypes) {
+        destroy_haplotype_table(&(counter->haplotypes));
+    }
+
+    free(counter);
+    close_read_log_reader(&reader);
+
+    return 0;
+}
@@ -0,0 +1,14 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef LOG_COUNTS_H
+#define LOG_COUNTS_H
+
+/* 'fsdm log-counts': recomputes the count table of a run from its read
+   log ('argv[0]' is the subcommand name) */
+extern int log_counts_main(int argc,
+                           const char **argv);
+
+#endif
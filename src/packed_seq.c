@@ -0,0 +1,369 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "packed_seq.h"
+
+#include "cpu_dispatch.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Base code + 1, so that 0 marks N and any other symbol */
+static const uint8_t BASE_CODES[256] = {
+    ['A'] = 1, ['C'] = 2, ['G'] = 3, ['T'] = 4
+};
+
+
+static inline uint64_t bits_at(const uint64_t *words,
+                               size_t bit_offset)
+{
+    size_t word = bit_offset >> 6;
+    unsigned shift = bit_offset & 63;
+    uint64_t bits = words[word] >> shift;
+
+    if (shift != 0) {
+        bits |= words[word + 1] << (64 - shift);
+    }
+
+    return bits;
+}
+
+
+/* Packs 32 bases into a word, setting a bit in 'n_bits' for each N;
+   N bases are stored as 0 */
+static inline uint64_t pack_block_scalar(const char *block,
+                                         uint32_t *n_bits)
+{
+    uint64_t bases = 0;
+    uint32_t n = 0;
+
+    for (size_t i = 0; i < 32; i++) {
+        unsigned code = BASE_CODES[(uint8_t) block[i]];
+
+        bases |= (uint64_t) (code - (code != 0)) << (2 * i);
+        n |= (uint32_t) (code == 0) << i;
+    }
+
+    *n_bits = n;
+
+    return bases;
+}
+
+
+#ifdef HAVE_X86_KERNELS
+/* Base codes indexed by the low nibble of 'A', 'C', 'G' and 'T' */
+#define NIBBLE_CODES 0, 0, 0, 1, 3, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0
+
+
+/* Codes are combined 2 -> 4 -> 8 bits with multiply-adds and the
+   bytes packed down, 16 bases at a time */
+TARGET_SSE42
+static inline uint64_t pack_block_sse42(const char *block,
+                                        uint32_t *n_bits)
+{
+    const __m128i nibble_codes = _mm_setr_epi8(NIBBLE_CODES);
+    uint64_t bases = 0;
+    uint32_t n = 0;
+
+    for (int half = 0; half < 2; half++) {
+        __m128i chars = _mm_loadu_si128((const __m128i *) (block + 16 * half));
+        __m128i valid = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8('A')),
+                                                  _mm_cmpeq_epi8(chars, _mm_set1_epi8('C'))),
+                                     _mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8('G')),
+                                                  _mm_cmpeq_epi8(chars, _mm_set1_epi8('T'))));
+        __m128i codes = _mm_and_si128(_mm_shuffle_epi8(nibble_codes, chars), valid);
+        __m128i pairs = _mm_maddubs_epi16(codes, _mm_set1_epi16(0x0401));
+        __m128i quads = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00100001));
+        __m128i packed = _mm_packus_epi16(_mm_packus_epi32(quads, quads), quads);
+
+        bases |= (uint64_t) (uint32_t) _mm_cvtsi128_si32(packed) << (32 * half);
+        n |= (uint32_t) (~_mm_movemask_epi8(valid) & 0xffff) << (16 * half);
+    }
+
+    *n_bits = n;
+
+    return bases;
+}
+
+
+TARGET_AVX2
+static inline uint64_t pack_block_avx2(const char *block,
+                                       uint32_t *n_bits)
+{
+    const __m256i nibble_codes = _mm256_setr_epi8(NIBBLE_CODES, NIBBLE_CODES);
+
+    __m256i chars = _mm256_loadu_si256((const __m256i *) block);
+    __m256i valid = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('A')),
+                                                    _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('C'))),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('G')),
+                                                    _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('T'))));
+    __m256i codes = _mm256_and_si256(_mm256_shuffle_epi8(nibble_codes, chars), valid);
+    __m256i pairs = _mm256_maddubs_epi16(codes, _mm256_set1_epi16(0x0401));
+    __m256i quads = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00100001));
+    __m256i packed = _mm256_packus_epi16(_mm256_packus_epi32(quads, quads), quads);
+
+    *n_bits = ~(uint32_t) _mm256_movemask_epi8(valid);
+
+    // Each 128-bit lane holds the packed bytes of 16 bases
+    return (uint64_t) (uint32_t) _mm256_extract_epi32(packed, 0) |
+           (uint64_t) (uint32_t) _mm256_extract_epi32(packed, 4) << 32;
+}
+#endif
+
+
+static KERNEL_INLINE void pack_words(const char *seq,
+                                     size_t length,
+                                     packed_seq *packed,
+                                     uint64_t (*pack_block)(const char *, uint32_t *))
+{
+    if (length > PACKED_MAX_BASES) {
+        length = PACKED_MAX_BASES;
+    }
+
+    packed->length = length;
+
+    size_t num_base_words = (length + 31) / 32;
+    size_t num_mask_words = (length + 63) / 64;
+
+    for (size_t w = 0; w < num_base_words; w++) {
+        size_t remaining = length - w * 32;
+        uint32_t n_bits;
+        uint64_t bases;
+
+        if (remaining >= 32) {
+            bases = pack_block(seq + w * 32, &n_bits);
+        }
+        else {
+            // Never read past the end of the sequence
+            char tail[32] = {0};
+
+            memcpy(tail, seq + w * 32, remaining);
+            bases = pack_block(tail, &n_bits);
+            bases &= (1ULL << (2 * remaining)) - 1;
+            n_bits &= (1U << remaining) - 1;
+        }
+
+        packed->bases[w] = bases;
+
+        if (w & 1) {
+            packed->n_mask[w / 2] |= (uint64_t) n_bits << 32;
+        }
+        else {
+            packed->n_mask[w / 2] = n_bits;
+        }
+    }
+
+    // Spare words keep reads across the last boundary well defined
+    packed->bases[num_base_words] = 0;
+    packed->n_mask[num_mask_words] = 0;
+}
+
+
+void pack_sequence_scalar(const char *seq,
+                          size_t length,
+                          packed_seq *packed)
+{
+    pack_words(seq, length, packed, pack_block_scalar);
+}
+
+
+#ifdef HAVE_X86_KERNELS
+TARGET_SSE42
+void pack_sequence_sse42(const char *seq,
+                         size_t length,
+                         packed_seq *packed)
+{
+    pack_words(seq, length, packed, pack_block_sse42);
+}
+
+
+TARGET_AVX2
+void pack_sequence_avx2(const char *seq,
+                        size_t length,
+                        packed_seq *packed)
+{
+    pack_words(seq, length, packed, pack_block_avx2);
+}
+
+
+/* 64 bases per step: masked loads cover the tail, and the two bits of
+   every code are scattered into place with PDEP */
+TARGET_AVX512BW
+void pack_sequence_avx512bw(const char *seq,
+                            size_t length,
+                            packed_seq *packed)
+{
+    const __m512i nibble_codes = _mm512_broadcast_i32x4(_mm_setr_epi8(NIBBLE_CODES));
+    const uint64_t EVEN_BITS = 0x5555555555555555ULL;
+    const uint64_t ODD_BITS = 0xaaaaaaaaaaaaaaaaULL;
+
+    if (length > PACKED_MAX_BASES) {
+        length = PACKED_MAX_BASES;
+    }
+
+    packed->length = length;
+
+    for (size_t i = 0; i < length; i += 64) {
+        size_t remaining = length - i;
+        __mmask64 in_range = (remaining >= 64) ? ~0ULL : (1ULL << remaining) - 1;
+
+        __m512i chars = _mm512_maskz_loadu_epi8(in_range, seq + i);
+        __mmask64 valid = _mm512_cmpeq_epi8_mask(chars, _mm512_set1_epi8('A')) |
+                          _mm512_cmpeq_epi8_mask(chars, _mm512_set1_epi8('C')) |
+                          _mm512_cmpeq_epi8_mask(chars, _mm512_set1_epi8('G')) |
+                          _mm512_cmpeq_epi8_mask(chars, _mm512_set1_epi8('T'));
+        __m512i codes = _mm512_maskz_shuffle_epi8(valid, nibble_codes, chars);
+        uint64_t low_bits = _mm512_test_epi8_mask(codes, _mm512_set1_epi8(1));
+        uint64_t high_bits = _mm512_test_epi8_mask(codes, _mm512_set1_epi8(2));
+
+        packed->bases[i / 32] = _pdep_u64(low_bits, EVEN_BITS) | _pdep_u64(high_bits, ODD_BITS);
+        packed->bases[i / 32 + 1] = _pdep_u64(low_bits >> 32, EVEN_BITS) |
+                                    _pdep_u64(high_bits >> 32, ODD_BITS);
+        packed->n_mask[i / 64] = ~valid & in_range;
+    }
+
+    packed->bases[(length + 31) / 32] = 0;
+    packed->n_mask[(length + 63) / 64] = 0;
+}
+#endif
+
+
+bool pack_kmer(const char *seq,
+               size_t k,
+               uint64_t *kmer)
+{
+    uint64_t bases = 0;
+
+    for (size_t i = 0; i < k; i++) {
+        unsigned code = BASE_CODES[(uint8_t) seq[i]];
+
+        if (code == 0) {
+            return false;
+        }
+
+        bases |= (uint64_t) (code - 1) << (2 * i);
+    }
+
+    *kmer = bases;
+
+    return true;
+}
+
+
+bool packed_kmer_at(const packed_seq *packed,
+                    size_t offset,
+                    size_t k,
+                    uint64_t *kmer)
+{
+    if (offset + k > packed->length) {
+        return false;
+    }
+
+    uint64_t n_bits = bits_at(packed->n_mask, offset);
+
+    if (k < 64) {
+        n_bits &= (1ULL << k) - 1;
+    }
+
+    if (n_bits != 0) {
+        return false;
+    }
+
+    uint64_t bases = bits_at(packed->bases, 2 * offset);
+
+    if (k < 32) {
+        bases &= (1ULL << (2 * k)) - 1;
+    }
+
+    *kmer = bases;
+
+    return true;
+}
+
+
+unsigned packed_base_at(const packed_seq *packed,
+                        size_t offset)
+{
+    if ((packed->n_mask[offset >> 6] >> (offset & 63)) & 1) {
+        return 4;
+    }
+
+    return (unsigned) (packed->bases[offset >> 5] >> (2 * (offset & 31))) & 3;
+}
+
+
+static KERNEL_INLINE int count_mismatches(const packed_seq *seq,
+                                          size_t offset,
+                                          const packed_seq *reference,
+                                          size_t length)
+{
+    if (offset + length > seq->length || length > reference->length) {
+        return -1;
+    }
+
+    int mismatches = 0;
+
+    for (size_t i = 0; i < length; i += 32) {
+        size_t num_bases = (length - i < 32) ? length - i : 32;
+        uint64_t base_bits = (num_bases == 32) ? ~0ULL : (1ULL << (2 * num_bases)) - 1;
+        uint64_t n_bits = (1ULL << num_bases) - 1;
+
+        if (((bits_at(seq->n_mask, offset + i) | bits_at(reference->n_mask, i)) & n_bits) != 0) {
+            return -1;
+        }
+
+        uint64_t diff = (bits_at(seq->bases, 2 * (offset + i)) ^
+                         bits_at(reference->bases, 2 * i)) & base_bits;
+
+        mismatches += POPCOUNT64((diff | (diff >> 1)) & 0x5555555555555555ULL);
+    }
+
+    return mismatches;
+}
+
+
+/* Windows are at most a few words, so the variants differ in using the
+   hardware population count rather than in vector width */
+int packed_mismatches_scalar(const packed_seq *seq,
+                             size_t offset,
+                             const packed_seq *reference,
+                             size_t length)
+{
+    return count_mismatches(seq, offset, reference, length);
+}
+
+
+#ifdef HAVE_X86_KERNELS
+TARGET_SSE42
+int packed_mismatches_sse42(const packed_seq *seq,
+                            size_t offset,
+                            const packed_seq *reference,
+                            size_t length)
+{
+    return count_mismatches(seq, offset, reference, length);
+}
+
+
+TARGET_AVX2
+int packed_mismatches_avx2(const packed_seq *seq,
+                           size_t offset,
+                           const packed_seq *reference,
+                           size_t length)
+{
+    return count_mismatches(seq, offset, reference, length);
+}
+
+
+TARGET_AVX512BW
+int packed_mismatches_avx512bw(const packed_seq *seq,
+                               size_t offset,
+                               const packed_seq *reference,
+                               size_t length)
+{
+    return count_mismatches(seq, offset, reference, length);
+}
+#endif
@@ -0,0 +1,64 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef PACKED_SEQ_H
+#define PACKED_SEQ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Sequences packed 2 bits per base (A=0, C=1, G=2, T=3), first base in
+   the lowest bits, 32 bases per word. Any other symbol is stored as 0
+   with a set bit in 'n_mask' (64 bases per word) and never matches. Each array
+   has one spare word so windows can be read across word boundaries. */
+enum { PACKED_MAX_BASES = 512 };
+
+typedef struct packed_seq {
+    size_t length;
+    uint64_t bases[PACKED_MAX_BASES / 32 + 1];
+    uint64_t n_mask[PACKED_MAX_BASES / 64 + 1];
+} packed_seq;
+
+#if defined __clang__ || defined __GNUC__ || defined __INTEL_COMPILER
+    #define POPCOUNT64(x) __builtin_popcountll(x)
+#else
+    static inline int POPCOUNT64(uint64_t x)
+    {
+        int count = 0;
+        for (; x; x &= x - 1) {
+            count++;
+        }
+        return count;
+    }
+#endif
+
+/* Number of differing bases between two packed k-mers (k <= 32) */
+static inline int kmer_mismatches(uint64_t kmer_1,
+                                  uint64_t kmer_2)
+{
+    uint64_t diff = kmer_1 ^ kmer_2;
+
+    return POPCOUNT64((diff | (diff >> 1)) & 0x5555555555555555ULL);
+}
+
+/* Packs a k-mer (k <= 32); returns false if it contains a base other
+   than A, C, G or T. */
+extern bool pack_kmer(const char *seq,
+                      size_t k,
+                      uint64_t *kmer);
+
+/* k-mer (k <= 32) starting at 'offset'; returns false if it runs past
+   the end of the sequence or contains an N. */
+extern bool packed_kmer_at(const packed_seq *packed,
+                           size_t offset,
+                           size_t k,
+                           uint64_t *kmer);
+
+/* 2-bit code of a base, or 4 for N and other symbols */
+extern unsigned packed_base_at(const packed_seq *packed,
+                               size_t offset);
+
+#endif
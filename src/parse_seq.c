@@ -3,8 +3,13 @@
    Mozilla Public License Version 2.0
 */
 
+#include "cpu_dispatch.h"
 #include "fs2_barcodes.h"
+#include "packed_seq.h"
 #include "parse_seq.h"
+#include "spacer_phase.h"
+#include "stream_reader.h"
+#include "umi_counts.h"
 #include "kseq.h"
 
 // #include <ctype.h>
@@ -14,9 +19,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <zlib.h>
 
-KSEQ_INIT(gzFile, gzread)
+KSEQ_INIT(stream_reader *, stream_reader_read)
 
 
 static inline void str_toupper(char *str)
@@ -45,6 +49,142 @@ static bool str_in_list(const char *str,
 }
 
 
+/* Parses a "spacerMIN-MAX" (or "spacerN") prototype segment */
+static bool parse_spacer(const char *segment,
+                         int *min_length,
+                         int *max_length)
+{
+    if (strncmp(segment, "spacer", 6) != 0) {
+        return false;
+    }
+
+    char *end = NULL;
+    long min = strtol(segment + 6, &end, 10);
+    long max = min;
+
+    if (end == segment + 6) {
+        return false;
+    }
+
+    if (*end == '-') {
+        const char *max_str = end + 1;
+
+        max = strtol(max_str, &end, 10);
+
+        if (end == max_str) {
+            return false;
+        }
+    }
+
+    if (*end != '\0' || min < 0 || max < min || max > MAX_SPACER_LENGTH) {
+        return false;
+    }
+
+    *min_length = (int) min;
+    *max_length = (int) max;
+
+    return true;
+}
+
+
+/* Parses a locus definition such as "FLANK[A/G]FLANK[C/T]FLANK" into
+   its flanks (offsets from the start of the locus) and allele sites */
+static bool parse_locus_definition(const char *definition,
+                                   panel_locus *locus)
+{
+    size_t position = 0;
+    size_t flank_start = 0;
+
+    locus->num_sites = 0;
+    locus->num_flanks = 0;
+
+    for (const char *c = definition; ; c++) {
+        // Each run of bases between sites is one flank
+        if (*c == '[' || *c == '\0') {
+            size_t flank_length = position - flank_start;
+
+            if (flank_length > 0) {
+                read_segment *flank = &(locus->flanks[locus->num_flanks++]);
+
+                memcpy(flank->seq, c - flank_length, flank_length);
+                flank->seq[flank_length] = '\0';
+                flank->offset = flank_start;
+                flank->length = flank_length;
+            }
+        }
+
+        if (*c == '\0') {
+            break;
+        }
+
+        if (*c != '[') {
+            if (strchr("ACGTN", *c) == NULL) {
+                return false;
+            }
+
+            position++;
+            continue;
+        }
+
+        if (locus->num_sites == MAX_ALLELE_SITES) {
+            return false;
+        }
+
+        char *alleles = locus->site_alleles[locus->num_sites];
+        size_t num_alleles = 0;
+
+        // "[A/G]": one to four distinct bases separated by slashes
+        for (c++; ; c += 2) {
+            if (*c == '\0' || strchr("ACGT", *c) == NULL || num_alleles == 4 ||
+                memchr(alleles, *c, num_alleles) != NULL) {
+                return false;
+            }
+
+            alleles[num_alleles++] = *c;
+
+            if (c[1] == ']') {
+                break;
+            }
+            else if (c[1] != '/') {
+                return false;
+            }
+        }
+
+        alleles[num_alleles] = '\0';
+        locus->site_offsets[locus->num_sites++] = position;
+
+        c++;
+        position++;
+        flank_start = position;
+    }
+
+    locus->length = position;
+
+    return locus->num_sites > 0;
+}
+
+
+/* Parses a "umiN" prototype segment, a UMI of N bases */
+static bool parse_umi(const char *segment,
+                      int *length)
+{
+    if (strncmp(segment, "umi", 3) != 0) {
+        return false;
+    }
+
+    char *end = NULL;
+    long umi_length = strtol(segment + 3, &end, 10);
+
+    if (end == segment + 3 || *end != '\0' || umi_length < 1 || umi_length > MAX_UMI_LENGTH) {
+        return false;
+    }
+
+    *length = (int) umi_length;
+
+    return true;
+}
+
+
 static int num_fasta_seqs_read(const read_segment *arr,
                                size_t arr_length)
 {
@@ -62,8 +202,9 @@ static bool valid_fasta_seq(const kseq_t *seq)
 {
     const char *valid_names[] = {"bc1", "bc2", "allele",
                                  "adapter1", "adapter2",
-                                 "flanking1", "flanking2",
-                                 "prototype1", "prototype2"};
+                                 "flanking1", "flanking2", "flanking3", "flanking4",
+                                 "flanking5", "flanking6", "flanking7", "flanking8",
+                                 "prototype1", "prototype2", "locus"};
     const size_t num_valid_names = sizeof(valid_names) / sizeof(valid_names[0]);
 
     if (! str_in_list(seq->name.s, valid_names, num_valid_names)) {
@@ -86,6 +227,11 @@ static bool valid_fasta_seq(const kseq_t *seq)
             fprintf(stderr, "Error: invalid barcode length: '%s'\n", seq->seq.s);
             seq_is_valid = false;
         }
+        // Barcodes are matched in 2-bit packed form
+        else if (strspn(seq->seq.s, "ACGTacgt") != seq->seq.l) {
+            fprintf(stderr, "Error: invalid barcode '%s'\n", seq->seq.s);
+            seq_is_valid = false;
+        }
 
         char *end = NULL;
         strtol(seq->comment.s, &end, 10);
@@ -95,6 +241,13 @@ static bool valid_fasta_seq(const kseq_t *seq)
             seq_is_valid = false;
         }
     }
+    else if (strcmp(seq->name.s, "locus") == 0) {
+        if (seq->comment.l == 0 || seq->comment.l > MAX_LOCUS_NAME) {
+            fprintf(stderr, "Error: locus '%s' needs a name of at most %d characters\n",
+                    seq->seq.s, MAX_LOCUS_NAME);
+            seq_is_valid = false;
+        }
+    }
     else if (strcmp(seq->name.s, "allele") == 0) {
         char allele[2] = {(char) toupper((unsigned char) seq->seq.s[0]), '\0'};
 
@@ -104,27 +257,86 @@ static bool valid_fasta_seq(const kseq_t *seq)
         }
     }
     else if (strncmp(seq->name.s, "prototype", 9) == 0) {
-        char prototype_str[strlen(seq->seq.s)];
+        char prototype_str[strlen(seq->seq.s) + 1];
         strcpy(prototype_str, seq->seq.s);
-        char *segment = strtok(prototype_str, "|");
+        char *save_ptr;
+        char *segment = strtok_r(prototype_str, "|", &save_ptr);
         int num_segments = 0;
+        int min_spacer, max_spacer;
+
+        // An optional spacer ("spacer0-7") may come before the barcode
+        if (segment != NULL && strncmp(segment, "spacer", 6) == 0) {
+            if (! parse_spacer(segment, &min_spacer, &max_spacer)) {
+                fprintf(stderr, "Error: invalid spacer '%s' in prototype '%s' "
+                        "(expected spacerMIN-MAX, at most %d bases)\n",
+                        segment, seq->seq.s, MAX_SPACER_LENGTH);
+                seq_is_valid = false;
+            }
+
+            segment = strtok_r(NULL, "|", &save_ptr);
+        }
 
-        if (strncmp(seq->seq.s, "bc", 2) != 0) {
+        if (segment == NULL || strncmp(segment, "bc", 2) != 0) {
             fprintf(stderr, "Error: invalid prototype '%s' "
-                    "(must start with 'bc1' or 'bc2')\n", seq->seq.s);
+                    "(must start with 'bc1' or 'bc2', optionally after a spacer)\n", seq->seq.s);
             seq_is_valid = false;
         }
 
+        int num_sites = 0;
+        bool has_locus = false;
+        int num_umis = 0;
+
         while (segment != NULL) {
-            if (! str_in_list(segment, valid_names, num_valid_names) || num_segments > 5) {
+            int umi_length;
+
+            if (strncmp(segment, "umi", 3) == 0) {
+                if (! parse_umi(segment, &umi_length) || ++num_umis > 1) {
+                    fprintf(stderr, "Error: invalid UMI '%s' in prototype '%s' "
+                            "(expected a single umiN, at most %d bases)\n",
+                            segment, seq->seq.s, MAX_UMI_LENGTH);
+                    seq_is_valid = false;
+                    break;
+                }
+            }
+            else if (! str_in_list(segment, valid_names, num_valid_names) ||
+                     strncmp(segment, "prototype", 9) == 0) {
                 fprintf(stderr, "Error: unrecognized segment '%s' in prototype '%s'\n",
                         segment, seq->seq.s);
                 seq_is_valid = false;
                 break;
             }
 
-            segment = strtok(NULL, "|");
-            num_segments++;
+            // A panel's loci bring their own allele sites, and end the read
+            if (has_locus) {
+                fprintf(stderr, "Error: 'locus' must be the last segment of prototype '%s'\n",
+                        seq->seq.s);
+                seq_is_valid = false;
+                break;
+            }
+
+            if (strcmp(segment, "locus") == 0) {
+                has_locus = true;
+            }
+            else if (strcmp(segment, "allele") == 0) {
+                num_sites++;
+            }
+            else if (strncmp(segment, "bc", 2) != 0 && strncmp(segment, "umi", 3) != 0) {
+                num_segments++;
+            }
+
+            segment = strtok_r(NULL, "|", &save_ptr);
+        }
+
+        if (num_segments > MAX_PLAN_CHECKS || num_sites > MAX_ALLELE_SITES) {
+            fprintf(stderr, "Error: prototype '%s' has more than %d adapter and flanking "
+                    "sequences or %d allele sites\n", seq->seq.s, MAX_PLAN_CHECKS, MAX_ALLELE_SITES);
+            seq_is_valid = false;
+        }
+
+        if (has_locus && (num_sites > 0 || strcmp(seq->name.s, "prototype1") != 0)) {
+            fprintf(stderr, "Error: only prototype1 may end with 'locus', and then without "
+                    "allele sites: '%s'\n", seq->seq.s);
+            seq_is_valid = false;
         }
     }
 
@@ -132,6 +344,56 @@ static bool valid_fasta_seq(const kseq_t *seq)
 }
 
 
+static bool prototype_has_locus(const char *prototype_str)
+{
+    size_t length = strlen(prototype_str);
+
+    return length >= 6 && strcmp(prototype_str + length - 6, "|locus") == 0;
+}
+
+
+/* A panel needs both adapters and prototypes, with prototype 1 ending
+   with its loci, and each locus's flanks must fit in the plan after
+   the adapter and flanking sequences that come before them */
+static bool valid_panel(const library_seqs *fs2_seqs)
+{
+    if (num_fasta_seqs_read(fs2_seqs->adapters, 2) != 2 ||
+        num_fasta_seqs_read(fs2_seqs->prototype_strings, 2) != 2) {
+        fprintf(stderr, "Error: FASTA file must contain two adapter sequences and prototypes\n");
+        return false;
+    }
+
+    if (! prototype_has_locus(fs2_seqs->prototype_strings[0].seq)) {
+        fprintf(stderr, "Error: prototype1 must end with 'locus' when the FASTA file has loci\n");
+        return false;
+    }
+
+    char prototype_str[MAX_SEQ_LEN + 1];
+    size_t num_shared_checks = 0;
+
+    strcpy(prototype_str, fs2_seqs->prototype_strings[0].seq);
+
+    char *save_ptr;
+
+    for (char *segment = strtok_r(prototype_str, "|", &save_ptr); segment != NULL;
+         segment = strtok_r(NULL, "|", &save_ptr)) {
+        if (segment[0] == 'a' || segment[0] == 'f') {
+            num_shared_checks++;
+        }
+    }
+
+    for (size_t i = 0; i < fs2_seqs->num_loci; i++) {
+        if (num_shared_checks + fs2_seqs->loci[i].num_flanks > MAX_PLAN_CHECKS) {
+            fprintf(stderr, "Error: locus '%s' and the prototype segments before it have more "
+                    "than %d adapter and flanking sequences\n", fs2_seqs->loci[i].name, MAX_PLAN_CHECKS);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
 size_t allele_char_to_enum(char allele)
 {
     size_t allele_i = 0;
@@ -175,13 +437,13 @@ bool all_standard_barcodes(const library_seqs *fs2_seqs) {
 }
 
 
-library_seqs *load_fasta_sequences(const char *filepath)
+library_seqs *load_fasta_sequences(const char *filepath,
+                                   const void *data,
+                                   size_t length)
 {
-    gzFile fp = gzopen(filepath, "r");
+    stream_reader *fp = stream_reader_open_memory(filepath, data, length);
 
     if (fp == NULL) {
-        fprintf(stderr, "Error: unable to read file '%s': %s\n",
-                filepath, strerror(errno));
         return NULL;
     }
 
@@ -189,14 +451,19 @@ library_seqs *load_fasta_sequences(const char *filepath)
     bool error_occurred = false;
     bool allocation_error = false;
     size_t num_bc_slots[2] = {0};
+    size_t num_locus_slots = 0;
 
-    library_seqs *fs2_seqs = calloc(1, sizeof(*fs2_seqs));
+    // Aligned for the classifier plans
+    library_seqs *fs2_seqs = NULL;
 
-    if (fs2_seqs == NULL) {
+    if (posix_memalign((void **) &fs2_seqs, 64, sizeof(*fs2_seqs)) != 0) {
+        fs2_seqs = NULL;
         allocation_error = true;
         goto CLEANUP;
     }
 
+    memset(fs2_seqs, 0, sizeof(*fs2_seqs));
+
     while (kseq_read(seq) >= 0) {
         if (! valid_fasta_seq(seq)) {
             error_occurred = true;
@@ -240,6 +507,41 @@ library_seqs *load_fasta_sequences(const char *filepath)
             copy_str = seq->comment.s;
             dest_str = fs2_seqs->alleles[allele_i].seq;
         }
+        else if (strcmp(seq->name.s, "locus") == 0) {
+            // Grown by copying, since the locus plans stay 64-byte aligned
+            if (fs2_seqs->num_loci == num_locus_slots) {
+                panel_locus *grown = NULL;
+
+                num_locus_slots += 16;
+
+                if (posix_memalign((void **) &grown, 64, num_locus_slots * sizeof(*grown)) != 0) {
+                    error_occurred = true;
+                    allocation_error = true;
+                    break;
+                }
+
+                if (fs2_seqs->num_loci > 0) {
+                    memcpy(grown, fs2_seqs->loci, fs2_seqs->num_loci * sizeof(*grown));
+                }
+
+                free(fs2_seqs->loci);
+                fs2_seqs->loci = grown;
+            }
+
+            panel_locus *locus = &(fs2_seqs->loci[fs2_seqs->num_loci]);
+            memset(locus, 0, sizeof(*locus));
+
+            if (! parse_locus_definition(seq->seq.s, locus)) {
+                fprintf(stderr, "Error: invalid locus '%s' (expected flanking sequences around "
+                        "1 to %d allele sites such as [A/G])\n", seq->comment.s, MAX_ALLELE_SITES);
+                error_occurred = true;
+                break;
+            }
+
+            strcpy(locus->name, seq->comment.s);
+            fs2_seqs->num_loci++;
+            continue;
+        }
         else {
             size_t last_char_index = strlen(seq->name.s) - 1;
             int seq_1_or_2 = atoi(seq->name.s + last_char_index) - 1;
@@ -258,7 +560,20 @@ library_seqs *load_fasta_sequences(const char *filepath)
         strcpy(dest_str, copy_str);
     }
 
-    if (num_fasta_seqs_read(fs2_seqs->adapters, 2) != 2 ||
+    if (! error_occurred && stream_reader_error(fp)) {
+        error_occurred = true;
+    }
+    // A panel's loci take the place of the flanking and allele sequences
+    else if (fs2_seqs->num_loci > 0) {
+        if (! error_occurred && ! valid_panel(fs2_seqs)) {
+            error_occurred = true;
+        }
+    }
+    else if (! error_occurred && prototype_has_locus(fs2_seqs->prototype_strings[0].seq)) {
+        fprintf(stderr, "Error: prototype1 ends with 'locus' but the FASTA file has no loci\n");
+        error_occurred = true;
+    }
+    else if (num_fasta_seqs_read(fs2_seqs->adapters, 2) != 2 ||
         num_fasta_seqs_read(fs2_seqs->flanking, 2) != 2 ||
         num_fasta_seqs_read(fs2_seqs->prototype_strings, 2) != 2 ||
         num_fasta_seqs_read(fs2_seqs->alleles, 4) < 1) {
@@ -275,33 +590,168 @@ library_seqs *load_fasta_sequences(const char *filepath)
     if (error_occurred) {
         free(fs2_seqs->barcodes[0]);
         free(fs2_seqs->barcodes[1]);
+        free(fs2_seqs->loci);
         free(fs2_seqs);
         fs2_seqs = NULL;
     }
 
     kseq_destroy(seq);
-    gzclose(fp);
+    stream_reader_close(fp);
 
     return fs2_seqs;
 }
 
 
-void parse_prototypes(library_seqs *fs2_seqs)
+static void compile_mate_plan(const prototype *prototype,
+                              const char *layout,
+                              mate_plan *plan)
+{
+    memset(plan, 0, sizeof(*plan));
+
+    plan->length = (uint16_t) prototype->length;
+    plan->allele_offset = (uint16_t) prototype->allele_offset;
+    plan->min_phase = (uint8_t) prototype->min_spacer;
+    plan->max_phase = (uint8_t) prototype->max_spacer;
+    plan->num_sites = (uint8_t) prototype->num_sites;
+    plan->umi_offset = (uint16_t) prototype->umi_offset;
+    plan->umi_length = (uint8_t) prototype->umi_length;
+
+    for (size_t i = 0; i < prototype->num_sites; i++) {
+        plan->site_offsets[i] = (uint16_t) prototype->site_offsets[i];
+    }
+
+    for (size_t i = 0; i < MAX_PLAN_CHECKS && prototype->segments[i]; i++) {
+        const read_segment *segment = prototype->segments[i];
+        segment_check *check = &(plan->checks[i]);
+        uint64_t bases;
+
+        check->offset = (uint16_t) segment->offset;
+        check->length = (uint16_t) segment->length;
+        check->segment = segment;
+
+        if (segment->length <= 32 && pack_kmer(segment->seq, segment->length, &bases)) {
+            check->inline_bases = true;
+            check->bases = bases;
+        }
+
+        plan->num_checks++;
+    }
+
+    if (strcmp(layout, "ba") == 0) {
+        plan->layout = LAYOUT_ADAPTER;
+    }
+    else if (strcmp(layout, "bafxf") == 0) {
+        plan->layout = LAYOUT_ADAPTER_FLANKED_ALLELE;
+    }
+    else {
+        plan->layout = LAYOUT_GENERIC;
+    }
+}
+
+
+/* Each locus is checked as prototype 1 with the locus in place of the
+   'locus' token: the segments before the token, then the locus flanks,
+   shifted to where the token puts them in the read. Prototype 1 itself
+   keeps only the segments before the token (which the barcode phase is
+   found from), but spans the longest locus. */
+static bool compile_panel_loci(library_seqs *fs2_seqs,
+                               const kernel_set *kernels)
+{
+    const prototype *shared = &(fs2_seqs->prototypes[0]);
+    size_t num_shared_checks = 0;
+    size_t max_length = 0;
+
+    while (num_shared_checks < MAX_PLAN_CHECKS && shared->segments[num_shared_checks]) {
+        num_shared_checks++;
+    }
+
+    for (size_t i = 0; i < fs2_seqs->num_loci; i++) {
+        panel_locus *locus = &(fs2_seqs->loci[i]);
+        prototype locus_proto = *shared;
+
+        for (size_t j = 0; j < locus->num_flanks; j++) {
+            read_segment *flank = &(locus->flanks[j]);
+
+            flank->offset += fs2_seqs->locus_offset;
+            kernels->pack_sequence(flank->seq, flank->length, &(flank->packed));
+            locus_proto.segments[num_shared_checks + j] = flank;
+        }
+
+        for (size_t k = 0; k < locus->num_sites; k++) {
+            locus->site_offsets[k] += fs2_seqs->locus_offset;
+            locus_proto.site_offsets[k] = locus->site_offsets[k];
+        }
+
+        locus_proto.num_sites = locus->num_sites;
+        locus_proto.allele_offset = locus->site_offsets[0];
+        locus_proto.length = fs2_seqs->locus_offset + locus->length;
+
+        compile_mate_plan(&locus_proto, "", &(locus->plan));
+        build_read_template(&(locus->plan), &(locus->tmpl));
+
+        if (locus->length > max_length) {
+            max_length = locus->length;
+        }
+    }
+
+    fs2_seqs->prototypes[0].length = fs2_seqs->locus_offset + max_length;
+    fs2_seqs->locus_index = build_locus_index(fs2_seqs->loci, fs2_seqs->num_loci);
+
+    return fs2_seqs->locus_index != NULL;
+}
+
+
+bool parse_prototypes(library_seqs *fs2_seqs,
+                      const kernel_set *kernels)
 {
     for (size_t i = 0; i < 2; i++) {
         char *prototype_str = fs2_seqs->prototype_strings[i].seq;
-        char *segment = strtok(prototype_str, "|");
+        char *save_ptr;
+        char *segment = strtok_r(prototype_str, "|", &save_ptr);
         size_t segment_length = 0;
         size_t segment_index = 0;
         size_t offset_counter = 0;
 
+        // Segment types in order (bc, adapter, flanking, allele -> "bafx")
+        char layout[MAX_SEQ_LEN] = {0};
+        size_t num_tokens = 0;
+
         while (segment != NULL) {
-            if (strncmp(segment, "bc", 2) == 0) {
+            int min_spacer, max_spacer, umi_length;
+
+            // Spacers take no place in the layout; reads are shifted by
+            // the phase found for them instead
+            if (parse_spacer(segment, &min_spacer, &max_spacer)) {
+                fs2_seqs->prototypes[i].min_spacer = (size_t) min_spacer;
+                fs2_seqs->prototypes[i].max_spacer = (size_t) max_spacer;
+                segment = strtok_r(NULL, "|", &save_ptr);
+                continue;
+            }
+            else if (strncmp(segment, "bc", 2) == 0) {
                 segment_length = 6;
+                layout[num_tokens] = 'b';
+            }
+            else if (parse_umi(segment, &umi_length)) {
+                fs2_seqs->prototypes[i].umi_offset = offset_counter;
+                fs2_seqs->prototypes[i].umi_length = (size_t) umi_length;
+                segment_length = (size_t) umi_length;
+                layout[num_tokens] = 'u';
+            }
+            else if (strcmp(segment, "locus") == 0) {
+                fs2_seqs->locus_offset = offset_counter;
+                segment_length = 0;
+                layout[num_tokens] = 'l';
             }
             else if (strcmp(segment, "allele") == 0) {
-                fs2_seqs->prototypes[i].allele_offset = offset_counter;
+                prototype *proto = &(fs2_seqs->prototypes[i]);
+
+                if (proto->num_sites == 0) {
+                    proto->allele_offset = offset_counter;
+                }
+
+                proto->site_offsets[proto->num_sites++] = offset_counter;
                 segment_length = 1;
+                layout[num_tokens] = 'x';
             }
             else {
                 size_t last_char_index = strlen(segment) - 1;
@@ -318,14 +768,56 @@ void parse_prototypes(library_seqs *fs2_seqs)
                 segment_length = strlen(segment_ptr->seq);
                 segment_ptr->offset = offset_counter;
                 segment_ptr->length = segment_length;
+                kernels->pack_sequence(segment_ptr->seq, segment_length, &(segment_ptr->packed));
 
                 fs2_seqs->prototypes[i].segments[segment_index] = segment_ptr;
+                layout[num_tokens] = segment[0];
 
                 segment_index++;
             }
 
             offset_counter += segment_length;
-            segment = strtok(NULL, "|");
+            num_tokens++;
+            segment = strtok_r(NULL, "|", &save_ptr);
+        }
+
+        fs2_seqs->prototypes[i].length = offset_counter;
+
+        if (i == 0 && fs2_seqs->num_loci > 0 && ! compile_panel_loci(fs2_seqs, kernels)) {
+            return false;
         }
+
+        compile_mate_plan(&(fs2_seqs->prototypes[i]), layout, &(fs2_seqs->plans[i]));
+        build_read_template(&(fs2_seqs->plans[i]), &(fs2_seqs->templates[i]));
+        build_phase_index(&(fs2_seqs->plans[i]), fs2_seqs->plans[i].min_phase,
+                          fs2_seqs->plans[i].max_phase, &(fs2_seqs->phases[i]));
+    }
+
+    build_allele_anchors(&(fs2_seqs->plans[0]), &(fs2_seqs->anchors));
+
+    // The UMIs of both mates are read as one
+    if (fs2_seqs->plans[0].umi_length + fs2_seqs->plans[1].umi_length > MAX_UMI_LENGTH) {
+        fprintf(stderr, "Error: the UMIs of both prototypes together may have at most %d bases\n",
+                MAX_UMI_LENGTH);
+        return false;
     }
+
+    return true;
+}
+
+
+void destroy_library_seqs(library_seqs **fs2_seqs_double_ptr)
+{
+    library_seqs *fs2_seqs = *fs2_seqs_double_ptr;
+
+    if (fs2_seqs->locus_index) {
+        destroy_locus_index(&(fs2_seqs->locus_index));
+    }
+
+    free(fs2_seqs->barcodes[0]);
+    free(fs2_seqs->barcodes[1]);
+    free(fs2_seqs->loci);
+    free(fs2_seqs);
+
+    *fs2_seqs_double_ptr = NULL;
 }
@@ -6,11 +6,34 @@
 #ifndef PARSE_SEQ_H
 #define PARSE_SEQ_H
 
+#include "allele_locate.h"
+#include "cpu_dispatch.h"
+#include "locus_index.h"
+#include "packed_seq.h"
+#include "spacer_phase.h"
+#include "template_align.h"
+
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 enum { MAX_SEQ_LEN = 304 };
 
+// Template alignments report edits for every check and allele site of a plan
+enum {
+    MAX_PLAN_CHECKS = MAX_TEMPLATE_SEGMENTS,
+    MAX_ALLELE_SITES = MAX_TEMPLATE_SITES,
+    MAX_FLANKING = 8,
+    MAX_LOCUS_NAME = 64
+};
+
+/* Prototype layouts that the classifier has specialised paths for */
+enum {
+    LAYOUT_GENERIC,
+    LAYOUT_ADAPTER,                  // bc|adapter
+    LAYOUT_ADAPTER_FLANKED_ALLELE    // bc|adapter|flanking|allele|flanking
+};
+
 enum {
     ALLELE_A,
     ALLELE_C,
@@ -27,26 +50,96 @@ typedef struct read_segment {
     size_t offset;
     size_t length;
     char seq[MAX_SEQ_LEN];
+    packed_seq packed;
 } read_segment;
 
+/* 'allele_offset' is the first of the 'num_sites' allele sites; a
+   'umi_length' of 0 means the prototype has no UMI */
 typedef struct prototype {
+    size_t length;
     size_t allele_offset;
-    read_segment *segments[5];
+    size_t umi_offset;
+    size_t umi_length;
+    size_t min_spacer;
+    size_t max_spacer;
+    size_t num_sites;
+    size_t site_offsets[MAX_ALLELE_SITES];
+    read_segment *segments[MAX_PLAN_CHECKS];
 } prototype;
 
+/* One read window compared against a library segment. Segments of up
+   to 32 bases without an N keep their packed bases inline in 'bases'. */
+typedef struct segment_check {
+    uint16_t offset;
+    uint16_t length;
+    bool inline_bases;
+    uint64_t bases;
+    const read_segment *segment;
+} segment_check;
+
+/* Flat per-mate classifier plan compiled from a prototype, so that the
+   per-read loop touches one or two cache lines instead of the scattered
+   read_segment structs. Offsets are those of a read without a spacer. */
+typedef struct mate_plan {
+    uint8_t layout;
+    uint8_t num_checks;
+    uint16_t length;
+    uint16_t allele_offset;
+    uint8_t min_phase;
+    uint8_t max_phase;
+    uint8_t num_sites;
+    uint8_t umi_length;
+    uint16_t umi_offset;
+    uint16_t site_offsets[MAX_ALLELE_SITES];
+    segment_check checks[MAX_PLAN_CHECKS];
+} __attribute__((aligned(64))) mate_plan;
+
+/* One locus of a multi-locus panel, defined by a sequence such as
+   "FLANK[A/G]FLANK[C/T]FLANK": the flanks between its allele sites and
+   the alleles declared for each site. Offsets are those in the read, as
+   placed by the 'locus' token of prototype 1, and the plan and template
+   cover the prototype segments before that token too. */
+typedef struct panel_locus {
+    char name[MAX_LOCUS_NAME + 1];
+    size_t length;
+    size_t num_sites;
+    size_t site_offsets[MAX_ALLELE_SITES];
+    char site_alleles[MAX_ALLELE_SITES][5];
+    size_t num_flanks;
+    read_segment flanks[MAX_ALLELE_SITES + 1];
+    mate_plan plan;
+    read_template tmpl;
+} panel_locus;
+
 typedef struct library_seqs {
     barcode_t *barcodes[2];
     unsigned int num_barcodes[2];
     read_segment adapters[2];
-    read_segment flanking[2];
+    read_segment flanking[MAX_FLANKING];
     read_segment alleles[4];
     read_segment prototype_strings[2];
     prototype prototypes[2];
+    mate_plan plans[2];
+    allele_anchors anchors;
+    read_template templates[2];
+    phase_index phases[2];
+    panel_locus *loci;
+    size_t num_loci;
+    size_t locus_offset;
+    locus_index *locus_index;
 } library_seqs;
 
 extern size_t allele_char_to_enum(char allele);
 extern bool all_standard_barcodes(const library_seqs *fs2_seqs);
-extern library_seqs *load_fasta_sequences(const char *filepath);
-extern void parse_prototypes(library_seqs *fs2_seqs);
+/* Parses the library FASTA file 'filepath' from its 'length' bytes of
+   contents 'data', which may be compressed */
+extern library_seqs *load_fasta_sequences(const char *filepath,
+                                          const void *data,
+                                          size_t length);
+/* Packs the segments with 'kernels'. Returns false (after reporting the
+   error) if a panel's loci cannot be told apart by their flanks. */
+extern bool parse_prototypes(library_seqs *fs2_seqs,
+                             const kernel_set *kernels);
+extern void destroy_library_seqs(library_seqs **fs2_seqs_double_ptr);
 
 #endif
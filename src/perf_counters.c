@@ -0,0 +1,449 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "perf_counters.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined __linux__ && defined __has_include
+    #if __has_include(<linux/perf_event.h>)
+        #define HAVE_PERF_EVENTS 1
+    #endif
+#endif
+
+#ifdef HAVE_PERF_EVENTS
+    #include <linux/perf_event.h>
+    #include <sys/syscall.h>
+#endif
+
+/* The task clock leads each thread's group, so that the time of each
+   stage is measured even where no hardware event is allowed */
+enum {
+    EVENT_TASK_CLOCK,
+    EVENT_CYCLES,
+    EVENT_INSTRUCTIONS,
+    EVENT_CACHE_MISSES,
+    EVENT_BRANCH_MISSES,
+    NUM_EVENTS
+};
+
+static const char *const STAGE_NAMES[NUM_PERF_STAGES] = {
+    "inflate",
+    "parse",
+    "barcode lookup",
+    "segment alignment",
+    "allele fallback",
+    "counting"
+};
+
+/* 'counted' are the events counted by every thread, 'counts' the totals
+   of each stage and 'sampled_pairs' the read pairs they cover (inflate
+   is measured throughout, and covers 'num_pairs'). 'tier_hits' are the
+   segment checks of all read pairs. */
+struct perf_profile {
+    pthread_mutex_t lock;
+    bool warned;
+    bool opened;
+    bool counted[NUM_EVENTS];
+    uint64_t counts[NUM_PERF_STAGES][NUM_EVENTS];
+    uint64_t num_pairs;
+    uint64_t sampled_pairs;
+    uint64_t tier_hits[NUM_MATCH_TIERS];
+};
+
+/* Reads of the counters timed to measure what one read costs */
+enum { CALIBRATION_READS = 64 };
+
+/* 'slots' is the position of each counted event in a read of the group
+   (0 if it is not counted, as the task clock is always first), 'failed'
+   is set if the group stopped counting, and 'read_cost' is what a read
+   adds to each count, which is taken off the stage it ends */
+struct perf_counters {
+    perf_profile *profile;
+    int fds[NUM_EVENTS];
+    size_t slots[NUM_EVENTS];
+    size_t num_open;
+    int stage;
+    bool failed;
+    uint64_t read_cost[NUM_EVENTS];
+    uint64_t last[NUM_EVENTS];
+    uint64_t counts[NUM_PERF_STAGES + 1][NUM_EVENTS];
+    uint64_t sampled_pairs;
+};
+
+
+perf_profile *init_perf_profile(void)
+{
+    perf_profile *profile = calloc(1, sizeof(*profile));
+
+    if (profile == NULL) {
+        perror("Error: memory allocation failed for performance counters");
+        return NULL;
+    }
+
+    pthread_mutex_init(&profile->lock, NULL);
+
+    for (size_t i = 0; i < NUM_EVENTS; i++) {
+        profile->counted[i] = true;
+    }
+
+    return profile;
+}
+
+
+/* Warns once per profile, with the system error if 'error' is set */
+static void warn(perf_profile *profile,
+                 const char *message,
+                 int error)
+{
+    pthread_mutex_lock(&profile->lock);
+
+    if (! profile->warned) {
+        fprintf(stderr, "Warning: %s", message);
+
+        if (error != 0) {
+            fprintf(stderr, " (%s%s)", strerror(error), (error == EACCES || error == EPERM) ?
+                    "; see /proc/sys/kernel/perf_event_paranoid" : "");
+        }
+
+        fputc('\n', stderr);
+        profile->warned = true;
+    }
+
+    pthread_mutex_unlock(&profile->lock);
+}
+
+
+#ifdef HAVE_PERF_EVENTS
+static int open_event(size_t event,
+                      int group_fd)
+{
+    static const struct {
+        uint32_t type;
+        uint64_t config;
+    } EVENTS[NUM_EVENTS] = {
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+    };
+
+    struct perf_event_attr attributes;
+
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.size = sizeof(attributes);
+    attributes.type = EVENTS[event].type;
+    attributes.config = EVENTS[event].config;
+    attributes.read_format = PERF_FORMAT_GROUP;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+
+    // A pinned group is never multiplexed with others, so its counts
+    // need no scaling; it stops counting instead if it cannot stay on
+    attributes.pinned = (group_fd < 0);
+
+    return (int) syscall(SYS_perf_event_open, &attributes, 0, -1, group_fd, 0);
+}
+
+
+/* The counts of every event since the group was opened */
+static bool read_events(perf_counters *counters,
+                        uint64_t *values)
+{
+    uint64_t group[1 + NUM_EVENTS];
+    size_t length = (1 + counters->num_open) * sizeof(uint64_t);
+
+    if (read(counters->fds[EVENT_TASK_CLOCK], group, length) != (ssize_t) length) {
+        return false;
+    }
+
+    for (size_t i = 0; i < NUM_EVENTS; i++) {
+        values[i] = (counters->fds[i] >= 0) ? group[1 + counters->slots[i]] : 0;
+    }
+
+    return true;
+}
+#endif
+
+
+static void free_counters(perf_counters *counters)
+{
+    for (size_t i = NUM_EVENTS; i-- > 0;) {
+        if (counters->fds[i] >= 0) {
+            close(counters->fds[i]);
+        }
+    }
+
+    free(counters);
+}
+
+
+perf_counters *open_perf_counters(perf_profile *profile)
+{
+#ifdef HAVE_PERF_EVENTS
+    perf_counters *counters = calloc(1, sizeof(*counters));
+
+    if (counters == NULL) {
+        perror("Error: memory allocation failed for performance counters");
+        return NULL;
+    }
+
+    counters->profile = profile;
+    counters->stage = PERF_UNPROFILED;
+
+    for (size_t i = 0; i < NUM_EVENTS; i++) {
+        counters->fds[i] = -1;
+    }
+
+    counters->fds[EVENT_TASK_CLOCK] = open_event(EVENT_TASK_CLOCK, -1);
+
+    if (counters->fds[EVENT_TASK_CLOCK] < 0) {
+        warn(profile, "performance counters are unavailable, so nothing is profiled", errno);
+        free(counters);
+        return NULL;
+    }
+
+    counters->num_open = 1;
+
+    int hardware_error = 0;
+
+    for (size_t i = EVENT_TASK_CLOCK + 1; i < NUM_EVENTS; i++) {
+        counters->fds[i] = open_event(i, counters->fds[EVENT_TASK_CLOCK]);
+
+        if (counters->fds[i] >= 0) {
+            counters->slots[i] = counters->num_open++;
+        }
+        else if (hardware_error == 0) {
+            hardware_error = errno;
+        }
+    }
+
+    if (counters->num_open == 1) {
+        warn(profile, "hardware performance counters are unavailable, so only the time of each "
+             "stage is profiled", hardware_error);
+    }
+
+    uint64_t first[NUM_EVENTS];
+    bool readable = read_events(counters, first);
+
+    errno = 0;
+
+    for (size_t i = 0; i < CALIBRATION_READS && readable; i++) {
+        readable = read_events(counters, counters->last);
+    }
+
+    if (! readable) {
+        warn(profile, "performance counters cannot be read, so nothing is profiled", errno);
+        free_counters(counters);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < NUM_EVENTS; i++) {
+        counters->read_cost[i] = (counters->last[i] - first[i]) / CALIBRATION_READS;
+    }
+
+    return counters;
+#else
+    warn(profile, "performance counters are not supported on this system", ENOSYS);
+
+    return NULL;
+#endif
+}
+
+
+void perf_counters_enter(perf_counters *counters,
+                         int stage)
+{
+#ifdef HAVE_PERF_EVENTS
+    uint64_t now[NUM_EVENTS];
+
+    if (counters->failed) {
+        return;
+    }
+
+    errno = 0;
+
+    if (! read_events(counters, now)) {
+        counters->failed = true;
+        warn(counters->profile, "performance counters stopped counting (another profiler may "
+             "have taken them), so the profile is incomplete", errno);
+        return;
+    }
+
+    for (size_t i = 0; i < NUM_EVENTS; i++) {
+        uint64_t count = now[i] - counters->last[i];
+
+        counters->counts[counters->stage][i] += (count > counters->read_cost[i]) ?
+                                                count - counters->read_cost[i] : 0;
+        counters->last[i] = now[i];
+    }
+#endif
+
+    counters->stage = stage;
+}
+
+
+void perf_counters_sample_pair(perf_counters *counters)
+{
+    perf_counters_enter(counters, PERF_PARSE);
+    counters->sampled_pairs++;
+}
+
+
+void close_perf_counters(perf_counters **counters_double_ptr,
+                         uint64_t num_pairs)
+{
+    perf_counters *counters = *counters_double_ptr;
+    perf_profile *profile = counters->profile;
+
+    perf_counters_enter(counters, PERF_UNPROFILED);
+    pthread_mutex_lock(&profile->lock);
+
+    profile->opened = true;
+    profile->num_pairs += num_pairs;
+    profile->sampled_pairs += counters->sampled_pairs;
+
+    for (size_t i = 0; i < NUM_EVENTS; i++) {
+        profile->counted[i] = profile->counted[i] && counters->fds[i] >= 0;
+
+        for (size_t stage = 0; stage < NUM_PERF_STAGES; stage++) {
+            profile->counts[stage][i] += counters->counts[stage][i];
+        }
+    }
+
+    pthread_mutex_unlock(&profile->lock);
+    free_counters(counters);
+
+    *counters_double_ptr = NULL;
+}
+
+
+void perf_profile_add_checks(perf_profile *profile,
+                             const uint64_t *tier_hits)
+{
+    pthread_mutex_lock(&profile->lock);
+
+    for (size_t i = 0; i < NUM_MATCH_TIERS; i++) {
+        profile->tier_hits[i] += tier_hits[i];
+    }
+
+    pthread_mutex_unlock(&profile->lock);
+}
+
+
+static void print_value(FILE *fp,
+                        bool counted,
+                        double value,
+                        int width,
+                        int precision)
+{
+    if (counted) {
+        fprintf(fp, "%*.*f", width, precision, value);
+    }
+    else {
+        fprintf(fp, "%*s", width, "-");
+    }
+}
+
+
+/* Prints one row: the counts per read pair, and the instructions per
+   cycle and misses per thousand instructions (MPKI) */
+static void print_row(FILE *fp,
+                      const char *name,
+                      const bool *counted,
+                      const double *values)
+{
+    bool ipc_counted = counted[EVENT_CYCLES] && counted[EVENT_INSTRUCTIONS] && values[EVENT_CYCLES] > 0;
+    bool per_instruction = counted[EVENT_INSTRUCTIONS] && values[EVENT_INSTRUCTIONS] > 0;
+    double kilo_instructions = values[EVENT_INSTRUCTIONS] / 1000.0;
+
+    fprintf(fp, "%-18s", name);
+    print_value(fp, counted[EVENT_TASK_CLOCK], values[EVENT_TASK_CLOCK], 10, 1);
+    print_value(fp, counted[EVENT_CYCLES], values[EVENT_CYCLES], 10, 1);
+    print_value(fp, counted[EVENT_INSTRUCTIONS], values[EVENT_INSTRUCTIONS], 10, 1);
+    print_value(fp, ipc_counted, ipc_counted ? values[EVENT_INSTRUCTIONS] / values[EVENT_CYCLES] : 0,
+                6, 2);
+    print_value(fp, counted[EVENT_CACHE_MISSES], values[EVENT_CACHE_MISSES], 10, 3);
+    print_value(fp, counted[EVENT_CACHE_MISSES] && per_instruction,
+                per_instruction ? values[EVENT_CACHE_MISSES] / kilo_instructions : 0, 8, 2);
+    print_value(fp, counted[EVENT_BRANCH_MISSES], values[EVENT_BRANCH_MISSES], 10, 3);
+    print_value(fp, counted[EVENT_BRANCH_MISSES] && per_instruction,
+                per_instruction ? values[EVENT_BRANCH_MISSES] / kilo_instructions : 0, 8, 2);
+    fputc('\n', fp);
+}
+
+
+static void print_tier_hits(const perf_profile *profile,
+                            FILE *fp)
+{
+    uint64_t num_checks = 0;
+
+    for (size_t i = 0; i < NUM_MATCH_TIERS; i++) {
+        num_checks += profile->tier_hits[i];
+    }
+
+    if (num_checks == 0) {
+        return;
+    }
+
+    fprintf(fp, "Segment checks: %" PRIu64 ", settled by exact match %.2f%%, mismatches %.2f%%, "
+            "Damerau-Levenshtein %.2f%%\n", num_checks,
+            100.0 * profile->tier_hits[MATCH_EXACT] / num_checks,
+            100.0 * profile->tier_hits[MATCH_MISMATCHES] / num_checks,
+            100.0 * profile->tier_hits[MATCH_DAMERAU_LEVENSHTEIN] / num_checks);
+}
+
+
+void print_perf_profile(const perf_profile *profile,
+                        FILE *fp)
+{
+    if (! profile->opened || profile->num_pairs == 0) {
+        print_tier_hits(profile, fp);
+        return;
+    }
+
+    double totals[NUM_EVENTS] = {0};
+
+    fprintf(fp, "Performance counters per read pair (1 in %d pairs profiled, inflate throughout):\n",
+            PERF_SAMPLE_PAIRS);
+    fprintf(fp, "%-18s%10s%10s%10s%6s%10s%8s%10s%8s\n", "stage", "ns", "cycles", "instr", "IPC",
+            "LLC miss", "MPKI", "br miss", "MPKI");
+
+    for (size_t stage = 0; stage < NUM_PERF_STAGES; stage++) {
+        uint64_t num_pairs = (stage == PERF_INFLATE) ? profile->num_pairs : profile->sampled_pairs;
+        double values[NUM_EVENTS];
+
+        for (size_t i = 0; i < NUM_EVENTS; i++) {
+            values[i] = (num_pairs > 0) ? (double) profile->counts[stage][i] / num_pairs : 0.0;
+            totals[i] += values[i];
+        }
+
+        print_row(fp, STAGE_NAMES[stage], profile->counted, values);
+    }
+
+    print_row(fp, "total", profile->counted, totals);
+    print_tier_hits(profile, fp);
+}
+
+
+void destroy_perf_profile(perf_profile **profile_double_ptr)
+{
+    perf_profile *profile = *profile_double_ptr;
+
+    pthread_mutex_destroy(&profile->lock);
+    free(profile);
+
+    *profile_double_ptr = NULL;
+}
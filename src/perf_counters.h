@@ -0,0 +1,83 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include "edit_distance.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* The stages that hardware performance counters are attributed to.
+   Counts between stages of interest go to PERF_UNPROFILED. */
+enum {
+    PERF_INFLATE,           // reading and decompressing the input
+    PERF_PARSE,             // parsing FASTQ records and packing their bases
+    PERF_BARCODE,           // barcode and UMI lookup
+    PERF_SEGMENTS,          // adapter and flanking checks, template alignment, locus routing
+    PERF_ALLELE,            // relocating an allele by its anchors
+    PERF_COUNTING,          // counting, logging and recording unmatched pairs
+    PERF_UNPROFILED,
+    NUM_PERF_STAGES = PERF_UNPROFILED
+};
+
+/* Only 1 in PERF_SAMPLE_PAIRS read pairs is profiled, as reading the
+   counters takes a system call at each change of stage */
+enum { PERF_SAMPLE_PAIRS = 16 };
+
+/* The counts of a run, added to by the counters of each thread as they
+   are closed. The hardware events are those the system allows: with
+   none (in virtual machines or when perf_event_paranoid forbids them),
+   only the time of each stage is measured, and if even that is not
+   allowed profiling is skipped, with a warning. */
+typedef struct perf_profile perf_profile;
+
+/* One thread's counters. Counting starts in PERF_UNPROFILED, and each
+   perf_counters_enter() adds the counts since the last to the stage
+   then current. */
+typedef struct perf_counters perf_counters;
+
+/* NULL if memory runs out */
+perf_profile *init_perf_profile(void);
+
+/* Counts the calling thread. Returns NULL (after warning once per
+   profile) if no event can be counted. */
+perf_counters *open_perf_counters(perf_profile *profile);
+
+void perf_counters_enter(perf_counters *counters,
+                         int stage);
+
+/* Starts a sampled read pair, in PERF_PARSE */
+void perf_counters_sample_pair(perf_counters *counters);
+
+/* Adds the thread's counts, and 'num_pairs' read pairs, to the profile */
+void close_perf_counters(perf_counters **counters_double_ptr,
+                         uint64_t num_pairs);
+
+/* Adds the segment checks settled by each MATCH_ tier */
+void perf_profile_add_checks(perf_profile *profile,
+                             const uint64_t *tier_hits);
+
+/* Prints the cycles, instructions, IPC, cache and branch misses and time
+   per read pair of each stage, and the share of segment checks each
+   tier of matching settled */
+void print_perf_profile(const perf_profile *profile,
+                        FILE *fp);
+
+void destroy_perf_profile(perf_profile **profile_double_ptr);
+
+/* For the classifying loop, where 'counters' is NULL unless the current
+   read pair is sampled */
+static inline void perf_stage(perf_counters *counters,
+                              int stage)
+{
+    if (counters) {
+        perf_counters_enter(counters, stage);
+    }
+}
+
+#endif
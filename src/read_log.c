@@ -0,0 +1,759 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "read_log.h"
+
+#include "haplotype_counts.h"
+#include "umi_counts.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+/* A log is a header describing the count layout, followed by blocks of
+   records. Every integer is little-endian. Each block starts with the
+   input it belongs to, its number of records, the ordinal of its first
+   record in that input, and the lengths of its packed and deflated
+   (zlib, so checksummed) records. Records are packed back to back with
+   no padding, each field from the lowest bit up in the order of
+   read_log_record. */
+static const char READ_LOG_MAGIC[8] = "FSDMLOG";
+
+enum {
+    READ_LOG_NUM_BLOCKS = 4,
+    BLOCK_HEADER_SIZE = 24,
+    REASON_BITS = 3,
+    // Values of up to 32 bits are packed through one unaligned 64-bit word
+    BLOCK_PADDING = 8
+};
+
+const char *const LOG_REASON_NAMES[NUM_LOG_REASONS] = {
+    "counted",
+    "no barcode",
+    "UMI with N",
+    "no locus",
+    "adapter/flanking",
+    "allele site"
+};
+
+/* Field widths of the records of a layout */
+struct record_fields {
+    unsigned bc_bits[2];
+    unsigned locus_bits;
+    unsigned allele_bits;
+    unsigned umi_bits;
+    size_t num_checks[2];
+    size_t record_bits;
+};
+
+struct log_block {
+    uint8_t *packed;
+    size_t num_records;
+    uint32_t input;
+    uint64_t first_ordinal;
+};
+
+/* The classification loop fills the block after the queued ones, and
+   the writer thread deflates and writes them in order from 'head' */
+struct read_log {
+    const char *path;
+    FILE *fp;
+    struct record_fields fields;
+    size_t block_capacity;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t drained;
+    struct log_block blocks[READ_LOG_NUM_BLOCKS];
+    size_t head;
+    size_t num_queued;
+    struct log_block *filling;
+    uint64_t position;
+    uint32_t input;
+    uint64_t ordinal;
+    uint8_t *deflated;
+    uLong deflated_capacity;
+    bool stop;
+    bool error;
+    bool thread_failed;
+};
+
+struct read_log_reader {
+    const char *path;
+    FILE *fp;
+    count_layout layout;
+    struct record_fields fields;
+    uint8_t *packed;
+    size_t packed_capacity;
+    uint8_t *deflated;
+    size_t deflated_capacity;
+    size_t num_records;
+    size_t next_record;
+    uint64_t position;
+    uint32_t input;
+    uint64_t first_ordinal;
+};
+
+
+static void *checked_calloc(size_t count,
+                            size_t size)
+{
+    void *ptr = calloc(count, size);
+
+    if (ptr == NULL) {
+        perror("Error: memory allocation failed for read log");
+    }
+
+    return ptr;
+}
+
+
+/* Bits to hold the values 0 to num_values - 1 */
+static unsigned bits_for(size_t num_values)
+{
+    unsigned bits = 0;
+
+    while (((size_t) 1 << bits) < num_values) {
+        bits++;
+    }
+
+    return bits;
+}
+
+
+static void layout_fields(const count_layout *layout,
+                          struct record_fields *fields)
+{
+    size_t max_sites = layout->num_sites;
+
+    for (size_t l = 0; l < layout->num_loci; l++) {
+        if (layout->locus_sites[l] > max_sites) {
+            max_sites = layout->locus_sites[l];
+        }
+    }
+
+    fields->bc_bits[0] = bits_for(layout->num_bc[0] + 1);
+    fields->bc_bits[1] = bits_for(layout->num_bc[1] + 1);
+    fields->locus_bits = bits_for(layout->num_loci);
+    fields->allele_bits = (layout->num_loci > 0 || layout->num_sites > 1) ?
+                          HAPLOTYPE_SITE_BITS * max_sites : 2;
+    fields->umi_bits = 2 * layout->umi_length;
+    fields->num_checks[0] = layout->num_checks[0];
+    fields->num_checks[1] = layout->num_checks[1];
+    fields->record_bits = REASON_BITS + 1 + fields->bc_bits[0] + fields->bc_bits[1] +
+                          fields->locus_bits + fields->allele_bits + fields->umi_bits +
+                          READ_LOG_EDIT_BITS * (fields->num_checks[0] + fields->num_checks[1]);
+}
+
+
+static inline void put_bits(uint8_t *data,
+                            uint64_t *position,
+                            uint64_t value,
+                            unsigned num_bits)
+{
+    uint8_t *word_ptr = data + (*position >> 3);
+    uint64_t word;
+
+    memcpy(&word, word_ptr, sizeof(word));
+    word |= value << (*position & 7);
+    memcpy(word_ptr, &word, sizeof(word));
+
+    *position += num_bits;
+}
+
+
+static inline uint64_t get_bits(const uint8_t *data,
+                                uint64_t *position,
+                                unsigned num_bits)
+{
+    uint64_t word;
+
+    memcpy(&word, data + (*position >> 3), sizeof(word));
+    word = (word >> (*position & 7)) & (((uint64_t) 1 << num_bits) - 1);
+    *position += num_bits;
+
+    return word;
+}
+
+
+static inline void store_u32(uint8_t *bytes,
+                             uint32_t value)
+{
+    for (size_t i = 0; i < 4; i++) {
+        bytes[i] = (uint8_t) (value >> (8 * i));
+    }
+}
+
+
+static inline uint32_t load_u32(const uint8_t *bytes)
+{
+    return (uint32_t) bytes[0] | ((uint32_t) bytes[1] << 8) |
+           ((uint32_t) bytes[2] << 16) | ((uint32_t) bytes[3] << 24);
+}
+
+
+static bool write_u32(FILE *fp,
+                      uint32_t value)
+{
+    uint8_t bytes[4];
+
+    store_u32(bytes, value);
+
+    return fwrite(bytes, sizeof(bytes), 1, fp) == 1;
+}
+
+
+static bool write_string(FILE *fp,
+                         const char *str)
+{
+    size_t length = strlen(str);
+
+    return write_u32(fp, (uint32_t) length) && fwrite(str, 1, length, fp) == length;
+}
+
+
+static bool write_layout(FILE *fp,
+                         const count_layout *layout)
+{
+    bool ok = fwrite(READ_LOG_MAGIC, sizeof(READ_LOG_MAGIC), 1, fp) == 1 &&
+              write_u32(fp, READ_LOG_VERSION);
+
+    for (size_t i = 0; i < 2; i++) {
+        ok = ok && write_u32(fp, layout->num_bc[i]);
+
+        for (size_t j = 0; j < layout->num_bc[i]; j++) {
+            ok = ok && write_u32(fp, (uint32_t) layout->bc_labels[i][j]);
+        }
+    }
+
+    for (size_t i = 0; i < 4; i++) {
+        ok = ok && write_string(fp, layout->allele_names[i]);
+    }
+
+    ok = ok && write_u32(fp, (uint32_t) layout->num_sites) &&
+         write_u32(fp, (uint32_t) layout->num_loci);
+
+    for (size_t l = 0; l < layout->num_loci; l++) {
+        ok = ok && write_string(fp, layout->locus_names[l]) &&
+             write_u32(fp, (uint32_t) layout->locus_sites[l]);
+    }
+
+    return ok && write_u32(fp, (uint32_t) layout->num_checks[0]) &&
+           write_u32(fp, (uint32_t) layout->num_checks[1]) &&
+           write_u32(fp, (uint32_t) layout->umi_length);
+}
+
+
+static bool write_block(read_log *self,
+                        const struct log_block *block)
+{
+    size_t packed_length = (block->num_records * self->fields.record_bits + 7) / 8;
+    uLongf deflated_length = self->deflated_capacity;
+
+    if (compress2(self->deflated, &deflated_length, block->packed, packed_length, 1) != Z_OK) {
+        return false;
+    }
+
+    uint8_t header[BLOCK_HEADER_SIZE];
+
+    store_u32(header, block->input);
+    store_u32(header + 4, (uint32_t) block->num_records);
+    store_u32(header + 8, (uint32_t) block->first_ordinal);
+    store_u32(header + 12, (uint32_t) (block->first_ordinal >> 32));
+    store_u32(header + 16, (uint32_t) packed_length);
+    store_u32(header + 20, (uint32_t) deflated_length);
+
+    return fwrite(header, sizeof(header), 1, self->fp) == 1 &&
+           fwrite(self->deflated, 1, deflated_length, self->fp) == deflated_length;
+}
+
+
+static void *writer_thread(void *arg)
+{
+    read_log *self = arg;
+
+    while (true) {
+        pthread_mutex_lock(&self->lock);
+
+        while (self->num_queued == 0 && ! self->stop) {
+            pthread_cond_wait(&self->queued, &self->lock);
+        }
+
+        if (self->num_queued == 0) {
+            pthread_mutex_unlock(&self->lock);
+            break;
+        }
+
+        struct log_block *block = &(self->blocks[self->head]);
+        bool failed = self->error;
+        pthread_mutex_unlock(&self->lock);
+
+        if (! failed && ! write_block(self, block)) {
+            fprintf(stderr, "Error: failed writing read log '%s': %s\n",
+                    self->path, strerror(errno));
+            failed = true;
+        }
+
+        pthread_mutex_lock(&self->lock);
+        self->error = failed;
+        self->head = (self->head + 1) % READ_LOG_NUM_BLOCKS;
+        self->num_queued--;
+        pthread_cond_signal(&self->drained);
+        pthread_mutex_unlock(&self->lock);
+    }
+
+    return NULL;
+}
+
+
+read_log *open_read_log(const char *path,
+                        const count_layout *layout)
+{
+    read_log *self = checked_calloc(1, sizeof(*self));
+
+    if (self == NULL) {
+        return NULL;
+    }
+
+    self->path = path;
+    self->fp = fopen(path, "wb");
+
+    if (self->fp == NULL) {
+        fprintf(stderr, "Error: unable to create read log '%s': %s\n", path, strerror(errno));
+        free(self);
+        return NULL;
+    }
+
+    if (! write_layout(self->fp, layout)) {
+        fprintf(stderr, "Error: failed writing read log '%s': %s\n", path, strerror(errno));
+        fclose(self->fp);
+        free(self);
+        return NULL;
+    }
+
+    layout_fields(layout, &(self->fields));
+    self->block_capacity = (READ_LOG_BLOCK_RECORDS * self->fields.record_bits + 7) / 8 + BLOCK_PADDING;
+
+    bool allocated = true;
+
+    for (size_t i = 0; i < READ_LOG_NUM_BLOCKS; i++) {
+        self->blocks[i].packed = checked_calloc(self->block_capacity, 1);
+        allocated = allocated && self->blocks[i].packed != NULL;
+    }
+
+    self->deflated_capacity = compressBound(self->block_capacity);
+    self->deflated = checked_calloc(self->deflated_capacity, 1);
+    self->filling = &(self->blocks[0]);
+    self->input = UINT32_MAX;
+
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->queued, NULL);
+    pthread_cond_init(&self->drained, NULL);
+
+    int status = allocated && self->deflated != NULL ?
+                 pthread_create(&self->thread, NULL, writer_thread, self) : ENOMEM;
+
+    if (status != 0) {
+        fprintf(stderr, "Error: unable to start read log thread: %s\n", strerror(status));
+        self->thread_failed = true;
+        close_read_log(&self);
+        return NULL;
+    }
+
+    return self;
+}
+
+
+/* Hands the block being filled to the writer thread and starts the
+   next one, waiting for a free block if the writer has fallen behind */
+static void submit_block(read_log *self)
+{
+    if (self->filling->num_records == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&self->lock);
+    self->num_queued++;
+    pthread_cond_signal(&self->queued);
+
+    while (self->num_queued == READ_LOG_NUM_BLOCKS) {
+        pthread_cond_wait(&self->drained, &self->lock);
+    }
+
+    self->filling = &(self->blocks[(self->head + self->num_queued) % READ_LOG_NUM_BLOCKS]);
+    pthread_mutex_unlock(&self->lock);
+
+    memset(self->filling->packed, 0, self->block_capacity);
+    self->filling->num_records = 0;
+    self->filling->input = self->input;
+    self->filling->first_ordinal = self->ordinal;
+    self->position = 0;
+}
+
+
+void read_log_start_input(read_log *self)
+{
+    submit_block(self);
+
+    self->input++;
+    self->ordinal = 0;
+    self->filling->input = self->input;
+    self->filling->first_ordinal = 0;
+}
+
+
+void read_log_write(read_log *self,
+                    const read_log_record *record)
+{
+    const struct record_fields *fields = &(self->fields);
+    uint8_t *packed = self->filling->packed;
+    uint64_t *position = &(self->position);
+
+    put_bits(packed, position, record->reason, REASON_BITS);
+    put_bits(packed, position, record->swapped, 1);
+    put_bits(packed, position, (uint64_t) (record->bc[0] + 1), fields->bc_bits[0]);
+    put_bits(packed, position, (uint64_t) (record->bc[1] + 1), fields->bc_bits[1]);
+    put_bits(packed, position, record->locus, fields->locus_bits);
+    put_bits(packed, position, record->allele, fields->allele_bits);
+    put_bits(packed, position, record->umi, fields->umi_bits);
+
+    for (size_t mate = 0; mate < 2; mate++) {
+        for (size_t i = 0; i < fields->num_checks[mate]; i++) {
+            put_bits(packed, position, record->segment_edits[mate][i], READ_LOG_EDIT_BITS);
+        }
+    }
+
+    self->ordinal++;
+
+    if (++(self->filling->num_records) == READ_LOG_BLOCK_RECORDS) {
+        submit_block(self);
+    }
+}
+
+
+bool close_read_log(read_log **log_double_ptr)
+{
+    read_log *self = *log_double_ptr;
+
+    if (! self->thread_failed) {
+        submit_block(self);
+
+        pthread_mutex_lock(&self->lock);
+        self->stop = true;
+        pthread_cond_signal(&self->queued);
+        pthread_mutex_unlock(&self->lock);
+        pthread_join(self->thread, NULL);
+    }
+
+    bool ok = ! self->error && ! self->thread_failed;
+
+    if (fclose(self->fp) != 0 && ok) {
+        fprintf(stderr, "Error: failed writing read log '%s': %s\n", self->path, strerror(errno));
+        ok = false;
+    }
+
+    pthread_mutex_destroy(&self->lock);
+    pthread_cond_destroy(&self->queued);
+    pthread_cond_destroy(&self->drained);
+
+    for (size_t i = 0; i < READ_LOG_NUM_BLOCKS; i++) {
+        free(self->blocks[i].packed);
+    }
+
+    free(self->deflated);
+    free(self);
+
+    *log_double_ptr = NULL;
+
+    return ok;
+}
+
+
+static bool read_u32(FILE *fp,
+                     uint32_t *value)
+{
+    uint8_t bytes[4];
+
+    if (fread(bytes, sizeof(bytes), 1, fp) != 1) {
+        return false;
+    }
+
+    *value = load_u32(bytes);
+
+    return true;
+}
+
+
+static bool read_string(FILE *fp,
+                        char *str,
+                        size_t max_length)
+{
+    uint32_t length;
+
+    if (! read_u32(fp, &length) || length > max_length || fread(str, 1, length, fp) != length) {
+        return false;
+    }
+
+    str[length] = '\0';
+
+    return true;
+}
+
+
+/* Reads a count layout, with limits on every size so that a corrupt
+   header cannot ask for unbounded memory */
+static bool read_layout(FILE *fp,
+                        count_layout *layout)
+{
+    char magic[sizeof(READ_LOG_MAGIC)];
+    uint32_t version;
+    uint32_t value;
+
+    if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, READ_LOG_MAGIC, sizeof(magic)) != 0 ||
+        ! read_u32(fp, &version) || version != READ_LOG_VERSION) {
+        return false;
+    }
+
+    for (size_t i = 0; i < 2; i++) {
+        if (! read_u32(fp, &value) || value > UINT16_MAX) {
+            return false;
+        }
+
+        layout->num_bc[i] = value;
+        layout->bc_labels[i] = checked_calloc(value + 1, sizeof(*layout->bc_labels[i]));
+
+        if (layout->bc_labels[i] == NULL) {
+            return false;
+        }
+
+        for (size_t j = 0; j < layout->num_bc[i]; j++) {
+            if (! read_u32(fp, &value)) {
+                return false;
+            }
+
+            layout->bc_labels[i][j] = (int) value;
+        }
+    }
+
+    for (size_t i = 0; i < 4; i++) {
+        if (! read_string(fp, layout->allele_names[i], MAX_SEQ_LEN - 1)) {
+            return false;
+        }
+    }
+
+    if (! read_u32(fp, &value) || value > MAX_ALLELE_SITES) {
+        return false;
+    }
+
+    layout->num_sites = value;
+
+    if (! read_u32(fp, &value) || value > UINT16_MAX) {
+        return false;
+    }
+
+    layout->num_loci = value;
+    layout->locus_names = checked_calloc(layout->num_loci + 1, sizeof(*layout->locus_names));
+    layout->locus_sites = checked_calloc(layout->num_loci + 1, sizeof(*layout->locus_sites));
+
+    if (layout->locus_names == NULL || layout->locus_sites == NULL) {
+        return false;
+    }
+
+    for (size_t l = 0; l < layout->num_loci; l++) {
+        if (! read_string(fp, layout->locus_names[l], MAX_LOCUS_NAME) ||
+            ! read_u32(fp, &value) || value > MAX_ALLELE_SITES) {
+            return false;
+        }
+
+        layout->locus_sites[l] = value;
+    }
+
+    for (size_t i = 0; i < 2; i++) {
+        if (! read_u32(fp, &value) || value > MAX_PLAN_CHECKS) {
+            return false;
+        }
+
+        layout->num_checks[i] = value;
+    }
+
+    if (! read_u32(fp, &value) || value > MAX_UMI_LENGTH) {
+        return false;
+    }
+
+    layout->umi_length = value;
+
+    return true;
+}
+
+
+read_log_reader *open_read_log_reader(const char *path)
+{
+    read_log_reader *self = checked_calloc(1, sizeof(*self));
+
+    if (self == NULL) {
+        return NULL;
+    }
+
+    self->path = path;
+    self->fp = fopen(path, "rb");
+
+    if (self->fp == NULL) {
+        fprintf(stderr, "Error: unable to read file '%s': %s\n", path, strerror(errno));
+        free(self);
+        return NULL;
+    }
+
+    if (! read_layout(self->fp, &(self->layout))) {
+        fprintf(stderr, "Error: '%s' is not an fsdm read log of version %d\n",
+                path, READ_LOG_VERSION);
+        close_read_log_reader(&self);
+        return NULL;
+    }
+
+    layout_fields(&(self->layout), &(self->fields));
+    self->packed_capacity = (READ_LOG_BLOCK_RECORDS * self->fields.record_bits + 7) / 8 + BLOCK_PADDING;
+    self->packed = checked_calloc(self->packed_capacity, 1);
+    self->deflated_capacity = compressBound(self->packed_capacity);
+    self->deflated = checked_calloc(self->deflated_capacity, 1);
+
+    if (self->packed == NULL || self->deflated == NULL) {
+        close_read_log_reader(&self);
+        return NULL;
+    }
+
+    return self;
+}
+
+
+const count_layout *read_log_layout(const read_log_reader *self)
+{
+    return &(self->layout);
+}
+
+
+/* Returns 1 once the next block is inflated, 0 at the end of the log
+   or -1 if it is truncated or corrupt */
+static int read_block(read_log_reader *self)
+{
+    uint8_t header[BLOCK_HEADER_SIZE];
+    size_t header_length = fread(header, 1, sizeof(header), self->fp);
+
+    if (header_length == 0 && feof(self->fp)) {
+        return 0;
+    }
+
+    if (header_length != sizeof(header)) {
+        return -1;
+    }
+
+    size_t num_records = load_u32(header + 4);
+    uLongf packed_length = load_u32(header + 16);
+    size_t deflated_length = load_u32(header + 20);
+
+    if (num_records == 0 || num_records > READ_LOG_BLOCK_RECORDS ||
+        packed_length != (num_records * self->fields.record_bits + 7) / 8 ||
+        deflated_length > self->deflated_capacity ||
+        fread(self->deflated, 1, deflated_length, self->fp) != deflated_length) {
+        return -1;
+    }
+
+    uLongf inflated_length = packed_length;
+
+    memset(self->packed, 0, self->packed_capacity);
+
+    if (uncompress(self->packed, &inflated_length, self->deflated, deflated_length) != Z_OK ||
+        inflated_length != packed_length) {
+        return -1;
+    }
+
+    self->input = load_u32(header);
+    self->first_ordinal = load_u32(header + 8) | ((uint64_t) load_u32(header + 12) << 32);
+    self->num_records = num_records;
+    self->next_record = 0;
+    self->position = 0;
+
+    return 1;
+}
+
+
+int read_log_next(read_log_reader *self,
+                  read_log_record *record)
+{
+    if (self->next_record == self->num_records) {
+        int status = read_block(self);
+
+        if (status < 0) {
+            fprintf(stderr, "Error: read log '%s' is truncated or corrupt\n", self->path);
+        }
+        if (status <= 0) {
+            return status;
+        }
+    }
+
+    const struct record_fields *fields = &(self->fields);
+    const uint8_t *packed = self->packed;
+    uint64_t *position = &(self->position);
+
+    memset(record, 0, sizeof(*record));
+    record->input = self->input;
+    record->ordinal = self->first_ordinal + self->next_record++;
+    record->reason = (uint8_t) get_bits(packed, position, REASON_BITS);
+    record->swapped = get_bits(packed, position, 1);
+    record->bc[0] = (int) get_bits(packed, position, fields->bc_bits[0]) - 1;
+    record->bc[1] = (int) get_bits(packed, position, fields->bc_bits[1]) - 1;
+    record->locus = (uint32_t) get_bits(packed, position, fields->locus_bits);
+    record->allele = (uint32_t) get_bits(packed, position, fields->allele_bits);
+    record->umi = (uint32_t) get_bits(packed, position, fields->umi_bits);
+
+    for (size_t mate = 0; mate < 2; mate++) {
+        for (size_t i = 0; i < fields->num_checks[mate]; i++) {
+            record->segment_edits[mate][i] = (uint8_t) get_bits(packed, position, READ_LOG_EDIT_BITS);
+        }
+    }
+
+    // Values the fields are wide enough for but that no writer produces
+    if (record->reason >= NUM_LOG_REASONS || record->bc[0] >= (int) self->layout.num_bc[0] ||
+        record->bc[1] >= (int) self->layout.num_bc[1] ||
+        (self->layout.num_loci > 0 && record->locus >= self->layout.num_loci)) {
+        fprintf(stderr, "Error: read log '%s' is corrupt\n", self->path);
+        return -1;
+    }
+
+    return 1;
+}
+
+
+void free_count_layout(count_layout *layout)
+{
+    free(layout->bc_labels[0]);
+    free(layout->bc_labels[1]);
+    free(layout->locus_names);
+    free(layout->locus_sites);
+
+    memset(layout, 0, sizeof(*layout));
+}
+
+
+void close_read_log_reader(read_log_reader **reader_double_ptr)
+{
+    read_log_reader *self = *reader_double_ptr;
+
+    if (self->fp != NULL) {
+        fclose(self->fp);
+    }
+
+    free_count_layout(&(self->layout));
+    free(self->packed);
+    free(self->deflated);
+    free(self);
+
+    *reader_double_ptr = NULL;
+}
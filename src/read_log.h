@@ -0,0 +1,109 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef READ_LOG_H
+#define READ_LOG_H
+
+#include "parse_seq.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    READ_LOG_VERSION = 1,
+    READ_LOG_BLOCK_RECORDS = 1 << 16,
+    READ_LOG_EDIT_BITS = 4,
+    READ_LOG_MAX_EDITS = 14,
+    READ_LOG_UNCHECKED = 15
+};
+
+/* Why a read pair was or was not counted. Pairs are rejected for the
+   first reason they meet, in this order. */
+enum {
+    LOG_COUNTED,
+    LOG_NO_BARCODE,        // bc1 or bc2 matched no library barcode
+    LOG_UMI_N,             // the UMI has an N
+    LOG_NO_LOCUS,          // no panel locus won the flank k-mer vote
+    LOG_SEGMENTS,          // an adapter or flanking sequence exceeded --mm or --ed
+    LOG_ALLELE_SITE,       // a site was deleted, past the read, or not declared
+    NUM_LOG_REASONS
+};
+
+extern const char *const LOG_REASON_NAMES[NUM_LOG_REASONS];
+
+/* What the count table of a run is keyed by, and so what its log
+   records hold: the barcode labels, the allele names (empty for alleles
+   not in the library), the allele sites of prototype 1 or the name and
+   sites of each panel locus, the number of adapter and flanking checks
+   of each mate (the most of any locus for prototype 1 of a panel) and
+   the UMI length. */
+typedef struct count_layout {
+    unsigned int num_bc[2];
+    int *bc_labels[2];
+    char allele_names[4][MAX_SEQ_LEN];
+    size_t num_sites;
+    size_t num_loci;
+    char (*locus_names)[MAX_LOCUS_NAME + 1];
+    size_t *locus_sites;
+    size_t num_checks[2];
+    size_t umi_length;
+} count_layout;
+
+/* One read pair. 'bc' are barcode indices (-1 if not found), 'allele'
+   is the allele index, or the haplotype if the pair is counted by
+   haplotype, and 'segment_edits' the edit distance of each check of
+   each mate (at most READ_LOG_MAX_EDITS, READ_LOG_UNCHECKED if the pair
+   was rejected before it). 'input' and 'ordinal' (the pair's position
+   in that input) are only set when reading a log. */
+typedef struct read_log_record {
+    uint32_t input;
+    uint64_t ordinal;
+    uint8_t reason;
+    bool swapped;
+    int bc[2];
+    uint32_t locus;
+    uint32_t allele;
+    uint32_t umi;
+    uint8_t segment_edits[2][MAX_PLAN_CHECKS];
+} read_log_record;
+
+/* Writes one fixed-width, bit-packed record per read pair. Records are
+   collected into blocks of READ_LOG_BLOCK_RECORDS, which a background
+   thread deflates and writes, so the classification loop only packs
+   bits. Returns NULL (after reporting the error) if the file cannot be
+   created or the writer cannot be started. */
+typedef struct read_log read_log;
+
+read_log *open_read_log(const char *path,
+                        const count_layout *layout);
+
+/* Starts the records of the next FASTQ input, numbered from 0 */
+void read_log_start_input(read_log *self);
+
+void read_log_write(read_log *self,
+                    const read_log_record *record);
+
+/* Writes the remaining records; returns false if any write failed */
+bool close_read_log(read_log **log_double_ptr);
+
+typedef struct read_log_reader read_log_reader;
+
+/* Returns NULL (after reporting the error) if the file is not a log */
+read_log_reader *open_read_log_reader(const char *path);
+
+/* Owned by the reader */
+const count_layout *read_log_layout(const read_log_reader *self);
+
+/* Returns 1 and fills in 'record', 0 at the end of the log, or -1 (after
+   reporting the error) if it is truncated or corrupt */
+int read_log_next(read_log_reader *self,
+                  read_log_record *record);
+
+void close_read_log_reader(read_log_reader **reader_double_ptr);
+
+void free_count_layout(count_layout *layout);
+
+#endif
@@ -0,0 +1,341 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "run_metrics.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* The outcome label of each LOG_ reason */
+static const char *const OUTCOME_LABELS[NUM_LOG_REASONS] = {
+    "counted",
+    "no_barcode",
+    "umi_n",
+    "no_locus",
+    "segments",
+    "allele_site"
+};
+
+/* The tier label of each MATCH_ tier */
+static const char *const TIER_LABELS[NUM_MATCH_TIERS] = {
+    "exact",
+    "mismatches",
+    "damerau_levenshtein"
+};
+
+struct metrics_writer {
+    const run_metrics *metrics;
+    char *path;
+    char *temp_path;
+    int interval_seconds;
+    struct timespec start;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t stopped;
+    bool stop;
+};
+
+
+static inline uint64_t read_metric(const uint64_t *metric)
+{
+    return __atomic_load_n(metric, __ATOMIC_RELAXED);
+}
+
+
+static inline double seconds_of(uint64_t nanoseconds)
+{
+    return (double) nanoseconds / 1e9;
+}
+
+
+static void print_metric(FILE *fp,
+                         const char *name,
+                         const char *type,
+                         const char *help)
+{
+    fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+
+/* Writes the metrics in the Prometheus text format; 'running' is false
+   for the last time, once the run is over */
+static void print_metrics(const metrics_writer *writer,
+                          bool running,
+                          FILE *fp)
+{
+    const run_metrics *metrics = writer->metrics;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double elapsed = (double) (now.tv_sec - writer->start.tv_sec) +
+                     (double) (now.tv_nsec - writer->start.tv_nsec) / 1e9;
+    uint64_t num_pairs = 0;
+
+    print_metric(fp, "fsdm_read_pairs_total", "counter", "Read pairs classified, by outcome");
+
+    for (size_t i = 0; i < NUM_LOG_REASONS; i++) {
+        uint64_t pairs = read_metric(&(metrics->read_pairs[i]));
+
+        fprintf(fp, "fsdm_read_pairs_total{outcome=\"%s\"} %" PRIu64 "\n", OUTCOME_LABELS[i], pairs);
+        num_pairs += pairs;
+    }
+
+    print_metric(fp, "fsdm_segment_checks_total", "counter",
+                 "Adapter and flanking checks, by the tier of matching that settled them");
+
+    for (size_t i = 0; i < NUM_MATCH_TIERS; i++) {
+        fprintf(fp, "fsdm_segment_checks_total{tier=\"%s\"} %" PRIu64 "\n", TIER_LABELS[i],
+                read_metric(&(metrics->segment_checks[i])));
+    }
+
+    print_metric(fp, "fsdm_input_bytes_total", "counter",
+                 "FASTQ bytes read, as stored and decompressed");
+
+    for (size_t i = 0; i < 2; i++) {
+        fprintf(fp, "fsdm_input_bytes_total{mate=\"%zu\",form=\"compressed\"} %" PRIu64 "\n",
+                i + 1, read_metric(&(metrics->inputs[i].compressed_bytes)));
+        fprintf(fp, "fsdm_input_bytes_total{mate=\"%zu\",form=\"uncompressed\"} %" PRIu64 "\n",
+                i + 1, read_metric(&(metrics->inputs[i].uncompressed_bytes)));
+    }
+
+    print_metric(fp, "fsdm_input_seconds_total", "counter",
+                 "Time the reader thread of each mate spent reading and decompressing");
+
+    for (size_t i = 0; i < 2; i++) {
+        fprintf(fp, "fsdm_input_seconds_total{mate=\"%zu\"} %.6f\n",
+                i + 1, seconds_of(read_metric(&(metrics->inputs[i].input_ns))));
+    }
+
+    print_metric(fp, "fsdm_input_wait_seconds_total", "counter",
+                 "Time classifying waited for the input of each mate");
+
+    uint64_t wait_ns = 0;
+
+    for (size_t i = 0; i < 2; i++) {
+        uint64_t input_wait_ns = read_metric(&(metrics->inputs[i].wait_ns));
+
+        fprintf(fp, "fsdm_input_wait_seconds_total{mate=\"%zu\"} %.6f\n",
+                i + 1, seconds_of(input_wait_ns));
+        wait_ns += input_wait_ns;
+    }
+
+    // The loop time is only brought up to date every CHECKPOINT_PAIRS
+    // pairs, so it can lag the waits within it
+    uint64_t loop_ns = read_metric(&(metrics->loop_ns));
+
+    print_metric(fp, "fsdm_classify_seconds_total", "counter",
+                 "Time spent classifying and counting read pairs");
+    fprintf(fp, "fsdm_classify_seconds_total %.6f\n",
+            seconds_of((loop_ns > wait_ns) ? loop_ns - wait_ns : 0));
+
+    print_metric(fp, "fsdm_input_buffers_filled", "gauge",
+                 "Buffers of each mate decompressed ahead of classifying");
+
+    for (size_t i = 0; i < 2; i++) {
+        fprintf(fp, "fsdm_input_buffers_filled{mate=\"%zu\"} %" PRIu64 "\n",
+                i + 1, read_metric(&(metrics->inputs[i].buffers_filled)));
+    }
+
+    print_metric(fp, "fsdm_input_queue_depth", "gauge",
+                 "Reads of each mate's file in flight, averaged over its latest buffer");
+
+    for (size_t i = 0; i < 2; i++) {
+        fprintf(fp, "fsdm_input_queue_depth{mate=\"%zu\"} %.3f\n",
+                i + 1, (double) read_metric(&(metrics->inputs[i].io_depth_milli)) / 1000.0);
+    }
+
+    print_metric(fp, "fsdm_inputs_completed_total", "counter", "FASTQ inputs classified");
+    fprintf(fp, "fsdm_inputs_completed_total %" PRIu64 "\n", read_metric(&(metrics->inputs_done)));
+
+    print_metric(fp, "fsdm_elapsed_seconds", "gauge", "Time since the run started");
+    fprintf(fp, "fsdm_elapsed_seconds %.3f\n", elapsed);
+
+    print_metric(fp, "fsdm_read_pairs_per_second", "gauge",
+                 "Read pairs classified per second since the run started");
+    fprintf(fp, "fsdm_read_pairs_per_second %.1f\n", (elapsed > 0.0) ? num_pairs / elapsed : 0.0);
+
+    // Progress is only known when the sizes of the inputs are
+    if (metrics->expected_bytes > 0) {
+        uint64_t read_bytes = read_metric(&(metrics->inputs[0].compressed_bytes)) +
+                              read_metric(&(metrics->inputs[1].compressed_bytes));
+        double progress = (double) read_bytes / (double) metrics->expected_bytes;
+
+        if (progress > 1.0 || ! running) {
+            progress = 1.0;
+        }
+
+        print_metric(fp, "fsdm_progress_ratio", "gauge",
+                     "Fraction of the compressed input read");
+        fprintf(fp, "fsdm_progress_ratio %.4f\n", progress);
+
+        if (progress > 0.0) {
+            print_metric(fp, "fsdm_estimated_seconds_remaining", "gauge",
+                         "Estimated time until the input is read, at the rate so far");
+            fprintf(fp, "fsdm_estimated_seconds_remaining %.1f\n",
+                    elapsed * (1.0 - progress) / progress);
+        }
+    }
+
+    print_metric(fp, "fsdm_running", "gauge", "1 while the run is classifying, 0 once it is over");
+    fprintf(fp, "fsdm_running %d\n", running ? 1 : 0);
+}
+
+
+static bool write_metrics(const metrics_writer *writer,
+                          bool running)
+{
+    FILE *fp = fopen(writer->temp_path, "w");
+
+    if (fp == NULL) {
+        fprintf(stderr, "Error: unable to write metrics file '%s': %s\n",
+                writer->temp_path, strerror(errno));
+        return false;
+    }
+
+    print_metrics(writer, running, fp);
+
+    bool ok = ! ferror(fp);
+
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+
+    if (ok && rename(writer->temp_path, writer->path) != 0) {
+        ok = false;
+    }
+
+    if (! ok) {
+        fprintf(stderr, "Error: failed writing metrics file '%s': %s\n",
+                writer->path, strerror(errno));
+        remove(writer->temp_path);
+    }
+
+    return ok;
+}
+
+
+static void *writer_thread(void *arg)
+{
+    metrics_writer *writer = arg;
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    pthread_mutex_lock(&writer->lock);
+
+    while (! writer->stop) {
+        int status = 0;
+
+        deadline.tv_sec += writer->interval_seconds;
+
+        while (! writer->stop && status != ETIMEDOUT) {
+            status = pthread_cond_timedwait(&writer->stopped, &writer->lock, &deadline);
+        }
+
+        if (writer->stop) {
+            break;
+        }
+
+        // A failed write is reported, and left to the next one
+        pthread_mutex_unlock(&writer->lock);
+        write_metrics(writer, true);
+        pthread_mutex_lock(&writer->lock);
+    }
+
+    pthread_mutex_unlock(&writer->lock);
+
+    return NULL;
+}
+
+
+static void free_writer(metrics_writer *writer)
+{
+    free(writer->path);
+    free(writer->temp_path);
+    free(writer);
+}
+
+
+metrics_writer *start_metrics_writer(const run_metrics *metrics,
+                                     const char *path,
+                                     int interval_seconds)
+{
+    metrics_writer *writer = calloc(1, sizeof(*writer));
+    size_t path_length = strlen(path);
+
+    if (writer == NULL ||
+        (writer->path = strdup(path)) == NULL ||
+        (writer->temp_path = malloc(path_length + 5)) == NULL) {
+        perror("Error: memory allocation failed for metrics");
+
+        if (writer) {
+            free_writer(writer);
+        }
+
+        return NULL;
+    }
+
+    memcpy(writer->temp_path, path, path_length);
+    memcpy(writer->temp_path + path_length, ".tmp", 5);
+
+    writer->metrics = metrics;
+    writer->interval_seconds = (interval_seconds > 0) ? interval_seconds : 1;
+    clock_gettime(CLOCK_MONOTONIC, &(writer->start));
+
+    // The first write shows at once whether the file can be written
+    if (! write_metrics(writer, true)) {
+        free_writer(writer);
+        return NULL;
+    }
+
+    pthread_condattr_t attributes;
+
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&writer->stopped, &attributes);
+    pthread_condattr_destroy(&attributes);
+    pthread_mutex_init(&writer->lock, NULL);
+
+    int status = pthread_create(&writer->thread, NULL, writer_thread, writer);
+
+    if (status != 0) {
+        fprintf(stderr, "Error: unable to start metrics thread: %s\n", strerror(status));
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->stopped);
+        free_writer(writer);
+        return NULL;
+    }
+
+    return writer;
+}
+
+
+bool stop_metrics_writer(metrics_writer **writer_double_ptr)
+{
+    metrics_writer *writer = *writer_double_ptr;
+
+    pthread_mutex_lock(&writer->lock);
+    writer->stop = true;
+    pthread_cond_signal(&writer->stopped);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    bool written = write_metrics(writer, false);
+
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->stopped);
+    free_writer(writer);
+
+    *writer_double_ptr = NULL;
+
+    return written;
+}
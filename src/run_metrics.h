@@ -0,0 +1,90 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef RUN_METRICS_H
+#define RUN_METRICS_H
+
+#include "edit_distance.h"
+#include "read_log.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Progress of a run, for the metrics file. Each counter has one writer
+   thread, which adds to it with relaxed atomic loads and stores (plain
+   moves, without the lock of an atomic add), so that the metrics thread
+   can read it at any time without slowing the classifying loop. */
+
+/* Of each mate's FASTQ input: the bytes read from the file and
+   decompressed, and the time spent on them (by its reader thread); the
+   time the classifying thread waited for them; the buffers decompressed
+   ahead and the mean number of reads in flight (in thousandths) while
+   the latest buffer was read */
+typedef struct input_metrics {
+    uint64_t compressed_bytes;
+    uint64_t uncompressed_bytes;
+    uint64_t input_ns;
+    uint64_t wait_ns;
+    uint64_t buffers_filled;
+    uint64_t io_depth_milli;
+} input_metrics;
+
+/* The read pairs of each outcome (a LOG_ reason), the segment checks
+   settled by each MATCH_ tier, the time spent in the classifying loop
+   (waits included), and 'expected_bytes', the total size of the inputs
+   (0 if unknown) */
+typedef struct run_metrics {
+    uint64_t read_pairs[NUM_LOG_REASONS];
+    uint64_t segment_checks[NUM_MATCH_TIERS];
+    uint64_t loop_ns;
+    uint64_t inputs_done;
+    uint64_t expected_bytes;
+    input_metrics inputs[2];
+} run_metrics;
+
+static inline void metrics_add(uint64_t *counter,
+                               uint64_t value)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+
+static inline void metrics_set(uint64_t *gauge,
+                               uint64_t value)
+{
+    __atomic_store_n(gauge, value, __ATOMIC_RELAXED);
+}
+
+
+/* Adds the nanoseconds since '*since' to 'counter' and moves '*since' to
+   now */
+static inline void metrics_add_elapsed(uint64_t *counter,
+                                       struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    metrics_add(counter, (uint64_t) ((now.tv_sec - since->tv_sec) * 1000000000LL +
+                                     (now.tv_nsec - since->tv_nsec)));
+    *since = now;
+}
+
+/* A thread that rewrites the metrics file every 'interval_seconds',
+   through a temporary file renamed over it, so that a collector never
+   reads part of one */
+typedef struct metrics_writer metrics_writer;
+
+/* Returns NULL (after reporting the error) if the file cannot be written
+   or the thread cannot start */
+metrics_writer *start_metrics_writer(const run_metrics *metrics,
+                                     const char *path,
+                                     int interval_seconds);
+
+/* Stops the thread and writes the final metrics; returns false if they
+   cannot be written */
+bool stop_metrics_writer(metrics_writer **writer_double_ptr);
+
+#endif
@@ -0,0 +1,1152 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+// For the peer credentials of a connection (struct ucred)
+#define _GNU_SOURCE
+
+#include "serve.h"
+
+#include "allele_locate.h"
+#include "argparse.h"
+#include "fsdm.h"
+#include "job.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* A job is sent as lines of "<field> <value>", from JOB_PROTOCOL to
+   "end": the option fields below, then "fasta", "log" and one "fastq"
+   per input, with absolute paths. The reply is one line, either "error
+   <message>" or "ok <output_all> <report bytes> <table bytes>", which is
+   followed by the --top report and warnings, then the count table. A
+   job must be sent within JOB_READ_SECONDS and MAX_JOB_BYTES. */
+static const char JOB_PROTOCOL[] = "fsdm-job 1";
+
+enum {
+    MAX_JOB_LINE = 1 << 16,
+    MAX_JOB_BYTES = 1 << 24,
+    JOB_READ_SECONDS = 30,
+    MAX_PENDING_JOBS = 64,
+    DEFAULT_CACHED_CLASSIFIERS = 8
+};
+
+static const struct {
+    const char *name;
+    size_t offset;
+} INT_FIELDS[] = {
+    {"bm", offsetof(args, bc_mismatches)},
+    {"mm", offsetof(args, ad_fl_mismatches)},
+    {"ed", offsetof(args, ed_threshold)},
+    {"max-shift", offsetof(args, max_shift)},
+    {"umi-memory", offsetof(args, umi_memory)},
+    {"top", offsetof(args, top)}
+};
+
+static const struct {
+    const char *name;
+    size_t offset;
+} BOOL_FIELDS[] = {
+    {"all", offsetof(args, output_all)},
+    {"interleaved", offsetof(args, interleaved)},
+    {"bc-scan", offsetof(args, bc_scan)},
+    {"bc-indels", offsetof(args, bc_indels)},
+    {"template-align", offsetof(args, template_align)},
+    {"any-orientation", offsetof(args, any_orientation)},
+    {"umi-collapse", offsetof(args, umi_collapse)}
+};
+
+/* A classifier kept for the library file and the options it was built
+   with. Once evicted, it is freed by the last job using it. */
+typedef struct cached_classifier {
+    char *fasta_file;
+    fsdm_options options;
+    struct stat file_info;
+    fsdm_classifier *classifier;
+    unsigned int num_users;
+    uint64_t last_used;
+    bool evicted;
+} cached_classifier;
+
+/* Connections wait in 'pending' for a worker. The cache holds at most
+   'max_cached' classifiers, unless more are in use. Every job uses the
+   server's 'kernel'. */
+typedef struct server {
+    pthread_mutex_t lock;
+    pthread_cond_t job_ready;
+    pthread_cond_t job_taken;
+    int pending[MAX_PENDING_JOBS];
+    size_t first_pending;
+    size_t num_pending;
+    bool stopping;
+    uint64_t num_jobs;
+    cached_classifier **cache;
+    size_t num_cached;
+    size_t max_cached;
+    uint64_t clock;
+    const char *kernel;
+} server;
+
+/* The parts of a job that its 'args' point to */
+typedef struct job_request {
+    args job;
+    char *fasta_file;
+    char *log_file;
+    char **fastq_files;
+    size_t num_fastq_files;
+} job_request;
+
+static int stop_fd = -1;
+
+
+static bool same_options(const fsdm_options *a,
+                         const fsdm_options *b)
+{
+    return a->bc_mismatches == b->bc_mismatches &&
+           a->ad_fl_mismatches == b->ad_fl_mismatches &&
+           a->ed_threshold == b->ed_threshold &&
+           a->max_shift == b->max_shift &&
+           a->bc_scan == b->bc_scan &&
+           a->bc_indels == b->bc_indels &&
+           a->template_align == b->template_align &&
+           a->any_orientation == b->any_orientation &&
+           a->output_all == b->output_all &&
+           a->umi_memory == b->umi_memory &&
+           (a->kernel == b->kernel ||
+            (a->kernel && b->kernel && strcmp(a->kernel, b->kernel) == 0));
+}
+
+
+/* The library file is taken to be unchanged if it is the same file,
+   with the same size and modification time */
+static bool same_file(const struct stat *a,
+                      const struct stat *b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+           a->st_size == b->st_size && a->st_mtime == b->st_mtime;
+}
+
+
+static void free_cached_classifier(cached_classifier *entry)
+{
+    if (entry->classifier) {
+        fsdm_classifier_free(&(entry->classifier));
+    }
+
+    free(entry->fasta_file);
+    free(entry);
+}
+
+
+/* With the server locked */
+static void evict_classifier(server *self,
+                             size_t i)
+{
+    cached_classifier *entry = self->cache[i];
+
+    self->cache[i] = self->cache[--self->num_cached];
+    entry->evicted = true;
+
+    if (entry->num_users == 0) {
+        free_cached_classifier(entry);
+    }
+}
+
+
+/* With the server locked: makes room for one more classifier by evicting
+   the least recently used ones that no job is using */
+static void make_cache_room(server *self)
+{
+    while (self->num_cached >= self->max_cached) {
+        size_t oldest = self->num_cached;
+
+        for (size_t i = 0; i < self->num_cached; i++) {
+            if (self->cache[i]->num_users == 0 &&
+                (oldest == self->num_cached || self->cache[i]->last_used < self->cache[oldest]->last_used)) {
+                oldest = i;
+            }
+        }
+
+        if (oldest == self->num_cached) {
+            break;
+        }
+
+        evict_classifier(self, oldest);
+    }
+}
+
+
+/* The cached classifier of the library and options, built if there is
+   none (outside the lock, so that other jobs go on meanwhile; two jobs
+   may then build the same one, and the unused copy ages out). Returns
+   NULL (after reporting the error) if the classifier cannot be built. */
+static cached_classifier *acquire_classifier(server *self,
+                                             const char *fasta_file,
+                                             const fsdm_options *options)
+{
+    struct stat file_info;
+
+    if (stat(fasta_file, &file_info) != 0) {
+        fprintf(stderr, "Error: unable to read file '%s': %s\n", fasta_file, strerror(errno));
+        return NULL;
+    }
+
+    pthread_mutex_lock(&(self->lock));
+
+    for (size_t i = 0; i < self->num_cached; i++) {
+        cached_classifier *entry = self->cache[i];
+
+        if (strcmp(entry->fasta_file, fasta_file) != 0 || ! same_options(&(entry->options), options)) {
+            continue;
+        }
+
+        if (same_file(&(entry->file_info), &file_info)) {
+            entry->num_users++;
+            entry->last_used = ++self->clock;
+            pthread_mutex_unlock(&(self->lock));
+
+            return entry;
+        }
+
+        // The library has changed since
+        evict_classifier(self, i);
+        break;
+    }
+
+    pthread_mutex_unlock(&(self->lock));
+
+    cached_classifier *entry = calloc(1, sizeof(*entry));
+
+    if (entry == NULL || (entry->fasta_file = strdup(fasta_file)) == NULL) {
+        perror("Error: memory allocation failed for classifier");
+        free(entry);
+        return NULL;
+    }
+
+    entry->options = *options;
+    entry->file_info = file_info;
+    entry->classifier = fsdm_classifier_new(fasta_file, options);
+    entry->num_users = 1;
+
+    if (entry->classifier == NULL) {
+        free_cached_classifier(entry);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&(self->lock));
+
+    make_cache_room(self);
+
+    cached_classifier **cache = realloc(self->cache, (self->num_cached + 1) * sizeof(*cache));
+
+    if (cache == NULL) {
+        // Used by this job only
+        entry->evicted = true;
+    }
+    else {
+        self->cache = cache;
+        self->cache[self->num_cached++] = entry;
+    }
+
+    entry->last_used = ++self->clock;
+
+    pthread_mutex_unlock(&(self->lock));
+
+    return entry;
+}
+
+
+static void release_classifier(server *self,
+                               cached_classifier *entry)
+{
+    pthread_mutex_lock(&(self->lock));
+
+    if (--entry->num_users == 0 && entry->evicted) {
+        free_cached_classifier(entry);
+    }
+
+    pthread_mutex_unlock(&(self->lock));
+}
+
+
+/* Paths must be absolute, since the server does not share the working
+   directory of the client */
+static bool set_job_field(job_request *request,
+                          const char *name,
+                          const char *value)
+{
+    for (size_t i = 0; i < sizeof(INT_FIELDS) / sizeof(INT_FIELDS[0]); i++) {
+        if (strcmp(name, INT_FIELDS[i].name) == 0) {
+            char *end = NULL;
+
+            errno = 0;
+
+            long number = strtol(value, &end, 10);
+
+            if (end == value || *end != '\0' || errno != 0 || number < INT_MIN || number > INT_MAX) {
+                return false;
+            }
+
+            *(int *) ((char *) &(request->job) + INT_FIELDS[i].offset) = (int) number;
+
+            return true;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(BOOL_FIELDS) / sizeof(BOOL_FIELDS[0]); i++) {
+        if (strcmp(name, BOOL_FIELDS[i].name) == 0) {
+            if (strcmp(value, "0") != 0 && strcmp(value, "1") != 0) {
+                return false;
+            }
+
+            *(int *) ((char *) &(request->job) + BOOL_FIELDS[i].offset) = (value[0] == '1');
+
+            return true;
+        }
+    }
+
+    if (value[0] != '/') {
+        return false;
+    }
+
+    if (strcmp(name, "fastq") == 0) {
+        char **fastq_files = realloc(request->fastq_files,
+                                     (request->num_fastq_files + 1) * sizeof(*fastq_files));
+
+        if (fastq_files == NULL) {
+            return false;
+        }
+
+        request->fastq_files = fastq_files;
+        request->fastq_files[request->num_fastq_files] = strdup(value);
+
+        return request->fastq_files[request->num_fastq_files++] != NULL;
+    }
+
+    char **path = NULL;
+
+    if (strcmp(name, "fasta") == 0) {
+        path = &(request->fasta_file);
+    }
+    else if (strcmp(name, "log") == 0) {
+        path = &(request->log_file);
+    }
+
+    if (path == NULL || *path != NULL) {
+        return false;
+    }
+
+    *path = strdup(value);
+
+    return *path != NULL;
+}
+
+
+static bool read_job(FILE *fp,
+                     job_request *request,
+                     char *message,
+                     size_t message_size)
+{
+    // Lines are read into a buffer of the longest allowed, so a client
+    // cannot make the server buffer more than that
+    char *line = malloc(MAX_JOB_LINE + 2);
+    size_t total_length = 0;
+    bool started = false;
+    bool ended = false;
+
+    if (line == NULL) {
+        snprintf(message, message_size, "memory allocation failed for the job");
+        return false;
+    }
+
+    while (! ended && fgets(line, MAX_JOB_LINE + 2, fp) != NULL) {
+        size_t length = strlen(line);
+
+        total_length += length;
+
+        // A line cut short of its newline before the end of the input is
+        // too long (or has a NUL byte)
+        if (length > 0 && line[length - 1] == '\n') {
+            line[length - 1] = '\0';
+        }
+        else if (! feof(fp)) {
+            snprintf(message, message_size, "job line longer than %d bytes", MAX_JOB_LINE);
+            break;
+        }
+
+        if (total_length > MAX_JOB_BYTES) {
+            snprintf(message, message_size, "job longer than %d bytes", MAX_JOB_BYTES);
+            break;
+        }
+
+        if (! started) {
+            if (strcmp(line, JOB_PROTOCOL) != 0) {
+                snprintf(message, message_size, "not an fsdm job (expected '%s')", JOB_PROTOCOL);
+                break;
+            }
+
+            started = true;
+            continue;
+        }
+
+        if (strcmp(line, "end") == 0) {
+            ended = true;
+            continue;
+        }
+
+        char *value = strchr(line, ' ');
+
+        if (value != NULL) {
+            *value++ = '\0';
+        }
+
+        if (value == NULL || ! set_job_field(request, line, value)) {
+            snprintf(message, message_size, "invalid job field '%.64s'", line);
+            break;
+        }
+    }
+
+    bool timed_out = ferror(fp) && (errno == EAGAIN || errno == EWOULDBLOCK);
+
+    free(line);
+
+    // A connection closed without a word (such as a check that the
+    // server is up) is not a job
+    if (timed_out && message[0] == '\0') {
+        snprintf(message, message_size, "job not sent within %d seconds", JOB_READ_SECONDS);
+    }
+    else if (started && ! ended && message[0] == '\0') {
+        snprintf(message, message_size, "incomplete job");
+    }
+
+    return ended;
+}
+
+
+/* The checks of the command line, for a job that may not have come from
+   it */
+static bool valid_job(job_request *request,
+                      char *message,
+                      size_t message_size)
+{
+    args *job = &(request->job);
+
+    if (request->fasta_file == NULL || request->num_fastq_files == 0 ||
+        (! job->interleaved && (request->num_fastq_files & 1) != 0)) {
+        snprintf(message, message_size, "invalid number of FASTA/FASTQ files");
+        return false;
+    }
+
+    if (job->bc_mismatches < 0 || job->bc_mismatches >= 6 || job->ad_fl_mismatches < 0 ||
+        job->ed_threshold < 0 || job->max_shift < 0 || job->max_shift > MAX_ALLELE_SHIFT ||
+        job->umi_memory < 0 || job->top < 0 || job->top > MAX_TOP_UNMATCHED) {
+        snprintf(message, message_size, "option out of range");
+        return false;
+    }
+
+    for (size_t i = 0; i <= request->num_fastq_files; i++) {
+        const char *path = (i == 0) ? request->fasta_file : request->fastq_files[i - 1];
+
+        if (access(path, R_OK) != 0) {
+            snprintf(message, message_size, "unable to read file '%s': %s", path, strerror(errno));
+            return false;
+        }
+    }
+
+    job->fasta_file = request->fasta_file;
+    job->fastq_files = (const char **) request->fastq_files;
+    job->num_fastq_pairs = (int) (job->interleaved ? request->num_fastq_files : request->num_fastq_files / 2);
+    job->log_file = request->log_file;
+
+    return true;
+}
+
+
+/* True if the client of the connection runs as the server's user */
+static bool same_user(int fd)
+{
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0 &&
+           credentials.uid == geteuid();
+}
+
+
+static void free_job_request(job_request *request)
+{
+    for (size_t i = 0; i < request->num_fastq_files; i++) {
+        free(request->fastq_files[i]);
+    }
+
+    free(request->fastq_files);
+    free(request->fasta_file);
+    free(request->log_file);
+}
+
+
+static bool write_all(int fd,
+                      const void *data,
+                      size_t length)
+{
+    const char *bytes = data;
+
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (written <= 0) {
+            return false;
+        }
+
+        bytes += written;
+        length -= (size_t) written;
+    }
+
+    return true;
+}
+
+
+static double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+/* Runs the job sent over one connection and replies with its results.
+   The errors of the library go to the server's stderr, so the client is
+   referred to it for those. */
+static void serve_job(server *self,
+                      int fd,
+                      uint64_t job_number)
+{
+    struct timespec start;
+    job_request request;
+    cached_classifier *entry = NULL;
+    fsdm_counts *counts = NULL;
+    char message[PATH_MAX + 128] = "";
+    char *report = NULL;
+    char *table = NULL;
+    size_t report_size = 0;
+    size_t table_size = 0;
+    bool ok = false;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(&request, 0, sizeof(request));
+
+    int request_fd = dup(fd);
+    FILE *request_fp = (request_fd >= 0) ? fdopen(request_fd, "r") : NULL;
+
+    if (request_fp == NULL) {
+        snprintf(message, sizeof(message), "unable to read the job: %s", strerror(errno));
+
+        if (request_fd >= 0) {
+            close(request_fd);
+        }
+
+        goto CLEANUP;
+    }
+
+    bool received = read_job(request_fp, &request, message, sizeof(message));
+
+    fclose(request_fp);
+
+    if (! received || ! valid_job(&request, message, sizeof(message))) {
+        goto CLEANUP;
+    }
+
+    // The log is created with the server's permissions, which clients of
+    // other users must not borrow to write files
+    if (request.log_file != NULL && ! same_user(fd)) {
+        snprintf(message, sizeof(message), "--log is only accepted from the server's user");
+        goto CLEANUP;
+    }
+
+    fsdm_options options;
+
+    job_options(&(request.job), &options);
+    options.kernel = self->kernel;
+    entry = acquire_classifier(self, request.fasta_file, &options);
+
+    if (entry == NULL) {
+        snprintf(message, sizeof(message), "unable to build the classifier of '%s' "
+                 "(see the server's log)", request.fasta_file);
+        goto CLEANUP;
+    }
+
+    FILE *report_fp = open_memstream(&report, &report_size);
+    FILE *table_fp = open_memstream(&table, &table_size);
+
+    if (report_fp && table_fp) {
+        counts = run_job(entry->classifier, &(request.job), report_fp);
+        ok = counts != NULL && fsdm_counts_write(counts, request.job.umi_collapse, table_fp);
+    }
+
+    if ((report_fp && fclose(report_fp) != 0) || (table_fp && fclose(table_fp) != 0) ||
+        report_fp == NULL || table_fp == NULL) {
+        ok = false;
+    }
+
+    if (! ok) {
+        snprintf(message, sizeof(message), "the run failed (see the server's log)");
+        goto CLEANUP;
+    }
+
+    char header[128];
+    int header_length = snprintf(header, sizeof(header), "ok %d %zu %zu\n",
+                                 fsdm_classifier_options(entry->classifier)->output_all,
+                                 report_size, table_size);
+
+    if (! write_all(fd, header, (size_t) header_length) || ! write_all(fd, report, report_size) ||
+        ! write_all(fd, table, table_size)) {
+        snprintf(message, sizeof(message), "the client disconnected");
+        ok = false;
+    }
+
+  CLEANUP:
+    if (! ok && message[0] != '\0') {
+        char reply[sizeof(message) + 8];
+        int reply_length = snprintf(reply, sizeof(reply), "error %s\n", message);
+
+        write_all(fd, reply, (size_t) reply_length);
+    }
+
+    if (ok || message[0] != '\0') {
+        fprintf(stderr, "Job %" PRIu64 ": %s, %zu FASTQ inputs: %s (%.2f s)\n", job_number,
+                request.fasta_file ? request.fasta_file : "-", request.num_fastq_files,
+                ok ? "done" : message, seconds_since(&start));
+    }
+
+    if (counts) {
+        fsdm_counts_free(&counts);
+    }
+
+    if (entry) {
+        release_classifier(self, entry);
+    }
+
+    free(report);
+    free(table);
+    free_job_request(&request);
+}
+
+
+/* Waits for a connection, and returns false once the server stops with
+   none left */
+static bool next_connection(server *self,
+                            int *fd,
+                            uint64_t *job_number)
+{
+    pthread_mutex_lock(&(self->lock));
+
+    while (self->num_pending == 0 && ! self->stopping) {
+        pthread_cond_wait(&(self->job_ready), &(self->lock));
+    }
+
+    bool found = self->num_pending > 0;
+
+    if (found) {
+        *fd = self->pending[self->first_pending];
+        *job_number = ++self->num_jobs;
+        self->first_pending = (self->first_pending + 1) % MAX_PENDING_JOBS;
+        self->num_pending--;
+        pthread_cond_signal(&(self->job_taken));
+    }
+
+    pthread_mutex_unlock(&(self->lock));
+
+    return found;
+}
+
+
+static void *serve_connections(void *data)
+{
+    server *self = data;
+    int fd = -1;
+    uint64_t job_number = 0;
+
+    while (next_connection(self, &fd, &job_number)) {
+        serve_job(self, fd, job_number);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+
+static void add_connection(server *self,
+                           int fd)
+{
+    pthread_mutex_lock(&(self->lock));
+
+    while (self->num_pending == MAX_PENDING_JOBS) {
+        pthread_cond_wait(&(self->job_taken), &(self->lock));
+    }
+
+    self->pending[(self->first_pending + self->num_pending) % MAX_PENDING_JOBS] = fd;
+    self->num_pending++;
+    pthread_cond_signal(&(self->job_ready));
+
+    pthread_mutex_unlock(&(self->lock));
+}
+
+
+static bool socket_address(const char *path,
+                           struct sockaddr_un *address)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "Error: socket path '%s' is longer than %zu bytes\n",
+                path, sizeof(address->sun_path) - 1);
+        return false;
+    }
+
+    strcpy(address->sun_path, path);
+
+    return true;
+}
+
+
+static int connect_to_server(const char *path,
+                             bool quiet)
+{
+    struct sockaddr_un address;
+
+    if (! socket_address(path, &address)) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0 || connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        if (! quiet) {
+            fprintf(stderr, "Error: unable to connect to server '%s': %s\n", path, strerror(errno));
+        }
+
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        return -1;
+    }
+
+    return fd;
+}
+
+
+/* A socket file left by a server that did not stop cleanly is replaced;
+   one that a server still listens on is an error */
+static int listen_on_socket(const char *path)
+{
+    struct sockaddr_un address;
+
+    if (! socket_address(path, &address)) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        perror("Error: unable to create socket");
+        return -1;
+    }
+
+    bool bound = bind(fd, (struct sockaddr *) &address, sizeof(address)) == 0;
+    struct stat file_info;
+
+    if (! bound && errno == EADDRINUSE && lstat(path, &file_info) == 0 && S_ISSOCK(file_info.st_mode)) {
+        int other_fd = connect_to_server(path, true);
+
+        if (other_fd >= 0) {
+            fprintf(stderr, "Error: a server is already listening on '%s'\n", path);
+            close(other_fd);
+            close(fd);
+            return -1;
+        }
+
+        unlink(path);
+        bound = bind(fd, (struct sockaddr *) &address, sizeof(address)) == 0;
+    }
+
+    if (! bound || listen(fd, MAX_PENDING_JOBS) != 0) {
+        fprintf(stderr, "Error: unable to listen on socket '%s': %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+static void request_stop(int signal_number)
+{
+    int saved_errno = errno;
+
+    (void) signal_number;
+
+    if (write(stop_fd, "", 1) < 0) {
+        // Nothing more to do in a signal handler
+    }
+
+    errno = saved_errno;
+}
+
+
+int serve_main(int argc,
+               const char **argv)
+{
+    static const char *usage[] = {
+        "fsdm serve [options] <socket>",
+        NULL
+    };
+
+    static const char *description = "Runs fsdm jobs sent by 'fsdm --server <socket>' until "
+                                     "interrupted, keeping the classifiers of recent libraries. "
+                                     "Inputs are read with the server's permissions, by any "
+                                     "user who can reach the socket; --log is only accepted "
+                                     "from the server's own user";
+
+    int num_workers = 0;
+    int max_cached = DEFAULT_CACHED_CLASSIFIERS;
+    char *kernel = NULL;
+
+    struct argparse_option arguments[] = {
+        OPT_HELP(false),
+
+        OPT_GROUP("Options"),
+        OPT_INTEGER('t', "threads", &num_workers,
+                    "Number of jobs run at once (default: the number of CPUs)",
+                    NULL, 0, 0),
+        OPT_INTEGER(0, "cache", &max_cached,
+                    "Number of library classifiers kept between jobs (default 8)",
+                    NULL, 0, 0),
+        OPT_STRING(0, "kernel", &kernel,
+                   "SIMD kernels to use: auto, scalar, sse4.2, avx2 or avx512bw (default auto)",
+                   NULL, 0, 0),
+
+        OPT_END()
+    };
+
+    struct argparse parser;
+    argparse_init(&parser, arguments, usage, 0);
+    argparse_describe(&parser, description, NULL);
+
+    argc = argparse_parse(&parser, argc, argv);
+
+    if (argc != 1) {
+        fprintf(stderr, "Error: expected one socket path\n\n\n");
+        argparse_usage(&parser, false);
+        return EXIT_FAILURE;
+    }
+
+    if (num_workers < 0 || max_cached < 1) {
+        fprintf(stderr, "Error: --threads cannot be negative and --cache must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+
+    if (num_workers == 0) {
+        long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        num_workers = (num_cpus > 0) ? (int) num_cpus : 1;
+    }
+
+    if (! fsdm_kernels_supported(kernel)) {
+        return EXIT_FAILURE;
+    }
+
+    const char *socket_path = argv[0];
+    int stop_pipe[2];
+
+    if (pipe(stop_pipe) != 0) {
+        perror("Error: unable to create pipe");
+        return EXIT_FAILURE;
+    }
+
+    int listen_fd = listen_on_socket(socket_path);
+
+    if (listen_fd < 0) {
+        return EXIT_FAILURE;
+    }
+
+    // Stop on SIGINT or SIGTERM, once the jobs already sent have run;
+    // a client that disconnects only fails its own job
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    stop_fd = stop_pipe[1];
+    action.sa_handler = request_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, NULL);
+
+    server self;
+
+    memset(&self, 0, sizeof(self));
+    pthread_mutex_init(&self.lock, NULL);
+    pthread_cond_init(&self.job_ready, NULL);
+    pthread_cond_init(&self.job_taken, NULL);
+    self.max_cached = (size_t) max_cached;
+    self.kernel = kernel;
+
+    pthread_t *workers = calloc((size_t) num_workers, sizeof(*workers));
+    int num_started = 0;
+
+    while (workers != NULL && num_started < num_workers &&
+           pthread_create(&workers[num_started], NULL, serve_connections, &self) == 0) {
+        num_started++;
+    }
+
+    int status = EXIT_SUCCESS;
+
+    if (num_started < num_workers) {
+        fprintf(stderr, "Error: unable to start %d workers\n", num_workers);
+        status = EXIT_FAILURE;
+    }
+    else {
+        fprintf(stderr, "Serving fsdm jobs on '%s' with %d workers\n", socket_path, num_workers);
+    }
+
+    struct pollfd events[2] = {
+        {.fd = listen_fd, .events = POLLIN},
+        {.fd = stop_pipe[0], .events = POLLIN}
+    };
+
+    while (status == EXIT_SUCCESS) {
+        if (poll(events, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("Error: unable to wait for connections");
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        if (events[1].revents) {
+            break;
+        }
+
+        int fd = accept(listen_fd, NULL, NULL);
+
+        if (fd >= 0) {
+            // A client that stops sending its job only holds a worker
+            // until the timeout
+            struct timeval timeout = {JOB_READ_SECONDS, 0};
+
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            add_connection(&self, fd);
+        }
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+
+    pthread_mutex_lock(&self.lock);
+    self.stopping = true;
+    pthread_cond_broadcast(&self.job_ready);
+    pthread_mutex_unlock(&self.lock);
+
+    for (int i = 0; i < num_started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    fprintf(stderr, "Stopped after %" PRIu64 " jobs\n", self.num_jobs);
+
+    for (size_t i = 0; i < self.num_cached; i++) {
+        free_cached_classifier(self.cache[i]);
+    }
+
+    free(self.cache);
+    free(workers);
+    pthread_cond_destroy(&self.job_taken);
+    pthread_cond_destroy(&self.job_ready);
+    pthread_mutex_destroy(&self.lock);
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+
+    return status;
+}
+
+
+/* Paths are sent absolute, and one to a line */
+static bool send_path(FILE *fp,
+                      const char *field,
+                      const char *path)
+{
+    if (strchr(path, '\n') != NULL) {
+        fprintf(stderr, "Error: path '%s' cannot be sent to a server\n", path);
+        return false;
+    }
+
+    if (path[0] == '/') {
+        fprintf(fp, "%s %s\n", field, path);
+        return true;
+    }
+
+    char directory[PATH_MAX];
+
+    if (getcwd(directory, sizeof(directory)) == NULL) {
+        perror("Error: unable to get the working directory");
+        return false;
+    }
+
+    fprintf(fp, "%s %s/%s\n", field, directory, path);
+
+    return true;
+}
+
+
+static bool copy_reply(FILE *reply_fp,
+                       size_t length,
+                       FILE *fp)
+{
+    char buffer[1 << 16];
+
+    while (length > 0) {
+        size_t block = (length < sizeof(buffer)) ? length : sizeof(buffer);
+
+        if (fread(buffer, 1, block, reply_fp) != block) {
+            return false;
+        }
+
+        fwrite(buffer, 1, block, fp);
+        length -= block;
+    }
+
+    return true;
+}
+
+
+int submit_job(const args *job)
+{
+    int fd = connect_to_server(job->server, false);
+
+    if (fd < 0) {
+        return EXIT_FAILURE;
+    }
+
+    // The reply is read from a second stream on the same socket
+    int request_fd = dup(fd);
+    FILE *request_fp = (request_fd >= 0) ? fdopen(request_fd, "w") : NULL;
+    FILE *reply_fp = fdopen(fd, "r");
+
+    if (request_fp == NULL || reply_fp == NULL) {
+        perror("Error: unable to open connection to server");
+        return EXIT_FAILURE;
+    }
+
+    fprintf(request_fp, "%s\n", JOB_PROTOCOL);
+
+    for (size_t i = 0; i < sizeof(INT_FIELDS) / sizeof(INT_FIELDS[0]); i++) {
+        fprintf(request_fp, "%s %d\n", INT_FIELDS[i].name,
+                *(const int *) ((const char *) job + INT_FIELDS[i].offset));
+    }
+
+    for (size_t i = 0; i < sizeof(BOOL_FIELDS) / sizeof(BOOL_FIELDS[0]); i++) {
+        fprintf(request_fp, "%s %d\n", BOOL_FIELDS[i].name,
+                *(const int *) ((const char *) job + BOOL_FIELDS[i].offset) != 0);
+    }
+
+    bool sent = send_path(request_fp, "fasta", job->fasta_file) &&
+                (job->log_file == NULL || send_path(request_fp, "log", job->log_file));
+    int num_fastq_files = job->interleaved ? job->num_fastq_pairs : 2 * job->num_fastq_pairs;
+
+    for (int i = 0; i < num_fastq_files && sent; i++) {
+        sent = send_path(request_fp, "fastq", job->fastq_files[i]);
+    }
+
+    fprintf(request_fp, "end\n");
+
+    if (fclose(request_fp) != 0) {
+        perror("Error: unable to send job to server");
+        sent = false;
+    }
+
+    if (! sent) {
+        fclose(reply_fp);
+        return EXIT_FAILURE;
+    }
+
+    char *line = NULL;
+    size_t capacity = 0;
+    int output_all = 0;
+    size_t report_size = 0;
+    size_t table_size = 0;
+    bool ok = false;
+
+    if (getline(&line, &capacity, reply_fp) <= 0) {
+        fprintf(stderr, "Error: the server closed the connection\n");
+    }
+    else if (strncmp(line, "error ", 6) == 0) {
+        fprintf(stderr, "Error: %s", line + 6);
+    }
+    else if (sscanf(line, "ok %d %zu %zu", &output_all, &report_size, &table_size) != 3) {
+        fprintf(stderr, "Error: invalid reply from server\n");
+    }
+    else {
+        ok = true;
+    }
+
+    free(line);
+
+    if (ok && output_all) {
+        puts(OUTPUT_ALL_NOTICE);
+    }
+
+    if (ok && ! copy_reply(reply_fp, report_size, stderr)) {
+        fprintf(stderr, "Error: the server closed the connection\n");
+        ok = false;
+    }
+
+    FILE *output_fp = stdout;
+
+    if (ok && job->outfile) {
+        output_fp = fopen(job->outfile, "w");
+
+        if (output_fp == NULL) {
+            fprintf(stderr, "Error: unable to open output file '%s': %s\n", job->outfile, strerror(errno));
+            ok = false;
+        }
+    }
+
+    if (ok && ! copy_reply(reply_fp, table_size, output_fp)) {
+        fprintf(stderr, "Error: the server closed the connection\n");
+        ok = false;
+    }
+
+    if (ok && job->outfile) {
+        fclose(output_fp);
+    }
+
+    fclose(reply_fp);
+
+    return ok ? 0 : EXIT_FAILURE;
+}
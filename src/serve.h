@@ -0,0 +1,21 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef SERVE_H
+#define SERVE_H
+
+#include "args.h"
+
+/* 'fsdm serve': runs jobs sent over a Unix socket on a pool of worker
+   threads, keeping the classifiers of recent libraries built between
+   them ('argv[0]' is the subcommand name) */
+extern int serve_main(int argc,
+                      const char **argv);
+
+/* 'fsdm --server': sends a run to a server and writes its results as the
+   run itself would. Returns the exit status of the run. */
+extern int submit_job(const args *job);
+
+#endif
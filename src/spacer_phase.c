@@ -0,0 +1,146 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "spacer_phase.h"
+
+#include "packed_seq.h"
+#include "parse_seq.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+static const int8_t EMPTY_SLOT = -1;
+static const int8_t REPEATED_KMER = -2;
+
+
+static inline size_t phase_slot(uint16_t kmer)
+{
+    return ((uint32_t) kmer * 40503u >> 10) & (PHASE_SLOTS - 1);
+}
+
+
+void build_phase_index(const mate_plan *plan,
+                       int min_phase,
+                       int max_phase,
+                       phase_index *index)
+{
+    memset(index, 0, sizeof(*index));
+    memset(index->offsets, EMPTY_SLOT, sizeof(index->offsets));
+
+    index->min_phase = (uint8_t) min_phase;
+    index->max_phase = (uint8_t) max_phase;
+
+    const segment_check *junction = NULL;
+
+    for (size_t i = 0; i < plan->num_checks; i++) {
+        if (junction == NULL || plan->checks[i].offset < junction->offset) {
+            junction = &(plan->checks[i]);
+        }
+    }
+
+    if (junction == NULL || min_phase == max_phase) {
+        return;
+    }
+
+    // The junction also runs into the segments after the first, so that
+    // one error in a short adapter does not hide every k-mer
+    index->junction_offset = junction->offset;
+    index->junction_length = PHASE_MAX_KMERS + PHASE_K - 1;
+
+    for (size_t i = 0; i < plan->num_checks; i++) {
+        const segment_check *check = &(plan->checks[i]);
+
+        for (size_t j = 0; j + PHASE_K <= check->length; j++) {
+            size_t offset = check->offset + j - junction->offset;
+            uint64_t packed;
+
+            if (offset >= PHASE_MAX_KMERS) {
+                break;
+            }
+            if (! pack_kmer(check->segment->seq + j, PHASE_K, &packed)) {
+                continue;
+            }
+
+            uint16_t kmer = (uint16_t) packed;
+            size_t slot = phase_slot(kmer);
+
+            while (index->offsets[slot] != EMPTY_SLOT && index->kmers[slot] != kmer) {
+                slot = (slot + 1) & (PHASE_SLOTS - 1);
+            }
+
+            // A k-mer seen twice in the junction cannot give the phase
+            index->offsets[slot] = (index->offsets[slot] == EMPTY_SLOT) ? (int8_t) offset : REPEATED_KMER;
+            index->kmers[slot] = kmer;
+        }
+    }
+}
+
+
+int find_phase(const phase_index *index,
+               const packed_seq *read,
+               int *runner_up)
+{
+    *runner_up = -1;
+
+    if (index->min_phase == index->max_phase) {
+        return index->min_phase;
+    }
+
+    // Offset of the junction k-mer nearest the barcode that gives each
+    // phase; k-mers after an indel give a phase that is off by its length
+    int nearest[MAX_SPACER_LENGTH + 1];
+    size_t first = index->junction_offset + index->min_phase;
+    size_t last = index->junction_offset + index->max_phase + index->junction_length - PHASE_K;
+
+    for (int phase = 0; phase <= MAX_SPACER_LENGTH; phase++) {
+        nearest[phase] = PHASE_MAX_KMERS;
+    }
+
+    for (size_t p = first; p <= last; p++) {
+        uint64_t kmer;
+
+        if (! packed_kmer_at(read, p, PHASE_K, &kmer)) {
+            continue;
+        }
+
+        size_t slot = phase_slot((uint16_t) kmer);
+
+        while (index->offsets[slot] != EMPTY_SLOT && index->kmers[slot] != (uint16_t) kmer) {
+            slot = (slot + 1) & (PHASE_SLOTS - 1);
+        }
+
+        int offset = index->offsets[slot];
+
+        if (offset < 0) {
+            continue;
+        }
+
+        long phase = (long) p - index->junction_offset - offset;
+
+        if (phase >= index->min_phase && phase <= index->max_phase && offset < nearest[phase]) {
+            nearest[phase] = offset;
+        }
+    }
+
+    int best = -1;
+
+    for (int phase = index->min_phase; phase <= index->max_phase; phase++) {
+        if (nearest[phase] == PHASE_MAX_KMERS) {
+            continue;
+        }
+
+        if (best < 0 || nearest[phase] < nearest[best]) {
+            *runner_up = best;
+            best = phase;
+        }
+        else if (*runner_up < 0 || nearest[phase] < nearest[*runner_up]) {
+            *runner_up = phase;
+        }
+    }
+
+    return best;
+}
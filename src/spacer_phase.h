@@ -0,0 +1,53 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef SPACER_PHASE_H
+#define SPACER_PHASE_H
+
+#include "packed_seq.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    MAX_SPACER_LENGTH = 16,
+    PHASE_K = 8,
+    PHASE_SLOTS = 64,
+    PHASE_MAX_KMERS = PHASE_SLOTS / 2
+};
+
+struct mate_plan;
+
+/* Phased primers put a spacer of min_phase to max_phase bases before
+   the barcode. The k-mers of the first bases after the barcode (the
+   barcode/adapter junction) are indexed with their offset from it, so
+   the phase of a read is found by looking up the few read positions
+   where they can be, without retrying the segment checks per phase. */
+typedef struct phase_index {
+    uint8_t min_phase;
+    uint8_t max_phase;
+    uint16_t junction_offset;
+    uint16_t junction_length;
+    uint16_t kmers[PHASE_SLOTS];
+    int8_t offsets[PHASE_SLOTS];
+} phase_index;
+
+extern void build_phase_index(const struct mate_plan *plan,
+                              int min_phase,
+                              int max_phase,
+                              phase_index *index);
+
+/* Length of the spacer before the barcode in 'read', or -1 if no
+   junction k-mer is found: the phase given by the junction k-mer found
+   nearest the barcode. An indel shifts the phase given by the k-mers
+   after it, so one further along the junction does not change the
+   result. One in the first bases can, so the phase given by the next
+   nearest k-mer that gives another phase, if any, is set in
+   'runner_up'. */
+extern int find_phase(const phase_index *index,
+                      const packed_seq *read,
+                      int *runner_up);
+
+#endif
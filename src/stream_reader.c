@@ -0,0 +1,246 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "stream_reader.h"
+
+#include "async_read.h"
+#include "decompress.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct stream_reader {
+    const char *path;
+    async_reader *input;
+    const unsigned char *chunk;
+    size_t chunk_length;
+    bool input_done;
+    const decompress_backend *backend;
+    void *state;
+    bool frame_open;
+    size_t frame_output;
+    bool error;
+};
+
+
+static int next_input_chunk(stream_reader *reader)
+{
+    long num_bytes = async_reader_next(reader->input, &(reader->chunk));
+
+    // An interrupted read was abandoned on purpose
+    if (num_bytes < 0 && errno != ECANCELED) {
+        fprintf(stderr, "Error: failed reading '%s': %s\n",
+                reader->path, strerror(errno));
+    }
+    if (num_bytes < 0) {
+        return -1;
+    }
+
+    reader->chunk_length = (size_t) num_bytes;
+    reader->input_done = (num_bytes == 0);
+
+    if (reader->backend == NULL && num_bytes > 0) {
+        reader->backend = select_decompress_backend(reader->chunk, reader->chunk_length);
+        reader->state = reader->backend->create();
+
+        if (reader->state == NULL) {
+            fprintf(stderr, "Error: unable to decompress '%s' (%s support is "
+                    "unavailable in this build)\n", reader->path, reader->backend->name);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+stream_reader *stream_reader_open(const char *path,
+                                  int follow_seconds)
+{
+    stream_reader *reader = calloc(1, sizeof(*reader));
+
+    if (reader == NULL) {
+        return NULL;
+    }
+
+    int fd;
+
+    if (strcmp(path, "-") == 0) {
+        fd = dup(STDIN_FILENO);
+    }
+    else {
+        fd = open(path, O_RDONLY);
+    }
+
+    if (fd >= 0) {
+        reader->input = async_reader_open(fd, follow_seconds);
+    }
+
+    if (reader->input == NULL) {
+        free(reader);
+        return NULL;
+    }
+
+    reader->path = path;
+
+    return reader;
+}
+
+
+stream_reader *stream_reader_open_memory(const char *name,
+                                         const void *data,
+                                         size_t length)
+{
+    stream_reader *reader = calloc(1, sizeof(*reader));
+
+    if (reader == NULL) {
+        fprintf(stderr, "Error: memory allocation failed reading '%s'\n", name);
+        return NULL;
+    }
+
+    // The whole input is one chunk that is already read
+    reader->path = name;
+    reader->chunk = data;
+    reader->chunk_length = length;
+    reader->input_done = true;
+
+    if (length > 0) {
+        reader->backend = select_decompress_backend(reader->chunk, reader->chunk_length);
+        reader->state = reader->backend->create();
+
+        if (reader->state == NULL) {
+            fprintf(stderr, "Error: unable to decompress '%s' (%s support is "
+                    "unavailable in this build)\n", name, reader->backend->name);
+            free(reader);
+            return NULL;
+        }
+    }
+
+    return reader;
+}
+
+
+int stream_reader_read(stream_reader *reader,
+                       void *buffer,
+                       unsigned int length)
+{
+    decompress_buffers buffers = {
+        .output = buffer,
+        .output_length = length
+    };
+
+    while (buffers.output_length > 0 && ! reader->error) {
+        if (reader->chunk_length == 0) {
+            if (reader->input_done) {
+                break;
+            }
+            if (next_input_chunk(reader) < 0) {
+                reader->error = true;
+            }
+            continue;
+        }
+
+        // Trailing bytes after the last frame that don't start another
+        // one are ignored, as gzread() does
+        if (! reader->frame_open && reader->backend->magic != NULL &&
+            ! decompress_magic_matches(reader->backend, reader->chunk, reader->chunk_length)) {
+            reader->chunk_length = 0;
+            reader->input_done = true;
+            break;
+        }
+
+        buffers.input = reader->chunk;
+        buffers.input_length = reader->chunk_length;
+
+        size_t output_length = buffers.output_length;
+        int status = reader->backend->decompress(reader->state, &buffers);
+
+        reader->chunk = buffers.input;
+        reader->chunk_length = buffers.input_length;
+        reader->frame_open = (status == 0);
+        reader->frame_output += output_length - buffers.output_length;
+
+        // An empty frame marks the end of a BGZF file
+        if (status == 1) {
+            if (reader->frame_output == 0 && reader->input != NULL) {
+                async_reader_stop_following(reader->input);
+            }
+
+            reader->frame_output = 0;
+        }
+
+        if (status < 0) {
+            fprintf(stderr, "Error: corrupt %s data in '%s'\n",
+                    reader->backend->name, reader->path);
+            reader->error = true;
+        }
+    }
+
+    if (reader->input_done && reader->frame_open && reader->backend->magic != NULL &&
+        ! reader->error) {
+        fprintf(stderr, "Error: unexpected end of %s data in '%s'\n",
+                reader->backend->name, reader->path);
+        reader->error = true;
+    }
+
+    return (int) (length - buffers.output_length);
+}
+
+
+bool stream_reader_error(const stream_reader *reader)
+{
+    return reader->error;
+}
+
+
+const char *stream_reader_format(const stream_reader *reader)
+{
+    return (reader->backend != NULL) ? reader->backend->name : NULL;
+}
+
+
+void stream_reader_stats(const stream_reader *reader,
+                         async_read_stats *stats)
+{
+    if (reader->input == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        stats->backend = "memory";
+        return;
+    }
+
+    async_reader_stats(reader->input, stats);
+}
+
+
+void stream_reader_interrupt(stream_reader *reader)
+{
+    if (reader->input != NULL) {
+        async_reader_interrupt(reader->input);
+    }
+}
+
+
+void stream_reader_close(stream_reader *reader)
+{
+    if (reader == NULL) {
+        return;
+    }
+
+    if (reader->state != NULL) {
+        reader->backend->destroy(reader->state);
+    }
+
+    if (reader->input != NULL) {
+        async_reader_close(reader->input);
+    }
+
+    free(reader);
+}
@@ -0,0 +1,54 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef STREAM_READER_H
+#define STREAM_READER_H
+
+#include "async_read.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct stream_reader stream_reader;
+
+/* Opens a file ("-" for stdin) for sequential decompressed reading. The
+   compression format is detected from its magic number (see
+   decompress.h), so gzip, zstd and uncompressed inputs are all read
+   through the same interface. A file that is still being written is
+   followed for 'follow_seconds' (see async_reader_open()), or until an
+   empty gzip member, such as the end-of-file block of BGZF. */
+extern stream_reader *stream_reader_open(const char *path,
+                                         int follow_seconds);
+
+/* Reads 'length' bytes of 'data' (named 'name' in errors) in the same
+   way; the data must outlive the reader. Returns NULL (after reporting
+   the error) if its format cannot be decompressed by this build. */
+extern stream_reader *stream_reader_open_memory(const char *name,
+                                                const void *data,
+                                                size_t length);
+
+/* gzread()-compatible read callback for kseq: fills 'buffer' completely
+   unless the end of the input is reached. Errors end the stream early
+   and are reported by stream_reader_error(). */
+extern int stream_reader_read(stream_reader *reader,
+                              void *buffer,
+                              unsigned int length);
+
+extern bool stream_reader_error(const stream_reader *reader);
+
+/* Name of the decompression backend, or NULL before the first read. */
+extern const char *stream_reader_format(const stream_reader *reader);
+
+extern void stream_reader_stats(const stream_reader *reader,
+                                async_read_stats *stats);
+
+/* Cuts short a stream_reader_read() blocked on input in another thread
+   (see async_reader_interrupt()); it then fails without a message, and
+   the reader can only be closed */
+extern void stream_reader_interrupt(stream_reader *reader);
+
+extern void stream_reader_close(stream_reader *reader);
+
+#endif
@@ -0,0 +1,297 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "template_align.h"
+
+#include "cpu_dispatch.h"
+#include "packed_seq.h"
+#include "parse_seq.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Traceback moves
+enum {
+    MOVE_DIAGONAL,
+    MOVE_DELETION,     // template base missing from the read
+    MOVE_INSERTION     // extra base in the read
+};
+
+/* Read bases never equal a library base that is not A, C, G or T */
+enum { TEMPLATE_OTHER_BASE = 5 };
+
+
+static inline uint8_t template_base(char base)
+{
+    switch (base) {
+        case 'A': case 'a':
+            return 0;
+        case 'C': case 'c':
+            return 1;
+        case 'G': case 'g':
+            return 2;
+        case 'T': case 't':
+            return 3;
+    }
+
+    return TEMPLATE_OTHER_BASE;
+}
+
+
+void build_read_template(const mate_plan *plan,
+                         read_template *tmpl)
+{
+    memset(tmpl, 0, sizeof(*tmpl));
+
+    if (plan->num_checks == 0) {
+        return;
+    }
+
+    size_t start = plan->length;
+
+    for (size_t i = 0; i < plan->num_checks; i++) {
+        if (plan->checks[i].offset < start) {
+            start = plan->checks[i].offset;
+        }
+    }
+
+    size_t length = plan->length - start;
+
+    if (length > PACKED_MAX_BASES) {
+        length = PACKED_MAX_BASES;
+    }
+
+    tmpl->start = (uint16_t) start;
+    tmpl->length = (uint16_t) length;
+    tmpl->num_segments = plan->num_checks;
+
+    memset(tmpl->bases, TEMPLATE_ANY_BASE, length);
+    memset(tmpl->segments, TEMPLATE_NO_SEGMENT, length);
+    memset(tmpl->sites, TEMPLATE_NO_SITE, length);
+
+    for (size_t i = 0; i < plan->num_checks; i++) {
+        const segment_check *check = &(plan->checks[i]);
+
+        for (size_t j = 0; j < check->length && check->offset + j - start < length; j++) {
+            tmpl->bases[check->offset + j - start] = template_base(check->segment->seq[j]);
+            tmpl->segments[check->offset + j - start] = (int8_t) i;
+        }
+    }
+
+    for (size_t k = 0; k < plan->num_sites; k++) {
+        size_t offset = plan->site_offsets[k];
+
+        if (offset >= start && offset - start < length &&
+            tmpl->segments[offset - start] == TEMPLATE_NO_SEGMENT) {
+            tmpl->sites[offset - start] = (int8_t) k;
+            tmpl->num_sites = (uint8_t) (k + 1);
+        }
+    }
+}
+
+
+/* Edits charged to the segment of template base 'i', or for an
+   insertion before it, to the segment on either side of the gap */
+static inline void charge_edit(const read_template *tmpl,
+                               long i,
+                               template_alignment *alignment)
+{
+    int segment = TEMPLATE_NO_SEGMENT;
+
+    if (i >= 0 && i < tmpl->length) {
+        segment = tmpl->segments[i];
+    }
+    if (segment == TEMPLATE_NO_SEGMENT && i + 1 < tmpl->length) {
+        segment = tmpl->segments[i + 1];
+    }
+
+    alignment->total_edits++;
+
+    if (segment != TEMPLATE_NO_SEGMENT) {
+        alignment->segment_edits[segment]++;
+    }
+}
+
+
+/* Banded edit distance over diagonals -band..band, where row i (the
+   first i template bases) and diagonal d end at read base
+   read_start + i + d. Rows whose best cell is already over 'max_edits'
+   end the alignment early. */
+static KERNEL_INLINE bool align_template_body(const read_template *tmpl,
+                                              const packed_seq *read,
+                                              long read_start,
+                                              int max_edits,
+                                              template_alignment *alignment)
+{
+    enum { INF = INT_MAX / 2, WIDTH = 2 * MAX_TEMPLATE_BAND + 1 };
+
+    memset(alignment, 0, sizeof(*alignment));
+
+    for (size_t k = 0; k < MAX_TEMPLATE_SITES; k++) {
+        alignment->site_positions[k] = -1;
+    }
+
+    if (read_start < 0 || max_edits < 0) {
+        return false;
+    }
+
+    const int band = (max_edits < MAX_TEMPLATE_BAND) ? max_edits : MAX_TEMPLATE_BAND;
+    const long length = tmpl->length;
+
+    // Read bases the band can reach, unpacked once
+    uint8_t read_bases[PACKED_MAX_BASES + MAX_TEMPLATE_BAND];
+    long window = length + band;
+
+    for (long j = 0; j < window; j++) {
+        long position = read_start + j;
+
+        read_bases[j] = (position < (long) read->length) ? (uint8_t) packed_base_at(read, position) : 4;
+    }
+
+    uint8_t moves[PACKED_MAX_BASES + 1][WIDTH];
+    int rows[2][WIDTH];
+    int *previous = rows[0];
+    int *current = rows[1];
+
+    for (int d = -band; d <= band; d++) {
+        previous[d + band] = (d >= 0) ? d : INF;
+        moves[0][d + band] = MOVE_INSERTION;
+    }
+
+    for (long i = 1; i <= length; i++) {
+        uint8_t base = tmpl->bases[i - 1];
+        int row_best = INF;
+
+        for (int d = -band; d <= band; d++) {
+            long j = i + d;
+            int cost = INF;
+            uint8_t move = MOVE_DIAGONAL;
+
+            if (j >= 1) {
+                cost = previous[d + band] + (base != TEMPLATE_ANY_BASE && base != read_bases[j - 1]);
+            }
+            if (j >= 0 && d < band && previous[d + band + 1] + 1 < cost) {
+                cost = previous[d + band + 1] + 1;
+                move = MOVE_DELETION;
+            }
+            if (j >= 1 && d > -band && current[d + band - 1] + 1 < cost) {
+                cost = current[d + band - 1] + 1;
+                move = MOVE_INSERTION;
+            }
+
+            current[d + band] = (cost < INF) ? cost : INF;
+            moves[i][d + band] = move;
+
+            if (cost < row_best) {
+                row_best = cost;
+            }
+        }
+
+        if (row_best > max_edits) {
+            return false;
+        }
+
+        int *swap = previous;
+        previous = current;
+        current = swap;
+    }
+
+    int best_d = 0;
+    int best_cost = INF;
+
+    for (int distance = 0; distance <= band; distance++) {
+        for (int sign = -1; sign <= 1; sign += 2) {
+            int d = sign * distance;
+
+            if (previous[d + band] < best_cost) {
+                best_cost = previous[d + band];
+                best_d = d;
+            }
+        }
+    }
+
+    if (best_cost > max_edits) {
+        return false;
+    }
+
+    long i = length;
+    int d = best_d;
+
+    while (i > 0 || d > 0) {
+        uint8_t move = moves[i][d + band];
+
+        if (move == MOVE_DIAGONAL) {
+            uint8_t base = tmpl->bases[i - 1];
+
+            if (base != TEMPLATE_ANY_BASE && base != read_bases[i + d - 1]) {
+                charge_edit(tmpl, i - 1, alignment);
+            }
+            if (tmpl->sites[i - 1] != TEMPLATE_NO_SITE) {
+                alignment->site_positions[tmpl->sites[i - 1]] = read_start + i + d - 1;
+            }
+
+            i--;
+        }
+        else if (move == MOVE_DELETION) {
+            charge_edit(tmpl, i - 1, alignment);
+            i--;
+            d++;
+        }
+        else {
+            charge_edit(tmpl, i - 1, alignment);
+            d--;
+        }
+    }
+
+    return true;
+}
+
+
+bool align_template_scalar(const read_template *tmpl,
+                           const packed_seq *read,
+                           long read_start,
+                           int max_edits,
+                           template_alignment *alignment)
+{
+    return align_template_body(tmpl, read, read_start, max_edits, alignment);
+}
+
+
+#ifdef HAVE_X86_KERNELS
+TARGET_SSE42
+bool align_template_sse42(const read_template *tmpl,
+                          const packed_seq *read,
+                          long read_start,
+                          int max_edits,
+                          template_alignment *alignment)
+{
+    return align_template_body(tmpl, read, read_start, max_edits, alignment);
+}
+
+
+TARGET_AVX2
+bool align_template_avx2(const read_template *tmpl,
+                         const packed_seq *read,
+                         long read_start,
+                         int max_edits,
+                         template_alignment *alignment)
+{
+    return align_template_body(tmpl, read, read_start, max_edits, alignment);
+}
+
+
+TARGET_AVX512BW
+bool align_template_avx512bw(const read_template *tmpl,
+                             const packed_seq *read,
+                             long read_start,
+                             int max_edits,
+                             template_alignment *alignment)
+{
+    return align_template_body(tmpl, read, read_start, max_edits, alignment);
+}
+#endif
@@ -0,0 +1,49 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef TEMPLATE_ALIGN_H
+#define TEMPLATE_ALIGN_H
+
+#include "packed_seq.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    MAX_TEMPLATE_SEGMENTS = 9,
+    MAX_TEMPLATE_SITES = 6,
+    MAX_TEMPLATE_BAND = 32,
+    TEMPLATE_ANY_BASE = 0xff,
+    TEMPLATE_NO_SEGMENT = -1,
+    TEMPLATE_NO_SITE = -1
+};
+
+struct mate_plan;
+
+/* The checked part of a prototype as one sequence, from its first
+   adapter or flanking base to its end. Each base records which plan
+   check it belongs to, and which allele site it is; allele sites and
+   any unchecked gaps match any read base and belong to no check. */
+typedef struct read_template {
+    uint16_t start;
+    uint16_t length;
+    uint8_t num_segments;
+    uint8_t num_sites;
+    uint8_t bases[PACKED_MAX_BASES];
+    int8_t segments[PACKED_MAX_BASES];
+    int8_t sites[PACKED_MAX_BASES];
+} read_template;
+
+typedef struct template_alignment {
+    int total_edits;
+    int segment_edits[MAX_TEMPLATE_SEGMENTS];
+    long site_positions[MAX_TEMPLATE_SITES];
+} template_alignment;
+
+extern void build_read_template(const struct mate_plan *plan,
+                                read_template *tmpl);
+
+#endif
@@ -0,0 +1,550 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#include "umi_counts.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+    INITIAL_SLOTS = 8,
+    SKETCH_REGISTERS = 1 << UMI_SKETCH_PRECISION
+};
+
+/* The top bit of a read count marks UMIs already visited while
+   collapsing */
+static const uint32_t VISITED_UMI = 1u << 31;
+
+/* Open addressing with linear probing; a read count of 0 marks an empty
+   slot, since every stored UMI has been seen at least once */
+struct umi_entry {
+    uint32_t group;
+    uint32_t umi;
+    uint32_t reads;
+};
+
+struct umi_set {
+    uint32_t num_slots;
+    uint32_t num_items;
+    struct umi_entry *items;
+};
+
+// A NULL register array marks an empty slot
+struct group_sketch {
+    uint32_t group;
+    uint8_t *registers;
+};
+
+struct sketch_map {
+    uint32_t num_slots;
+    uint32_t num_items;
+    struct group_sketch *items;
+};
+
+struct sample_umis {
+    struct umi_set set;
+    struct sketch_map sketches;
+};
+
+struct umi_table {
+    size_t num_samples;
+    size_t umi_length;
+    size_t memory_limit;
+    size_t memory_used;
+    bool estimated;
+    umi_group_count *distinct;
+    struct sample_umis samples[];
+};
+
+
+static inline uint64_t mix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+
+    return x ^ (x >> 31);
+}
+
+
+static void *checked_calloc(size_t count,
+                            size_t size)
+{
+    void *ptr = calloc(count, size);
+
+    if (ptr == NULL) {
+        perror("Error: memory allocation failed for UMI counts");
+    }
+
+    return ptr;
+}
+
+
+umi_table *init_umi_table(size_t num_samples,
+                          size_t umi_length,
+                          size_t memory_limit)
+{
+    umi_table *table = checked_calloc(1, sizeof(*table) + num_samples * sizeof(*table->samples));
+
+    if (table == NULL) {
+        return NULL;
+    }
+
+    table->num_samples = num_samples;
+    table->umi_length = umi_length;
+    table->memory_limit = memory_limit;
+
+    return table;
+}
+
+
+static struct umi_entry *find_umi(const struct umi_set *set,
+                                  uint32_t group,
+                                  uint32_t umi)
+{
+    uint32_t mask = set->num_slots - 1;
+    uint32_t slot = (uint32_t) mix64(((uint64_t) group << 32) | umi) & mask;
+
+    while (set->items[slot].reads != 0 &&
+           (set->items[slot].group != group || set->items[slot].umi != umi)) {
+        slot = (slot + 1) & mask;
+    }
+
+    return &(set->items[slot]);
+}
+
+
+static void insert_umi(struct umi_set *set,
+                       uint32_t group,
+                       uint32_t umi,
+                       uint32_t reads)
+{
+    struct umi_entry *entry = find_umi(set, group, umi);
+
+    if (entry->reads == 0) {
+        entry->group = group;
+        entry->umi = umi;
+        set->num_items++;
+    }
+
+    // Saturates below the flag bit
+    entry->reads = (entry->reads + reads < VISITED_UMI) ? entry->reads + reads : VISITED_UMI - 1;
+}
+
+
+static bool grow_set(struct umi_set *set)
+{
+    struct umi_set grown = {
+        .num_slots = (set->num_slots > 0) ? 2 * set->num_slots : INITIAL_SLOTS,
+        .num_items = 0
+    };
+
+    grown.items = checked_calloc(grown.num_slots, sizeof(*grown.items));
+
+    if (grown.items == NULL) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < set->num_slots; i++) {
+        if (set->items[i].reads != 0) {
+            insert_umi(&grown, set->items[i].group, set->items[i].umi, set->items[i].reads);
+        }
+    }
+
+    free(set->items);
+    *set = grown;
+
+    return true;
+}
+
+
+/* The registers of the group's sketch, added if it has none; NULL if
+   memory runs out */
+static uint8_t *find_sketch(struct sketch_map *map,
+                            uint32_t group)
+{
+    // Doubled once over two-thirds full, as the UMI sets are
+    if (3 * (map->num_items + 1) > 2 * map->num_slots) {
+        struct sketch_map grown = {
+            .num_slots = (map->num_slots > 0) ? 2 * map->num_slots : INITIAL_SLOTS,
+            .num_items = map->num_items
+        };
+
+        grown.items = checked_calloc(grown.num_slots, sizeof(*grown.items));
+
+        if (grown.items == NULL) {
+            return NULL;
+        }
+
+        for (uint32_t i = 0; i < map->num_slots; i++) {
+            if (map->items[i].registers != NULL) {
+                uint32_t slot = (uint32_t) mix64(map->items[i].group) & (grown.num_slots - 1);
+
+                while (grown.items[slot].registers != NULL) {
+                    slot = (slot + 1) & (grown.num_slots - 1);
+                }
+
+                grown.items[slot] = map->items[i];
+            }
+        }
+
+        free(map->items);
+        *map = grown;
+    }
+
+    uint32_t mask = map->num_slots - 1;
+    uint32_t slot = (uint32_t) mix64(group) & mask;
+
+    while (map->items[slot].registers != NULL && map->items[slot].group != group) {
+        slot = (slot + 1) & mask;
+    }
+
+    if (map->items[slot].registers == NULL) {
+        uint8_t *registers = checked_calloc(SKETCH_REGISTERS, 1);
+
+        if (registers == NULL) {
+            return NULL;
+        }
+
+        map->items[slot].group = group;
+        map->items[slot].registers = registers;
+        map->num_items++;
+    }
+
+    return map->items[slot].registers;
+}
+
+
+/* The register picked by the top bits of the UMI's hash keeps the
+   highest position of the first set bit seen in the rest */
+static bool sketch_add(struct sketch_map *map,
+                       uint32_t group,
+                       uint32_t umi)
+{
+    uint8_t *registers = find_sketch(map, group);
+
+    if (registers == NULL) {
+        return false;
+    }
+
+    uint64_t hash = mix64(umi);
+    size_t index = hash >> (64 - UMI_SKETCH_PRECISION);
+    uint64_t rest = hash << UMI_SKETCH_PRECISION;
+    uint8_t rank = (rest != 0) ? (uint8_t) (__builtin_clzll(rest) + 1)
+                               : (uint8_t) (64 - UMI_SKETCH_PRECISION + 1);
+
+    if (rank > registers[index]) {
+        registers[index] = rank;
+    }
+
+    return true;
+}
+
+
+static uint32_t sketch_estimate(const uint8_t *registers)
+{
+    const double m = SKETCH_REGISTERS;
+    double sum = 0.0;
+    size_t num_zeros = 0;
+
+    for (size_t i = 0; i < SKETCH_REGISTERS; i++) {
+        sum += ldexp(1.0, -registers[i]);
+        num_zeros += (registers[i] == 0);
+    }
+
+    double estimate = (0.7213 / (1.0 + 1.079 / m)) * m * m / sum;
+
+    // Linear counting is more accurate while many registers are empty
+    if (estimate <= 2.5 * m && num_zeros > 0) {
+        estimate = m * log(m / num_zeros);
+    }
+
+    return (uint32_t) (estimate + 0.5);
+}
+
+
+static bool switch_to_sketches(umi_table *self)
+{
+    self->memory_used = 0;
+    self->estimated = true;
+
+    for (size_t s = 0; s < self->num_samples; s++) {
+        struct sample_umis *sample = &(self->samples[s]);
+
+        for (uint32_t i = 0; i < sample->set.num_slots; i++) {
+            if (sample->set.items[i].reads != 0 &&
+                ! sketch_add(&(sample->sketches), sample->set.items[i].group, sample->set.items[i].umi)) {
+                return false;
+            }
+        }
+
+        free(sample->set.items);
+        memset(&(sample->set), 0, sizeof(sample->set));
+    }
+
+    return true;
+}
+
+
+static bool add_umi(umi_table *self,
+                    size_t sample,
+                    uint32_t group,
+                    uint32_t umi,
+                    uint32_t reads)
+{
+    struct sample_umis *umis = &(self->samples[sample]);
+
+    if (self->estimated) {
+        return sketch_add(&(umis->sketches), group, umi);
+    }
+
+    struct umi_set *set = &(umis->set);
+
+    if (3 * (set->num_items + 1) > 2 * set->num_slots) {
+        size_t old_size = set->num_slots * sizeof(*set->items);
+        size_t new_size = (set->num_slots > 0) ? 2 * old_size : INITIAL_SLOTS * sizeof(*set->items);
+
+        if (self->memory_limit > 0 && self->memory_used + new_size - old_size > self->memory_limit) {
+            return switch_to_sketches(self) && sketch_add(&(umis->sketches), group, umi);
+        }
+
+        if (! grow_set(set)) {
+            return false;
+        }
+
+        self->memory_used += new_size - old_size;
+    }
+
+    insert_umi(set, group, umi, reads);
+
+    return true;
+}
+
+
+bool umi_table_add(umi_table *self,
+                   size_t sample,
+                   uint32_t group,
+                   uint32_t umi)
+{
+    return add_umi(self, sample, group, umi, 1);
+}
+
+
+bool umi_table_merge(umi_table *self,
+                     const umi_table *other)
+{
+    if (other->estimated && ! self->estimated && ! switch_to_sketches(self)) {
+        return false;
+    }
+
+    for (size_t s = 0; s < self->num_samples; s++) {
+        const struct sample_umis *umis = &(other->samples[s]);
+
+        for (uint32_t i = 0; i < umis->set.num_slots; i++) {
+            const struct umi_entry *entry = &(umis->set.items[i]);
+
+            if (entry->reads != 0 && ! add_umi(self, s, entry->group, entry->umi, entry->reads)) {
+                return false;
+            }
+        }
+
+        // A sketch of the union keeps the highest rank of each register
+        for (uint32_t i = 0; i < umis->sketches.num_slots; i++) {
+            const struct group_sketch *sketch = &(umis->sketches.items[i]);
+
+            if (sketch->registers == NULL) {
+                continue;
+            }
+
+            uint8_t *registers = find_sketch(&(self->samples[s].sketches), sketch->group);
+
+            if (registers == NULL) {
+                return false;
+            }
+
+            for (size_t r = 0; r < SKETCH_REGISTERS; r++) {
+                if (sketch->registers[r] > registers[r]) {
+                    registers[r] = sketch->registers[r];
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+
+bool umi_table_estimated(const umi_table *self)
+{
+    return self->estimated;
+}
+
+
+/* By group, then the most reads first, so a UMI is only ever collapsed
+   into one that has been visited before it */
+static int compare_umis(const void *a,
+                        const void *b)
+{
+    const struct umi_entry *umi_a = a;
+    const struct umi_entry *umi_b = b;
+
+    if (umi_a->group != umi_b->group) {
+        return (umi_a->group < umi_b->group) ? -1 : 1;
+    }
+    if (umi_a->reads != umi_b->reads) {
+        return (umi_a->reads > umi_b->reads) ? -1 : 1;
+    }
+
+    return (umi_a->umi > umi_b->umi) - (umi_a->umi < umi_b->umi);
+}
+
+
+static int compare_groups(const void *a,
+                          const void *b)
+{
+    uint32_t group_a = ((const umi_group_count *) a)->group;
+    uint32_t group_b = ((const umi_group_count *) b)->group;
+
+    return (group_a > group_b) - (group_a < group_b);
+}
+
+
+/* Whether the UMI is an error of one already visited: one substitution
+   away in the same group, with at least twice as many reads less one
+   (the directional rule of UMI-tools) */
+static bool is_umi_error(const struct umi_set *set,
+                         const struct umi_entry *entry,
+                         size_t umi_length)
+{
+    for (size_t i = 0; i < umi_length; i++) {
+        for (uint32_t base = 1; base < 4; base++) {
+            uint32_t neighbour = entry->umi ^ (base << (2 * i));
+            const struct umi_entry *found = find_umi(set, entry->group, neighbour);
+
+            if ((found->reads & VISITED_UMI) &&
+                (found->reads & ~VISITED_UMI) >= 2 * entry->reads - 1) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+
+const umi_group_count *umi_table_distinct(umi_table *self,
+                                          size_t sample,
+                                          bool collapse,
+                                          size_t *num_groups)
+{
+    struct sample_umis *umis = &(self->samples[sample]);
+    size_t n = 0;
+
+    free(self->distinct);
+
+    *num_groups = 0;
+
+    if (self->estimated) {
+        self->distinct = checked_calloc(umis->sketches.num_items + 1, sizeof(*self->distinct));
+
+        if (self->distinct == NULL) {
+            return NULL;
+        }
+
+        for (uint32_t i = 0; i < umis->sketches.num_slots; i++) {
+            const struct group_sketch *sketch = &(umis->sketches.items[i]);
+
+            if (sketch->registers != NULL) {
+                self->distinct[n].group = sketch->group;
+                self->distinct[n].count = sketch_estimate(sketch->registers);
+                n++;
+            }
+        }
+
+        qsort(self->distinct, n, sizeof(*self->distinct), compare_groups);
+        *num_groups = n;
+
+        return self->distinct;
+    }
+
+    struct umi_set *set = &(umis->set);
+    struct umi_entry *sorted = checked_calloc(set->num_items + 1, sizeof(*sorted));
+    size_t num_umis = 0;
+
+    self->distinct = NULL;
+
+    if (sorted == NULL) {
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < set->num_slots; i++) {
+        if (set->items[i].reads != 0) {
+            sorted[num_umis++] = set->items[i];
+        }
+    }
+
+    qsort(sorted, num_umis, sizeof(*sorted), compare_umis);
+    self->distinct = checked_calloc(num_umis + 1, sizeof(*self->distinct));
+
+    if (self->distinct == NULL) {
+        free(sorted);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < num_umis; i++) {
+        if (collapse) {
+            bool error = is_umi_error(set, &sorted[i], self->umi_length);
+
+            find_umi(set, sorted[i].group, sorted[i].umi)->reads |= VISITED_UMI;
+
+            if (error) {
+                continue;
+            }
+        }
+
+        if (n == 0 || self->distinct[n - 1].group != sorted[i].group) {
+            self->distinct[n++].group = sorted[i].group;
+        }
+
+        self->distinct[n - 1].count++;
+    }
+
+    // The marks are only needed while this sample is collapsed
+    for (uint32_t i = 0; i < set->num_slots; i++) {
+        set->items[i].reads &= ~VISITED_UMI;
+    }
+
+    free(sorted);
+    *num_groups = n;
+
+    return self->distinct;
+}
+
+
+void destroy_umi_table(umi_table **table_double_ptr)
+{
+    umi_table *table = *table_double_ptr;
+
+    for (size_t s = 0; s < table->num_samples; s++) {
+        struct sketch_map *sketches = &(table->samples[s].sketches);
+
+        for (uint32_t i = 0; i < sketches->num_slots; i++) {
+            free(sketches->items[i].registers);
+        }
+
+        free(sketches->items);
+        free(table->samples[s].set.items);
+    }
+
+    free(table->distinct);
+    free(table);
+
+    *table_double_ptr = NULL;
+}
@@ -0,0 +1,63 @@
+/*
+   Copyright (c) 2020 Roy Zhao <roy.zhao@uci.edu>
+   Mozilla Public License Version 2.0
+*/
+
+#ifndef UMI_COUNTS_H
+#define UMI_COUNTS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* UMIs are packed 2 bits per base like k-mers, so at most 16 bases */
+enum {
+    MAX_UMI_LENGTH = 16,
+    UMI_SKETCH_PRECISION = 12
+};
+
+typedef struct umi_group_count {
+    uint32_t group;
+    uint32_t count;
+} umi_group_count;
+
+/* The distinct UMIs seen for each group (allele or haplotype) of each
+   sample (barcode combination), kept as one sparse set of UMIs per
+   sample with the number of reads of each. Once the sets would take
+   more than 'memory_limit' bytes (0 for no limit), every group is moved
+   to a HyperLogLog sketch of 2^UMI_SKETCH_PRECISION registers instead,
+   which estimates its distinct UMIs in a fixed space. Functions that
+   allocate return NULL or false (after reporting the error) if memory
+   runs out, after which the table can only be destroyed. */
+typedef struct umi_table umi_table;
+
+umi_table *init_umi_table(size_t num_samples,
+                          size_t umi_length,
+                          size_t memory_limit);
+
+bool umi_table_add(umi_table *self,
+                   size_t sample,
+                   uint32_t group,
+                   uint32_t umi);
+
+/* Adds the UMIs of 'other', a table of as many samples and the same
+   UMI length; the result is estimated if either table is */
+bool umi_table_merge(umi_table *self,
+                     const umi_table *other);
+
+/* True once the table has switched to sketches */
+bool umi_table_estimated(const umi_table *self);
+
+/* Distinct UMIs of each group of 'sample', in group order. With
+   'collapse', a UMI within one mismatch of a UMI of the same group with
+   at least twice as many reads (less one) is counted as an error of
+   that UMI (sketches cannot collapse). The array is owned by the table
+   and valid until the next call. */
+const umi_group_count *umi_table_distinct(umi_table *self,
+                                          size_t sample,
+                                          bool collapse,
+                                          size_t *num_groups);
+
+void destroy_umi_table(umi_table **table_double_ptr);
+
+#endif